@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "remotefs.h"
+#include "fscore.h"
+
+/*
+ * Load generator for the Remote File System server.
+ *
+ * Simulates many logged-in sessions, each on its own connection, that keep
+ * one request in flight at a time: when a reply arrives the session sends its
+ * next command at once (closed loop). All connections are driven by the
+ * client library's I/O threads, so thousands of sessions need only
+ * ceil(sessions / RFS_MAX_POOL) threads. UPLOAD and DOWNLOAD are the
+ * exception: each runs on its own text connection and thread, through
+ * rfs_upload_file_on()/rfs_download_file_on(), like any client would.
+ *
+ * Build: gcc -O2 bench.c remotefs.c fscore.c -o bench -lpthread   (Windows: -lws2_32)
+ * Run:   ./bench --mix browse --sessions 1000 --duration 10 --json out.json
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+#define sleep_ms(ms) Sleep(ms)
+#else
+#include <unistd.h>
+#include <pthread.h>
+#define sleep_ms(ms) usleep((ms) * 1000)
+typedef pthread_mutex_t CRITICAL_SECTION;
+#define InitializeCriticalSection(cs) pthread_mutex_init((cs), NULL)
+#define DeleteCriticalSection(cs) pthread_mutex_destroy(cs)
+#define EnterCriticalSection(cs) pthread_mutex_lock(cs)
+#define LeaveCriticalSection(cs) pthread_mutex_unlock(cs)
+#endif
+
+#define BENCH_PASSWORD "benchpw"
+#define BENCH_DIRS 5
+#define BENCH_HOT_FILES 4
+#define BENCH_SOURCE "bench_upload.bin"     // local file every UPLOAD sends
+
+enum { OP_LOGIN, OP_LS, OP_LSR, OP_STAT, OP_READ, OP_WRITE, OP_PUT, OP_GET, OP_UPLOAD, OP_DOWNLOAD, OP_COUNT };
+const char *op_names[OP_COUNT] = { "LOGIN", "LS", "LSR", "STAT", "READ", "WRITE", "PUT", "GET", "UPLOAD", "DOWNLOAD" };
+
+typedef struct {
+    const char *name;
+    int weight[OP_COUNT];               // relative share of each command
+    int shared;                         // every session logs in as the same user
+} Mix;
+
+const Mix mixes[] = {
+    //                  LOGIN LS LSR STAT READ WRITE PUT GET UPLOAD DOWNLOAD
+    { "login",        { 100,  0,  0,   0,   0,    0,  0,  0,     0,     0 }, 0 },
+    { "browse",       {   0, 50, 25,  25,   0,    0,  0,  0,     0,     0 }, 0 },
+    { "contention",   {   0,  0,  0,   0,  70,   30,  0,  0,     0,     0 }, 1 },
+    { "transfer",     {   0,  0,  0,   0,   0,    0,  0,  0,    50,    50 }, 0 },
+    { "frames",       {   0,  0,  0,   0,   0,    0, 50, 50,     0,     0 }, 0 },
+    { "mixed",        {   5, 25, 10,  15,  25,   10,  5,  5,     0,     0 }, 0 },
+};
+
+typedef struct {
+    long ops, errors;
+    long long bytes;                    // request + reply payload
+    long long total_us;
+    long long max_us;
+    long long hist[HIST_BUCKETS];           // fscore.c latency histogram
+} CmdStats;
+
+// One per RfsClient. Its I/O thread and its transfer threads update it.
+typedef struct {
+    RfsClient *c;
+    CRITICAL_SECTION cs;
+    CmdStats stats[OP_COUNT];
+} Pool;
+
+typedef struct {
+    Pool *pool;
+    int id, conn, user, op;
+    unsigned int rng;
+    long sent;
+    double t0;
+} Session;
+
+typedef struct {
+    const char *host;
+    int port;
+    const Mix *mix;
+    int sessions, users, files, duration;
+    long size_kb;
+    const char *json;
+} Config;
+
+Config g_cfg = { "127.0.0.1", 8080, &mixes[5], 100, 0, 50, 10, 1024, NULL };
+volatile int g_stop = 0;
+char *g_payload = NULL;     // PUT data
+
+double now_us() {
+#ifdef _WIN32
+    LARGE_INTEGER f, t;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart * 1e6 / (double)f.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+#endif
+}
+
+unsigned int next_rand(unsigned int *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+long long stats_percentile(const CmdStats *st, double p) {
+    return hist_percentile(st->hist, st->ops, st->max_us, p);
+}
+
+/* ---------- SESSIONS ---------- */
+// Replies that mean the command did not do its work.
+const char *reply_errors[] = {
+    "Access Denied", "ACCESS DENIED", "Error", "Please login", "Invalid",
+    "File not found", "No Such", "Server memory error", "Server Error", "Not available", "Connection lost",
+};
+
+int reply_failed(const RfsReply *r) {
+    if (!r->ok) return 1;
+    for (int i = 0; i < (int)(sizeof(reply_errors) / sizeof(reply_errors[0])); i++) {
+        long n = (long)strlen(reply_errors[i]);
+        if (r->len >= n && memcmp(r->data, reply_errors[i], n) == 0) return 1;
+    }
+    return 0;
+}
+
+void session_next(Session *s);
+
+void session_done(void *ctx, const RfsReply *reply) {
+    Session *s = (Session*)ctx;
+    long long us = (long long)(now_us() - s->t0);
+    CmdStats *st = &s->pool->stats[s->op];
+    EnterCriticalSection(&s->pool->cs);
+    st->ops++;
+    if (reply_failed(reply)) st->errors++;
+    st->bytes += s->sent + reply->len;
+    st->total_us += us;
+    if (us > st->max_us) st->max_us = us;
+    st->hist[hist_bucket(us)]++;
+    LeaveCriticalSection(&s->pool->cs);
+    if (!g_stop) session_next(s);
+}
+
+// Picks the next command from the mix and sends it.
+void session_next(Session *s) {
+    char cmd[300], name[64];
+    int total = 0, pick, op = 0;
+    for (int i = 0; i < OP_COUNT; i++) total += g_cfg.mix->weight[i];
+    pick = (int)(next_rand(&s->rng) % (unsigned int)total);
+    while (pick >= g_cfg.mix->weight[op]) pick -= g_cfg.mix->weight[op++];
+
+    unsigned int r = next_rand(&s->rng);
+    int dir = (int)(r % BENCH_DIRS), file = (int)((r / BENCH_DIRS) % (unsigned int)g_cfg.files);
+    int hot = (int)(r % BENCH_HOT_FILES);
+    int ok;
+    s->op = op;
+    s->t0 = now_us();
+    switch (op) {
+    case OP_LOGIN:
+        sprintf(cmd, "LOGIN bench%d %s", (int)(r % (unsigned int)g_cfg.users), BENCH_PASSWORD);
+        break;
+    case OP_LS:   strcpy(cmd, "LS"); break;
+    case OP_LSR:  strcpy(cmd, "LSR"); break;
+    case OP_STAT: sprintf(cmd, "STAT d%d/f%d", dir, file); break;
+    case OP_READ: sprintf(cmd, "READ hot%d", hot); break;
+    case OP_WRITE: sprintf(cmd, "WRITE hot%d x", hot); break;
+    default: break;
+    }
+    if (op == OP_PUT) {
+        // Each session writes its own file, so PUTs never wait for each other.
+        sprintf(name, "put%d.bin", s->id);
+        s->sent = g_cfg.size_kb * 1024;
+        ok = rfs_put_on(s->pool->c, s->conn, name, g_payload, s->sent, session_done, s);
+    } else if (op == OP_GET) {
+        s->sent = (long)strlen("blob.bin");
+        ok = rfs_get_on(s->pool->c, s->conn, "blob.bin", session_done, s);
+    } else if (op == OP_UPLOAD) {
+        sprintf(name, "up%d.bin", s->id);
+        s->sent = g_cfg.size_kb * 1024;
+        ok = rfs_upload_file_on(s->pool->c, s->conn, BENCH_SOURCE, name, session_done, s);
+    } else if (op == OP_DOWNLOAD) {
+        // Counted as the bytes it moved, like an UPLOAD.
+        sprintf(name, "bench_download%d.bin", s->id);
+        s->sent = g_cfg.size_kb * 1024;
+        ok = rfs_download_file_on(s->pool->c, s->conn, "xfer.bin", name, session_done, s);
+    } else {
+        s->sent = (long)strlen(cmd);
+        ok = rfs_command_on(s->pool->c, s->conn, cmd, session_done, s);
+    }
+    // A session whose connection is gone stops; its error shows in the report.
+    if (!ok) {
+        EnterCriticalSection(&s->pool->cs);
+        s->pool->stats[op].errors++;
+        LeaveCriticalSection(&s->pool->cs);
+    }
+}
+
+/* ---------- SETUP ---------- */
+void count_failure(void *ctx, const RfsReply *reply) {
+    if (reply_failed(reply)) (*(long*)ctx)++;
+}
+
+// Writes the local file UPLOADs send, unless one of the right size is
+// already there from an earlier run.
+int prepare_source(void) {
+    long long size = (long long)g_cfg.size_kb * 1024;
+    FILE *fp = fopen(BENCH_SOURCE, "rb");
+    if (fp) {
+        fseek(fp, 0, SEEK_END);
+        long long have = ftell(fp);
+        fclose(fp);
+        if (have == size) return 1;
+    }
+    char *chunk = (char*)malloc(1024 * 1024);
+    fp = fopen(BENCH_SOURCE, "wb");
+    if (!chunk || !fp) {
+        free(chunk);
+        if (fp) fclose(fp);
+        return 0;
+    }
+    for (long i = 0; i < 1024 * 1024; i++) chunk[i] = (char)(i * 31 + 7);
+    long long written = 0;
+    while (written < size) {
+        long n = (size - written < 1024 * 1024) ? (long)(size - written) : 1024 * 1024;
+        if ((long)fwrite(chunk, 1, n, fp) != n) break;
+        written += n;
+    }
+    free(chunk);
+    return fclose(fp) == 0 && written == size;
+}
+
+// Registers the users and gives each one the files the mix needs.
+int prepare_users(void) {
+    char cmd[300], *reply;
+    long failed = 0;
+    RfsClient *c = rfs_connect(g_cfg.host, g_cfg.port, 1);
+    if (!c) return 0;
+    for (int u = 0; u < g_cfg.users; u++) {
+        sprintf(cmd, "REGISTER bench%d %s", u, BENCH_PASSWORD);
+        rfs_command(c, cmd, NULL, NULL);
+    }
+    rfs_wait(c);
+    for (int u = 0; u < g_cfg.users; u++) {
+        sprintf(cmd, "LOGIN bench%d %s", u, BENCH_PASSWORD);
+        reply = rfs_call(c, cmd, NULL, NULL);
+        int in = reply && strncmp(reply, "Login successful", 16) == 0;
+        rfs_free(reply);
+        if (!in) {
+            fprintf(stderr, "Cannot log in as bench%d (left from a run with another password?)\n", u);
+            rfs_close(c);
+            return 0;
+        }
+        // A pool of one keeps these in order; each only has to exist once.
+        for (int d = 0; d < BENCH_DIRS; d++) {
+            sprintf(cmd, "MKDIR d%d", d);
+            rfs_command(c, cmd, NULL, NULL);
+            for (int f = 0; f < g_cfg.files; f++) {
+                sprintf(cmd, "TOUCH d%d/f%d", d, f);
+                rfs_command(c, cmd, NULL, NULL);
+            }
+        }
+        for (int h = 0; h < BENCH_HOT_FILES; h++) {
+            sprintf(cmd, "TOUCH hot%d", h);
+            rfs_command(c, cmd, NULL, NULL);
+        }
+        if (g_cfg.mix->weight[OP_GET])
+            rfs_put(c, "blob.bin", g_payload, g_cfg.size_kb * 1024, count_failure, &failed);
+        if (g_cfg.mix->weight[OP_DOWNLOAD] && !rfs_upload_file(c, BENCH_SOURCE, "xfer.bin", count_failure, &failed))
+            failed++;
+        rfs_wait(c);
+    }
+    rfs_close(c);
+    if (failed) fprintf(stderr, "%ld setup uploads failed\n", failed);
+    return failed == 0;
+}
+
+/* ---------- REPORT ---------- */
+void print_report(CmdStats *all, double seconds) {
+    CmdStats total;
+    memset(&total, 0, sizeof(total));
+    printf("\nmix %s, %d sessions, %d users, %.1f s\n", g_cfg.mix->name, g_cfg.sessions, g_cfg.users, seconds);
+    printf("%-8s %10s %8s %11s %10s %9s %9s %9s %9s\n",
+           "COMMAND", "OPS", "ERRORS", "OPS/S", "MB/S", "P50 ms", "P99 ms", "P999 ms", "MAX ms");
+    for (int i = 0; i <= OP_COUNT; i++) {
+        CmdStats *st = (i < OP_COUNT) ? &all[i] : &total;
+        if (i < OP_COUNT) {
+            if (st->ops == 0 && st->errors == 0) continue;
+            total.ops += st->ops;
+            total.errors += st->errors;
+            total.bytes += st->bytes;
+            total.total_us += st->total_us;
+            if (st->max_us > total.max_us) total.max_us = st->max_us;
+            for (int b = 0; b < HIST_BUCKETS; b++) total.hist[b] += st->hist[b];
+        }
+        printf("%-8s %10ld %8ld %11.0f %10.2f %9.3f %9.3f %9.3f %9.3f\n",
+               (i < OP_COUNT) ? op_names[i] : "TOTAL", st->ops, st->errors, st->ops / seconds,
+               st->bytes / seconds / (1024.0 * 1024.0), stats_percentile(st, 0.50) / 1000.0,
+               stats_percentile(st, 0.99) / 1000.0, stats_percentile(st, 0.999) / 1000.0, st->max_us / 1000.0);
+    }
+    if (!g_cfg.json) return;
+
+    FILE *fp = strcmp(g_cfg.json, "-") == 0 ? stdout : fopen(g_cfg.json, "w");
+    if (!fp) {
+        fprintf(stderr, "Cannot write %s\n", g_cfg.json);
+        return;
+    }
+    fprintf(fp, "{\n  \"mix\": \"%s\", \"sessions\": %d, \"users\": %d, \"files\": %d, \"size_kb\": %ld, \"seconds\": %.3f,\n",
+            g_cfg.mix->name, g_cfg.sessions, g_cfg.users, g_cfg.files, g_cfg.size_kb, seconds);
+    fprintf(fp, "  \"commands\": {");
+    int first = 1;
+    for (int i = 0; i <= OP_COUNT; i++) {
+        CmdStats *st = (i < OP_COUNT) ? &all[i] : &total;
+        if (i < OP_COUNT && st->ops == 0 && st->errors == 0) continue;
+        if (i == OP_COUNT) fprintf(fp, "\n  },\n  \"total\": ");
+        else fprintf(fp, "%s\n    \"%s\": ", first ? "" : ",", op_names[i]);
+        first = 0;
+        fprintf(fp, "{\"ops\": %ld, \"errors\": %ld, \"ops_per_sec\": %.1f, \"bytes_per_sec\": %.0f, "
+                "\"mean_us\": %.1f, \"p50_us\": %lld, \"p99_us\": %lld, \"p999_us\": %lld, \"max_us\": %lld}",
+                st->ops, st->errors, st->ops / seconds, st->bytes / seconds,
+                st->ops ? (double)st->total_us / st->ops : 0.0, stats_percentile(st, 0.50),
+                stats_percentile(st, 0.99), stats_percentile(st, 0.999), st->max_us);
+    }
+    fprintf(fp, "\n}\n");
+    if (fp != stdout) fclose(fp);
+}
+
+void usage(void) {
+    printf("Usage: bench [options]\n");
+    printf("  --host IP          server address (default 127.0.0.1)\n");
+    printf("  --port N           server port (default 8080)\n");
+    printf("  --mix NAME         login | browse | contention | transfer | frames | mixed (default mixed)\n");
+    printf("  --sessions N       simulated sessions, one connection each (default 100)\n");
+    printf("  --users N          distinct users (default: sessions, at most 100; contention: 1)\n");
+    printf("  --files N          files per folder in each user's tree (default 50)\n");
+    printf("  --size-kb N        UPLOAD/DOWNLOAD and PUT/GET file size (default 1024;\n");
+    printf("                     at most 16383 when the mix sends PUT/GET frames)\n");
+    printf("  --size-mb N        the same in MB, for multi-GB transfers\n");
+    printf("  --duration S       seconds to run (default 10)\n");
+    printf("  --json FILE        also write the results as JSON ('-' for stdout)\n");
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--host") == 0 && v) g_cfg.host = argv[++i];
+        else if (strcmp(argv[i], "--port") == 0 && v) g_cfg.port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--sessions") == 0 && v) g_cfg.sessions = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--users") == 0 && v) g_cfg.users = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--files") == 0 && v) g_cfg.files = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--size-kb") == 0 && v) g_cfg.size_kb = atol(argv[++i]);
+        else if (strcmp(argv[i], "--size-mb") == 0 && v) g_cfg.size_kb = atol(argv[++i]) * 1024;
+        else if (strcmp(argv[i], "--duration") == 0 && v) g_cfg.duration = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--json") == 0 && v) g_cfg.json = argv[++i];
+        else if (strcmp(argv[i], "--mix") == 0 && v) {
+            g_cfg.mix = NULL;
+            for (int m = 0; m < (int)(sizeof(mixes) / sizeof(mixes[0])); m++)
+                if (strcmp(argv[i + 1], mixes[m].name) == 0) g_cfg.mix = &mixes[m];
+            i++;
+            if (!g_cfg.mix) {
+                usage();
+                return 1;
+            }
+        } else {
+            usage();
+            return strcmp(argv[i], "--help") == 0 ? 0 : 1;
+        }
+    }
+    if (g_cfg.users <= 0) g_cfg.users = g_cfg.mix->shared ? 1 : (g_cfg.sessions < 100 ? g_cfg.sessions : 100);
+    int frames = g_cfg.mix->weight[OP_PUT] || g_cfg.mix->weight[OP_GET];
+    int files = g_cfg.mix->weight[OP_UPLOAD] || g_cfg.mix->weight[OP_DOWNLOAD];
+    if (g_cfg.sessions < 1 || g_cfg.users < 1 || g_cfg.files < 1 || g_cfg.duration < 1 ||
+        g_cfg.size_kb < 1 || (frames && g_cfg.size_kb * 1024 > RFS_FRAME_MAX - 1024)) {
+        usage();
+        return 1;
+    }
+    if (frames) {
+        g_payload = malloc(g_cfg.size_kb * 1024);
+        if (!g_payload) return 1;
+        for (long i = 0; i < g_cfg.size_kb * 1024; i++) g_payload[i] = (char)(i * 31 + 7);
+    }
+    if (files && !prepare_source()) {
+        fprintf(stderr, "Cannot write %s\n", BENCH_SOURCE);
+        return 1;
+    }
+
+    printf("Preparing %d users...\n", g_cfg.users);
+    if (!prepare_users()) {
+        fprintf(stderr, "Setup failed (is the server running on %s:%d?)\n", g_cfg.host, g_cfg.port);
+        return 1;
+    }
+
+    // Sessions fill pools of RFS_MAX_POOL connections, one I/O thread each.
+    int npools = (g_cfg.sessions + RFS_MAX_POOL - 1) / RFS_MAX_POOL;
+    Pool *pools = (Pool*)calloc(npools, sizeof(Pool));
+    Session *sessions = (Session*)calloc(g_cfg.sessions, sizeof(Session));
+    long login_failed = 0;
+    int opened = 0;
+    if (!pools || !sessions) return 1;
+    for (int p = 0; p < npools; p++) InitializeCriticalSection(&pools[p].cs);
+    printf("Opening %d sessions...\n", g_cfg.sessions);
+    for (int p = 0; p < npools; p++) {
+        int want = g_cfg.sessions - p * RFS_MAX_POOL;
+        if (want > RFS_MAX_POOL) want = RFS_MAX_POOL;
+        pools[p].c = rfs_connect(g_cfg.host, g_cfg.port, want);
+        int got = pools[p].c ? rfs_pool_size(pools[p].c) : 0;
+        for (int k = 0; k < got; k++) {
+            char cmd[100];
+            Session *s = &sessions[opened++];
+            s->pool = &pools[p];
+            s->id = opened - 1;
+            s->conn = k;
+            s->user = (opened - 1) % g_cfg.users;
+            s->rng = 2654435761u * (unsigned int)opened;
+            sprintf(cmd, "LOGIN bench%d %s", s->user, BENCH_PASSWORD);
+            rfs_command_on(pools[p].c, k, cmd, count_failure, &login_failed);
+        }
+        if (got < want) break;
+    }
+    for (int p = 0; p < npools; p++)
+        if (pools[p].c) rfs_wait(pools[p].c);
+    if (opened < g_cfg.sessions || login_failed)
+        fprintf(stderr, "Only %ld of %d sessions are logged in (raise the open file limit?)\n",
+                opened - login_failed, g_cfg.sessions);
+    if (opened == 0) return 1;
+    g_cfg.sessions = opened;
+
+    printf("Running mix '%s' for %d s...\n", g_cfg.mix->name, g_cfg.duration);
+    double t0 = now_us();
+    for (int i = 0; i < opened; i++) session_next(&sessions[i]);
+    sleep_ms(g_cfg.duration * 1000);
+    g_stop = 1;
+    for (int p = 0; p < npools; p++)
+        if (pools[p].c) rfs_wait(pools[p].c);
+    double seconds = (now_us() - t0) / 1e6;
+
+    CmdStats all[OP_COUNT];
+    memset(all, 0, sizeof(all));
+    for (int p = 0; p < npools; p++) {
+        for (int i = 0; i < OP_COUNT; i++) {
+            CmdStats *st = &pools[p].stats[i];
+            all[i].ops += st->ops;
+            all[i].errors += st->errors;
+            all[i].bytes += st->bytes;
+            all[i].total_us += st->total_us;
+            if (st->max_us > all[i].max_us) all[i].max_us = st->max_us;
+            for (int b = 0; b < HIST_BUCKETS; b++) all[i].hist[b] += st->hist[b];
+        }
+        if (pools[p].c) rfs_close(pools[p].c);
+        DeleteCriticalSection(&pools[p].cs);
+    }
+    // Downloads are only timed; the files themselves are not kept.
+    for (int i = 0; files && i < opened; i++) {
+        char name[64];
+        sprintf(name, "bench_download%d.bin", i);
+        remove(name);
+    }
+    print_report(all, seconds);
+    free(sessions);
+    free(pools);
+    free(g_payload);
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <string.h>
+#include "checksum.h"
+
+/* ---------- CRC-32 ---------- */
+unsigned int crc_table[8][256];
+
+void crc32_init() {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[0][i] = c;
+    }
+    for (int t = 1; t < 8; t++)
+        for (int i = 0; i < 256; i++)
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+}
+
+// Standard CRC-32 (as zlib's crc32()); start with crc = 0.
+unsigned int crc32_update(unsigned int crc, const char *data, long len) {
+    const unsigned char *p = (const unsigned char*)data;
+    crc = ~crc;
+    // Slicing-by-8: eight table lookups per 8 bytes instead of one per byte.
+    while (len >= 8) {
+        unsigned int a = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24);
+        crc = crc_table[7][a & 0xFF] ^ crc_table[6][(a >> 8) & 0xFF] ^
+              crc_table[5][(a >> 16) & 0xFF] ^ crc_table[4][a >> 24] ^
+              crc_table[3][p[4]] ^ crc_table[2][p[5]] ^ crc_table[1][p[6]] ^ crc_table[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* ---------- MD5 AND ROLLING CHECKSUM (delta uploads) ---------- */
+const unsigned int md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+const unsigned char md5_r[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+void md5_init(Md5 *m) {
+    m->h[0] = 0x67452301;
+    m->h[1] = 0xefcdab89;
+    m->h[2] = 0x98badcfe;
+    m->h[3] = 0x10325476;
+    m->len = 0;
+}
+
+void md5_block(Md5 *m, const unsigned char *p) {
+    unsigned int w[16], a = m->h[0], b = m->h[1], c = m->h[2], d = m->h[3];
+    for (int i = 0; i < 16; i++)
+        w[i] = p[i * 4] | p[i * 4 + 1] << 8 | p[i * 4 + 2] << 16 | (unsigned int)p[i * 4 + 3] << 24;
+    for (int i = 0; i < 64; i++) {
+        unsigned int f;
+        int g, r = md5_r[(i / 16) * 4 + (i & 3)];
+        if (i < 16) { f = (b & c) | (~b & d); g = i; }
+        else if (i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) & 15; }
+        else if (i < 48) { f = b ^ c ^ d; g = (3 * i + 5) & 15; }
+        else { f = c ^ (b | ~d); g = (7 * i) & 15; }
+        f += a + md5_k[i] + w[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (f << r) | (f >> (32 - r));
+    }
+    m->h[0] += a;
+    m->h[1] += b;
+    m->h[2] += c;
+    m->h[3] += d;
+}
+
+void md5_update(Md5 *m, const void *data, long len) {
+    const unsigned char *p = (const unsigned char*)data;
+    int used = (int)(m->len & 63);
+    m->len += len;
+    if (used) {
+        int take = (len < 64 - used) ? (int)len : 64 - used;
+        memcpy(m->buf + used, p, take);
+        p += take;
+        len -= take;
+        if (used + take < 64) return;
+        md5_block(m, m->buf);
+    }
+    for (; len >= 64; p += 64, len -= 64) md5_block(m, p);
+    memcpy(m->buf, p, len);
+}
+
+void md5_final(Md5 *m, unsigned char out[16]) {
+    unsigned char pad[72] = { 0x80 };
+    unsigned long long bits = m->len * 8;
+    int used = (int)(m->len & 63);
+    int n = (used < 56) ? 56 - used : 120 - used;
+    for (int i = 0; i < 8; i++) pad[n + i] = (unsigned char)(bits >> (8 * i));
+    md5_update(m, pad, n + 8);
+    for (int i = 0; i < 16; i++) out[i] = (unsigned char)(m->h[i / 4] >> (8 * (i % 4)));
+}
+
+// rsync's rolling checksum: low half the byte sum, high half the sum
+// weighted by distance from the end of the block.
+unsigned int delta_weak(const unsigned char *p, long n) {
+    unsigned int a = 0, b = 0;
+    for (long i = 0; i < n; i++) {
+        a += p[i];
+        b += (unsigned int)(n - i) * p[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+void put_be32(unsigned char *p, unsigned int v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+unsigned int get_be32(const unsigned char *p) {
+    return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
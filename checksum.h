@@ -0,0 +1,35 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+/*
+ * Checksums shared by the server and the client. Both ends of the parallel
+ * chunk upload compare CRC-32s, and both ends of a delta upload compare block
+ * signatures and MD5s, so they must compute them with the same code.
+ *
+ * Build: link checksum.c into both server and client, e.g.
+ *   gcc server.c fscore.c checksum.c -o server -lpthread
+ *   gcc client.c remotefs.c checksum.c -o client -lpthread
+ */
+
+/* ---------- CRC-32 ---------- */
+void crc32_init();                   // build the tables; call once before crc32_update()
+unsigned int crc32_update(unsigned int crc, const char *data, long len);
+
+/* ---------- MD5 AND ROLLING CHECKSUM (delta uploads) ---------- */
+typedef struct {
+    unsigned int h[4];
+    unsigned long long len;
+    unsigned char buf[64];
+} Md5;
+
+void md5_init(Md5 *m);
+void md5_block(Md5 *m, const unsigned char *p);
+void md5_update(Md5 *m, const void *data, long len);
+void md5_final(Md5 *m, unsigned char out[16]);
+unsigned int delta_weak(const unsigned char *p, long n);
+
+// Integers in the delta protocol are 4-byte big-endian.
+void put_be32(unsigned char *p, unsigned int v);
+unsigned int get_be32(const unsigned char *p);
+
+#endif
@@ -1,14 +1,110 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include "remotefs.h"
+#include "checksum.h"
+
+#ifdef _WIN32
 #include <winsock2.h>
+#include <windows.h>
 
 #pragma comment(lib, "ws2_32.lib")
+#else
+/* ---------- POSIX COMPATIBILITY ---------- */
+/* Lets the client build on Linux too (gcc client.c remotefs.c checksum.c -o client -lpthread). */
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#endif
 
+#define SERVER_IP "127.0.0.1"  // 🔁 Change to server IP if on different PC
 #define PORT 8080
 #define BUFFER 1024
+#define TRANSFER_BUF (256 * 1024)  // file data per send/recv call
+#define DEFAULT_STREAMS 4
+#define DEFAULT_CHUNK_KB 8192
+#define DEFAULT_BENCH_POOL 4
+
+// Opens a new connection to the server, or INVALID_SOCKET.
+SOCKET connect_server() {
+    struct sockaddr_in server;
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+
+    /* Server details */
+    server.sin_family = AF_INET;
+    server.sin_port = htons(PORT);
+    server.sin_addr.s_addr = inet_addr(SERVER_IP);
+
+    if (connect(sock, (struct sockaddr*)&server, sizeof(server)) < 0) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+double now_ms() {
+#ifdef _WIN32
+    return (double)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+void print_rate(const char *what, long bytes, double ms) {
+    double mbps = (ms > 0) ? (bytes / (1024.0 * 1024.0)) / (ms / 1000.0) : 0;
+    printf("%s %ld bytes in %.1f ms (%.1f MB/s)\n", what, bytes, ms, mbps);
+}
+
+// send() until everything is out. Returns 0 if the connection failed.
+int send_all(SOCKET sock, const char *data, long len) {
+    while (len > 0) {
+        int n = send(sock, data, (len > (1 << 20)) ? (1 << 20) : (int)len, 0);
+        if (n <= 0) return 0;
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+int recv_all(SOCKET sock, char *data, long len) {
+    while (len > 0) {
+        int n = recv(sock, data, (len > (1 << 20)) ? (1 << 20) : (int)len, 0);
+        if (n <= 0) return 0;
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
 
 /* Helper functions for file transfer */
+
+// Asks the server how much of an earlier, interrupted upload of this file
+// it already has. Returns the byte to continue from (0 = start over).
+long upload_resume_offset(SOCKET sock, const char *filename, long filesize) {
+    char cmd[BUFFER], resp[BUFFER];
+    long received = 0, expected = 0;
+    sprintf(cmd, "UPLOAD_STATUS %s", filename);
+    send(sock, cmd, strlen(cmd), 0);
+    int n = recv(sock, resp, BUFFER - 1, 0);
+    if (n <= 0) return 0;
+    resp[n] = 0;
+    if (sscanf(resp, "PARTIAL %ld %ld", &received, &expected) != 2) return 0;
+    if (strstr(resp, "ACTIVE")) return 0;   // server will refuse with "Upload in progress"
+    if (received <= 0 || received >= filesize) return 0;
+    if (expected != 0 && expected != filesize) return 0;   // a different file was being uploaded
+    return received;
+}
+
 void upload_file(SOCKET sock, const char *filename) {
     FILE *fp = fopen(filename, "rb");
     if (!fp) {
@@ -19,23 +115,38 @@ void upload_file(SOCKET sock, const char *filename) {
     fseek(fp, 0, SEEK_END);
     long filesize = ftell(fp);
     fseek(fp, 0, SEEK_SET);
+
+    // Continue an interrupted upload from the last byte the server has.
+    long offset = upload_resume_offset(sock, filename, filesize);
     
     // Send upload header
     char cmd[BUFFER];
-    sprintf(cmd, "UPLOAD %s %ld", filename, filesize);
-    send(sock, cmd, strlen(cmd), 0);
-    
-    // Wait for server ready
     char ack[BUFFER];
-    recv(sock, ack, BUFFER, 0);
+    while (1) {
+        if (offset > 0) sprintf(cmd, "UPLOAD %s %ld %ld", filename, filesize, offset);
+        else sprintf(cmd, "UPLOAD %s %ld", filename, filesize);
+        send(sock, cmd, strlen(cmd), 0);
+
+        // Wait for server ready
+        memset(ack, 0, BUFFER);
+        recv(sock, ack, BUFFER - 1, 0);
+        if (offset > 0 && strstr(ack, "Invalid Offset")) {
+            offset = 0;     // the partial upload is gone, start over
+            continue;
+        }
+        break;
+    }
     if (strstr(ack, "READY")) {
-        printf("Uploading %ld bytes...\n", filesize);
-        char *fbuf = malloc(BUFFER);
-        long sent = 0;
+        if (offset > 0) printf("Resuming upload at byte %ld of %ld...\n", offset, filesize);
+        else printf("Uploading %ld bytes...\n", filesize);
+        fseek(fp, offset, SEEK_SET);
+        double t0 = now_ms();
+        char *fbuf = malloc(TRANSFER_BUF);
+        long sent = offset;
         while (sent < filesize) {
-            int n = fread(fbuf, 1, BUFFER, fp);
+            int n = fread(fbuf, 1, TRANSFER_BUF, fp);
             if (n > 0) {
-                send(sock, fbuf, n, 0);
+                if (!send_all(sock, fbuf, n)) break;
                 sent += n;
             } else break;
         }
@@ -43,38 +154,72 @@ void upload_file(SOCKET sock, const char *filename) {
         
         // Wait for final ack
         memset(ack, 0, BUFFER);
-        recv(sock, ack, BUFFER, 0);
-        printf("Server: %s", ack);
+        if (recv(sock, ack, BUFFER - 1, 0) <= 0) {
+            printf("Connection lost. Reconnect and UPLOAD again to resume.\n");
+        } else {
+            print_rate("Uploaded", sent - offset, now_ms() - t0);
+            printf("Server: %s", ack);
+        }
     } else {
         printf("Server Error: %s", ack);
     }
     fclose(fp);
 }
 
+// Downloads into <filename>.part and renames it when complete. If a .part
+// file is already there from an interrupted download, only the rest of
+// the file is requested.
 void download_file(SOCKET sock, const char *filename) {
-    char cmd[BUFFER];
-    sprintf(cmd, "DOWNLOAD %s", filename);
-    send(sock, cmd, strlen(cmd), 0);
-    
+    char cmd[BUFFER], part[BUFFER];
+    sprintf(part, "%s.part", filename);
+
+    long have = 0;
+    FILE *old = fopen(part, "rb");
+    if (old) {
+        fseek(old, 0, SEEK_END);
+        have = ftell(old);
+        fclose(old);
+    }
+
     char resp[BUFFER];
-    int n = recv(sock, resp, BUFFER, 0);
-    resp[n] = 0;
+    int n;
+    while (1) {
+        if (have > 0) sprintf(cmd, "DOWNLOAD %s %ld", filename, have);
+        else sprintf(cmd, "DOWNLOAD %s", filename);
+        send(sock, cmd, strlen(cmd), 0);
+
+        n = recv(sock, resp, BUFFER - 1, 0);
+        if (n <= 0) {
+            printf("Server disconnected\n");
+            return;
+        }
+        resp[n] = 0;
+        if (have > 0 && strstr(resp, "Invalid Range")) {
+            have = 0;       // the server's file is shorter now, start over
+            continue;
+        }
+        break;
+    }
     
-    long filesize = 0;
-    if (sscanf(resp, "SIZE %ld", &filesize) == 1) {
+    long filesize = 0, total = 0;
+    int fields = sscanf(resp, "SIZE %ld %ld", &filesize, &total);
+    if (fields >= 1) {
+        if (fields < 2) total = filesize;
         send(sock, "READY", 5, 0); // Send ACK
         
-        FILE *fp = fopen(filename, "wb");
+        FILE *fp = fopen(part, have > 0 ? "ab" : "wb");
         if (!fp) {
             printf("Error: Cannot create local file\n");
             return;
         }
         
-        printf("Downloading %ld bytes...\n", filesize);
-        char *fbuf = malloc(BUFFER);
+        if (have > 0) printf("Resuming download at byte %ld of %ld...\n", have, total);
+        else printf("Downloading %ld bytes...\n", filesize);
+        double t0 = now_ms();
+        char *fbuf = malloc(TRANSFER_BUF);
         long rcvd = 0;
         while (rcvd < filesize) {
-            int to_read = (filesize - rcvd < BUFFER) ? (filesize - rcvd) : BUFFER;
+            int to_read = (filesize - rcvd < TRANSFER_BUF) ? (filesize - rcvd) : TRANSFER_BUF;
             int r = recv(sock, fbuf, to_read, 0);
             if (r <= 0) break;
             fwrite(fbuf, 1, r, fp);
@@ -82,13 +227,595 @@ void download_file(SOCKET sock, const char *filename) {
         }
         free(fbuf);
         fclose(fp);
-        printf("Download Complete\n");
+        if (rcvd == filesize) {
+            remove(filename);
+            rename(part, filename);
+            print_rate("Downloaded", rcvd, now_ms() - t0);
+            printf("Download Complete\n");
+        } else {
+            printf("Download interrupted at byte %ld of %ld. Reconnect and DOWNLOAD again to resume.\n",
+                   have + rcvd, total);
+        }
     } else {
         printf("Server Response: %s", resp);
     }
 }
 
+/* Parallel transfers: one file split into chunks over several connections */
+typedef struct {
+    const char *local;      // local file (for downloads, the .part file)
+    const char *remote;
+    char token[64];         // SESSION_TOKEN of the main connection
+    long size, chunk;
+    int nchunks;
+    int next;               // next chunk nobody has taken yet
+    int upload;
+    int failed;
+    long bytes;             // moved so far, all streams together
+} ParallelXfer;
+
+// Sends one command and reads one reply into resp.
+int request(SOCKET sock, const char *cmd, char *resp) {
+    send(sock, cmd, strlen(cmd), 0);
+    int n = recv(sock, resp, BUFFER - 1, 0);
+    if (n <= 0) return 0;
+    resp[n] = 0;
+    return 1;
+}
+
+// One stream: its own connection, attached to the user's login, taking
+// chunks until none are left.
+void stream_run(ParallelXfer *x) {
+    char cmd[BUFFER], resp[BUFFER];
+    SOCKET sock = connect_server();
+    FILE *fp = fopen(x->local, x->upload ? "rb" : "r+b");
+    char *data = malloc(x->chunk);
+    sprintf(cmd, "ATTACH %s", x->token);
+    if (sock == INVALID_SOCKET || !fp || !data || !request(sock, cmd, resp) || !strstr(resp, "Attached")) {
+        x->failed = 1;
+    }
+
+    int i;
+    while (!x->failed && (i = __atomic_fetch_add(&x->next, 1, __ATOMIC_RELAXED)) < x->nchunks) {
+        long offset = (long)i * x->chunk;
+        long len = (x->size - offset < x->chunk) ? x->size - offset : x->chunk;
+        if (x->upload) {
+            fseek(fp, offset, SEEK_SET);
+            if ((long)fread(data, 1, len, fp) != len) { x->failed = 1; break; }
+            sprintf(cmd, "UPLOAD_CHUNK %s %d %08x", x->remote, i, crc32_update(0, data, len));
+            if (!request(sock, cmd, resp)) { x->failed = 1; break; }
+            if (strncmp(resp, "CHUNK_DONE", 10) == 0) continue;
+            if (strncmp(resp, "READY", 5) != 0 || !send_all(sock, data, len) ||
+                !request(sock, "", resp) || strncmp(resp, "CHUNK_OK", 8) != 0) {
+                printf("Chunk %d failed: %s\n", i, resp);
+                x->failed = 1;
+                break;
+            }
+        } else {
+            long size = -1;
+            sprintf(cmd, "DOWNLOAD %s %ld %ld", x->remote, offset, len);
+            if (!request(sock, cmd, resp) || sscanf(resp, "SIZE %ld", &size) != 1 || size != len) {
+                x->failed = 1;
+                break;
+            }
+            send(sock, "READY", 5, 0);
+            if (!recv_all(sock, data, len)) { x->failed = 1; break; }
+            fseek(fp, offset, SEEK_SET);
+            if ((long)fwrite(data, 1, len, fp) != len) { x->failed = 1; break; }
+        }
+        __atomic_add_fetch(&x->bytes, len, __ATOMIC_RELAXED);
+    }
+    free(data);
+    if (fp) fclose(fp);
+    if (sock != INVALID_SOCKET) closesocket(sock);
+}
+
+#ifdef _WIN32
+DWORD WINAPI stream_thread(LPVOID arg) {
+    stream_run((ParallelXfer*)arg);
+    return 0;
+}
+#else
+void* stream_thread(void *arg) {
+    stream_run((ParallelXfer*)arg);
+    return NULL;
+}
+#endif
+
+// Runs 'streams' streams over x and waits for all of them.
+void run_streams(ParallelXfer *x, int streams) {
+#ifdef _WIN32
+    HANDLE threads[64];
+    for (int i = 0; i < streams; i++) threads[i] = CreateThread(NULL, 0, stream_thread, x, 0, NULL);
+    for (int i = 0; i < streams; i++) {
+        if (threads[i]) {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        } else {
+            x->failed = 1;
+        }
+    }
+#else
+    pthread_t threads[64];
+    int started[64];
+    for (int i = 0; i < streams; i++) started[i] = pthread_create(&threads[i], NULL, stream_thread, x) == 0;
+    for (int i = 0; i < streams; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        else x->failed = 1;
+    }
+#endif
+}
+
+// Fills x->token and x->nchunks. Returns 0 (after printing why) on failure.
+int parallel_setup(SOCKET sock, ParallelXfer *x, int streams, long chunk_kb) {
+    char resp[BUFFER];
+    if (streams < 1 || streams > 64 || chunk_kb < 64) {
+        printf("Usage: streams 1-64, chunk size at least 64 KB\n");
+        return 0;
+    }
+    if (!request(sock, "SESSION_TOKEN", resp) || sscanf(resp, "TOKEN %63s", x->token) != 1) {
+        printf("Server: %s", resp);
+        return 0;
+    }
+    crc32_init();
+    x->chunk = chunk_kb * 1024;
+    x->nchunks = (int)((x->size + x->chunk - 1) / x->chunk);
+    return 1;
+}
+
+void parallel_upload(SOCKET sock, const char *filename, int streams, long chunk_kb) {
+    ParallelXfer x;
+    char cmd[BUFFER], resp[BUFFER];
+    memset(&x, 0, sizeof(x));
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        printf("Error: File not found locally\n");
+        return;
+    }
+    fseek(fp, 0, SEEK_END);
+    x.size = ftell(fp);
+    fclose(fp);
+    if (x.size == 0) {
+        upload_file(sock, filename);
+        return;
+    }
+    x.local = x.remote = filename;
+    x.upload = 1;
+    if (!parallel_setup(sock, &x, streams, chunk_kb)) return;
+
+    sprintf(cmd, "UPLOAD_BEGIN %s %ld %ld", filename, x.size, x.chunk);
+    if (!request(sock, cmd, resp) || strncmp(resp, "XFER", 4) != 0) {
+        printf("Server: %s", resp);
+        return;
+    }
+    printf("Uploading %ld bytes in %d chunks over %d streams...\n", x.size, x.nchunks, streams);
+    double t0 = now_ms();
+    run_streams(&x, streams);
+
+    sprintf(cmd, "UPLOAD_END %s", filename);
+    if (!request(sock, cmd, resp)) {
+        printf("Server disconnected\n");
+        return;
+    }
+    if (!x.failed) print_rate("Uploaded", x.bytes, now_ms() - t0);
+    printf("Server: %s", resp);
+}
+
+void parallel_download(SOCKET sock, const char *filename, int streams, long chunk_kb) {
+    ParallelXfer x;
+    char cmd[BUFFER], resp[BUFFER], part[BUFFER];
+    memset(&x, 0, sizeof(x));
+    sprintf(cmd, "STAT %s", filename);
+    if (!request(sock, cmd, resp) || sscanf(resp, "Size: %ld", &x.size) != 1) {
+        printf("Server Response: %s", resp);
+        return;
+    }
+    sprintf(part, "%s.part", filename);
+    x.local = part;
+    x.remote = filename;
+    if (!parallel_setup(sock, &x, streams, chunk_kb)) return;
+
+    FILE *fp = fopen(part, "wb");
+    if (!fp) {
+        printf("Error: Cannot create local file\n");
+        return;
+    }
+    fclose(fp);
+    printf("Downloading %ld bytes in %d chunks over %d streams...\n", x.size, x.nchunks, streams);
+    double t0 = now_ms();
+    run_streams(&x, streams);
+    if (x.failed || x.bytes != x.size) {
+        printf("Download failed after %ld of %ld bytes\n", x.bytes, x.size);
+        return;
+    }
+    remove(filename);
+    rename(part, filename);
+    print_rate("Downloaded", x.bytes, now_ms() - t0);
+    printf("Download Complete\n");
+}
+
+/* Delta uploads: only what changed since the server's copy goes over the wire */
+#define DELTA_LITERAL_MAX TRANSFER_BUF  // literal bytes per instruction (server allows 1 MB)
+
+typedef struct {
+    unsigned int weak;
+    unsigned char strong[16];
+    long len;
+    int next;               // next block in the same hash bucket
+} DeltaBlock;
+
+typedef struct {
+    SOCKET sock;
+    char *buf;              // instructions not sent yet
+    long len;
+    long run_start, run_count;  // matched blocks not emitted yet
+    long literal, matched;
+    int failed;
+} DeltaOut;
+
+void delta_flush(DeltaOut *o) {
+    if (o->len > 0 && !send_all(o->sock, o->buf, o->len)) o->failed = 1;
+    o->len = 0;
+}
+
+void delta_put(DeltaOut *o, const void *data, long len) {
+    if (o->len + len > TRANSFER_BUF + 16) delta_flush(o);
+    if (len > TRANSFER_BUF) {
+        if (!send_all(o->sock, data, len)) o->failed = 1;
+        return;
+    }
+    memcpy(o->buf + o->len, data, len);
+    o->len += len;
+}
+
+void delta_emit_run(DeltaOut *o) {
+    unsigned char op[9] = { 'B' };
+    if (o->run_count == 0) return;
+    put_be32(op + 1, (unsigned int)o->run_start);
+    put_be32(op + 5, (unsigned int)o->run_count);
+    delta_put(o, op, 9);
+    o->run_count = 0;
+}
+
+void delta_emit_literal(DeltaOut *o, const char *data, long len) {
+    unsigned char op[5] = { 'L' };
+    if (len > 0) delta_emit_run(o);
+    while (len > 0) {
+        long n = (len < DELTA_LITERAL_MAX) ? len : DELTA_LITERAL_MAX;
+        put_be32(op + 1, (unsigned int)n);
+        delta_put(o, op, 5);
+        delta_put(o, data, n);
+        o->literal += n;
+        data += n;
+        len -= n;
+    }
+}
 
+void delta_emit_block(DeltaOut *o, long index, long len) {
+    if (o->run_count > 0 && o->run_start + o->run_count == index) {
+        o->run_count++;
+    } else {
+        delta_emit_run(o);
+        o->run_start = index;
+        o->run_count = 1;
+    }
+    o->matched += len;
+}
+
+// The signature block matching buf[0..n) with checksum weak, or -1.
+// 'hint' (the block after the last match) is tried first so runs stay runs.
+long delta_find(DeltaBlock *blocks, long count, int *heads, unsigned int mask,
+                unsigned int weak, const char *buf, long n, long hint) {
+    unsigned char strong[16];
+    int have_strong = 0;
+    int from_hint = hint >= 0 && hint < count && blocks[hint].weak == weak;
+    long i = from_hint ? hint : heads[weak & mask];
+    while (i >= 0) {
+        if (blocks[i].weak == weak && blocks[i].len == n) {
+            if (!have_strong) {
+                Md5 m;
+                md5_init(&m);
+                md5_update(&m, buf, n);
+                md5_final(&m, strong);
+                have_strong = 1;
+            }
+            if (memcmp(strong, blocks[i].strong, 16) == 0) return i;
+        }
+        if (from_hint) {
+            from_hint = 0;
+            i = heads[weak & mask];
+        } else {
+            i = blocks[i].next;
+        }
+    }
+    return -1;
+}
+
+// Reads one "\n"-terminated reply line, without reading past it.
+int recv_line(SOCKET sock, char *line, int max) {
+    int n = 0;
+    while (n < max - 1) {
+        if (recv(sock, line + n, 1, 0) != 1) return 0;
+        if (line[n++] == '\n') break;
+    }
+    line[n] = 0;
+    return 1;
+}
+
+// Reads the signature that follows a "SIG" line into blocks and a hash table.
+DeltaBlock* delta_read_signature(SOCKET sock, long size, long block, long count, int **heads, unsigned int *mask) {
+    unsigned char entry[20];
+    unsigned int buckets = 1024;
+    while (buckets < count * 2) buckets *= 2;
+    DeltaBlock *blocks = malloc((count ? count : 1) * sizeof(DeltaBlock));
+    *heads = malloc(buckets * sizeof(int));
+    *mask = buckets - 1;
+    if (!blocks || !*heads) {
+        free(blocks);
+        free(*heads);
+        return NULL;
+    }
+    memset(*heads, 0xFF, buckets * sizeof(int));   // all -1
+    for (long i = 0; i < count; i++) {
+        if (!recv_all(sock, (char*)entry, 20)) {
+            free(blocks);
+            free(*heads);
+            return NULL;
+        }
+        blocks[i].weak = get_be32(entry);
+        memcpy(blocks[i].strong, entry + 4, 16);
+        blocks[i].len = (size - i * block < block) ? size - i * block : block;
+        blocks[i].next = (*heads)[blocks[i].weak & *mask];
+        (*heads)[blocks[i].weak & *mask] = (int)i;
+    }
+    return blocks;
+}
+
+// Walks the local file with a rolling checksum, emitting a block reference
+// wherever a block of the server's copy turns up and literal data between.
+void delta_encode(FILE *fp, DeltaOut *o, DeltaBlock *blocks, long count, int *heads,
+                  unsigned int mask, long block, Md5 *whole) {
+    long cap = 4 * (block + DELTA_LITERAL_MAX);
+    char *buf = malloc(cap);
+    long len = 0, p = 0, lit = 0, hint = -1;
+    unsigned int a = 0, b = 0;
+    int eof = 0, have_weak = 0;
+    long last_len = count ? blocks[count - 1].len : 0;
+    if (!buf) {
+        o->failed = 1;
+        return;
+    }
+    while (!o->failed) {
+        if (!eof && len - p <= block) {
+            // Slide the window's bytes to the front and read more behind them.
+            delta_emit_literal(o, buf + lit, p - lit);
+            memmove(buf, buf + p, len - p);
+            len -= p;
+            p = lit = 0;
+            long n = (long)fread(buf + len, 1, cap - len, fp);
+            if (n <= 0) eof = 1;
+            md5_update(whole, buf + len, n > 0 ? n : 0);
+            len += n > 0 ? n : 0;
+            continue;
+        }
+        if (p + block > len) {
+            // Less than a block left: only the server's short last block can match.
+            long t = len - last_len;
+            long i = -1;
+            if (count && last_len < block && t >= p)
+                i = delta_find(blocks, count, heads, mask, delta_weak((unsigned char*)buf + t, last_len),
+                               buf + t, last_len, count - 1);
+            if (i == count - 1) {
+                delta_emit_literal(o, buf + lit, t - lit);
+                delta_emit_block(o, i, last_len);
+            } else {
+                delta_emit_literal(o, buf + lit, len - lit);
+            }
+            break;
+        }
+        if (!have_weak) {
+            unsigned int w = delta_weak((unsigned char*)buf + p, block);
+            a = w & 0xFFFF;
+            b = w >> 16;
+            have_weak = 1;
+        }
+        long i = delta_find(blocks, count, heads, mask, (a & 0xFFFF) | (b << 16), buf + p, block, hint);
+        if (i >= 0) {
+            delta_emit_literal(o, buf + lit, p - lit);
+            delta_emit_block(o, i, block);
+            p += block;
+            lit = p;
+            hint = i + 1;
+            have_weak = 0;
+            continue;
+        }
+        // Roll one byte forward.
+        unsigned char out = (unsigned char)buf[p];
+        if (p + block < len) {
+            unsigned char in = (unsigned char)buf[p + block];
+            a += in - out;
+            b += a - (unsigned int)block * out;
+        } else {
+            have_weak = 0;
+        }
+        p++;
+        if (p - lit >= DELTA_LITERAL_MAX) {
+            delta_emit_literal(o, buf + lit, p - lit);
+            lit = p;
+        }
+    }
+    free(buf);
+}
+
+// Uploads a new version of a file the server already has, sending only the
+// parts that changed. Falls back to a normal upload if there is no old copy.
+void delta_upload(SOCKET sock, const char *filename) {
+    char cmd[BUFFER], resp[BUFFER];
+    long size = 0, block = 0, count = 0;
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        printf("Error: File not found locally\n");
+        return;
+    }
+    fseek(fp, 0, SEEK_END);
+    long filesize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    sprintf(cmd, "DELTA_SIG %s", filename);
+    send(sock, cmd, strlen(cmd), 0);
+    if (!recv_line(sock, resp, BUFFER)) {
+        printf("Server disconnected\n");
+        fclose(fp);
+        return;
+    }
+    if (sscanf(resp, "SIG %ld %ld %ld", &size, &block, &count) != 3 || filesize == 0) {
+        fclose(fp);
+        if (strncmp(resp, "SIG", 3) == 0) {
+            // Nothing to gain for an empty file; drain the signature first.
+            char entry[20];
+            for (long i = 0; i < count; i++) recv_all(sock, entry, 20);
+        } else if (!strstr(resp, "No Such File")) {
+            printf("Server: %s", resp);
+            return;
+        }
+        printf("No usable copy on the server, uploading the whole file\n");
+        upload_file(sock, filename);
+        return;
+    }
+
+    int *heads;
+    unsigned int mask;
+    double t0 = now_ms();
+    DeltaBlock *blocks = delta_read_signature(sock, size, block, count, &heads, &mask);
+    if (!blocks) {
+        printf("Failed to read the signature\n");
+        fclose(fp);
+        return;
+    }
+    sprintf(cmd, "DELTA_UPLOAD %s %ld %ld", filename, filesize, block);
+    if (!request(sock, cmd, resp) || strncmp(resp, "READY", 5) != 0) {
+        printf("Server: %s", resp);
+    } else {
+        DeltaOut o;
+        Md5 whole;
+        unsigned char end[17] = { 'E' };
+        memset(&o, 0, sizeof(o));
+        o.sock = sock;
+        o.buf = malloc(TRANSFER_BUF + 16);
+        o.failed = !o.buf;
+        md5_init(&whole);
+        printf("Sending changes against the server's %ld-byte copy (%ld blocks of %ld)...\n", size, count, block);
+        if (!o.failed) delta_encode(fp, &o, blocks, count, heads, mask, block, &whole);
+        delta_emit_run(&o);
+        md5_final(&whole, end + 1);
+        delta_put(&o, end, 17);
+        delta_flush(&o);
+        free(o.buf);
+        if (o.failed || !recv_line(sock, resp, BUFFER)) {
+            printf("Connection lost during delta upload\n");
+        } else {
+            print_rate("Sent", o.literal + count * 20, now_ms() - t0);
+            printf("%ld of %ld bytes were new, %ld reused from the server's copy\n", o.literal, filesize, o.matched);
+            printf("Server: %s", resp);
+            if (strstr(resp, "Delta Mismatch")) {
+                printf("The server's copy changed meanwhile, uploading the whole file\n");
+                fclose(fp);
+                fp = NULL;
+                upload_file(sock, filename);
+            }
+        }
+    }
+    free(blocks);
+    free(heads);
+    if (fp) fclose(fp);
+}
+
+/* Batches: many commands from a file in one round trip */
+#define BATCH_MAX 10000
+
+// Sends every command in 'path' (one per line; blank lines and lines
+// starting with '#' are skipped) as one BATCH and prints each result.
+void run_batch(SOCKET sock, const char *path, int atomic) {
+    char line[BUFFER], header[64];
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        printf("Error: Cannot open batch file\n");
+        return;
+    }
+    long cap = 64 * 1024, len = 0;
+    int count = 0;
+    char *body = malloc(cap);
+    while (body && fgets(line, BUFFER, fp)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] == 0 || line[0] == '#') continue;
+        long n = strlen(line);
+        if (len + n + 1 > cap) {
+            char *grown = realloc(body, cap *= 2);
+            if (!grown) {
+                free(body);
+                body = NULL;
+                break;
+            }
+            body = grown;
+        }
+        memcpy(body + len, line, n);
+        body[len + n] = '\n';
+        len += n + 1;
+        count++;
+    }
+    fclose(fp);
+    if (!body || count == 0 || count > BATCH_MAX) {
+        printf(body ? "Batch files hold 1 to %d commands\n" : "Out of memory\n", BATCH_MAX);
+        free(body);
+        return;
+    }
+
+    // Header and commands go out in one send, so Nagle does not hold the
+    // commands back until the header is acknowledged.
+    double t0 = now_ms();
+    sprintf(header, "BATCH %d%s\n", count, atomic ? " ATOMIC" : "");
+    long hlen = strlen(header);
+    char *msg = malloc(hlen + len);
+    int sent = msg != NULL;
+    if (msg) {
+        memcpy(msg, header, hlen);
+        memcpy(msg + hlen, body, len);
+        sent = send_all(sock, msg, hlen + len);
+        free(msg);
+    }
+    free(body);
+    if (!sent) {
+        printf("Server disconnected\n");
+        return;
+    }
+
+    char *reply = malloc(TRANSFER_BUF);
+    while (reply && recv_line(sock, line, BUFFER)) {
+        int index;
+        long size;
+        char status[8];
+        if (sscanf(line, "%d %7s %ld", &index, status, &size) != 3) {
+            printf("Server: %s", line);     // "END ...", or the batch was refused
+            break;
+        }
+        printf("[%d] %s: ", index, status);
+        while (size > 0) {
+            long n = (size < TRANSFER_BUF - 1) ? size : TRANSFER_BUF - 1;
+            if (!recv_all(sock, reply, n)) {
+                size = -1;
+                break;
+            }
+            fwrite(reply, 1, n, stdout);
+            size -= n;
+        }
+        if (size < 0) {
+            printf("\nServer disconnected\n");
+            break;
+        }
+    }
+    free(reply);
+    printf("%d commands in %.1f ms\n", count, now_ms() - t0);
+}
 
 void show_help() {
     printf("\n==================== COMMAND LIST ====================\n");
@@ -110,43 +837,104 @@ void show_help() {
     printf("%-10s : %-35s | %s\n", "COPY", "Copy file", "COPY <src> <dest>");
     printf("%-10s : %-35s | %s\n", "MOVE", "Move/Rename file", "MOVE <src> <dest>");
     printf("%-10s : %-35s | %s\n", "PUTFILE", "Move file into directory", "PUTFILE <file> <dir>");
-    printf("%-10s : %-35s | %s\n", "UPLOAD", "Upload local file to server", "UPLOAD <filename>");
-    printf("%-10s : %-35s | %s\n", "DOWNLOAD", "Download server file", "DOWNLOAD <filename>");
+    printf("%-10s : %-35s | %s\n", "UPLOAD", "Upload local file (resumes if cut off)", "UPLOAD <filename>");
+    printf("%-10s : %-35s | %s\n", "DOWNLOAD", "Download file (resumes if cut off)", "DOWNLOAD <filename>");
+    printf("%-10s : %-35s | %s\n", "BATCH", "Run commands from a file at once", "BATCH <file> [ATOMIC]");
+    printf("%-10s : %-35s | %s\n", "PUPLOAD", "Upload over parallel streams", "PUPLOAD <file> [streams] [chunk_kb]");
+    printf("%-10s : %-35s | %s\n", "DUPLOAD", "Upload only the changes (delta)", "DUPLOAD <filename>");
+    printf("%-10s : %-35s | %s\n", "PDOWNLOAD", "Download over parallel streams", "PDOWNLOAD <file> [streams] [chunk_kb]");
+    printf("%-10s : %-35s | %s\n", "BENCH", "Time a command, serial vs pipelined", "BENCH <count> <command...>");
     printf("==========================================================================\n");
 }
 
+/* ---------- COMMANDS OVER THE CLIENT LIBRARY ---------- */
+// Prints a reply the way the server sent it, minus the C strings' NULs.
+void print_reply(const char *reply, long len) {
+    printf("Server: ");
+    for (long i = 0; i < len; i++)
+        if (reply[i]) putchar(reply[i]);
+}
+
+// A text connection for the handshake commands, logged in like 'rfs' when
+// it is (otherwise a plain one the server answers "Please login first").
+SOCKET open_transfer_socket(RfsClient *rfs, int logged_in) {
+    if (logged_in) {
+        intptr_t s = rfs_open_text(rfs);
+        if (s >= 0) return (SOCKET)s;
+    }
+    return connect_server();
+}
+
+void bench_done(void *ctx, const RfsReply *reply) {
+    if (!reply->ok) (*(long*)ctx)++;
+}
+
+// Runs 'cmd' count times one round trip at a time, then with every request
+// in flight at once over a pool of 'pool' connections.
+void run_bench(RfsClient *rfs, int logged_in, long count, int pool, const char *cmd) {
+    char token[64] = "";
+    long failed = 0;
+    if (logged_in) {
+        char *reply = rfs_call(rfs, "SESSION_TOKEN", NULL, NULL);
+        if (reply) sscanf(reply, "TOKEN %63s", token);
+        rfs_free(reply);
+    }
+
+    double t0 = now_ms();
+    for (long i = 0; i < count; i++) {
+        int ok = 0;
+        char *reply = rfs_call(rfs, cmd, NULL, &ok);
+        if (!reply) {
+            printf("Server disconnected\n");
+            return;
+        }
+        if (!ok) failed++;
+        rfs_free(reply);
+    }
+    double sync_ms = now_ms() - t0;
+
+    RfsClient *p = rfs_connect(SERVER_IP, PORT, pool);
+    if (!p || (token[0] && !rfs_attach(p, token))) {
+        printf("Could not open a pool of %d connections\n", pool);
+        rfs_close(p);
+        return;
+    }
+    t0 = now_ms();
+    for (long i = 0; i < count; i++)
+        if (!rfs_command(p, cmd, bench_done, &failed)) failed++;
+    rfs_wait(p);
+    double pipe_ms = now_ms() - t0;
+    rfs_close(p);
+
+    printf("one at a time: %ld requests in %.1f ms (%.0f req/s)\n", count, sync_ms, count * 1000.0 / (sync_ms > 0 ? sync_ms : 1));
+    printf("pipelined x%d: %ld requests in %.1f ms (%.0f req/s)\n", pool, count, pipe_ms, count * 1000.0 / (pipe_ms > 0 ? pipe_ms : 1));
+    if (failed) printf("%ld requests failed\n", failed);
+}
+
 int main() {
-    WSADATA wsa;
+    RfsClient *rfs;
     SOCKET sock;
-    struct sockaddr_in server;
     char buffer[BUFFER];
-    int bytes;
+    int logged_in = 0;
 
+#ifdef _WIN32
     /* Initialize Winsock */
+    WSADATA wsa;
     if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
         printf("WSAStartup failed\n");
         return 1;
     }
+#endif
 
-    /* Create socket */
-    sock = socket(AF_INET, SOCK_STREAM, 0);
+    /* Connect: commands go through the library, transfers over 'sock' */
+    rfs = rfs_connect(SERVER_IP, PORT, 1);
+    sock = rfs ? connect_server() : INVALID_SOCKET;
     if (sock == INVALID_SOCKET) {
-        printf("Socket creation failed\n");
-        WSACleanup();
-        return 1;
-    }
-
-    /* Server details */
-    server.sin_family = AF_INET;
-    server.sin_port = htons(PORT);
-    server.sin_addr.s_addr = inet_addr("127.0.0.1");  
-    // 🔁 Change to server IP if on different PC
-
-    /* Connect */
-    if (connect(sock, (struct sockaddr*)&server, sizeof(server)) < 0) {
         printf("Connection to server failed\n");
-        closesocket(sock);
+        rfs_close(rfs);
+#ifdef _WIN32
         WSACleanup();
+#endif
         return 1;
     }
 
@@ -157,10 +945,10 @@ int main() {
     while (1) {
         printf("\nEnter command: ");
         memset(buffer, 0, BUFFER);
-        fgets(buffer, BUFFER, stdin);
+        if (!fgets(buffer, BUFFER, stdin)) break;
 
         /* Parse command locally to intercept UPLOAD/DOWNLOAD */
-        char temp_cmd[BUFFER], arg1[BUFFER];
+        char temp_cmd[BUFFER];
         strcpy(temp_cmd, buffer);
         char *token = strtok(temp_cmd, " \n");
 
@@ -173,6 +961,34 @@ int main() {
             }
             continue;
         } 
+        else if (token && (strcmp(token, "PUPLOAD") == 0 || strcmp(token, "PDOWNLOAD") == 0)) {
+            int upload = strcmp(token, "PUPLOAD") == 0;
+            char *name = strtok(NULL, " \n");
+            char *streams = strtok(NULL, " \n");
+            char *chunk_kb = strtok(NULL, " \n");
+            int n = streams ? atoi(streams) : DEFAULT_STREAMS;
+            long kb = chunk_kb ? atol(chunk_kb) : DEFAULT_CHUNK_KB;
+            if (!name) printf("Usage: %s <filename> [streams] [chunk_kb]\n", token);
+            else if (upload) parallel_upload(sock, name, n, kb);
+            else parallel_download(sock, name, n, kb);
+            continue;
+        }
+        else if (token && strcmp(token, "BATCH") == 0) {
+            char *file = strtok(NULL, " \n");
+            char *mode = strtok(NULL, " \n");
+            if (file) run_batch(sock, file, mode && strcmp(mode, "ATOMIC") == 0);
+            else printf("Usage: BATCH <file> [ATOMIC]\n");
+            continue;
+        }
+        else if (token && strcmp(token, "DUPLOAD") == 0) {
+            token = strtok(NULL, " \n");
+            if (token) {
+                delta_upload(sock, token);
+            } else {
+                printf("Usage: DUPLOAD <filename>\n");
+            }
+            continue;
+        }
         else if (token && strcmp(token, "DOWNLOAD") == 0) {
             token = strtok(NULL, " \n");
             if (token) {
@@ -183,23 +999,44 @@ int main() {
             continue;
         }
 
-        /* Send standard command */
-        send(sock, buffer, strlen(buffer), 0);
-
-        /* Receive response */
-        memset(buffer, 0, BUFFER);
-        bytes = recv(sock, buffer, BUFFER - 1, 0);
+        else if (token && strcmp(token, "BENCH") == 0) {
+            char *count = strtok(NULL, " \n");
+            char *rest = strtok(NULL, "\n");
+            if (count && rest && atol(count) > 0) run_bench(rfs, logged_in, atol(count), DEFAULT_BENCH_POOL, rest);
+            else printf("Usage: BENCH <count> <command...>\n");
+            continue;
+        }
+        if (!token) continue;
 
-        if (bytes <= 0) {
+        /* Send standard command */
+        buffer[strcspn(buffer, "\r\n")] = '\0';
+        long len = 0;
+        char *reply = rfs_call(rfs, buffer, &len, NULL);
+        if (!reply) {
             printf("Server disconnected\n");
             break;
         }
+        print_reply(reply, len);
 
-        buffer[bytes] = '\0';
-        printf("Server: %s", buffer);
+        // The transfer socket follows the login of the command connection.
+        int login = strcmp(token, "LOGIN") == 0 && strncmp(reply, "Login successful", 16) == 0;
+        if (login || strcmp(token, "LOGOUT") == 0) {
+            logged_in = login;
+            closesocket(sock);
+            sock = open_transfer_socket(rfs, logged_in);
+            if (sock == INVALID_SOCKET) {
+                rfs_free(reply);
+                printf("Server disconnected\n");
+                break;
+            }
+        }
+        rfs_free(reply);
     }
 
-    closesocket(sock);
+    if (sock != INVALID_SOCKET) closesocket(sock);
+    rfs_close(rfs);
+#ifdef _WIN32
     WSACleanup();
+#endif
     return 0;
 }
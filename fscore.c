@@ -0,0 +1,1124 @@
+#include "fscore.h"
+
+/*
+ * See fscore.h. Everything here used to live in server.c and keeps its
+ * design notes; the server plugs in its metadata cache and I/O backend
+ * where this code needs them (WalkCache).
+ */
+
+#ifndef _WIN32
+// Same contract as Win32: returns 0 on timeout.
+int SleepConditionVariableCS(CONDITION_VARIABLE *cv, CRITICAL_SECTION *cs, DWORD ms) {
+    if (ms == INFINITE) return pthread_cond_wait(cv, cs) == 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return pthread_cond_timedwait(cv, cs, &ts) == 0;
+}
+#endif
+
+#ifdef FSCORE_ALLOC_STATS
+long fscore_allocs = 0;
+
+void* fscore_malloc(size_t n) {
+    __atomic_add_fetch(&fscore_allocs, 1, __ATOMIC_RELAXED);
+    return malloc(n);
+}
+
+void* fscore_calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&fscore_allocs, 1, __ATOMIC_RELAXED);
+    return calloc(n, size);
+}
+
+void* fscore_realloc(void *p, size_t n) {
+    __atomic_add_fetch(&fscore_allocs, 1, __ATOMIC_RELAXED);
+    return realloc(p, n);
+}
+
+char* fscore_strdup(const char *s) {
+    __atomic_add_fetch(&fscore_allocs, 1, __ATOMIC_RELAXED);
+    return strdup(s);
+}
+
+#define malloc(n) fscore_malloc(n)
+#define calloc(n, size) fscore_calloc((n), (size))
+#define realloc(p, n) fscore_realloc((p), (n))
+#define strdup(s) fscore_strdup(s)
+#endif
+
+// Atomically puts a rewritten users.txt / shared_folders.txt in place.
+int rename_replace(const char *tmp, const char *dst) {
+#ifdef _WIN32
+    return MoveFileExA(tmp, dst, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return rename(tmp, dst);
+#endif
+}
+
+/* ---------- USER DATABASE ---------- */
+/*
+ * users.txt is read once at startup into an open-addressing hash table.
+ * LOGIN/SHARE lookups take the table's lock shared; REGISTER and CHPASS
+ * take it exclusive, update the table and append one "user pass" line to
+ * users.txt (a later line for the same user wins). When stale lines
+ * outnumber live users the file is rewritten from the table.
+ */
+#define USER_NAME_MAX 50
+#define USER_TABLE_INIT 1024
+#define USER_COMPACT_MIN 1024 // don't bother compacting tiny files
+
+typedef struct {
+    unsigned long long hash;
+    char name[USER_NAME_MAX];
+    char pass[USER_NAME_MAX];
+} UserEntry;
+
+typedef struct {
+    SRWLOCK lock;
+    UserEntry **slots;
+    int cap, count;
+    int log_lines;  // lines currently in users.txt
+    FILE *log;      // users.txt, open for append
+} UserDB;
+
+UserDB user_db;
+
+UserEntry* user_find(const char *u) {
+    unsigned long long h = path_hash(u);
+    int mask = user_db.cap - 1;
+    for (int i = (int)(h & mask); user_db.slots[i]; i = (i + 1) & mask) {
+        UserEntry *e = user_db.slots[i];
+        if (e->hash == h && strcmp(e->name, u) == 0) return e;
+    }
+    return NULL;
+}
+
+void user_place(UserEntry **slots, int cap, UserEntry *e) {
+    int i = (int)(e->hash & (cap - 1));
+    while (slots[i]) i = (i + 1) & (cap - 1);
+    slots[i] = e;
+}
+
+int user_insert(const char *u, const char *p) {
+    if ((user_db.count + 1) * 4 > user_db.cap * 3) {
+        int cap = user_db.cap * 2;
+        UserEntry **slots = (UserEntry**)calloc(cap, sizeof(UserEntry*));
+        if (!slots) return 0;
+        for (int i = 0; i < user_db.cap; i++)
+            if (user_db.slots[i]) user_place(slots, cap, user_db.slots[i]);
+        free(user_db.slots);
+        user_db.slots = slots;
+        user_db.cap = cap;
+    }
+    UserEntry *e = (UserEntry*)malloc(sizeof(UserEntry));
+    if (!e) return 0;
+    e->hash = path_hash(u);
+    snprintf(e->name, sizeof(e->name), "%s", u);
+    snprintf(e->pass, sizeof(e->pass), "%s", p);
+    user_place(user_db.slots, user_db.cap, e);
+    user_db.count++;
+    return 1;
+}
+
+// Rewrites users.txt with one line per user. Caller holds the lock exclusive.
+void user_db_compact() {
+    FILE *tmp = fopen("users_temp.txt", "w");
+    if (!tmp) return;
+    for (int i = 0; i < user_db.cap; i++) {
+        UserEntry *e = user_db.slots[i];
+        if (e) fprintf(tmp, "%s %s\n", e->name, e->pass);
+    }
+    if (fclose(tmp) != 0) {
+        remove("users_temp.txt");
+        return;
+    }
+    if (user_db.log) fclose(user_db.log);
+    if (rename_replace("users_temp.txt", "users.txt") == 0)
+        user_db.log_lines = user_db.count;
+    user_db.log = fopen("users.txt", "a");
+}
+
+// Appends a record and compacts once stale lines dominate the file.
+void user_db_append(const char *u, const char *p) {
+    if (!user_db.log) user_db.log = fopen("users.txt", "a");
+    if (!user_db.log) return;
+    fprintf(user_db.log, "%s %s\n", u, p);
+    fflush(user_db.log);
+    user_db.log_lines++;
+    if (user_db.log_lines > USER_COMPACT_MIN && user_db.log_lines > 2 * user_db.count)
+        user_db_compact();
+}
+
+void user_db_init() {
+    char line[256], user[USER_NAME_MAX], pass[USER_NAME_MAX];
+    InitializeSRWLock(&user_db.lock);
+    user_db.cap = USER_TABLE_INIT;
+    user_db.slots = (UserEntry**)calloc(user_db.cap, sizeof(UserEntry*));
+
+    FILE *fp = fopen("users.txt", "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "%49s %49s", user, pass) != 2) continue;
+            user_db.log_lines++;
+            UserEntry *e = user_find(user);
+            if (e) snprintf(e->pass, sizeof(e->pass), "%s", pass);
+            else user_insert(user, pass);
+        }
+        fclose(fp);
+    }
+    if (user_db.log_lines > user_db.count) user_db_compact();
+    if (!user_db.log) user_db.log = fopen("users.txt", "a");
+    printf("Loaded %d users\n", user_db.count);
+}
+
+int user_exists(const char *u) {
+    AcquireSRWLockShared(&user_db.lock);
+    int found = user_find(u) != NULL;
+    ReleaseSRWLockShared(&user_db.lock);
+    return found;
+}
+
+int authenticate(const char *u, const char *p) {
+    AcquireSRWLockShared(&user_db.lock);
+    UserEntry *e = user_find(u);
+    int ok = e && strcmp(e->pass, p) == 0;
+    ReleaseSRWLockShared(&user_db.lock);
+    return ok;
+}
+
+// Returns 0 if the user already exists (checked and added atomically).
+int register_user(const char *u, const char *p) {
+    int ok = 0;
+    AcquireSRWLockExclusive(&user_db.lock);
+    if (!user_find(u) && user_insert(u, p)) {
+        user_db_append(u, p);
+        ok = 1;
+    }
+    ReleaseSRWLockExclusive(&user_db.lock);
+    return ok;
+}
+
+int change_password_file(const char *u, const char *old_p, const char *new_p) {
+    int found = 0;
+    AcquireSRWLockExclusive(&user_db.lock);
+    UserEntry *e = user_find(u);
+    if (e && strcmp(e->pass, old_p) == 0) {
+        snprintf(e->pass, sizeof(e->pass), "%s", new_p);
+        user_db_append(u, new_p);
+        found = 1;
+    }
+    ReleaseSRWLockExclusive(&user_db.lock);
+    return found;
+}
+
+/* ---------- FILE LOCKING SYSTEM ---------- */
+/*
+ * Lock registry: LOCK_SHARDS open-addressed hash tables keyed by a hash of
+ * the path, each with its own critical section, so lookups are O(1) and
+ * sessions touching different files rarely contend. An entry lives only
+ * while it is referenced (get_file_lock() .. put_file_lock()) or held by a
+ * reader/writer; whoever drops the last use frees it. The table therefore
+ * tracks the files in use, not every file ever touched.
+ */
+#define LOCK_SHARD_INIT 16      // initial slots per shard, power of two
+
+LockShard lock_shards[LOCK_SHARDS];
+
+// FNV-1a
+unsigned long long path_hash(const char *p) {
+    unsigned long long h = 1469598103934665603ULL;
+    while (*p) {
+        h ^= (unsigned char)*p++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+LockShard* lock_shard_for(unsigned long long h) {
+    return &lock_shards[h & (LOCK_SHARDS - 1)];
+}
+
+// Home slot uses the bits above the shard index.
+int lock_home_slot(const LockShard *sh, unsigned long long h) {
+    return (int)((h >> LOCK_SHARD_BITS) & (unsigned long long)(sh->cap - 1));
+}
+
+void lock_registry_init() {
+    for (int i = 0; i < LOCK_SHARDS; i++) {
+        InitializeCriticalSection(&lock_shards[i].cs);
+        lock_shards[i].slots = (FileLock**)calloc(LOCK_SHARD_INIT, sizeof(FileLock*));
+        lock_shards[i].cap = LOCK_SHARD_INIT;
+        lock_shards[i].count = 0;
+    }
+}
+
+// All shard_* helpers expect the shard's critical section to be held.
+int shard_find(LockShard *sh, unsigned long long h, const char *path) {
+    int mask = sh->cap - 1;
+    int i = lock_home_slot(sh, h);
+    while (sh->slots[i]) {
+        if (sh->slots[i]->hash == h && strcmp(sh->slots[i]->filepath, path) == 0) return i;
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+void shard_place(LockShard *sh, FileLock *l) {
+    int mask = sh->cap - 1;
+    int i = lock_home_slot(sh, l->hash);
+    while (sh->slots[i]) i = (i + 1) & mask;
+    sh->slots[i] = l;
+}
+
+int shard_grow(LockShard *sh) {
+    FileLock **old = sh->slots;
+    int old_cap = sh->cap;
+    FileLock **slots = (FileLock**)calloc(old_cap * 2, sizeof(FileLock*));
+    if (!slots) return 0;
+    sh->slots = slots;
+    sh->cap = old_cap * 2;
+    for (int i = 0; i < old_cap; i++)
+        if (old[i]) shard_place(sh, old[i]);
+    free(old);
+    return 1;
+}
+
+// Backward-shift deletion: keeps linear-probe chains intact without tombstones.
+void shard_remove(LockShard *sh, int i) {
+    int mask = sh->cap - 1;
+    int j = (i + 1) & mask;
+    sh->slots[i] = NULL;
+    sh->count--;
+    while (sh->slots[j]) {
+        int home = lock_home_slot(sh, sh->slots[j]->hash);
+        // Entry at j may move to the hole at i unless its home lies in (i, j]
+        int stays = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+        if (!stays) {
+            sh->slots[i] = sh->slots[j];
+            sh->slots[j] = NULL;
+            i = j;
+        }
+        j = (j + 1) & mask;
+    }
+}
+
+// Frees the entry if nobody references or holds it any more.
+void shard_reclaim(LockShard *sh, FileLock *l) {
+    if (l->refs > 0 || l->readers > 0 || l->writers > 0 || l->waiters) return;
+    int i = shard_find(sh, l->hash, l->filepath);
+    if (i >= 0) shard_remove(sh, i);
+#ifndef _WIN32
+    pthread_cond_destroy(&l->cond);
+#endif
+    free(l);
+}
+
+// Returns a referenced lock entry for path (created on first use), or NULL
+// if out of memory. Every successful call must be paired with put_file_lock().
+FileLock* get_file_lock(const char *path) {
+    unsigned long long h = path_hash(path);
+    LockShard *sh = lock_shard_for(h);
+    FileLock *l = NULL;
+
+    EnterCriticalSection(&sh->cs);
+    int i = shard_find(sh, h, path);
+    if (i >= 0) {
+        l = sh->slots[i];
+    } else if ((sh->count + 1) * 4 <= sh->cap * 3 || shard_grow(sh)) {
+        l = (FileLock*)malloc(sizeof(FileLock) + strlen(path) + 1);
+        if (l) {
+            strcpy(l->filepath, path);
+            l->hash = h;
+            l->shard = (int)(sh - lock_shards);
+            l->refs = 0;
+            l->readers = 0;
+            l->writers = 0;
+            l->owner_socket = INVALID_SOCKET;
+            l->waiters = NULL;
+            InitializeConditionVariable(&l->cond);
+            shard_place(sh, l);
+            sh->count++;
+        }
+    }
+    if (l) l->refs++;
+    LeaveCriticalSection(&sh->cs);
+    return l;
+}
+
+void put_file_lock(FileLock *l) {
+    LockShard *sh = &lock_shards[l->shard];
+    EnterCriticalSection(&sh->cs);
+    l->refs--;
+    shard_reclaim(sh, l);
+    LeaveCriticalSection(&sh->cs);
+}
+
+// Lookup only (no entry is created): used by LSR to show (LOCKED).
+int file_is_write_locked(const char *path) {
+    unsigned long long h = path_hash(path);
+    LockShard *sh = lock_shard_for(h);
+    int locked = 0;
+    EnterCriticalSection(&sh->cs);
+    int i = shard_find(sh, h, path);
+    if (i >= 0 && sh->slots[i]->writers > 0) locked = 1;
+    LeaveCriticalSection(&sh->cs);
+    return locked;
+}
+
+/* ---------- SHARED FOLDERS SYSTEM ---------- */
+/*
+ * The share table is an immutable snapshot: an array of shares plus hash
+ * indexes over it. Readers pin the current snapshot (share_pin) and use it
+ * without taking any lock. SHARE builds a new snapshot and swaps the
+ * pointer; an old snapshot is freed once no thread has it pinned. Pinning
+ * publishes the snapshot in a per-thread hazard slot that the writer scans.
+ *
+ * shared_folders.txt keeps its "owner folder grantee perm" lines. Re-sharing
+ * the same folder with the same user replaces the permission and appends a
+ * line; the file is rewritten once stale lines outnumber live shares.
+ */
+typedef struct ShareReader {
+    ShareSnapshot *hazard;
+    int depth;              // share_pin() nesting on this thread
+    int in_use;
+    struct ShareReader *next;
+} ShareReader;
+
+typedef struct ShareRetired {
+    ShareSnapshot *snap;
+    struct ShareRetired *next;
+} ShareRetired;
+
+#define SHARE_COMPACT_MIN 1024
+
+CRITICAL_SECTION share_cs;  // serialises writers and reader registration
+ShareSnapshot *share_current = NULL;
+ShareReader *share_readers = NULL;
+ShareRetired *share_retired = NULL;
+THREAD_LOCAL ShareReader *share_me = NULL;
+int share_file_lines = 0;
+
+unsigned long long share_key(const char *a, const char *b, const char *c) {
+    unsigned long long h = path_hash(a);
+    if (b) h = (h ^ path_hash(b)) * 1099511628211ULL;
+    if (c) h = (h ^ path_hash(c)) * 31ULL;
+    return h;
+}
+
+// Probes 'table' for an item matching the given fields; NULL fields are
+// not compared. Returns the slot (empty if not found).
+int share_probe(ShareSnapshot *sn, int *table, const char *grantee, const char *owner, const char *folder) {
+    int i = (int)(share_key(grantee, owner, folder) & sn->mask);
+    while (table[i]) {
+        SharedFolder *f = &sn->items[table[i] - 1];
+        if (strcmp(f->shared_with, grantee) == 0 &&
+            (!owner || strcmp(f->owner, owner) == 0) &&
+            (!folder || strcmp(f->folder_name, folder) == 0))
+            return i;
+        i = (i + 1) & sn->mask;
+    }
+    return i;
+}
+
+void share_snapshot_free(ShareSnapshot *sn) {
+    if (!sn) return;
+    free(sn->items);
+    free(sn->by_share);
+    free(sn->by_folder);
+    free(sn->by_grantee);
+    free(sn->next_for_grantee);
+    free(sn);
+}
+
+// Takes ownership of 'items' and indexes them.
+ShareSnapshot* share_snapshot_build(SharedFolder *items, int count) {
+    ShareSnapshot *sn = (ShareSnapshot*)calloc(1, sizeof(ShareSnapshot));
+    if (!sn) {
+        free(items);
+        return NULL;
+    }
+    int size = 16;
+    while (size < count * 2) size <<= 1;
+    sn->items = items;
+    sn->count = count;
+    sn->mask = size - 1;
+    sn->by_share = (int*)calloc(size, sizeof(int));
+    sn->by_folder = (int*)calloc(size, sizeof(int));
+    sn->by_grantee = (int*)calloc(size, sizeof(int));
+    sn->next_for_grantee = (int*)malloc((count + 1) * sizeof(int));
+    if (!sn->by_share || !sn->by_folder || !sn->by_grantee || !sn->next_for_grantee) {
+        share_snapshot_free(sn);
+        return NULL;
+    }
+
+    // Walk backwards so each grantee chain comes out in insertion order and
+    // by_folder ends up pointing at the first match, as the old scan did.
+    for (int k = count - 1; k >= 0; k--) {
+        SharedFolder *f = &items[k];
+        sn->by_share[share_probe(sn, sn->by_share, f->shared_with, f->owner, f->folder_name)] = k + 1;
+        sn->by_folder[share_probe(sn, sn->by_folder, f->shared_with, NULL, f->folder_name)] = k + 1;
+        int g = share_probe(sn, sn->by_grantee, f->shared_with, NULL, NULL);
+        sn->next_for_grantee[k] = sn->by_grantee[g] - 1;
+        sn->by_grantee[g] = k + 1;
+    }
+    return sn;
+}
+
+SharedFolder* share_find(ShareSnapshot *sn, const char *grantee, const char *owner, const char *folder) {
+    int k = sn->by_share[share_probe(sn, sn->by_share, grantee, owner, folder)];
+    return k ? &sn->items[k - 1] : NULL;
+}
+
+SharedFolder* share_find_folder(ShareSnapshot *sn, const char *grantee, const char *folder) {
+    int k = sn->by_folder[share_probe(sn, sn->by_folder, grantee, NULL, folder)];
+    return k ? &sn->items[k - 1] : NULL;
+}
+
+// First share for 'grantee' (-1 if none); continue with next_for_grantee[k].
+int share_first_for(ShareSnapshot *sn, const char *grantee) {
+    return sn->by_grantee[share_probe(sn, sn->by_grantee, grantee, NULL, NULL)] - 1;
+}
+
+ShareSnapshot* share_pin() {
+    if (!share_me) {
+        EnterCriticalSection(&share_cs);
+        ShareReader *r = share_readers;
+        while (r && r->in_use) r = r->next;
+        if (!r) {
+            r = (ShareReader*)calloc(1, sizeof(ShareReader));
+            if (!r) {
+                // Can't register: fall back to an empty table.
+                LeaveCriticalSection(&share_cs);
+                static ShareSnapshot empty;
+                static int empty_slot[1];
+                empty.by_share = empty.by_folder = empty.by_grantee = empty_slot;
+                return &empty;
+            }
+            r->next = share_readers;
+            share_readers = r;
+        }
+        r->in_use = 1;
+        share_me = r;
+        LeaveCriticalSection(&share_cs);
+    }
+    if (share_me->depth++ > 0) return share_me->hazard;
+
+    ShareSnapshot *sn;
+    do {
+        sn = __atomic_load_n(&share_current, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&share_me->hazard, sn, __ATOMIC_SEQ_CST);
+    } while (sn != __atomic_load_n(&share_current, __ATOMIC_SEQ_CST));
+    return sn;
+}
+
+void share_unpin() {
+    if (!share_me) return;
+    if (--share_me->depth == 0)
+        __atomic_store_n(&share_me->hazard, NULL, __ATOMIC_RELEASE);
+}
+
+void share_thread_release() {
+    if (!share_me) return;
+    EnterCriticalSection(&share_cs);
+    share_me->hazard = NULL;
+    share_me->depth = 0;
+    share_me->in_use = 0;
+    LeaveCriticalSection(&share_cs);
+    share_me = NULL;
+}
+
+// Publishes 'sn' and frees every retired snapshot nobody has pinned.
+// Caller holds share_cs.
+void share_publish(ShareSnapshot *sn) {
+    ShareSnapshot *old = share_current;
+    __atomic_store_n(&share_current, sn, __ATOMIC_SEQ_CST);
+    if (old) {
+        ShareRetired *r = (ShareRetired*)malloc(sizeof(ShareRetired));
+        if (r) {
+            r->snap = old;
+            r->next = share_retired;
+            share_retired = r;
+        }
+    }
+    ShareRetired **pp = &share_retired;
+    while (*pp) {
+        ShareRetired *r = *pp;
+        int pinned = 0;
+        for (ShareReader *rd = share_readers; rd && !pinned; rd = rd->next)
+            if (__atomic_load_n(&rd->hazard, __ATOMIC_SEQ_CST) == r->snap) pinned = 1;
+        if (pinned) {
+            pp = &r->next;
+        } else {
+            *pp = r->next;
+            share_snapshot_free(r->snap);
+            free(r);
+        }
+    }
+}
+
+// Rewrites shared_folders.txt from the current snapshot. Caller holds share_cs.
+void share_compact() {
+    ShareSnapshot *sn = share_current;
+    FILE *tmp = fopen("shared_folders_temp.txt", "w");
+    if (!tmp) return;
+    for (int k = 0; k < sn->count; k++)
+        fprintf(tmp, "%s %s %s %s\n", sn->items[k].owner, sn->items[k].folder_name,
+                sn->items[k].shared_with, sn->items[k].permission);
+    if (fclose(tmp) != 0) {
+        remove("shared_folders_temp.txt");
+        return;
+    }
+    if (rename_replace("shared_folders_temp.txt", "shared_folders.txt") == 0)
+        share_file_lines = sn->count;
+}
+
+// Copy of 'sn' with the share added, or its permission replaced.
+ShareSnapshot* share_with(ShareSnapshot *sn, const SharedFolder *f, int *replaced) {
+    int count = sn ? sn->count : 0;
+    SharedFolder *items = (SharedFolder*)malloc((count + 1) * sizeof(SharedFolder));
+    if (!items) return NULL;
+    if (count) memcpy(items, sn->items, count * sizeof(SharedFolder));
+
+    SharedFolder *old = sn ? share_find(sn, f->shared_with, f->owner, f->folder_name) : NULL;
+    *replaced = old != NULL;
+    if (old) strcpy(items[old - sn->items].permission, f->permission);
+    else items[count++] = *f;
+    return share_snapshot_build(items, count);
+}
+
+void share_init() {
+    char line[256];
+    int n = 0, cap = 64;
+    SharedFolder *raw = (SharedFolder*)malloc(cap * sizeof(SharedFolder));
+
+    InitializeCriticalSection(&share_cs);
+    FILE *fp = fopen("shared_folders.txt", "r");
+    while (fp && raw && fgets(line, sizeof(line), fp)) {
+        SharedFolder *f = &raw[n];
+        if (sscanf(line, "%49s %49s %49s %15s", f->owner, f->folder_name, f->shared_with, f->permission) != 4)
+            continue;
+        if (++n == cap) {
+            SharedFolder *grown = (SharedFolder*)realloc(raw, (cap *= 2) * sizeof(SharedFolder));
+            if (!grown) break;
+            raw = grown;
+        }
+    }
+    if (fp) fclose(fp);
+    share_file_lines = n;
+
+    // Index the raw lines once to fold repeated shares into the first
+    // occurrence, keeping the permission from the last one.
+    SharedFolder *items = (SharedFolder*)malloc((n + 1) * sizeof(SharedFolder));
+    ShareSnapshot *all = NULL;
+    int count = 0;
+    if (raw && items) all = share_snapshot_build(raw, n); // frees raw on failure
+    else free(raw);
+    if (all) {
+        for (int k = 0; k < n; k++) {
+            SharedFolder *first = share_find(all, raw[k].shared_with, raw[k].owner, raw[k].folder_name);
+            if (first != &raw[k]) strcpy(first->permission, raw[k].permission);
+        }
+        for (int k = 0; k < n; k++)
+            if (share_find(all, raw[k].shared_with, raw[k].owner, raw[k].folder_name) == &raw[k])
+                items[count++] = raw[k];
+        share_snapshot_free(all);
+    }
+    ShareSnapshot *sn = items ? share_snapshot_build(items, count) : NULL;
+    if (!sn) {
+        printf("Share table allocation failed\n");
+        exit(1);
+    }
+
+    EnterCriticalSection(&share_cs);
+    share_publish(sn);
+    if (share_file_lines > count) share_compact();
+    LeaveCriticalSection(&share_cs);
+    printf("Loaded %d shares\n", count);
+}
+
+int save_share(const char *owner, const char *folder, const char *target, const char *perm) {
+    SharedFolder f;
+    int replaced;
+    snprintf(f.owner, sizeof(f.owner), "%s", owner);
+    snprintf(f.folder_name, sizeof(f.folder_name), "%s", folder);
+    snprintf(f.shared_with, sizeof(f.shared_with), "%s", target);
+    snprintf(f.permission, sizeof(f.permission), "%s", perm);
+
+    EnterCriticalSection(&share_cs);
+    ShareSnapshot *sn = share_with(share_current, &f, &replaced);
+    if (!sn) {
+        LeaveCriticalSection(&share_cs);
+        return 0;
+    }
+    share_publish(sn);
+
+    FILE *fp = fopen("shared_folders.txt", "a");
+    if (fp) {
+        fprintf(fp, "%s %s %s %s\n", f.owner, f.folder_name, f.shared_with, f.permission);
+        fclose(fp);
+        share_file_lines++;
+    }
+    if (share_file_lines > SHARE_COMPACT_MIN && share_file_lines > 2 * sn->count)
+        share_compact();
+    LeaveCriticalSection(&share_cs);
+    return 1;
+}
+
+/* 
+ * resolve_path:
+ * Resolves input_path to a physical path on disk.
+ * Handles:
+ * 1. Local files: "storage/<current_user>/<input_path>"
+ * 2. Shared files (legacy implicit): "storage/<owner>/<input_path>"
+ * 3. Shared files (explicit): "SHARED/<owner>/<path>"
+ */
+int resolve_path(const char *current_user, const char *input_path, char *final_path, const char *required_perm) {
+    // 1. Check for explicit "SHARED/" prefix
+    if (strncmp(input_path, "SHARED/", 7) == 0) {
+         char temp[256];
+         strcpy(temp, input_path + 7); // Strip "SHARED/"
+         
+         // Format: user1/folder/file...
+         char owner[50], remainder[200];
+         char *slash = strchr(temp, '/');
+         if (!slash) return 0; // Invalid format
+         
+         int len = slash - temp;
+         strncpy(owner, temp, len);
+         owner[len] = '\0';
+         strcpy(remainder, slash + 1);
+         
+         // remainder is now folder/file...
+         // We need to match folder name against shared_table
+         char folder[50], subpath[200] = "";
+         slash = strchr(remainder, '/');
+         if (slash) {
+             len = slash - remainder;
+             strncpy(folder, remainder, len);
+             folder[len] = '\0';
+             strcpy(subpath, slash + 1);
+         } else {
+             strcpy(folder, remainder);
+         }
+         
+         // Check permissions in table
+         ShareSnapshot *sn = share_pin();
+         SharedFolder *f = share_find(sn, current_user, owner, folder);
+         int has_write = f && (strstr(f->permission, "WRITE") != NULL);
+         share_unpin();
+         if (!f) return 0; // Not found in shares
+
+         int is_write_req = (strcmp(required_perm, "WRITE") == 0);
+         if (is_write_req && !has_write) return 0;
+
+         // Build Path
+         if (strlen(subpath) > 0)
+             sprintf(final_path, "storage/%s/%s/%s", owner, folder, subpath);
+         else
+             sprintf(final_path, "storage/%s/%s", owner, folder);
+         return 1;
+    }
+
+    // 2. Original Logic (Implicit Shared or Local)
+    char first_component[100];
+    char remainder[256] = "";
+    
+    int i = 0;
+    while(input_path[i] != '/' && input_path[i] != '\0' && i < 99) {
+        first_component[i] = input_path[i];
+        i++;
+    }
+    first_component[i] = '\0';
+    if (input_path[i] == '/') strcpy(remainder, input_path + i + 1);
+
+    // Check shared table (legacy implicit support)
+    ShareSnapshot *sn = share_pin();
+    SharedFolder *f = share_find_folder(sn, current_user, first_component);
+    if (f) {
+        int has_write = (strstr(f->permission, "WRITE") != NULL);
+        int is_write_req = (strcmp(required_perm, "WRITE") == 0);
+        if (is_write_req && !has_write) {
+            share_unpin();
+            return 0;
+        }
+
+        if (strlen(remainder) > 0)
+            sprintf(final_path, "storage/%s/%s/%s", f->owner, first_component, remainder);
+        else
+            sprintf(final_path, "storage/%s/%s", f->owner, first_component);
+        share_unpin();
+        return 1;
+    }
+    share_unpin();
+
+    sprintf(final_path, "storage/%s/%s", current_user, input_path);
+    return 1;
+}
+
+/* ---------- PARALLEL TREE WALKER ---------- */
+/*
+ * Reads a directory tree with a shared pool of --walk-threads threads, but
+ * hands it to the caller one directory at a time in sorted depth-first
+ * order, so output is the same whatever the thread count.
+ *
+ * Each directory is a WalkNode. Reading a node fills its sorted entries and
+ * creates (unread) child nodes for its subdirectories, which are queued
+ * for the pool while the walk is less than WALK_AHEAD directories ahead of
+ * the caller. Every pool thread has its own deque: it pops its newest task
+ * and, when empty, steals the oldest task of another thread. The caller's
+ * tree_walk_wait() reads a node itself if no thread has claimed it yet, so
+ * the walk finishes even with --walk-threads 0.
+ *
+ * On POSIX directories are opened with openat() relative to the walk's
+ * root fd, and d_type avoids an fstatat() for most entries.
+ */
+#define WALK_AHEAD 1024     // directories read ahead of the caller, per walk
+int walk_entry_cmp(const void *a, const void *b) {
+    return strcmp(((const WalkEntry*)a)->name, ((const WalkEntry*)b)->name);
+}
+
+// Reads an open directory into a sorted list; 'path' is only needed where
+// d_type is unavailable. Returns the count; *out may be NULL on OOM.
+int dir_read_sorted(DIR *dp, const char *path, WalkEntry **out) {
+    int n = 0, cap = 32;
+    WalkEntry *list = (WalkEntry*)malloc(cap * sizeof(WalkEntry));
+    struct dirent *entry;
+    struct stat st;
+    while (list && (entry = readdir(dp))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (n == cap) {
+            WalkEntry *grown = (WalkEntry*)realloc(list, (cap *= 2) * sizeof(WalkEntry));
+            if (!grown) break;
+            list = grown;
+        }
+        WalkEntry *e = &list[n];
+#ifdef _WIN32
+        char full[1100];
+        snprintf(full, sizeof(full), "%s/%s", path, entry->d_name);
+        e->is_dir = stat(full, &st) == 0 && S_ISDIR(st.st_mode);
+#else
+        (void)path;
+        if (entry->d_type == DT_DIR) e->is_dir = 1;
+        else if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) e->is_dir = 0;
+        else e->is_dir = fstatat(dirfd(dp), entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+#endif
+        e->name = strdup(entry->d_name);
+        if (e->name) n++;
+    }
+    if (n) qsort(list, n, sizeof(WalkEntry), walk_entry_cmp);
+    *out = list;
+    return n;
+}
+
+void dir_list_free(WalkEntry *list, int n) {
+    for (int i = 0; i < n; i++) free(list[i].name);
+    free(list);
+}
+
+typedef struct {
+    CRITICAL_SECTION cs;
+    WalkNode **items;
+    int head, tail, cap;        // items[head..tail) in a ring
+} WalkDeque;
+
+WalkDeque walk_deques[WALK_MAX_THREADS];
+int walk_nthreads = 0;
+long walk_pending = 0;          // queued tasks over all deques
+CRITICAL_SECTION walk_pool_cs;
+CONDITION_VARIABLE walk_pool_cond;
+THREAD_LOCAL int walk_self = -1;  // deque index of a pool thread
+const WalkCache *walk_cache = NULL;
+
+int walk_deque_push(WalkDeque *d, WalkNode *n) {
+    EnterCriticalSection(&d->cs);
+    if (d->tail - d->head == d->cap) {
+        int cap = d->cap ? d->cap * 2 : 256;
+        WalkNode **items = (WalkNode**)malloc(cap * sizeof(WalkNode*));
+        if (!items) {
+            LeaveCriticalSection(&d->cs);
+            return 0;
+        }
+        for (int i = d->head; i < d->tail; i++) items[i - d->head] = d->items[i % d->cap];
+        free(d->items);
+        d->items = items;
+        d->tail -= d->head;
+        d->head = 0;
+        d->cap = cap;
+    }
+    d->items[d->tail++ % d->cap] = n;
+    LeaveCriticalSection(&d->cs);
+    return 1;
+}
+
+// Owner end (newest first) or thief end (oldest first).
+WalkNode* walk_deque_take(WalkDeque *d, int steal) {
+    WalkNode *n = NULL;
+    EnterCriticalSection(&d->cs);
+    if (d->head != d->tail) {
+        if (steal) n = d->items[d->head++ % d->cap];
+        else n = d->items[--d->tail % d->cap];
+        if (d->head == d->tail) d->head = d->tail = 0;
+    }
+    LeaveCriticalSection(&d->cs);
+    return n;
+}
+
+void walk_unref(TreeWalk *w) {
+    if (__atomic_sub_fetch(&w->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+#ifndef _WIN32
+    if (w->root_fd >= 0) close(w->root_fd);
+#endif
+    free(w->resume);
+    free(w);
+}
+
+void walk_node_unref(WalkNode *n) {
+    if (__atomic_sub_fetch(&n->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    for (int i = 0; i < n->count; i++) {
+        free(n->entries[i].name);
+        if (n->children && n->children[i]) walk_node_unref(n->children[i]);
+    }
+    free(n->entries);
+    free(n->children);
+    free(n->rel);
+    TreeWalk *w = n->walk;
+    free(n);
+    walk_unref(w);
+}
+
+WalkNode* walk_node_new(TreeWalk *w, const char *rel) {
+    WalkNode *n = (WalkNode*)calloc(1, sizeof(WalkNode));
+    if (!n) return NULL;
+    n->rel = strdup(rel);
+    if (!n->rel) {
+        free(n);
+        return NULL;
+    }
+    n->walk = w;
+    n->refs = 1;
+    __atomic_add_fetch(&w->refs, 1, __ATOMIC_RELAXED);
+    return n;
+}
+
+// 1 if 'rel' sorts before the resume cursor and is not one of its ancestors.
+int walk_before_resume(TreeWalk *w, const char *rel) {
+    const char *a = rel, *b = w->resume;
+    if (!b) return 0;
+    while (*a && *b) {
+        int la = strcspn(a, "/"), lb = strcspn(b, "/");
+        int cmp = strncmp(a, b, la < lb ? la : lb);
+        if (cmp == 0 && la != lb) cmp = la < lb ? -1 : 1;
+        if (cmp != 0) return cmp < 0;
+        a += la;
+        b += lb;
+        if (*a) a++;
+        if (*b) b++;
+    }
+    return 0;
+}
+
+// Queues 'n' for the pool if the walk isn't too far ahead already.
+void walk_offer(WalkNode *n) {
+    TreeWalk *w = n->walk;
+    if (walk_nthreads == 0 || n->queued || n->claimed) return;
+    if (__atomic_add_fetch(&w->ahead, 1, __ATOMIC_RELAXED) > WALK_AHEAD) {
+        __atomic_sub_fetch(&w->ahead, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    static unsigned int rr = 0;
+    int q = walk_self >= 0 ? walk_self : (int)(__atomic_add_fetch(&rr, 1, __ATOMIC_RELAXED) % walk_nthreads);
+    n->queued = 1;
+    __atomic_add_fetch(&n->refs, 1, __ATOMIC_RELAXED);
+    if (!walk_deque_push(&walk_deques[q], n)) {
+        n->queued = 0;
+        __atomic_sub_fetch(&w->ahead, 1, __ATOMIC_RELAXED);
+        walk_node_unref(n);
+        return;
+    }
+    EnterCriticalSection(&walk_pool_cs);
+    walk_pending++;
+    WakeConditionVariable(&walk_pool_cond);
+    LeaveCriticalSection(&walk_pool_cs);
+}
+
+// Fills n->entries (sorted) from the metadata cache or the disk.
+// Unreadable directories are empty.
+void walk_read(WalkNode *n) {
+    TreeWalk *w = n->walk;
+    WalkEntry *list = NULL;
+    char dir[1024];
+    if (n->rel[0]) snprintf(dir, sizeof(dir), "%s/%s", w->base, n->rel);
+    else snprintf(dir, sizeof(dir), "%s", w->base);
+
+    if (!w->cancelled && (n->count = walk_cache ? walk_cache->get_dir(dir, &list) : -1) < 0) {
+        unsigned long token = walk_cache ? walk_cache->begin(dir, dir) : 0;
+        DIR *dp = NULL;
+        n->count = 0;
+#ifdef _WIN32
+        dp = opendir(dir);
+#else
+        int fd = n->rel[0] ? openat(w->root_fd, n->rel, O_RDONLY | O_DIRECTORY) : dup(w->root_fd);
+        if (fd >= 0 && !(dp = fdopendir(fd))) close(fd);
+        if (dp && !n->rel[0]) rewinddir(dp); // dup() shares the offset
+#endif
+        if (dp) {
+            n->count = dir_read_sorted(dp, dir, &list);
+            closedir(dp);
+            if (list && walk_cache) walk_cache->put_dir(dir, list, n->count, token);
+            if (!list) n->count = 0;
+        }
+    }
+    if (n->count < 0) n->count = 0;
+    n->entries = list;
+
+    n->children = n->count ? (WalkNode**)calloc(n->count, sizeof(WalkNode*)) : NULL;
+    char rel[1024];
+    for (int i = 0; i < n->count && n->children; i++) {
+        if (!n->entries[i].is_dir) continue;
+        if (n->rel[0]) snprintf(rel, sizeof(rel), "%s/%s", n->rel, n->entries[i].name);
+        else snprintf(rel, sizeof(rel), "%s", n->entries[i].name);
+        if (!walk_before_resume(w, rel)) n->children[i] = walk_node_new(w, rel);
+    }
+    // Newest-first popping then reads the first child first.
+    for (int i = n->count - 1; i >= 0 && n->children; i--)
+        if (n->children[i]) walk_offer(n->children[i]);
+
+    EnterCriticalSection(&w->cs);
+    n->done = 1;
+    WakeAllConditionVariable(&w->cond);
+    LeaveCriticalSection(&w->cs);
+}
+
+int walk_claim(WalkNode *n) {
+    int expected = 0;
+    return __atomic_compare_exchange_n(&n->claimed, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+#ifdef _WIN32
+DWORD WINAPI walk_thread(LPVOID arg) {
+#else
+void* walk_thread(void *arg) {
+#endif
+    walk_self = (int)(long)arg;
+    while (1) {
+        EnterCriticalSection(&walk_pool_cs);
+        while (walk_pending == 0)
+            SleepConditionVariableCS(&walk_pool_cond, &walk_pool_cs, INFINITE);
+        walk_pending--;
+        LeaveCriticalSection(&walk_pool_cs);
+
+        // A task is guaranteed to be somewhere: own deque first, then steal.
+        WalkNode *n = NULL;
+        for (int i = 0; !n; i = (i + 1) % walk_nthreads) {
+            int q = (walk_self + i) % walk_nthreads;
+            n = walk_deque_take(&walk_deques[q], q != walk_self);
+        }
+        if (walk_claim(n)) walk_read(n);
+        walk_node_unref(n);
+    }
+    return 0;
+}
+
+void tree_walk_init(int threads, const WalkCache *cache) {
+    InitializeCriticalSection(&walk_pool_cs);
+    InitializeConditionVariable(&walk_pool_cond);
+    walk_cache = cache;
+    int want = threads > WALK_MAX_THREADS ? WALK_MAX_THREADS : threads;
+    for (int i = 0; i < want; i++) InitializeCriticalSection(&walk_deques[i].cs);
+    for (int i = 0; i < want; i++) {
+#ifdef _WIN32
+        HANDLE h = CreateThread(NULL, 0, walk_thread, (LPVOID)(long)i, 0, NULL);
+        if (!h) break;
+        CloseHandle(h);
+#else
+        pthread_t t;
+        if (pthread_create(&t, NULL, walk_thread, (void*)(long)i) != 0) break;
+        pthread_detach(t);
+#endif
+        walk_nthreads++;
+    }
+}
+
+// Starts walking 'base'. 'resume' (relative to base, may be NULL) makes the
+// walk skip every subtree that sorts entirely before it.
+TreeWalk* tree_walk_start(const char *base, const char *resume, WalkNode **root) {
+    TreeWalk *w = (TreeWalk*)calloc(1, sizeof(TreeWalk));
+    if (!w) return NULL;
+    snprintf(w->base, sizeof(w->base), "%s", base);
+    w->resume = resume ? strdup(resume) : NULL;
+    w->refs = 1;
+    w->root_fd = -1;
+#ifndef _WIN32
+    w->root_fd = open(base, O_RDONLY | O_DIRECTORY);
+#endif
+    InitializeCriticalSection(&w->cs);
+    InitializeConditionVariable(&w->cond);
+    *root = walk_node_new(w, "");
+    if (!*root) {
+        walk_unref(w);
+        return NULL;
+    }
+    return w;
+}
+
+// Makes sure 'n' has been read, reading it here if nobody has started.
+void tree_walk_wait(WalkNode *n) {
+    TreeWalk *w = n->walk;
+    if (walk_claim(n)) {
+        walk_read(n);
+        return;
+    }
+    EnterCriticalSection(&w->cs);
+    while (!n->done) SleepConditionVariableCS(&w->cond, &w->cs, INFINITE);
+    LeaveCriticalSection(&w->cs);
+    // Its subdirectories may have been left unqueued while we were far
+    // behind; offer them now that the caller has caught up.
+    for (int i = n->count - 1; i >= 0; i--)
+        if (n->children && n->children[i]) walk_offer(n->children[i]);
+}
+
+// The caller is finished with 'n' and everything below it.
+void tree_walk_release(WalkNode *n) {
+    if (n->queued) __atomic_sub_fetch(&n->walk->ahead, 1, __ATOMIC_RELAXED);
+    walk_node_unref(n);
+}
+
+// Stops the walk; queued directories are dropped without being read.
+void tree_walk_end(TreeWalk *w, WalkNode *root) {
+    w->cancelled = 1;
+    tree_walk_release(root);
+    walk_unref(w);
+}
+
+/* ---------- LATENCY HISTOGRAMS ---------- */
+int hist_bucket(long long us) {
+    if (us < HIST_SUB) return us < 0 ? 0 : (int)us;
+    int k = 0;
+    while ((us >> k) >= 2 * HIST_SUB) k++;
+    int b = (k + 1) * HIST_SUB + (int)(us >> k) - HIST_SUB;
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+// Largest value that falls in bucket b.
+long long hist_value(int b) {
+    if (b < HIST_SUB) return b;
+    int k = b / HIST_SUB - 1;
+    return ((long long)(b % HIST_SUB + HIST_SUB + 1) << k) - 1;
+}
+
+// The p-th percentile of 'count' values whose largest was 'max'.
+long long hist_percentile(const long long *hist, long long count, long long max, double p) {
+    long long want = (long long)(count * p + 0.5), seen = 0;
+    if (want < 1) want = 1;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= want) return hist_value(b) < max ? hist_value(b) : max;
+    }
+    return max;
+}
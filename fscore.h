@@ -0,0 +1,227 @@
+#ifndef FSCORE_H
+#define FSCORE_H
+
+/*
+ * Core of the Remote File System server, built as its own translation unit
+ * so the server and the microbenchmarks (microbench.c) link the same code:
+ * the platform layer, the user database, the file lock registry, shared
+ * folders with resolve_path(), and the parallel directory tree walker.
+ *
+ * Build: gcc server.c fscore.c checksum.c -o server -lpthread   (Windows: -lws2_32)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <dirent.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <direct.h>
+#include <process.h> /* For threads if using _beginthreadex, though we used CreateThread which is in windows.h */
+
+#ifndef _WINDOWS_
+#include <windows.h>
+#endif
+
+#pragma comment(lib, "ws2_32.lib")
+#define THREAD_LOCAL __declspec(thread)
+#else
+/* ---------- POSIX COMPATIBILITY ---------- */
+/* Lets the same server build on Linux (gcc server.c fscore.c checksum.c -o server -lpthread).
+ * Only the handful of Win32 names the server uses are mapped. */
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define closesocket close
+#define WSAGetLastError() errno
+#define WSAEINVAL EINVAL
+#define WSAENOTSOCK ENOTSOCK
+#define WSAEWOULDBLOCK EWOULDBLOCK
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+#define InitializeCriticalSection(cs) pthread_mutex_init((cs), NULL)
+#define EnterCriticalSection(cs) pthread_mutex_lock(cs)
+#define LeaveCriticalSection(cs) pthread_mutex_unlock(cs)
+
+typedef unsigned int DWORD;
+#define INFINITE 0xFFFFFFFF
+typedef pthread_cond_t CONDITION_VARIABLE;
+#define InitializeConditionVariable(cv) pthread_cond_init((cv), NULL)
+#define WakeConditionVariable(cv) pthread_cond_signal(cv)
+#define WakeAllConditionVariable(cv) pthread_cond_broadcast(cv)
+
+typedef pthread_rwlock_t SRWLOCK;
+#define InitializeSRWLock(l) pthread_rwlock_init((l), NULL)
+#define AcquireSRWLockShared(l) pthread_rwlock_rdlock(l)
+#define ReleaseSRWLockShared(l) pthread_rwlock_unlock(l)
+#define AcquireSRWLockExclusive(l) pthread_rwlock_wrlock(l)
+#define ReleaseSRWLockExclusive(l) pthread_rwlock_unlock(l)
+
+#define THREAD_LOCAL __thread
+
+// Same contract as Win32: returns 0 on timeout.
+int SleepConditionVariableCS(CONDITION_VARIABLE *cv, CRITICAL_SECTION *cs, DWORD ms);
+
+#define Sleep(ms) usleep((ms) * 1000)
+#define _mkdir(p) mkdir((p), 0755)
+#define _rmdir rmdir
+#endif
+
+/* ---------- USER DATABASE ---------- */
+void user_db_init();
+int user_exists(const char *u);
+int authenticate(const char *u, const char *p);
+int register_user(const char *u, const char *p);
+int change_password_file(const char *u, const char *old_p, const char *new_p);
+
+/* ---------- FILE LOCKING SYSTEM ---------- */
+#define LOCK_SHARD_BITS 6
+#define LOCK_SHARDS (1 << LOCK_SHARD_BITS)
+
+typedef struct LockWaiter {
+    int is_writer;
+    SOCKET sock;
+    int granted;        // set by whoever hands the lock over
+    struct LockWaiter *next;
+} LockWaiter;
+
+typedef struct FileLock {
+    unsigned long long hash;
+    int shard;
+    int refs;           // get_file_lock() handles not yet put back
+    int readers;
+    int writers;
+    SOCKET owner_socket; // Valid if writers > 0
+    LockWaiter *waiters; // queued requests, granted from the front
+    CONDITION_VARIABLE cond;
+    char filepath[];
+} FileLock;
+
+typedef struct {
+    CRITICAL_SECTION cs;
+    FileLock **slots;
+    int cap;
+    int count;
+} LockShard;
+
+extern LockShard lock_shards[LOCK_SHARDS];
+
+unsigned long long path_hash(const char *p);
+void lock_registry_init();
+// Shard helpers expect the shard's critical section to be held.
+int shard_find(LockShard *sh, unsigned long long h, const char *path);
+void shard_reclaim(LockShard *sh, FileLock *l);
+FileLock* get_file_lock(const char *path);
+void put_file_lock(FileLock *l);
+int file_is_write_locked(const char *path);
+
+/* ---------- SHARED FOLDERS SYSTEM ---------- */
+typedef struct {
+    char owner[50];
+    char folder_name[50];
+    char shared_with[50];
+    char permission[16]; // "READ", "WRITE", "READ_WRITE"
+} SharedFolder;
+
+typedef struct {
+    SharedFolder *items;    // insertion order, unique per (grantee, owner, folder)
+    int count;
+    int mask;               // index size - 1
+    int *by_share;          // (grantee, owner, folder) -> item + 1
+    int *by_folder;         // (grantee, folder) -> first such item + 1
+    int *by_grantee;        // grantee -> first item + 1
+    int *next_for_grantee;  // next item with the same grantee, or -1
+} ShareSnapshot;
+
+void share_init();
+int save_share(const char *owner, const char *folder, const char *target, const char *perm);
+// Readers pin the current snapshot and unpin when done; pins nest.
+ShareSnapshot* share_pin();
+void share_unpin();
+void share_thread_release();
+SharedFolder* share_find(ShareSnapshot *sn, const char *grantee, const char *owner, const char *folder);
+SharedFolder* share_find_folder(ShareSnapshot *sn, const char *grantee, const char *folder);
+int share_first_for(ShareSnapshot *sn, const char *grantee);
+int resolve_path(const char *current_user, const char *input_path, char *final_path, const char *required_perm);
+
+/* ---------- PARALLEL TREE WALKER ---------- */
+typedef struct {
+    char *name;
+    int is_dir;
+} WalkEntry;
+
+#define WALK_MAX_THREADS 64
+
+typedef struct TreeWalk TreeWalk;
+
+typedef struct WalkNode {
+    TreeWalk *walk;
+    char *rel;                  // "" for the root
+    int claimed;                // set once by whoever reads it
+    int done;
+    int queued;                 // counted in walk->ahead
+    int refs;                   // parent's children[] + a queue slot
+    WalkEntry *entries;
+    int count;
+    struct WalkNode **children; // per entry; NULL for files and skipped dirs
+} WalkNode;
+
+struct TreeWalk {
+    char base[512];
+    char *resume;               // entries sorting before this are skipped
+    int root_fd;
+    int refs;                   // caller + live nodes
+    int ahead;
+    int cancelled;
+    CRITICAL_SECTION cs;
+    CONDITION_VARIABLE cond;    // a node finished
+};
+
+// Optional cache the walker reads listings through (the server's metadata
+// cache). get_dir returns -1 on a miss; begin returns the token for put_dir,
+// 0 if the listing must not be cached.
+typedef struct {
+    int (*get_dir)(const char *dir, WalkEntry **out);
+    unsigned long (*begin)(const char *dir, const char *key);
+    void (*put_dir)(const char *dir, const WalkEntry *list, int n, unsigned long token);
+} WalkCache;
+
+int dir_read_sorted(DIR *dp, const char *path, WalkEntry **out);
+void dir_list_free(WalkEntry *list, int n);
+void tree_walk_init(int threads, const WalkCache *cache);
+TreeWalk* tree_walk_start(const char *base, const char *resume, WalkNode **root);
+void tree_walk_wait(WalkNode *n);
+void tree_walk_release(WalkNode *n);
+void tree_walk_end(TreeWalk *w, WalkNode *root);
+
+/* ---------- LATENCY HISTOGRAMS ---------- */
+// Log-linear (HDR-style) buckets of microseconds: exact below HIST_SUB,
+// then HIST_SUB per power of two (about 6% precision). Shared by the
+// server's STATS and bench.c.
+#define HIST_SUB 16
+#define HIST_BUCKETS (40 * HIST_SUB)    // up to 2^42 us
+
+int hist_bucket(long long us);
+long long hist_value(int b);
+long long hist_percentile(const long long *hist, long long count, long long max, double p);
+
+#ifdef FSCORE_ALLOC_STATS
+// Heap allocations made by fscore.c so far (microbench.c reports allocs/op).
+extern long fscore_allocs;
+#endif
+
+#endif
@@ -0,0 +1,364 @@
+#include "fscore.h"
+
+/*
+ * Microbenchmarks for the server's hot internal functions (fscore.c):
+ *
+ *   authenticate      LOGIN check against users.txt with N users
+ *   resolve_path      path resolution with N shares (SHARED/, implicit, local)
+ *   get_file_lock     get + put of one of N files already in the registry
+ *   get_file_lock_new get + put of a file the registry does not track yet
+ *   walk_wide         tree walk (LSR) of one folder with N files, per entry
+ *   walk_deep         tree walk of N entries, 4 folders + 4 files per folder
+ *
+ * at scales of 10, 1000, 100000 and 1000000 entries. Each case runs in a
+ * child process (this program with --child) so the library's globals start
+ * empty, and reports ns/op and heap allocations/op made inside fscore.c.
+ *
+ * Build: gcc -O2 -DFSCORE_ALLOC_STATS microbench.c fscore.c -o microbench -lpthread
+ * Run:   ./microbench [--max N] [--tree-max N] [--only CASE] [--json FILE]
+ */
+
+#ifndef FSCORE_ALLOC_STATS
+#error "build with -DFSCORE_ALLOC_STATS (see the build line above)"
+#endif
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+#define MB_MIN_NS 200000000.0   // time each case for at least 0.2 s
+#define MB_QUERIES (1 << 16)    // pre-built inputs, picked at random from the N entries
+
+const char *cases[] = { "authenticate", "resolve_path", "get_file_lock", "get_file_lock_new", "walk_wide", "walk_deep" };
+const long scales[] = { 10, 1000, 100000, 1000000 };
+
+double now_ns() {
+#ifdef _WIN32
+    LARGE_INTEGER f, t;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart * 1e9 / (double)f.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+unsigned int mb_rand(unsigned int *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Makes every missing folder of 'path' (like mkdir -p).
+void make_dirs(const char *path) {
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        _mkdir(tmp);
+        *p = '/';
+    }
+    _mkdir(tmp);
+}
+
+void touch(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (fp) fclose(fp);
+}
+
+/* ---------- CASES ---------- */
+// Each returns ops done; *ns gets the time they took and timed_allocs the
+// fscore.c allocations made meanwhile (setup is not counted).
+
+long timed_allocs;
+long allocs_at_start;
+
+double timer_start() {
+    allocs_at_start = fscore_allocs;
+    return now_ns();
+}
+
+void timer_stop(double t0, double *ns) {
+    *ns = now_ns() - t0;
+    timed_allocs = fscore_allocs - allocs_at_start;
+}
+
+typedef struct {
+    char a[MB_QUERIES][64];
+    char b[MB_QUERIES][64];
+} Queries;
+
+long bench_authenticate(long n, double *ns, Queries *q) {
+    FILE *fp = fopen("users.txt", "w");
+    unsigned int rng = 12345;
+    if (!fp) return 0;
+    for (long i = 0; i < n; i++) fprintf(fp, "user%ld pass%ld\n", i, i);
+    fclose(fp);
+    user_db_init();
+    for (int i = 0; i < MB_QUERIES; i++) {
+        long k = mb_rand(&rng) % n;
+        sprintf(q->a[i], "user%ld", k);
+        sprintf(q->b[i], "pass%ld", k);
+    }
+
+    long ops = 0, ok = 0;
+    double t0 = timer_start();
+    while (now_ns() - t0 < MB_MIN_NS) {
+        for (int i = 0; i < MB_QUERIES; i++) ok += authenticate(q->a[i], q->b[i]);
+        ops += MB_QUERIES;
+    }
+    timer_stop(t0, ns);
+    return ok == ops ? ops : 0;
+}
+
+long bench_resolve_path(long n, double *ns, Queries *q) {
+    FILE *fp = fopen("shared_folders.txt", "w");
+    unsigned int rng = 12345;
+    char out[1024];
+    if (!fp) return 0;
+    // 1000 owners share their folders among 100 users.
+    for (long k = 0; k < n; k++) fprintf(fp, "own%ld f%ld user%ld READ_WRITE\n", k % 1000, k, k % 100);
+    fclose(fp);
+    share_init();
+    for (int i = 0; i < MB_QUERIES; i++) {
+        long k = mb_rand(&rng) % n;
+        sprintf(q->a[i], "user%ld", k % 100);
+        if (i % 3 == 0) sprintf(q->b[i], "SHARED/own%ld/f%ld/a.txt", k % 1000, k);
+        else if (i % 3 == 1) sprintf(q->b[i], "f%ld/a.txt", k);
+        else strcpy(q->b[i], "notes/a.txt");
+    }
+
+    long ops = 0, ok = 0;
+    double t0 = timer_start();
+    while (now_ns() - t0 < MB_MIN_NS) {
+        for (int i = 0; i < MB_QUERIES; i++) ok += resolve_path(q->a[i], q->b[i], out, i & 1 ? "READ" : "WRITE");
+        ops += MB_QUERIES;
+    }
+    timer_stop(t0, ns);
+    return ok == ops ? ops : 0;
+}
+
+long bench_file_lock(long n, double *ns, Queries *q, int tracked) {
+    unsigned int rng = 12345;
+    char path[64];
+    lock_registry_init();
+    // The registry keeps an entry while it is referenced, as during a READ.
+    for (long k = 0; k < n; k++) {
+        sprintf(path, "storage/bench/d%ld/file%ld", k % 100, k);
+        if (!get_file_lock(path)) return 0;
+    }
+    for (int i = 0; i < MB_QUERIES; i++) {
+        long k = mb_rand(&rng) % n;
+        if (tracked) sprintf(q->a[i], "storage/bench/d%ld/file%ld", k % 100, k);
+        else sprintf(q->a[i], "storage/bench/d%ld/new%ld", k % 100, k);
+    }
+
+    long ops = 0;
+    double t0 = timer_start();
+    while (now_ns() - t0 < MB_MIN_NS) {
+        for (int i = 0; i < MB_QUERIES; i++) {
+            FileLock *l = get_file_lock(q->a[i]);
+            if (!l) return 0;
+            put_file_lock(l);
+        }
+        ops += MB_QUERIES;
+    }
+    timer_stop(t0, ns);
+    return ops;
+}
+
+// Path of folder 'd' of the deep tree (0 is the root, 4d+1+k its k-th child).
+void deep_dir_path(const char *root, long d, char *out, size_t size) {
+    char rel[800] = "";
+    while (d > 0) {
+        char tmp[800];
+        snprintf(tmp, sizeof(tmp), "/d%ld%s", (d - 1) % 4, rel);
+        strcpy(rel, tmp);
+        d = (d - 1) / 4;
+    }
+    snprintf(out, size, "%s%s", root, rel);
+}
+
+// Builds the tree once; later runs at the same scale reuse it.
+int build_tree(const char *root, long n, int deep) {
+    char path[1024], marker[1100];
+    snprintf(marker, sizeof(marker), "%s.ready", root);
+    FILE *fp = fopen(marker, "r");
+    if (fp) {
+        fclose(fp);
+        return 1;
+    }
+    make_dirs(root);
+    if (!deep) {
+        for (long i = 0; i < n; i++) {
+            snprintf(path, sizeof(path), "%s/file%07ld", root, i);
+            touch(path);
+        }
+    } else {
+        // Breadth first: folder i holds folders 4i+1 .. 4i+4, then 4 files.
+        long entries = 0;
+        for (long d = 0; entries < n; d++) {
+            char dir[900];
+            deep_dir_path(root, d, dir, sizeof(dir));
+            for (int k = 0; k < 4 && entries < n; k++, entries++) {
+                snprintf(path, sizeof(path), "%s/d%d", dir, k);
+                _mkdir(path);
+            }
+            for (int k = 0; k < 4 && entries < n; k++, entries++) {
+                snprintf(path, sizeof(path), "%s/f%d", dir, k);
+                touch(path);
+            }
+        }
+    }
+    touch(marker);
+    return 1;
+}
+
+// Walks 'n' the way LSR does, minus the output; returns entries seen.
+long walk_count(WalkNode *n) {
+    long entries = 0;
+    tree_walk_wait(n);
+    for (int i = 0; i < n->count; i++) {
+        WalkNode *sub = n->children ? n->children[i] : NULL;
+        entries++;
+        if (sub) {
+            entries += walk_count(sub);
+            n->children[i] = NULL;
+            tree_walk_release(sub);
+        }
+    }
+    return entries;
+}
+
+long bench_walk(long n, double *ns, int deep, int threads) {
+    char root[100];
+    snprintf(root, sizeof(root), "../tree-%s-%ld", deep ? "deep" : "wide", n);
+    if (!build_tree(root, n, deep)) return 0;
+    tree_walk_init(threads, NULL);
+
+    long ops = 0;
+    double t0 = timer_start();
+    while (now_ns() - t0 < MB_MIN_NS) {
+        WalkNode *node;
+        TreeWalk *w = tree_walk_start(root, NULL, &node);
+        if (!w) return 0;
+        long seen = walk_count(node);
+        tree_walk_end(w, node);
+        if (seen != n) return 0;
+        ops += seen;
+    }
+    timer_stop(t0, ns);
+    return ops;
+}
+
+// Runs one case in this (fresh) process and prints its RESULT line.
+int run_child(const char *name, long n, const char *dir, int threads) {
+    char work[600];
+    double ns = 0;
+    long ops = 0;
+    Queries *q = (Queries*)malloc(sizeof(Queries));
+    snprintf(work, sizeof(work), "%s/%s-%ld", dir, name, n);
+    make_dirs(work);
+    if (!q || chdir(work) != 0) return 1;
+
+    if (strcmp(name, "authenticate") == 0) ops = bench_authenticate(n, &ns, q);
+    else if (strcmp(name, "resolve_path") == 0) ops = bench_resolve_path(n, &ns, q);
+    else if (strcmp(name, "get_file_lock") == 0) ops = bench_file_lock(n, &ns, q, 1);
+    else if (strcmp(name, "get_file_lock_new") == 0) ops = bench_file_lock(n, &ns, q, 0);
+    else if (strcmp(name, "walk_wide") == 0) ops = bench_walk(n, &ns, 0, threads);
+    else if (strcmp(name, "walk_deep") == 0) ops = bench_walk(n, &ns, 1, threads);
+    free(q);
+    if (ops <= 0) return 1;
+    printf("RESULT %s %ld %ld %.1f %.3f\n", name, n, ops, ns / ops, (double)timed_allocs / ops);
+    return 0;
+}
+
+int is_tree_case(const char *name) {
+    return strncmp(name, "walk_", 5) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    long max = 1000000, tree_max = 100000;
+    int threads = 4;
+    const char *only = NULL, *json_path = NULL, *dir = "microbench_data";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--child") == 0 && i + 2 < argc) {
+            const char *name = argv[++i];
+            long n = atol(argv[++i]);
+            for (int j = i + 1; j + 1 < argc; j++) {
+                if (strcmp(argv[j], "--dir") == 0) dir = argv[j + 1];
+                else if (strcmp(argv[j], "--walk-threads") == 0) threads = atoi(argv[j + 1]);
+            }
+            return run_child(name, n, dir, threads);
+        }
+        else if (strcmp(argv[i], "--max") == 0 && i + 1 < argc) max = atol(argv[++i]);
+        else if (strcmp(argv[i], "--tree-max") == 0 && i + 1 < argc) tree_max = atol(argv[++i]);
+        else if (strcmp(argv[i], "--walk-threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc) only = argv[++i];
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) dir = argv[++i];
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) json_path = argv[++i];
+        else {
+            printf("Usage: %s [--max N] [--tree-max N] [--walk-threads N] [--only CASE] [--dir PATH] [--json FILE|-]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (threads < 0) threads = 0;
+    if (threads > WALK_MAX_THREADS) threads = WALK_MAX_THREADS;
+    make_dirs(dir);
+
+    char json[16384];
+    int jlen = snprintf(json, sizeof(json), "{\"walk_threads\":%d,\"results\":[", threads);
+    int first = 1, failed = 0;
+
+    printf("%-18s %9s %12s %12s %10s\n", "case", "n", "ops", "ns/op", "allocs/op");
+    for (int c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++) {
+        if (only && strcmp(only, cases[c]) != 0) continue;
+        for (int s = 0; s < (int)(sizeof(scales) / sizeof(scales[0])); s++) {
+            long n = scales[s];
+            if (n > max || (is_tree_case(cases[c]) && n > tree_max)) continue;
+
+            char cmd[1200], line[256], name[64];
+            long rn = 0, ops = 0;
+            double per_op = 0, allocs = 0;
+            int got = 0;
+            snprintf(cmd, sizeof(cmd), "\"%s\" --child %s %ld --dir \"%s\" --walk-threads %d",
+                     argv[0], cases[c], n, dir, threads);
+            FILE *p = popen(cmd, "r");
+            if (p) {
+                while (fgets(line, sizeof(line), p))
+                    if (sscanf(line, "RESULT %63s %ld %ld %lf %lf", name, &rn, &ops, &per_op, &allocs) == 5) got = 1;
+                if (pclose(p) != 0) got = 0;
+            }
+            if (!got) {
+                printf("%-18s %9ld %12s\n", cases[c], n, "FAILED");
+                failed = 1;
+                continue;
+            }
+            printf("%-18s %9ld %12ld %12.1f %10.3f\n", cases[c], n, ops, per_op, allocs);
+            fflush(stdout);
+            if (jlen < (int)sizeof(json) - 200)
+                jlen += snprintf(json + jlen, sizeof(json) - jlen,
+                                 "%s{\"case\":\"%s\",\"n\":%ld,\"ops\":%ld,\"ns_per_op\":%.1f,\"allocs_per_op\":%.3f}",
+                                 first ? "" : ",", cases[c], n, ops, per_op, allocs);
+            first = 0;
+        }
+    }
+    snprintf(json + jlen, sizeof(json) - jlen, "]}\n");
+
+    if (json_path) {
+        FILE *fp = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+        if (!fp) {
+            printf("Cannot write %s\n", json_path);
+            return 1;
+        }
+        fputs(json, fp);
+        if (fp != stdout) fclose(fp);
+    }
+    return failed;
+}
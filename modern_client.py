@@ -2,12 +2,103 @@ import customtkinter as ctk
 import socket
 import threading
 import os
+import hashlib
+import mmap
+from itertools import accumulate
 from tkinter import filedialog, messagebox
 
+try:
+    import remotefs  # C client library (remotefs.c), used for uploads when built
+except (ImportError, OSError):
+    remotefs = None
+
 # --- Configuration ---
 SERVER_IP = '127.0.0.1'
 SERVER_PORT = 8080
 BUFFER_SIZE = 1024
+LSR_PAGE = 500  # entries per LSR page
+DELTA_LITERAL_MAX = 256 * 1024  # literal bytes per delta instruction (server allows 1 MB)
+
+
+# --- Delta Uploads (DELTA_SIG / DELTA_UPLOAD, same encoding as client.c) ---
+def delta_weak(data):
+    """rsync's rolling checksum of one block, as its (low, high) halves."""
+    return sum(data) & 0xFFFF, sum(accumulate(data)) & 0xFFFF
+
+def delta_encode(data, sig, block, send):
+    """Sends (through send) the instructions that turn the server's copy,
+    described by sig = [(weak, md5, length), ...], into data. Returns
+    (literal_bytes, reused_bytes)."""
+    table = {}
+    for i, (weak, _, _) in enumerate(sig):
+        table.setdefault(weak, []).append(i)
+    size, last_len = len(data), (sig[-1][2] if sig else 0)
+    stats = [0, 0]
+    run = [0, 0]  # matched blocks not sent yet: start, count
+
+    def find(weak, start, length, hint):
+        if weak not in table: return -1
+        strong = hashlib.md5(data[start:start + length]).digest()
+        for i in ([hint] if 0 <= hint < len(sig) else []) + table[weak]:
+            if sig[i][0] == weak and sig[i][2] == length and sig[i][1] == strong:
+                return i
+        return -1
+
+    def flush_run():
+        if run[1]:
+            send(b"B" + run[0].to_bytes(4, "big") + run[1].to_bytes(4, "big"))
+            run[1] = 0
+
+    def literal(start, end):
+        if end > start: flush_run()
+        for k in range(start, end, DELTA_LITERAL_MAX):
+            piece = data[k:min(end, k + DELTA_LITERAL_MAX)]
+            send(b"L" + len(piece).to_bytes(4, "big") + piece)
+            stats[0] += len(piece)
+
+    def matched(i, length):
+        if run[1] and run[0] + run[1] == i:
+            run[1] += 1
+        else:
+            flush_run()
+            run[0], run[1] = i, 1
+        stats[1] += length
+
+    p = lit = 0
+    hint, a, b = -1, None, None
+    while True:
+        if p + block > size:
+            # Less than a block left: only the server's short last block can match.
+            t, last = size - last_len, len(sig) - 1
+            ta, tb = delta_weak(data[t:size]) if sig and last_len < block and t >= p else (0, 0)
+            if sig and last_len < block and t >= p and find(ta | tb << 16, t, last_len, last) == last:
+                literal(lit, t)
+                matched(last, last_len)
+            else:
+                literal(lit, size)
+            break
+        if a is None:
+            a, b = delta_weak(data[p:p + block])
+        i = find(a | b << 16, p, block, hint)
+        if i >= 0:
+            literal(lit, p)
+            matched(i, block)
+            p += block
+            lit, hint, a = p, i + 1, None
+            continue
+        if p + block < size:
+            out = data[p]
+            a = (a - out + data[p + block]) & 0xFFFF
+            b = (b - block * out + a) & 0xFFFF
+        else:
+            a = None
+        p += 1
+        if p - lit >= DELTA_LITERAL_MAX:
+            literal(lit, p)
+            lit = p
+    flush_run()
+    return stats[0], stats[1]
+
 
 # --- Theme Setup ---
 ctk.set_appearance_mode("Dark")
@@ -24,6 +115,7 @@ class ModernClient(ctk.CTk):
 
         # Network State
         self.sock = None
+        self.rfs = None  # remotefs.Client attached to this login, if available
         self.username = None
         self.is_connected = False
 
@@ -33,7 +125,7 @@ class ModernClient(ctk.CTk):
 
         # Initialize Frames
         self.login_frame = LoginFrame(self, self.attempt_login, self.attempt_register)
-        self.main_frame = MainFrame(self, self.send_command, self.logout, self.upload_file)
+        self.main_frame = MainFrame(self, self.send_command, self.logout, self.upload_file, self.list_tree)
         self.loading_frame = LoadingFrame(self, self.connect_to_server)
 
         # Start
@@ -82,10 +174,42 @@ class ModernClient(ctk.CTk):
             self.handle_disconnect(e)
             return f"Error: {e}"
 
+    def list_tree(self, path="", page=LSR_PAGE):
+        # LSR is paged: every reply ends with 'NEXT <cursor>' or 'END'.
+        if not self.sock:
+            return "Error: Not connected"
+        out, cursor = [], None
+        try:
+            while True:
+                cmd = f"LSR {path} LIMIT {page}".replace("  ", " ")
+                if cursor: cmd += f" AFTER {cursor}"
+                self.sock.send((cmd + "\n").encode())
+                data = b""
+                while True:
+                    chunk = self.sock.recv(65536)
+                    if not chunk: raise ConnectionError("server closed connection")
+                    data += chunk
+                    lines = data.decode('utf-8', errors='ignore').split("\n")
+                    if data.endswith(b"\n") and (lines[-2] == "END" or lines[-2].startswith("NEXT ")
+                                                  or lines[-2].startswith("Error:") or "(Is a file)" in lines[-2]):
+                        break
+                last = lines[-2]
+                if not last.startswith("NEXT ") and last != "END":
+                    out.extend(lines[:-1])
+                    break
+                out.extend(lines[:-2])
+                if last == "END": break
+                cursor = last[5:]
+            return "\n".join(out).strip("\n")
+        except Exception as e:
+            self.handle_disconnect(e)
+            return f"Error: {e}"
+
     def handle_disconnect(self, e):
         print(f"Connection lost: {e}")
         self.is_connected = False
         self.sock = None
+        self.close_library()
         self.show_frame("loading")
         self.loading_frame.set_error("Connection Lost. Reconnecting...")
         self.connect_to_server()
@@ -95,6 +219,7 @@ class ModernClient(ctk.CTk):
         resp = self.send_command(f"LOGIN {user} {pwd}")
         if "successful" in resp.lower():
             self.username = user
+            self.open_library()
             self.show_frame("main")
             self.main_frame.update_user(user)
             self.main_frame.refresh_files()
@@ -106,12 +231,75 @@ class ModernClient(ctk.CTk):
         return "successful" in resp.lower(), resp
 
     def logout(self):
+        self.close_library()
         self.send_command("LOGOUT")
         self.username = None
         self.login_frame.clear_inputs()
         self.show_frame("login")
 
+    def open_library(self):
+        """Attaches a remotefs.Client to this login (SESSION_TOKEN/ATTACH)."""
+        if not remotefs: return
+        resp = self.send_command("SESSION_TOKEN").replace("\x00", "")
+        if not resp.startswith("TOKEN "): return
+        try:
+            self.rfs = remotefs.Client(SERVER_IP, SERVER_PORT)
+            if not self.rfs.attach(resp.split()[1]): self.close_library()
+        except ConnectionError as e:
+            print(f"remotefs unavailable: {e}")
+            self.rfs = None
+
+    def close_library(self):
+        if self.rfs:
+            self.rfs.close()
+            self.rfs = None
+
     # --- File Transfer Protocols (Matching client.c) ---
+    def _recv_line(self):
+        line = b""
+        while not line.endswith(b"\n"):
+            c = self.sock.recv(1)
+            if not c: raise ConnectionError("server closed connection")
+            line += c
+        return line.decode('utf-8', errors='ignore').strip()
+
+    def _recv_exact(self, n):
+        data = bytearray()
+        while len(data) < n:
+            chunk = self.sock.recv(min(n - len(data), 1 << 20))
+            if not chunk: raise ConnectionError("server closed connection")
+            data += chunk
+        return bytes(data)
+
+    def delta_upload(self, filepath, filename):
+        """Sends only what changed since the server's copy (like client.c's
+        DUPLOAD). Returns the server's reply, or None when there is no copy
+        to patch and the whole file has to go."""
+        size = os.path.getsize(filepath)
+        if size == 0: return None
+        self.sock.send(f"DELTA_SIG {filename}\n".encode())
+        line = self._recv_line()
+        if not line.startswith("SIG "): return None
+        old_size, block, count = (int(v) for v in line.split()[1:4])
+        raw = self._recv_exact(count * 20)
+        sig = [(int.from_bytes(raw[k:k + 4], "big"), raw[k + 4:k + 20], min(block, old_size - (k // 20) * block))
+               for k in range(0, len(raw), 20)]
+
+        resp = self.send_command(f"DELTA_UPLOAD {filename} {size} {block}")
+        if "READY" not in resp: return resp
+        out = bytearray()
+        def send(piece):
+            out.extend(piece)
+            if len(out) >= DELTA_LITERAL_MAX:
+                self.sock.sendall(out)
+                out.clear()
+        with open(filepath, 'rb') as f, mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as data:
+            literal, reused = delta_encode(data, sig, block, send)
+            send(b"E" + hashlib.md5(data).digest())
+        self.sock.sendall(out)
+        self.main_frame.log_output(f"Delta: {literal} of {size} bytes sent, {reused} reused from the server's copy")
+        return self._recv_line()
+
     def upload_file(self):
         # 1. Select File
         filepath = filedialog.askopenfilename()
@@ -120,6 +308,24 @@ class ModernClient(ctk.CTk):
         filename = os.path.basename(filepath)
         filesize = os.path.getsize(filepath)
 
+        # A file the server already has goes up as a delta.
+        try:
+            result = self.delta_upload(filepath, filename)
+        except Exception as e:
+            self.handle_disconnect(e)
+            return
+        if result and "Mismatch" not in result:
+            self.main_frame.log_output(f"Upload Status: {result}")
+            self.main_frame.refresh_files()
+            return
+
+        # The C library streams the file with large buffers when it is built.
+        if self.rfs:
+            ok, final_resp = self.rfs.upload_file(filepath, filename)
+            self.main_frame.log_output(f"Upload Status: {final_resp}")
+            if ok: self.main_frame.refresh_files()
+            return
+
         # 2. Send Command: UPLOAD <filename> <size>
         resp = self.send_command(f"UPLOAD {filename} {filesize}")
         
@@ -231,9 +437,10 @@ class LoginFrame(ctk.CTkFrame):
 
 
 class MainFrame(ctk.CTkFrame):
-    def __init__(self, master, cmd_cb, logout_cb, upload_cb):
+    def __init__(self, master, cmd_cb, logout_cb, upload_cb, list_cb):
         super().__init__(master)
         self.cmd_cb = cmd_cb
+        self.list_cb = list_cb
         self.logout_cb = logout_cb
         self.upload_cb = upload_cb
 
@@ -380,13 +587,13 @@ class MainFrame(ctk.CTkFrame):
             return f"Error: {e}"
 
     def refresh_files(self): self.log_output(self.cmd_cb("LS"))
-    def list_all(self): self.log_output(self.cmd_cb("LSR"))
+    def list_all(self): self.log_output(self.list_cb())
     def list_shared(self): self.log_output(self.cmd_cb("SHARED_WITH_ME"))
     
     def explore_dir(self):
         path = self._ask_input("Explore Folder", "Enter path OR 'SHARED/user/folder':")
         if path:
-            self.log_output(self.cmd_cb(f"LSR {path}"))
+            self.log_output(self.list_cb(path))
 
     def share_folder(self):
         raw_input = self._ask_input("Share Folder", "Enter: Folder User Permission\n(e.g. 'docs user2 READ')")
@@ -0,0 +1,810 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "remotefs.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+
+#pragma comment(lib, "ws2_32.lib")
+#define poll WSAPoll
+#define rfs_would_block() (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+/* ---------- POSIX COMPATIBILITY ---------- */
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#define rfs_would_block() (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+#define InitializeCriticalSection(cs) pthread_mutex_init((cs), NULL)
+#define DeleteCriticalSection(cs) pthread_mutex_destroy(cs)
+#define EnterCriticalSection(cs) pthread_mutex_lock(cs)
+#define LeaveCriticalSection(cs) pthread_mutex_unlock(cs)
+
+typedef pthread_cond_t CONDITION_VARIABLE;
+#define InitializeConditionVariable(cv) pthread_cond_init((cv), NULL)
+#define WakeAllConditionVariable(cv) pthread_cond_broadcast(cv)
+#define SleepConditionVariableCS(cv, cs, ms) pthread_cond_wait((cv), (cs))
+#define INFINITE 0xFFFFFFFF
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define RFS_HDR 12
+#define RFS_CMD 1
+#define RFS_PUT 2
+#define RFS_GET 3
+#define RFS_ERROR 0x2
+#define RFS_IO_BUF (256 * 1024)     // bytes per recv() on the I/O thread
+#define RFS_XFER_BUF (1024 * 1024)  // file data per send/recv in whole-file transfers
+
+typedef struct RfsRequest {
+    unsigned int id;
+    RfsCallback cb;
+    void *ctx;
+    char *frame;            // header + payload; freed once fully sent
+    long len, sent;
+    struct RfsRequest *next;
+} RfsRequest;
+
+typedef struct {
+    SOCKET sock;
+    RfsRequest *send_head, *send_tail;  // not completely written yet
+    RfsRequest *wait_head, *wait_tail;  // written, reply not here yet
+    int outstanding;
+    char *in;               // received, not yet parsed
+    long in_len, in_cap;
+    long skip;              // bytes left of a reply too large to keep
+    int dead;
+} RfsConn;
+
+struct RfsClient {
+    char host[64];
+    int port;
+    RfsConn conns[RFS_MAX_POOL];
+    int nconns;
+    unsigned int next_id;
+    int outstanding;        // requests and whole-file transfers not finished
+    long completed;
+    int closing;
+    int wake_pending;
+    CRITICAL_SECTION cs;
+    CONDITION_VARIABLE cv;  // a request completed
+#ifdef _WIN32
+    HANDLE io;
+#else
+    pthread_t io;
+    int wake[2];            // pipe that interrupts the I/O thread's poll()
+#endif
+};
+
+/* ---------- SOCKET HELPERS ---------- */
+SOCKET rfs_dial(const char *host, int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+    SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == INVALID_SOCKET) return INVALID_SOCKET;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    addr.sin_addr.s_addr = inet_addr(host);
+    if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    // Small pipelined frames must not wait for Nagle.
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+    return s;
+}
+
+void rfs_set_nonblocking(SOCKET s) {
+#ifdef _WIN32
+    u_long on = 1;
+    ioctlsocket(s, FIONBIO, &on);
+#else
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+}
+
+int rfs_send_all(SOCKET s, const char *data, long len) {
+    while (len > 0) {
+        int n = send(s, data, (len > (1 << 20)) ? (1 << 20) : (int)len, MSG_NOSIGNAL);
+        if (n <= 0) return 0;
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+int rfs_recv_all(SOCKET s, char *data, long len) {
+    while (len > 0) {
+        int n = recv(s, data, (len > (1 << 20)) ? (1 << 20) : (int)len, 0);
+        if (n <= 0) return 0;
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Reads a reply line on a blocking socket, without reading past '\n'.
+int rfs_recv_line(SOCKET s, char *line, int max) {
+    int n = 0;
+    while (n < max - 1) {
+        if (recv(s, line + n, 1, 0) != 1) return 0;
+        if (line[n++] == '\n') break;
+    }
+    line[n] = '\0';
+    return 1;
+}
+
+void rfs_put_be32(unsigned char *p, unsigned int v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+unsigned int rfs_get_be32(const unsigned char *p) {
+    return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* ---------- REQUEST COMPLETION ---------- */
+// Runs the callback, then counts the request as done.
+void rfs_complete(RfsClient *c, RfsConn *cn, RfsRequest *r, int ok, const char *data, long len) {
+    RfsReply reply;
+    reply.ok = ok;
+    reply.data = data;
+    reply.len = len;
+    if (r->cb) r->cb(r->ctx, &reply);
+    free(r->frame);
+    free(r);
+    EnterCriticalSection(&c->cs);
+    if (cn) cn->outstanding--;
+    c->outstanding--;
+    c->completed++;
+    WakeAllConditionVariable(&c->cv);
+    LeaveCriticalSection(&c->cs);
+}
+
+// The connection is gone: every request on it fails.
+void rfs_fail_conn(RfsClient *c, RfsConn *cn) {
+    EnterCriticalSection(&c->cs);
+    RfsRequest *sending = cn->send_head, *waiting = cn->wait_head;
+    cn->send_head = cn->send_tail = cn->wait_head = cn->wait_tail = NULL;
+    cn->dead = 1;
+    LeaveCriticalSection(&c->cs);
+    for (int pass = 0; pass < 2; pass++) {
+        RfsRequest *r = pass ? sending : waiting;
+        while (r) {
+            RfsRequest *next = r->next;
+            rfs_complete(c, cn, r, 0, "Connection lost\n", 16);
+            r = next;
+        }
+    }
+}
+
+/* ---------- I/O THREAD ---------- */
+// Writes queued frames until the socket would block.
+void rfs_flush(RfsClient *c, RfsConn *cn) {
+    int broken = 0;
+    EnterCriticalSection(&c->cs);
+    while (cn->send_head) {
+        RfsRequest *r = cn->send_head;
+        long left = r->len - r->sent;
+        int n = send(cn->sock, r->frame + r->sent, (left > (1 << 20)) ? (1 << 20) : (int)left, MSG_NOSIGNAL);
+        if (n <= 0) {
+            broken = !rfs_would_block();
+            break;
+        }
+        r->sent += n;
+        if (r->sent < r->len) continue;
+        free(r->frame);
+        r->frame = NULL;
+        cn->send_head = r->next;
+        if (!cn->send_head) cn->send_tail = NULL;
+        r->next = NULL;
+        if (cn->wait_tail) cn->wait_tail->next = r;
+        else cn->wait_head = r;
+        cn->wait_tail = r;
+    }
+    LeaveCriticalSection(&c->cs);
+    if (broken) rfs_fail_conn(c, cn);
+}
+
+// Takes the request with this id off the wait list (normally its head).
+RfsRequest* rfs_take_waiting(RfsClient *c, RfsConn *cn, unsigned int id) {
+    RfsRequest *prev = NULL, *r;
+    EnterCriticalSection(&c->cs);
+    for (r = cn->wait_head; r && r->id != id; r = r->next) prev = r;
+    if (r) {
+        if (prev) prev->next = r->next;
+        else cn->wait_head = r->next;
+        if (cn->wait_tail == r) cn->wait_tail = prev;
+    }
+    LeaveCriticalSection(&c->cs);
+    return r;
+}
+
+// Reads what is there and completes every request whose reply is whole.
+void rfs_read(RfsClient *c, RfsConn *cn, char *buf) {
+    int n = recv(cn->sock, buf, RFS_IO_BUF, 0);
+    if (n < 0 && rfs_would_block()) return;
+    if (n <= 0) {
+        rfs_fail_conn(c, cn);
+        return;
+    }
+    if (cn->in_len + n > cn->in_cap) {
+        long cap = cn->in_cap ? cn->in_cap : RFS_IO_BUF;
+        while (cap < cn->in_len + n) cap *= 2;
+        char *grown = realloc(cn->in, cap);
+        if (!grown) {
+            rfs_fail_conn(c, cn);
+            return;
+        }
+        cn->in = grown;
+        cn->in_cap = cap;
+    }
+    memcpy(cn->in + cn->in_len, buf, n);
+    cn->in_len += n;
+
+    long pos = 0;
+    for (;;) {
+        if (cn->skip > 0) {
+            long drop = (cn->in_len - pos < cn->skip) ? cn->in_len - pos : cn->skip;
+            pos += drop;
+            cn->skip -= drop;
+            if (cn->skip > 0) break;
+        }
+        if (cn->in_len - pos < RFS_HDR) break;
+        const unsigned char *h = (const unsigned char*)cn->in + pos;
+        long len = rfs_get_be32(h);
+        unsigned short flags = (unsigned short)(h[6] << 8 | h[7]);
+        if (len > RFS_FRAME_MAX) {
+            // Only this request fails; its payload is discarded as it arrives.
+            RfsRequest *r = rfs_take_waiting(c, cn, rfs_get_be32(h + 8));
+            if (r) rfs_complete(c, cn, r, 0, "Reply too large\n", 16);
+            pos += RFS_HDR;
+            cn->skip = len;
+            continue;
+        }
+        if (cn->in_len - pos < RFS_HDR + len) break;
+        RfsRequest *r = rfs_take_waiting(c, cn, rfs_get_be32(h + 8));
+        if (r) rfs_complete(c, cn, r, !(flags & RFS_ERROR), cn->in + pos + RFS_HDR, len);
+        pos += RFS_HDR + len;
+    }
+    memmove(cn->in, cn->in + pos, cn->in_len - pos);
+    cn->in_len -= pos;
+    // Give back the room a large reply needed.
+    if (cn->in_cap > RFS_IO_BUF && cn->in_len <= RFS_IO_BUF) {
+        char *shrunk = realloc(cn->in, RFS_IO_BUF);
+        if (shrunk) {
+            cn->in = shrunk;
+            cn->in_cap = RFS_IO_BUF;
+        }
+    }
+}
+
+void rfs_io_run(RfsClient *c) {
+    struct pollfd fds[RFS_MAX_POOL + 1];
+    int which[RFS_MAX_POOL];
+    char *buf = malloc(RFS_IO_BUF);
+    while (buf) {
+        int n = 0;
+        EnterCriticalSection(&c->cs);
+        if (c->closing) {
+            LeaveCriticalSection(&c->cs);
+            break;
+        }
+        for (int i = 0; i < c->nconns; i++) {
+            if (c->conns[i].dead) continue;
+            fds[n].fd = c->conns[i].sock;
+            fds[n].events = POLLIN | (c->conns[i].send_head ? POLLOUT : 0);
+            fds[n].revents = 0;
+            which[n++] = i;
+        }
+        LeaveCriticalSection(&c->cs);
+#ifdef _WIN32
+        // No wake pipe for WSAPoll: new requests are picked up within 5 ms.
+        if (n == 0) {
+            Sleep(5);
+            continue;
+        }
+        int r = poll(fds, n, 5);
+#else
+        fds[n].fd = c->wake[0];
+        fds[n].events = POLLIN;
+        fds[n].revents = 0;
+        int r = poll(fds, n + 1, -1);
+        if (r > 0 && (fds[n].revents & POLLIN)) {
+            char drain[64];
+            EnterCriticalSection(&c->cs);
+            c->wake_pending = 0;
+            LeaveCriticalSection(&c->cs);
+            while (read(c->wake[0], drain, sizeof(drain)) == (int)sizeof(drain)) {}
+        }
+#endif
+        if (r <= 0) continue;
+        for (int k = 0; k < n; k++) {
+            RfsConn *cn = &c->conns[which[k]];
+            if (fds[k].revents & POLLOUT) rfs_flush(c, cn);
+            if (!cn->dead && (fds[k].revents & (POLLIN | POLLERR | POLLHUP))) rfs_read(c, cn, buf);
+        }
+    }
+    free(buf);
+}
+
+#ifdef _WIN32
+DWORD WINAPI rfs_io_thread(LPVOID arg) {
+    rfs_io_run((RfsClient*)arg);
+    return 0;
+}
+#else
+void* rfs_io_thread(void *arg) {
+    rfs_io_run((RfsClient*)arg);
+    return NULL;
+}
+#endif
+
+/* ---------- REQUESTS ---------- */
+// Queues a frame of 'a' followed by 'b' on connection 'conn' (-1: the
+// least busy one).
+int rfs_submit(RfsClient *c, int conn, unsigned short opcode, const char *a, long alen,
+               const char *b, long blen, RfsCallback cb, void *ctx) {
+    long len = alen + blen;
+    if (len > RFS_FRAME_MAX) return 0;
+    RfsRequest *r = (RfsRequest*)calloc(1, sizeof(RfsRequest));
+    char *frame = malloc(RFS_HDR + len);
+    if (!r || !frame) {
+        free(r);
+        free(frame);
+        return 0;
+    }
+    memcpy(frame + RFS_HDR, a, alen);
+    if (blen) memcpy(frame + RFS_HDR + alen, b, blen);
+    r->frame = frame;
+    r->len = RFS_HDR + len;
+    r->cb = cb;
+    r->ctx = ctx;
+
+    EnterCriticalSection(&c->cs);
+    RfsConn *cn = NULL;
+    if (conn >= 0) {
+        if (conn < c->nconns && !c->conns[conn].dead) cn = &c->conns[conn];
+    } else {
+        for (int i = 0; i < c->nconns; i++)
+            if (!c->conns[i].dead && (!cn || c->conns[i].outstanding < cn->outstanding)) cn = &c->conns[i];
+    }
+    if (!cn || c->closing) {
+        LeaveCriticalSection(&c->cs);
+        free(frame);
+        free(r);
+        return 0;
+    }
+    r->id = ++c->next_id;
+    rfs_put_be32((unsigned char*)frame, (unsigned int)len);
+    frame[4] = (char)(opcode >> 8);
+    frame[5] = (char)opcode;
+    frame[6] = frame[7] = 0;
+    rfs_put_be32((unsigned char*)frame + 8, r->id);
+    if (cn->send_tail) cn->send_tail->next = r;
+    else cn->send_head = r;
+    cn->send_tail = r;
+    cn->outstanding++;
+    c->outstanding++;
+    int wake = !c->wake_pending;
+    c->wake_pending = 1;
+    LeaveCriticalSection(&c->cs);
+#ifndef _WIN32
+    if (wake && write(c->wake[1], "x", 1) < 0) {}
+#else
+    (void)wake;
+#endif
+    return 1;
+}
+
+int rfs_command_on(RfsClient *c, int conn, const char *cmd, RfsCallback cb, void *ctx) {
+    return rfs_submit(c, conn, RFS_CMD, cmd, (long)strlen(cmd), NULL, 0, cb, ctx);
+}
+
+int rfs_put_on(RfsClient *c, int conn, const char *name, const char *data, long len, RfsCallback cb, void *ctx) {
+    char head[300];
+    if (strlen(name) > 255) return 0;
+    sprintf(head, "%s\n", name);
+    return rfs_submit(c, conn, RFS_PUT, head, (long)strlen(head), data, len, cb, ctx);
+}
+
+int rfs_get_on(RfsClient *c, int conn, const char *name, RfsCallback cb, void *ctx) {
+    return rfs_submit(c, conn, RFS_GET, name, (long)strlen(name), NULL, 0, cb, ctx);
+}
+
+int rfs_command(RfsClient *c, const char *cmd, RfsCallback cb, void *ctx) {
+    return rfs_command_on(c, -1, cmd, cb, ctx);
+}
+
+int rfs_put(RfsClient *c, const char *name, const char *data, long len, RfsCallback cb, void *ctx) {
+    return rfs_put_on(c, -1, name, data, len, cb, ctx);
+}
+
+int rfs_get(RfsClient *c, const char *name, RfsCallback cb, void *ctx) {
+    return rfs_get_on(c, -1, name, cb, ctx);
+}
+
+int rfs_pool_size(RfsClient *c) {
+    return c->nconns;
+}
+
+void rfs_wait(RfsClient *c) {
+    EnterCriticalSection(&c->cs);
+    while (c->outstanding > 0) SleepConditionVariableCS(&c->cv, &c->cs, INFINITE);
+    LeaveCriticalSection(&c->cs);
+}
+
+long rfs_completed(RfsClient *c) {
+    EnterCriticalSection(&c->cs);
+    long n = c->completed;
+    LeaveCriticalSection(&c->cs);
+    return n;
+}
+
+void rfs_free(void *p) {
+    free(p);
+}
+
+typedef struct {
+    RfsClient *c;
+    int done, ok;
+    char *data;
+    long len;
+} RfsSync;
+
+void rfs_sync_done(void *ctx, const RfsReply *reply) {
+    RfsSync *w = (RfsSync*)ctx;
+    char *copy = malloc(reply->len + 1);
+    if (copy) {
+        memcpy(copy, reply->data, reply->len);
+        copy[reply->len] = '\0';
+    }
+    EnterCriticalSection(&w->c->cs);
+    w->data = copy;
+    w->len = copy ? reply->len : 0;
+    w->ok = reply->ok && copy;
+    w->done = 1;
+    WakeAllConditionVariable(&w->c->cv);
+    LeaveCriticalSection(&w->c->cs);
+}
+
+char* rfs_call_on(RfsClient *c, int conn, const char *cmd, long *len, int *ok) {
+    RfsSync w;
+    memset(&w, 0, sizeof(w));
+    w.c = c;
+    if (!rfs_submit(c, conn, RFS_CMD, cmd, (long)strlen(cmd), NULL, 0, rfs_sync_done, &w)) return NULL;
+    EnterCriticalSection(&c->cs);
+    while (!w.done) SleepConditionVariableCS(&c->cv, &c->cs, INFINITE);
+    LeaveCriticalSection(&c->cs);
+    if (len) *len = w.len;
+    if (ok) *ok = w.ok;
+    return w.data;
+}
+
+char* rfs_call(RfsClient *c, const char *cmd, long *len, int *ok) {
+    return rfs_call_on(c, -1, cmd, len, ok);
+}
+
+// Sends cmd on every connection; 1 if every reply starts with 'expect'.
+int rfs_call_all(RfsClient *c, const char *cmd, const char *expect) {
+    int all = 1;
+    for (int i = 0; i < c->nconns; i++) {
+        char *reply = rfs_call_on(c, i, cmd, NULL, NULL);
+        if (!reply || strncmp(reply, expect, strlen(expect)) != 0) all = 0;
+        free(reply);
+    }
+    return all;
+}
+
+int rfs_login(RfsClient *c, const char *user, const char *pass) {
+    char cmd[520];
+    if (strlen(user) > 250 || strlen(pass) > 250) return 0;
+    sprintf(cmd, "LOGIN %s %s", user, pass);
+    return rfs_call_all(c, cmd, "Login successful");
+}
+
+int rfs_attach(RfsClient *c, const char *token) {
+    char cmd[100];
+    if (strlen(token) > 80) return 0;
+    sprintf(cmd, "ATTACH %s", token);
+    return rfs_call_all(c, cmd, "Attached");
+}
+
+/* ---------- CONNECT / CLOSE ---------- */
+RfsClient* rfs_connect(const char *host, int port, int pool) {
+    char line[64];
+    if (pool < 1 || pool > RFS_MAX_POOL || strlen(host) >= 64) return NULL;
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) return NULL;
+#endif
+    RfsClient *c = (RfsClient*)calloc(1, sizeof(RfsClient));
+    if (!c) return NULL;
+    strcpy(c->host, host);
+    c->port = port;
+    for (int i = 0; i < pool; i++) {
+        SOCKET s = rfs_dial(host, port);
+        if (s == INVALID_SOCKET) break;
+        if (!rfs_send_all(s, "PROTO BINARY 1\n", 15) || !rfs_recv_line(s, line, sizeof(line)) ||
+            strncmp(line, "PROTO BINARY 1 OK", 17) != 0) {
+            closesocket(s);
+            break;
+        }
+        rfs_set_nonblocking(s);
+        c->conns[c->nconns++].sock = s;
+    }
+    InitializeCriticalSection(&c->cs);
+    InitializeConditionVariable(&c->cv);
+    int started = c->nconns > 0;
+#ifdef _WIN32
+    if (started) started = (c->io = CreateThread(NULL, 0, rfs_io_thread, c, 0, NULL)) != NULL;
+#else
+    if (started) started = pipe(c->wake) == 0;
+    if (started) {
+        fcntl(c->wake[0], F_SETFL, O_NONBLOCK);
+        if (pthread_create(&c->io, NULL, rfs_io_thread, c) != 0) {
+            close(c->wake[0]);
+            close(c->wake[1]);
+            started = 0;
+        }
+    }
+#endif
+    if (!started) {
+        for (int i = 0; i < c->nconns; i++) closesocket(c->conns[i].sock);
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void rfs_close(RfsClient *c) {
+    if (!c) return;
+    rfs_wait(c);
+    EnterCriticalSection(&c->cs);
+    c->closing = 1;
+    LeaveCriticalSection(&c->cs);
+#ifdef _WIN32
+    WaitForSingleObject(c->io, INFINITE);
+    CloseHandle(c->io);
+#else
+    if (write(c->wake[1], "x", 1) < 0) {}
+    pthread_join(c->io, NULL);
+    close(c->wake[0]);
+    close(c->wake[1]);
+#endif
+    for (int i = 0; i < c->nconns; i++) {
+        closesocket(c->conns[i].sock);
+        free(c->conns[i].in);
+    }
+    free(c);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+/* ---------- TEXT CONNECTIONS AND WHOLE-FILE TRANSFERS ---------- */
+// The token comes from pooled connection 'conn', so the text connection
+// acts for that connection's login.
+intptr_t rfs_open_text_on(RfsClient *c, int conn) {
+    char token[64], cmd[100], line[64];
+    char *reply = rfs_call_on(c, conn, "SESSION_TOKEN", NULL, NULL);
+    int have = reply && sscanf(reply, "TOKEN %63s", token) == 1;
+    free(reply);
+    if (!have) return -1;
+    SOCKET s = rfs_dial(c->host, c->port);
+    if (s == INVALID_SOCKET) return -1;
+    sprintf(cmd, "ATTACH %s\n", token);
+    if (!rfs_send_all(s, cmd, strlen(cmd)) || !rfs_recv_line(s, line, sizeof(line)) ||
+        strncmp(line, "Attached", 8) != 0) {
+        closesocket(s);
+        return -1;
+    }
+    return (intptr_t)s;
+}
+
+intptr_t rfs_open_text(RfsClient *c) {
+    return rfs_open_text_on(c, -1);
+}
+
+typedef struct {
+    RfsClient *c;
+    int conn;
+    SOCKET sock;
+    char local[1024], remote[256];
+    int upload;
+    RfsCallback cb;
+    void *ctx;
+} RfsTransfer;
+
+// UPLOAD on the text connection; the reply is the server's final word.
+int rfs_upload_run(RfsTransfer *t, char *reply, int max) {
+    char cmd[400];
+    FILE *fp = fopen(t->local, "rb");
+    if (!fp) {
+        strcpy(reply, "Local file not found\n");
+        return 0;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    sprintf(cmd, "UPLOAD %s %ld\n", t->remote, size);
+    int n = rfs_send_all(t->sock, cmd, strlen(cmd)) ? recv(t->sock, reply, max - 1, 0) : -1;
+    if (n <= 0) {
+        fclose(fp);
+        strcpy(reply, "Connection lost\n");
+        return 0;
+    }
+    reply[n] = '\0';
+    if (strncmp(reply, "READY", 5) != 0) {
+        fclose(fp);
+        return 0;
+    }
+    char *data = malloc(RFS_XFER_BUF);
+    long sent = 0;
+    while (data && sent < size) {
+        long got = (long)fread(data, 1, RFS_XFER_BUF, fp);
+        if (got <= 0 || !rfs_send_all(t->sock, data, got)) break;
+        sent += got;
+    }
+    free(data);
+    fclose(fp);
+    if (sent < size || !rfs_recv_line(t->sock, reply, max)) {
+        strcpy(reply, "Upload interrupted\n");
+        return 0;
+    }
+    return strncmp(reply, "Upload Complete", 15) == 0;
+}
+
+// DOWNLOAD into <local>.part, renamed to <local> once complete.
+int rfs_download_run(RfsTransfer *t, char *reply, int max) {
+    char cmd[400], part[1100];
+    long size = 0;
+    sprintf(cmd, "DOWNLOAD %s\n", t->remote);
+    int n = rfs_send_all(t->sock, cmd, strlen(cmd)) ? recv(t->sock, reply, max - 1, 0) : -1;
+    if (n <= 0) {
+        strcpy(reply, "Connection lost\n");
+        return 0;
+    }
+    reply[n] = '\0';
+    if (sscanf(reply, "SIZE %ld", &size) != 1) return 0;
+    snprintf(part, sizeof(part), "%s.part", t->local);
+    FILE *fp = fopen(part, "wb");
+    if (!fp) {
+        strcpy(reply, "Cannot create local file\n");
+        return 0;
+    }
+    char *data = malloc(RFS_XFER_BUF);
+    long got = 0;
+    if (data && rfs_send_all(t->sock, "READY", 5)) {
+        while (got < size) {
+            long want = (size - got < RFS_XFER_BUF) ? size - got : RFS_XFER_BUF;
+            int r = recv(t->sock, data, (int)want, 0);
+            if (r <= 0 || (long)fwrite(data, 1, r, fp) != r) break;
+            got += r;
+        }
+    }
+    free(data);
+    fclose(fp);
+    if (got < size) {
+        strcpy(reply, "Download interrupted\n");
+        return 0;
+    }
+    remove(t->local);
+    if (rename(part, t->local) != 0) {
+        strcpy(reply, "Cannot rename local file\n");
+        return 0;
+    }
+    strcpy(reply, "Download Complete\n");
+    return 1;
+}
+
+// Runs on its own thread, so opening the text connection may block here
+// and rfs_upload_file() itself is safe to call from a callback.
+void rfs_transfer_run(RfsTransfer *t) {
+    char reply[256];
+    RfsRequest r;
+    intptr_t s = rfs_open_text_on(t->c, t->conn);
+    int ok = 0;
+    if (s < 0) {
+        strcpy(reply, "Cannot open a transfer connection\n");
+    } else {
+        t->sock = (SOCKET)s;
+        ok = t->upload ? rfs_upload_run(t, reply, sizeof(reply)) : rfs_download_run(t, reply, sizeof(reply));
+        closesocket(t->sock);
+    }
+    memset(&r, 0, sizeof(r));
+    r.cb = t->cb;
+    r.ctx = t->ctx;
+    // rfs_complete() frees the request it is given, so hand it a heap copy.
+    RfsRequest *heap = (RfsRequest*)malloc(sizeof(RfsRequest));
+    if (heap) {
+        *heap = r;
+        rfs_complete(t->c, NULL, heap, ok, reply, (long)strlen(reply));
+    } else {
+        EnterCriticalSection(&t->c->cs);
+        t->c->outstanding--;
+        WakeAllConditionVariable(&t->c->cv);
+        LeaveCriticalSection(&t->c->cs);
+    }
+    free(t);
+}
+
+#ifdef _WIN32
+DWORD WINAPI rfs_transfer_thread(LPVOID arg) {
+    rfs_transfer_run((RfsTransfer*)arg);
+    return 0;
+}
+#else
+void* rfs_transfer_thread(void *arg) {
+    rfs_transfer_run((RfsTransfer*)arg);
+    return NULL;
+}
+#endif
+
+int rfs_transfer_start(RfsClient *c, int conn, const char *local, const char *remote, int upload,
+                       RfsCallback cb, void *ctx) {
+    if (strlen(local) >= 1024 || strlen(remote) >= 256) return 0;
+    RfsTransfer *t = (RfsTransfer*)calloc(1, sizeof(RfsTransfer));
+    if (!t) return 0;
+    t->c = c;
+    t->conn = conn;
+    strcpy(t->local, local);
+    strcpy(t->remote, remote);
+    t->upload = upload;
+    t->cb = cb;
+    t->ctx = ctx;
+    EnterCriticalSection(&c->cs);
+    c->outstanding++;
+    LeaveCriticalSection(&c->cs);
+#ifdef _WIN32
+    HANDLE th = CreateThread(NULL, 0, rfs_transfer_thread, t, 0, NULL);
+    int started = th != NULL;
+    if (th) CloseHandle(th);
+#else
+    pthread_t th;
+    int started = pthread_create(&th, NULL, rfs_transfer_thread, t) == 0;
+    if (started) pthread_detach(th);
+#endif
+    if (!started) {
+        free(t);
+        EnterCriticalSection(&c->cs);
+        c->outstanding--;
+        WakeAllConditionVariable(&c->cv);
+        LeaveCriticalSection(&c->cs);
+    }
+    return started;
+}
+
+int rfs_upload_file_on(RfsClient *c, int conn, const char *local, const char *remote, RfsCallback cb, void *ctx) {
+    return rfs_transfer_start(c, conn, local, remote, 1, cb, ctx);
+}
+
+int rfs_download_file_on(RfsClient *c, int conn, const char *remote, const char *local, RfsCallback cb, void *ctx) {
+    return rfs_transfer_start(c, conn, local, remote, 0, cb, ctx);
+}
+
+int rfs_upload_file(RfsClient *c, const char *local, const char *remote, RfsCallback cb, void *ctx) {
+    return rfs_upload_file_on(c, -1, local, remote, cb, ctx);
+}
+
+int rfs_download_file(RfsClient *c, const char *remote, const char *local, RfsCallback cb, void *ctx) {
+    return rfs_download_file_on(c, -1, remote, local, cb, ctx);
+}
@@ -0,0 +1,93 @@
+#ifndef REMOTEFS_H
+#define REMOTEFS_H
+
+#include <stdint.h>
+
+/*
+ * Client library for the Remote File System server.
+ *
+ * An RfsClient keeps a pool of connections in binary frame mode
+ * (PROTO BINARY 1) and one I/O thread that drives all of them with
+ * non-blocking sockets. Requests are queued without waiting: any number
+ * can be outstanding on each connection, and each completes by calling
+ * its callback on the I/O thread with the reply payload. Replies on one
+ * connection come back in order; requests spread over a pool of several
+ * connections may complete in any order, so call rfs_wait() between
+ * requests that depend on each other (or use a pool of one).
+ *
+ * rfs_call() is the blocking form for simple callers. Files too large for
+ * one frame go through rfs_upload_file()/rfs_download_file(), which use a
+ * separate text-mode connection attached to the same login.
+ *
+ * Build: gcc -c remotefs.c (Windows: link -lws2_32), or as a shared
+ * library for the Python binding: gcc -shared -fPIC remotefs.c -o libremotefs.so -lpthread
+ *
+ * Never call the blocking functions (rfs_call, rfs_wait, rfs_login, ...)
+ * from inside a callback: callbacks run on the I/O thread they wait for.
+ */
+
+#define RFS_MAX_POOL 64
+#define RFS_FRAME_MAX (16 * 1024 * 1024)    // largest rfs_put()/rfs_get() payload
+
+typedef struct RfsClient RfsClient;
+
+typedef struct {
+    int ok;             // 0 if the server flagged an error or the connection was lost
+    const char *data;   // reply payload; only valid during the callback
+    long len;
+} RfsReply;
+
+typedef void (*RfsCallback)(void *ctx, const RfsReply *reply);
+
+// Opens 'pool' connections (1 to RFS_MAX_POOL). NULL if none could be made.
+RfsClient* rfs_connect(const char *host, int port, int pool);
+// Waits for outstanding requests, then closes everything.
+void rfs_close(RfsClient *c);
+
+// LOGIN / ATTACH on every pooled connection. 1 if all of them succeeded.
+int rfs_login(RfsClient *c, const char *user, const char *pass);
+int rfs_attach(RfsClient *c, const char *token);
+
+// Queue a request; the callback (may be NULL) runs when its reply arrives.
+// Return 0 if the request could not be queued (the callback is not called).
+int rfs_command(RfsClient *c, const char *cmd, RfsCallback cb, void *ctx);
+int rfs_put(RfsClient *c, const char *name, const char *data, long len, RfsCallback cb, void *ctx);
+int rfs_get(RfsClient *c, const char *name, RfsCallback cb, void *ctx);
+
+// The same, on connection 'conn' of the pool (0 .. rfs_pool_size() - 1;
+// -1 picks the least busy one), for callers that keep per-connection
+// state such as a different login.
+int rfs_command_on(RfsClient *c, int conn, const char *cmd, RfsCallback cb, void *ctx);
+int rfs_put_on(RfsClient *c, int conn, const char *name, const char *data, long len, RfsCallback cb, void *ctx);
+int rfs_get_on(RfsClient *c, int conn, const char *name, RfsCallback cb, void *ctx);
+// Connections actually opened by rfs_connect.
+int rfs_pool_size(RfsClient *c);
+
+// Blocks until every queued request has completed.
+void rfs_wait(RfsClient *c);
+// Runs one command and returns its reply, NUL-terminated, to be released
+// with rfs_free(). NULL if the connection failed. *len and *ok may be NULL.
+char* rfs_call(RfsClient *c, const char *cmd, long *len, int *ok);
+void rfs_free(void *p);
+
+// Whole-file transfers of any size over a text-mode connection, in the
+// background. The callback gets the server's final reply (ok = 1 when the
+// file arrived complete), on the transfer's own thread. Return 0 if the
+// transfer could not start. These do not block, so a callback may start
+// the next transfer. The _on forms act for the login of pooled
+// connection 'conn' (-1: any).
+int rfs_upload_file(RfsClient *c, const char *local, const char *remote, RfsCallback cb, void *ctx);
+int rfs_download_file(RfsClient *c, const char *remote, const char *local, RfsCallback cb, void *ctx);
+int rfs_upload_file_on(RfsClient *c, int conn, const char *local, const char *remote, RfsCallback cb, void *ctx);
+int rfs_download_file_on(RfsClient *c, int conn, const char *remote, const char *local, RfsCallback cb, void *ctx);
+
+// A new text-mode connection logged in as this client (via SESSION_TOKEN
+// and ATTACH), for the handshake-based commands (UPLOAD, DELTA_UPLOAD,
+// UPLOAD_CHUNK, ...). The caller owns the socket. -1 on failure.
+intptr_t rfs_open_text(RfsClient *c);
+intptr_t rfs_open_text_on(RfsClient *c, int conn);
+
+// Requests completed since rfs_connect, for benchmarks.
+long rfs_completed(RfsClient *c);
+
+#endif
@@ -0,0 +1,123 @@
+"""ctypes binding for the remotefs C client library (remotefs.h).
+
+Build the library first:
+    gcc -shared -fPIC -O2 remotefs.c -o libremotefs.so -lpthread     (Linux)
+    gcc -shared -O2 remotefs.c -o remotefs.dll -lws2_32              (Windows)
+
+Callbacks run on the library's I/O thread; keep them short and never call
+blocking methods (call, wait, ...) from inside one.
+"""
+import ctypes
+import os
+import threading
+
+class _Reply(ctypes.Structure):
+    _fields_ = [("ok", ctypes.c_int), ("data", ctypes.c_void_p), ("len", ctypes.c_long)]
+
+_CALLBACK = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.POINTER(_Reply))
+
+def _load():
+    here = os.path.dirname(os.path.abspath(__file__))
+    for name in ("libremotefs.so", "remotefs.dll", "libremotefs.dylib"):
+        path = os.path.join(here, name)
+        if os.path.exists(path):
+            lib = ctypes.CDLL(path)
+            break
+    else:
+        raise OSError("libremotefs not built (see remotefs.py)")
+    p, s, i, l = ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int, ctypes.c_long
+    for fn, res, args in (
+            ("rfs_connect", p, [s, i, i]), ("rfs_close", None, [p]),
+            ("rfs_login", i, [p, s, s]), ("rfs_attach", i, [p, s]),
+            ("rfs_command", i, [p, s, _CALLBACK, p]), ("rfs_put", i, [p, s, s, l, _CALLBACK, p]),
+            ("rfs_get", i, [p, s, _CALLBACK, p]), ("rfs_wait", None, [p]),
+            ("rfs_call", p, [p, s, ctypes.POINTER(l), ctypes.POINTER(i)]), ("rfs_free", None, [p]),
+            ("rfs_upload_file", i, [p, s, s, _CALLBACK, p]), ("rfs_download_file", i, [p, s, s, _CALLBACK, p]),
+            ("rfs_completed", l, [p])):
+        getattr(lib, fn).restype = res
+        getattr(lib, fn).argtypes = args
+    return lib
+
+_lib = _load()
+
+
+class Client:
+    """A pool of pipelined connections. Replies are bytes; the async methods
+    take callback(ok, data) and return False if the request was not queued."""
+
+    def __init__(self, host="127.0.0.1", port=8080, pool=1):
+        self._c = _lib.rfs_connect(host.encode(), port, pool)
+        if not self._c:
+            raise ConnectionError(f"cannot connect to {host}:{port}")
+        # ctypes callbacks must outlive their call; they are dropped in wait(),
+        # once the library has returned from all of them.
+        self._callbacks = []
+        self._lock = threading.Lock()
+
+    def _queue(self, submit, callback):
+        def done(_ctx, reply):
+            r = reply.contents
+            data = ctypes.string_at(r.data, r.len) if r.len else b""
+            if callback: callback(bool(r.ok), data)
+
+        cb = _CALLBACK(done)
+        with self._lock:
+            self._callbacks.append(cb)
+        return bool(submit(cb))
+
+    def call(self, cmd):
+        """Runs one command and returns (ok, reply)."""
+        n, ok = ctypes.c_long(), ctypes.c_int()
+        p = _lib.rfs_call(self._c, cmd.encode(), ctypes.byref(n), ctypes.byref(ok))
+        if not p:
+            raise ConnectionError("connection lost")
+        data = ctypes.string_at(p, n.value)
+        _lib.rfs_free(p)
+        return bool(ok.value), data
+
+    def login(self, user, password):
+        return bool(_lib.rfs_login(self._c, user.encode(), password.encode()))
+
+    def attach(self, token):
+        return bool(_lib.rfs_attach(self._c, token.encode()))
+
+    def command_async(self, cmd, callback=None):
+        return self._queue(lambda cb: _lib.rfs_command(self._c, cmd.encode(), cb, None), callback)
+
+    def put(self, name, data, callback=None):
+        return self._queue(lambda cb: _lib.rfs_put(self._c, name.encode(), data, len(data), cb, None), callback)
+
+    def get(self, name, callback=None):
+        return self._queue(lambda cb: _lib.rfs_get(self._c, name.encode(), cb, None), callback)
+
+    def wait(self):
+        with self._lock:
+            held = len(self._callbacks)
+        _lib.rfs_wait(self._c)
+        with self._lock:
+            del self._callbacks[:held]
+
+    def completed(self):
+        return _lib.rfs_completed(self._c)
+
+    def _transfer(self, start, a, b):
+        done, result = threading.Event(), []
+        def finished(ok, data):
+            result.append((ok, data.decode('utf-8', errors='ignore').strip()))
+            done.set()
+        if not self._queue(lambda cb: start(self._c, a.encode(), b.encode(), cb, None), finished):
+            return False, "Transfer could not start"
+        done.wait()
+        return result[0]
+
+    def upload_file(self, local, remote):
+        """Uploads a local file of any size; returns (ok, server reply)."""
+        return self._transfer(_lib.rfs_upload_file, local, remote)
+
+    def download_file(self, remote, local):
+        return self._transfer(_lib.rfs_download_file, remote, local)
+
+    def close(self):
+        if self._c:
+            _lib.rfs_close(self._c)
+            self._c = None
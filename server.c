@@ -1,1007 +1,5175 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <winsock2.h>
-#include <direct.h>
-#include <sys/stat.h>
-#include <time.h>
-#include <dirent.h>
-
-#include <process.h> /* For threads if using _beginthreadex, though we used CreateThread which is in windows.h */
-
-#ifndef _WINDOWS_
-#include <windows.h>
+#ifdef __linux__
+#define _GNU_SOURCE /* pthread_setaffinity_np, sched_getcpu */
 #endif
+#ifdef _WIN32
+#define _CRT_RAND_S /* rand_s for session tokens */
+#endif
+
+#include "fscore.h"
+#include "checksum.h"
 
-#pragma comment(lib, "ws2_32.lib")
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
 
 #define PORT 8080
 #define BUF 1024
 
-/* ---------- USER DATABASE ---------- */
-int user_exists(const char *u) {
-    FILE *fp = fopen("users.txt", "r");
-    char user[50], pass[50];
-    if (!fp) return 0;
-    while (fscanf(fp, "%s %s", user, pass) != EOF) {
-        if (strcmp(user, u) == 0) {
-            fclose(fp);
-            return 1;
+/* ---------- SERVER CONFIG ---------- */
+typedef struct {
+    int use_epoll;      // --epoll : event-driven mode (Linux only)
+    int workers;        // --workers N : disk/command worker threads for --epoll
+    int reactors;       // --reactors N : SO_REUSEPORT listeners, one reactor each (0 = one per core)
+    int backlog;        // --backlog N : listen() queue depth
+    int use_uring;      // --io uring : io_uring file I/O backend (Linux only)
+    int lock_policy;    // --lock-policy fifo|writer : order of queued lock requests
+    int writer_wait_ms; // --writer-wait MS : how long WRITE/LOCK_FILE queue before DENIED
+    int log_flush_ms;   // --log-flush MS : how often the log writer drains the rings
+    long log_max_bytes; // --log-max-mb N : rotate server_log.txt past this size (0 = never)
+    int walk_threads;   // --walk-threads N : directory reader threads for LSR/tree scans (0 = inline)
+    long meta_cache_bytes; // --meta-cache-mb N : STAT/LS/LSR metadata cache budget (0 = off)
+    long file_cache_bytes; // --file-cache-mb N : READ/DOWNLOAD content cache budget (0 = off)
+    long read_inflight_bytes; // --read-inflight-mb N : READ slice memory across all sessions
+    int copy_threads;   // --copy-threads N : files copied at once by a folder COPY (0 = one by one)
+    int metrics_port;   // --metrics-port N : Prometheus text endpoint on 127.0.0.1 (0 = off)
+} ServerConfig;
+
+#define LOCK_POLICY_FIFO 0
+#define LOCK_POLICY_WRITER 1
+
+ServerConfig g_cfg = { 0, 4, 1, SOMAXCONN, 0, LOCK_POLICY_FIFO, 0, 200, 10L << 20, 4, 64L << 20, 64L << 20, 256L << 20, 4, 0 };
+
+typedef struct Session Session;
+void session_send(Session *s, const char *data, long len);
+int send_all(SOCKET c, const char *data, long len);
+double now_ms();
+void worker_block_begin();
+void worker_block_end();
+void worker_note_timeout(long n);
+int replace_file(const char *tmp, const char *dst);
+int fs_stat(const char *path, struct stat *st);
+void transfer_session_closed(SOCKET c);
+void content_invalidate(const char *path, int tree);
+
+/* ---------- COMMAND LOG ---------- */
+/*
+ * log_command() never touches the disk. Each thread that logs owns a
+ * single-producer ring; the log writer thread is the single consumer and
+ * turns everything it drains into one fwrite per flush interval. A full
+ * ring drops the entry and counts it rather than blocking the command.
+ * Rings are recycled when a client thread exits (log_thread_release).
+ */
+#define LOG_RING_SIZE 256   // entries per thread, power of two
+#define LOG_ENTRY_MAX 240
+#define LOG_BATCH (64 * 1024)
+#define LOG_KEEP 3          // server_log.txt.1 .. .3 after rotation
+
+typedef struct {
+    time_t when;
+    char text[LOG_ENTRY_MAX];  // "user : command"
+} LogEntry;
+
+typedef struct LogRing {
+    unsigned int head;     // written by the owning thread only
+    unsigned int tail;     // written by the log writer only
+    int in_use;
+    struct LogRing *next;
+    LogEntry entries[LOG_RING_SIZE];
+} LogRing;
+
+CRITICAL_SECTION log_cs;        // guards the ring list and ownership
+CONDITION_VARIABLE log_wake;
+LogRing *log_rings = NULL;
+THREAD_LOCAL LogRing *log_my_ring = NULL;
+long log_dropped = 0, log_written = 0;
+
+LogRing* log_ring_claim() {
+    EnterCriticalSection(&log_cs);
+    LogRing *r = log_rings;
+    while (r && r->in_use) r = r->next;
+    if (!r) {
+        r = (LogRing*)calloc(1, sizeof(LogRing));
+        if (r) {
+            r->next = log_rings;
+            log_rings = r;
         }
     }
-    fclose(fp);
-    return 0;
+    if (r) r->in_use = 1;
+    LeaveCriticalSection(&log_cs);
+    return r;
 }
 
-int authenticate(const char *u, const char *p) {
-    FILE *fp = fopen("users.txt", "r");
-    char user[50], pass[50];
-    if (!fp) return 0;
-    while (fscanf(fp, "%s %s", user, pass) != EOF) {
-        if (strcmp(user, u) == 0 && strcmp(pass, p) == 0) {
-            fclose(fp);
-            return 1;
-        }
+// Called when a thread that may have logged is about to exit. Anything
+// still queued in its ring is written by the next drain as usual.
+void log_thread_release() {
+    if (!log_my_ring) return;
+    EnterCriticalSection(&log_cs);
+    log_my_ring->in_use = 0;
+    LeaveCriticalSection(&log_cs);
+    log_my_ring = NULL;
+}
+
+void log_command(const char *user, const char *command) {
+    LogRing *r = log_my_ring;
+    if (!r) r = log_my_ring = log_ring_claim();
+    if (!r) {
+        __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    unsigned int head = r->head;
+    unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= LOG_RING_SIZE) {
+        __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+        return;
     }
+    LogEntry *e = &r->entries[head & (LOG_RING_SIZE - 1)];
+    e->when = time(NULL);
+    snprintf(e->text, sizeof(e->text), "%s : %s",
+             (user && strlen(user) > 0) ? user : "Unknown", command);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    // Wake the writer early rather than wait out the interval and drop.
+    if (head - tail + 1 == LOG_RING_SIZE / 2) WakeConditionVariable(&log_wake);
+}
+
+// Shifts server_log.txt -> .1 -> .2 ... and starts a fresh file.
+FILE* log_rotate(FILE *fp) {
+    char from[64], to[64];
     fclose(fp);
-    return 0;
+    for (int i = LOG_KEEP; i > 0; i--) {
+        if (i > 1) sprintf(from, "server_log.txt.%d", i - 1);
+        else strcpy(from, "server_log.txt");
+        sprintf(to, "server_log.txt.%d", i);
+        remove(to);
+        rename(from, to);
+    }
+    return fopen("server_log.txt", "a");
 }
 
+// Copies every queued entry into 'batch'; returns the bytes used.
+long log_drain(char *batch, long cap) {
+    static time_t stamp_for = 0;
+    static char stamp[32];
+    long len = 0;
 
-int change_password_file(const char *u, const char *old_p, const char *new_p) {
-    FILE *fp = fopen("users.txt", "r");
-    FILE *tmp = fopen("users_temp.txt", "w");
-    char user[50], pass[50];
-    int found = 0;
+    EnterCriticalSection(&log_cs);
+    for (LogRing *r = log_rings; r; r = r->next) {
+        unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned int tail = r->tail;
+        while (tail != head && cap - len > LOG_ENTRY_MAX + 40) {
+            LogEntry *e = &r->entries[tail & (LOG_RING_SIZE - 1)];
+            if (e->when != stamp_for) {
+                char *t = ctime(&e->when);
+                snprintf(stamp, sizeof(stamp), "%s", t ? t : "?");
+                stamp[strcspn(stamp, "\n")] = '\0';
+                stamp_for = e->when;
+            }
+            len += sprintf(batch + len, "[%s] %s\n", stamp, e->text);
+            tail++;
+            log_written++;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+    LeaveCriticalSection(&log_cs);
+    return len;
+}
+
+#ifdef _WIN32
+DWORD WINAPI log_writer(LPVOID arg) {
+#else
+void* log_writer(void *arg) {
+#endif
+    (void)arg;
+    char *batch = (char*)malloc(LOG_BATCH);
+    FILE *fp = fopen("server_log.txt", "a");
+    long size = 0, reported = 0;
+    struct stat st;
+    if (stat("server_log.txt", &st) == 0) size = (long)st.st_size;
 
-    if (!fp || !tmp) return 0;
+    while (batch) {
+        EnterCriticalSection(&log_cs);
+        SleepConditionVariableCS(&log_wake, &log_cs, g_cfg.log_flush_ms);
+        LeaveCriticalSection(&log_cs);
 
-    while (fscanf(fp, "%s %s", user, pass) != EOF) {
-        if (strcmp(user, u) == 0 && strcmp(pass, old_p) == 0) {
-            fprintf(tmp, "%s %s\n", user, new_p);
-            found = 1;
-        } else {
-            fprintf(tmp, "%s %s\n", user, pass);
+        long len;
+        while ((len = log_drain(batch, LOG_BATCH)) > 0) {
+            if (!fp) fp = fopen("server_log.txt", "a");
+            if (!fp) continue; // entries are lost, but the rings keep moving
+            fwrite(batch, 1, len, fp);
+            size += len;
+        }
+        long dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+        if (dropped != reported && fp) {
+            time_t now = time(NULL);
+            char *t = ctime(&now);
+            if (t) t[strlen(t) - 1] = '\0';
+            size += fprintf(fp, "[%s] Server : %ld log entries dropped (ring full)\n", t, dropped - reported);
+            printf("[LOG] %ld entries dropped so far\n", dropped);
+            reported = dropped;
+        }
+        if (fp) fflush(fp);
+        if (fp && g_cfg.log_max_bytes > 0 && size >= g_cfg.log_max_bytes) {
+            fp = log_rotate(fp);
+            size = 0;
         }
     }
-    
-    fclose(fp);
-    fclose(tmp);
+    return 0;
+}
 
-    if (found) {
-        remove("users.txt");
-        rename("users_temp.txt", "users.txt");
-        return 1;
-    } else {
-        remove("users_temp.txt");
-        return 0;
-    }
+void log_init() {
+    InitializeCriticalSection(&log_cs);
+    InitializeConditionVariable(&log_wake);
+#ifdef _WIN32
+    HANDLE h = CreateThread(NULL, 0, log_writer, NULL, 0, NULL);
+    if (h) CloseHandle(h);
+#else
+    pthread_t t;
+    if (pthread_create(&t, NULL, log_writer, NULL) == 0) pthread_detach(t);
+#endif
 }
 
-void log_command(const char *user, const char *command) {
-    FILE *fp = fopen("server_log.txt", "a");
-    time_t now = time(NULL);
-    char *t = ctime(&now);
-    if(t) t[strlen(t) - 1] = '\0'; // remove newline
-    
-    if (user && strlen(user) > 0)
-        fprintf(fp, "[%s] %s : %s\n", t, user, command);
-    else
-        fprintf(fp, "[%s] Unknown : %s\n", t, command);
-    
-    fclose(fp);
+/* ---------- LOCK WAIT QUEUES ---------- */
+/*
+ * Requests that cannot be granted right away queue on the lock and sleep on
+ * its condition variable instead of polling. Whoever releases the lock
+ * grants it to the front of the queue (all leading readers at once, or one
+ * writer) and wakes them. Queue order is arrival order; with
+ * --lock-policy writer a new writer is queued ahead of waiting readers.
+ * Wait times go into a log2 histogram that LOCKSTATS prints.
+ */
+#define WAIT_BUCKETS 16     // <1ms, <2ms, <4ms, ... , >=16s
+
+typedef struct {
+    long read_waits[WAIT_BUCKETS];  // updated with relaxed atomics, no lock
+    long write_waits[WAIT_BUCKETS];
+    long write_timeouts;
+    long write_denied;      // refused without waiting
+} LockStats;
+
+LockStats lock_stats;
+
+void lock_stats_init() {
+    memset(&lock_stats, 0, sizeof(lock_stats));
 }
 
-/* ---------- FILE LOCKING SYSTEM ---------- */
-CRITICAL_SECTION file_locks_cs;
+void lock_stats_record(int is_writer, double waited_ms) {
+    int b = 0;
+    while (b < WAIT_BUCKETS - 1 && waited_ms >= (double)(1 << b)) b++;
+    __atomic_add_fetch(is_writer ? &lock_stats.write_waits[b] : &lock_stats.read_waits[b], 1, __ATOMIC_RELAXED);
+}
 
-typedef struct FileLock {
-    char filepath[512];
-    int readers;
-    int writers;
-    SOCKET owner_socket; // Valid if writers > 0
-    struct FileLock *next;
-} FileLock;
+long lock_stats_waits(const long *buckets) {
+    long total = 0;
+    for (int b = 0; b < WAIT_BUCKETS; b++) total += __atomic_load_n(&buckets[b], __ATOMIC_RELAXED);
+    return total;
+}
 
-FileLock *head_lock = NULL;
+// Writes the contention report for LOCKSTATS into out (BUF * 2 bytes).
+void lock_stats_format(char *out) {
+    int len = sprintf(out, "Lock wait times (queued requests only)\n%-10s %10s %10s\n", "wait", "readers", "writers");
+    for (int b = 0; b < WAIT_BUCKETS; b++) {
+        long r = __atomic_load_n(&lock_stats.read_waits[b], __ATOMIC_RELAXED);
+        long w = __atomic_load_n(&lock_stats.write_waits[b], __ATOMIC_RELAXED);
+        if (r == 0 && w == 0) continue;
+        char label[20];
+        if (b == WAIT_BUCKETS - 1) sprintf(label, ">=%dms", 1 << (b - 1));
+        else sprintf(label, "<%dms", 1 << b);
+        len += sprintf(out + len, "%-10s %10ld %10ld\n", label, r, w);
+    }
+    sprintf(out + len, "Writer timeouts: %ld\nWriter denied: %ld\n",
+            __atomic_load_n(&lock_stats.write_timeouts, __ATOMIC_RELAXED),
+            __atomic_load_n(&lock_stats.write_denied, __ATOMIC_RELAXED));
+}
 
-FileLock* get_file_lock(const char *path) {
-    EnterCriticalSection(&file_locks_cs);
-    FileLock *curr = head_lock;
-    while(curr) {
-        if(strcmp(curr->filepath, path) == 0) {
-            LeaveCriticalSection(&file_locks_cs);
-            return curr;
+// Hands the lock to the front of the queue. Caller holds the shard lock.
+void lock_grant_waiters(FileLock *l) {
+    int woke = 0;
+    while (l->waiters) {
+        LockWaiter *w = l->waiters;
+        if (w->is_writer) {
+            if (l->readers > 0 || l->writers > 0) break;
+            l->writers = 1;
+            l->owner_socket = w->sock;
+        } else {
+            if (l->writers > 0) break;
+            l->readers++;
         }
-        curr = curr->next;
+        w->granted = 1;
+        l->waiters = w->next;
+        woke = 1;
+        if (w->is_writer) break;
+    }
+    if (woke) WakeAllConditionVariable(&l->cond);
+}
+
+void lock_enqueue(FileLock *l, LockWaiter *w) {
+    LockWaiter **pos = &l->waiters;
+    if (w->is_writer && g_cfg.lock_policy == LOCK_POLICY_WRITER) {
+        // Writer preference: go ahead of every waiting reader
+        while (*pos && (*pos)->is_writer) pos = &(*pos)->next;
+    } else {
+        while (*pos) pos = &(*pos)->next;
     }
-    FileLock *new_lock = (FileLock*)malloc(sizeof(FileLock));
-    strcpy(new_lock->filepath, path);
-    new_lock->readers = 0;
-    new_lock->writers = 0;
-    new_lock->owner_socket = INVALID_SOCKET;
-    new_lock->next = head_lock;
-    head_lock = new_lock;
-    LeaveCriticalSection(&file_locks_cs);
-    return new_lock;
+    w->next = *pos;
+    *pos = w;
+}
+
+void lock_dequeue(FileLock *l, LockWaiter *w) {
+    LockWaiter **pos = &l->waiters;
+    while (*pos && *pos != w) pos = &(*pos)->next;
+    if (*pos) *pos = w->next;
 }
 
 // Releases all locks held by a specific client (on disconnect)
 void release_all_locks_for_client(SOCKET c) {
-    EnterCriticalSection(&file_locks_cs);
-    FileLock *curr = head_lock;
-    while(curr) {
-        if(curr->writers > 0 && curr->owner_socket == c) {
-            curr->writers = 0;
-            curr->owner_socket = INVALID_SOCKET;
-            printf("[DEBUG] Auto-released lock for %s on disconnect\n", curr->filepath);
+    for (int k = 0; k < LOCK_SHARDS; k++) {
+        LockShard *sh = &lock_shards[k];
+        EnterCriticalSection(&sh->cs);
+        int i = 0;
+        while (i < sh->cap) {
+            FileLock *curr = sh->slots[i];
+            if (curr && curr->writers > 0 && curr->owner_socket == c) {
+                curr->writers = 0;
+                curr->owner_socket = INVALID_SOCKET;
+                printf("[DEBUG] Auto-released lock for %s on disconnect\n", curr->filepath);
+                lock_grant_waiters(curr);
+                if (curr->refs == 0 && curr->readers == 0 && curr->writers == 0) {
+                    shard_reclaim(sh, curr);
+                    continue; // slot i now holds a shifted entry (or nothing)
+                }
+            }
+            i++;
         }
-        curr = curr->next;
+        LeaveCriticalSection(&sh->cs);
     }
-    LeaveCriticalSection(&file_locks_cs);
 }
 
-// Tries to acquire lock. Returns 1 if successful, 0 if denied.
-// If already locked by 'c', returns 1.
-int try_acquire_write_lock(FileLock *l, SOCKET c) {
+// Acquires the write lock for 'c', queueing for up to wait_ms if it is busy
+// (0 = answer immediately). Returns 1 if granted (or already owned by 'c').
+int acquire_write_lock(FileLock *l, SOCKET c, int wait_ms) {
     int result = 0;
-    EnterCriticalSection(&file_locks_cs);
+    LockShard *sh = &lock_shards[l->shard];
+    EnterCriticalSection(&sh->cs);
     
     if (l->writers > 0 && l->owner_socket == c) {
         result = 1; // Already owned
     }
-    else if (l->writers == 0 && l->readers == 0) {
+    else if (l->writers == 0 && l->readers == 0 && !l->waiters) {
         l->writers = 1;
         l->owner_socket = c;
         result = 1;
     }
+    else if (wait_ms > 0) {
+        LockWaiter w = { 1, c, 0, NULL };
+        double start = now_ms();
+        lock_enqueue(l, &w);
+        worker_block_begin();
+        while (!w.granted) {
+            double left = wait_ms - (now_ms() - start);
+            if (left <= 0) break;
+            SleepConditionVariableCS(&l->cond, &sh->cs, (DWORD)left + 1);
+        }
+        worker_block_end();
+        if (!w.granted) {
+            lock_dequeue(l, &w);
+            lock_grant_waiters(l); // readers queued behind us may go now
+        }
+        result = w.granted;
+        lock_stats_record(1, now_ms() - start);
+    }
     
-    LeaveCriticalSection(&file_locks_cs);
+    LeaveCriticalSection(&sh->cs);
+
+    if (!result) {
+        __atomic_add_fetch(wait_ms > 0 ? &lock_stats.write_timeouts : &lock_stats.write_denied, 1, __ATOMIC_RELAXED);
+    }
     return result;
 }
 
 void release_write_lock(FileLock *l, SOCKET c) {
-    EnterCriticalSection(&file_locks_cs);
+    LockShard *sh = &lock_shards[l->shard];
+    EnterCriticalSection(&sh->cs);
     if (l->writers > 0 && l->owner_socket == c) {
         l->writers = 0;
         l->owner_socket = INVALID_SOCKET;
+        lock_grant_waiters(l);
     }
-    LeaveCriticalSection(&file_locks_cs);
+    LeaveCriticalSection(&sh->cs);
 }
 
-void acquire_read_lock(FileLock *l, SOCKET c) {
-    int notified = 0;
-    while(1) {
-        EnterCriticalSection(&file_locks_cs);
-        if (l->writers == 0) {
-            l->readers++;
-            int r_count = l->readers;
-            LeaveCriticalSection(&file_locks_cs);
-            
-            if (r_count > 1) {
-                char *msg = "Server: Multiple readers permitted. No writer active.\n";
-                send(c, msg, strlen(msg), 0);
-            } else {
-                char *msg = "Server: READ_LOCK_GRANTED. You may read now.\n";
-                send(c, msg, strlen(msg), 0);
-            }
-            break;
-        }
-        LeaveCriticalSection(&file_locks_cs);
+// Blocks (without polling) until no writer holds or is queued ahead of us.
+// 's' is told about the wait; internal readers (COPY) pass NULL.
+void acquire_read_lock(FileLock *l, Session *s) {
+    LockShard *sh = &lock_shards[l->shard];
+    int r_count;
+    EnterCriticalSection(&sh->cs);
+    if (l->writers == 0 && !l->waiters) {
+        l->readers++;
+        r_count = l->readers;
+        LeaveCriticalSection(&sh->cs);
+    } else {
+        LockWaiter w = { 0, INVALID_SOCKET, 0, NULL };
+        double start = now_ms();
+        lock_enqueue(l, &w);
+        LeaveCriticalSection(&sh->cs);
+
+        char *msg = "Server: File is being modified. Your read request is queued.\n";
+        if (s) session_send(s, msg, strlen(msg));
+
+        worker_block_begin();
+        EnterCriticalSection(&sh->cs);
+        while (!w.granted)
+            SleepConditionVariableCS(&l->cond, &sh->cs, INFINITE);
+        r_count = l->readers;
+        LeaveCriticalSection(&sh->cs);
+        worker_block_end();
+        lock_stats_record(0, now_ms() - start);
+    }
+
+    if (!s) {
+        return;
+    } else if (r_count > 1) {
+        char *msg = "Server: Multiple readers permitted. No writer active.\n";
+        session_send(s, msg, strlen(msg));
+    } else {
+        char *msg = "Server: READ_LOCK_GRANTED. You may read now.\n";
+        session_send(s, msg, strlen(msg));
+    }
+}
 
-        if (!notified) {
-            char *msg = "Server: File is being modified. Your read request is queued.\n";
-            send(c, msg, strlen(msg), 0);
-            notified = 1;
+// Read access for COPY's source on behalf of 'c'. Returns 1 with a read
+// lock taken, 2 if 'c' itself holds the write lock (which already covers
+// reading; nothing to release), or 0 if a writer kept it for wait_ms
+// (0 = answer immediately).
+int acquire_copy_read_lock(FileLock *l, SOCKET c, int wait_ms) {
+    LockShard *sh = &lock_shards[l->shard];
+    int result = 0;
+    EnterCriticalSection(&sh->cs);
+    if (l->writers > 0 && l->owner_socket == c) {
+        result = 2;
+    } else if (l->writers == 0 && !l->waiters) {
+        l->readers++;
+        result = 1;
+    } else if (wait_ms > 0) {
+        LockWaiter w = { 0, c, 0, NULL };
+        double start = now_ms();
+        lock_enqueue(l, &w);
+        worker_block_begin();
+        while (!w.granted) {
+            double left = wait_ms - (now_ms() - start);
+            if (left <= 0) break;
+            SleepConditionVariableCS(&l->cond, &sh->cs, (DWORD)left + 1);
         }
-        Sleep(200);
+        worker_block_end();
+        if (!w.granted) lock_dequeue(l, &w);
+        result = w.granted;
+        lock_stats_record(0, now_ms() - start);
     }
+    LeaveCriticalSection(&sh->cs);
+    return result;
 }
 
 void release_read_lock(FileLock *l, SOCKET c) {
-    EnterCriticalSection(&file_locks_cs);
+    LockShard *sh = &lock_shards[l->shard];
+    (void)c;
+    EnterCriticalSection(&sh->cs);
     l->readers--;
-    LeaveCriticalSection(&file_locks_cs);
+    if (l->readers == 0) lock_grant_waiters(l);
+    LeaveCriticalSection(&sh->cs);
     // No specific release message requested for READ, but we can be silent or redundant.
 }
 
-/* ---------- CLIENT SESSION ---------- */
-/* ---------- SHARED FOLDERS SYSTEM ---------- */
-#define MAX_SHARES 100
+/* ---------- METRICS ---------- */
+/*
+ * Counters behind STATS and the --metrics-port endpoint. Recording never
+ * takes a lock: each thread adds (relaxed atomics) into one of
+ * METRIC_SHARDS copies, picked round robin the first time it records, so
+ * hot commands do not all hit the same cache lines; readers sum the shards.
+ * Latencies go into the log-linear histograms of fscore.c. Counters are
+ * long long: long is 32 bits on Windows and byte counts pass 2 GB quickly.
+ */
+#define METRIC_SHARDS 8
+#define METRICS_REPORT (64 * 1024)   // STATS / scrape text, ample for every command
+
+// Everything else is counted as OTHER (the last entry).
+const char *metric_commands[] = {
+    "LS", "LSR", "STAT", "READ", "WRITE", "UPLOAD", "DOWNLOAD", "PUT", "GET",
+    "DELETE", "MOVE", "COPY", "MKDIR", "RMDIR", "TOUCH", "PUTFILE",
+    "LOGIN", "LOGOUT", "REGISTER", "CHPASS", "ATTACH", "SESSION_TOKEN",
+    "SHARE", "SHARED_WITH_ME", "LOCK_FILE", "UNLOCK_FILE",
+    "UPLOAD_BEGIN", "UPLOAD_CHUNK", "UPLOAD_END", "UPLOAD_STATUS",
+    "DELTA_SIG", "DELTA_UPLOAD", "BATCH", "PROTO",
+    "STATS", "LOCKSTATS", "CACHESTATS", "OTHER"
+};
+#define METRIC_COMMANDS 38
 
 typedef struct {
-    char owner[50];
-    char folder_name[50];
-    char shared_with[50];
-    char permission[10]; // "READ", "WRITE", "READ_WRITE"
-} SharedFolder;
-
-SharedFolder shared_table[MAX_SHARES];
-int shared_count = 0;
-
-void load_shares() {
-    FILE *fp = fopen("shared_folders.txt", "r");
-    if (!fp) return;
-    shared_count = 0;
-    while (fscanf(fp, "%s %s %s %s", 
-           shared_table[shared_count].owner,
-           shared_table[shared_count].folder_name,
-           shared_table[shared_count].shared_with,
-           shared_table[shared_count].permission) != EOF) {
-        shared_count++;
-        if (shared_count >= MAX_SHARES) break;
-    }
-    fclose(fp);
+    long long count, sum_us, max_us;
+    long long hist[HIST_BUCKETS];
+} CommandMetrics;
+
+typedef struct {
+    CommandMetrics cmd[METRIC_COMMANDS];
+    long long bytes_in, bytes_out;
+} MetricShard;
+
+MetricShard *metric_shards;
+THREAD_LOCAL MetricShard *metric_my_shard = NULL;
+int metric_next_shard = 0;
+long sessions_active = 0, sessions_total = 0;
+time_t metrics_started;
+
+// Microseconds from a monotonic clock.
+double now_us() {
+#ifdef _WIN32
+    LARGE_INTEGER f, t;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart * 1e6 / (double)f.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+#endif
 }
 
-void save_share(const char *owner, const char *folder, const char *target, const char *perm) {
-    FILE *fp = fopen("shared_folders.txt", "a");
-    fprintf(fp, "%s %s %s %s\n", owner, folder, target, perm);
-    fclose(fp);
-    
-    // Update in-memory
-    if (shared_count < MAX_SHARES) {
-        strcpy(shared_table[shared_count].owner, owner);
-        strcpy(shared_table[shared_count].folder_name, folder);
-        strcpy(shared_table[shared_count].shared_with, target);
-        strcpy(shared_table[shared_count].permission, perm);
-        shared_count++;
+MetricShard* metric_shard() {
+    if (!metric_my_shard) {
+        int i = __atomic_fetch_add(&metric_next_shard, 1, __ATOMIC_RELAXED);
+        metric_my_shard = &metric_shards[i % METRIC_SHARDS];
     }
+    return metric_my_shard;
 }
 
-/* RECURSIVE LISTING (LSR) */
-void list_recursive(const char *base_path, const char *rel_path, const char *display_prefix, char *buffer, int *buf_len) {
-    char full_path[512];
-    struct dirent *entry;
-    DIR *dp;
+int metric_index(const char *cmd) {
+    for (int i = 0; i < METRIC_COMMANDS - 1; i++)
+        if (strcmp(cmd, metric_commands[i]) == 0) return i;
+    return METRIC_COMMANDS - 1;
+}
+
+// Records one command that started at now_us() == start.
+void metrics_command(const char *cmd, double start) {
+    long long us = (long long)(now_us() - start);
+    CommandMetrics *m = &metric_shard()->cmd[metric_index(cmd)];
+    __atomic_add_fetch(&m->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->sum_us, us, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->hist[hist_bucket(us)], 1, __ATOMIC_RELAXED);
+    long long max = __atomic_load_n(&m->max_us, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&m->max_us, &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
 
-    if (strlen(rel_path) == 0) sprintf(full_path, "%s", base_path);
-    else sprintf(full_path, "%s/%s", base_path, rel_path);
+void metrics_bytes(long long in, long long out) {
+    MetricShard *sh = metric_shard();
+    if (in > 0) __atomic_add_fetch(&sh->bytes_in, in, __ATOMIC_RELAXED);
+    if (out > 0) __atomic_add_fetch(&sh->bytes_out, out, __ATOMIC_RELAXED);
+}
 
-    dp = opendir(full_path);
-    if (dp == NULL) return;
+// recv() that counts what arrives.
+int recv_counted(SOCKET c, char *buf, int len) {
+    int n = recv(c, buf, len, 0);
+    if (n > 0) metrics_bytes(n, 0);
+    return n;
+}
 
-    while ((entry = readdir(dp))) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
+void metrics_session(int opened) {
+    if (opened) __atomic_add_fetch(&sessions_total, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sessions_active, opened ? 1 : -1, __ATOMIC_RELAXED);
+}
 
-        char new_rel_path[512];
-        if (strlen(rel_path) == 0) sprintf(new_rel_path, "%s", entry->d_name);
-        else sprintf(new_rel_path, "%s/%s", rel_path, entry->d_name);
+// Adds up one command over all shards.
+void metrics_sum(int i, CommandMetrics *out) {
+    memset(out, 0, sizeof(*out));
+    for (int k = 0; k < METRIC_SHARDS; k++) {
+        CommandMetrics *m = &metric_shards[k].cmd[i];
+        out->count += __atomic_load_n(&m->count, __ATOMIC_RELAXED);
+        out->sum_us += __atomic_load_n(&m->sum_us, __ATOMIC_RELAXED);
+        long long max = __atomic_load_n(&m->max_us, __ATOMIC_RELAXED);
+        if (max > out->max_us) out->max_us = max;
+        for (int b = 0; b < HIST_BUCKETS; b++) out->hist[b] += __atomic_load_n(&m->hist[b], __ATOMIC_RELAXED);
+    }
+}
 
-        struct stat st;
-        char stat_path[512];
-        sprintf(stat_path, "%s/%s", full_path, entry->d_name);
-        stat(stat_path, &st);
-
-        // Check if directory
-        if (S_ISDIR(st.st_mode)) {
-            // Append Directory Header with Display Prefix
-            char line[200];
-            if (strlen(display_prefix) > 0)
-                sprintf(line, "\n%s/%s/:\n", display_prefix, new_rel_path);
-            else
-                sprintf(line, "\n%s/:\n", new_rel_path);
+long long metrics_percentile(const CommandMetrics *m, double p) {
+    return hist_percentile(m->hist, m->count, m->max_us, p);
+}
 
-            if (*buf_len + strlen(line) < BUF-100) {
-                strcat(buffer, line);
-                *buf_len += strlen(line);
-            }
-            // Recurse
-            list_recursive(base_path, new_rel_path, display_prefix, buffer, buf_len);
-        } else {
-            // Check Lock
-            char line[200];
-            FileLock *l = get_file_lock(stat_path);
-            /* Check if strictly locked for writing */
-            char lock_status[30] = "";
-            EnterCriticalSection(&file_locks_cs);
-            if (l->writers > 0) strcpy(lock_status, " (LOCKED)");
-            LeaveCriticalSection(&file_locks_cs);
-
-            sprintf(line, "  |-- %s%s\n", entry->d_name, lock_status);
-            
-            if (*buf_len + strlen(line) < BUF-50) {
-                strcat(buffer, line);
-                *buf_len += strlen(line);
-            }
-        }
+void metrics_totals(long long *in, long long *out) {
+    *in = *out = 0;
+    for (int k = 0; k < METRIC_SHARDS; k++) {
+        *in += __atomic_load_n(&metric_shards[k].bytes_in, __ATOMIC_RELAXED);
+        *out += __atomic_load_n(&metric_shards[k].bytes_out, __ATOMIC_RELAXED);
     }
-    closedir(dp);
 }
 
-/* 
- * resolve_path:
- * Resolves input_path to a physical path on disk.
- * Handles:
- * 1. Local files: "storage/<current_user>/<input_path>"
- * 2. Shared files (legacy implicit): "storage/<owner>/<input_path>"
- * 3. Shared files (explicit): "SHARED/<owner>/<path>"
- */
-int resolve_path(const char *current_user, const char *input_path, char *final_path, const char *required_perm) {
-    // 1. Check for explicit "SHARED/" prefix
-    if (strncmp(input_path, "SHARED/", 7) == 0) {
-         char temp[256];
-         strcpy(temp, input_path + 7); // Strip "SHARED/"
-         
-         // Format: user1/folder/file...
-         char owner[50], remainder[200];
-         char *slash = strchr(temp, '/');
-         if (!slash) return 0; // Invalid format
-         
-         int len = slash - temp;
-         strncpy(owner, temp, len);
-         owner[len] = '\0';
-         strcpy(remainder, slash + 1);
-         
-         // remainder is now folder/file...
-         // We need to match folder name against shared_table
-         char folder[50], subpath[200] = "";
-         slash = strchr(remainder, '/');
-         if (slash) {
-             len = slash - remainder;
-             strncpy(folder, remainder, len);
-             folder[len] = '\0';
-             strcpy(subpath, slash + 1);
-         } else {
-             strcpy(folder, remainder);
-         }
-         
-         // Check permissions in table
-         for (int k = 0; k < shared_count; k++) {
-             if (strcmp(shared_table[k].owner, owner) == 0 &&
-                 strcmp(shared_table[k].folder_name, folder) == 0 &&
-                 strcmp(shared_table[k].shared_with, current_user) == 0) {
-                 
-                 // Check perm
-                 int has_write = (strstr(shared_table[k].permission, "WRITE") != NULL);
-                 int is_write_req = (strcmp(required_perm, "WRITE") == 0);
-                 if (is_write_req && !has_write) return 0;
-                 
-                 // Build Path
-                 if (strlen(subpath) > 0)
-                     sprintf(final_path, "storage/%s/%s/%s", owner, folder, subpath);
-                 else
-                     sprintf(final_path, "storage/%s/%s", owner, folder);
-                 return 1;
-             }
-         }
-         return 0; // Not found in shares
+// The STATS report: totals, then one line per command seen (METRICS_REPORT bytes).
+void metrics_format(char *out) {
+    long long in, sent;
+    CommandMetrics m;
+    metrics_totals(&in, &sent);
+    int len = sprintf(out, "Uptime: %ld s\nSessions: %ld active, %ld total\nBytes: %lld in, %lld out\n"
+                      "Lock waits: %ld read, %ld write; writer timeouts %ld, denied %ld\n",
+                      (long)(time(NULL) - metrics_started),
+                      __atomic_load_n(&sessions_active, __ATOMIC_RELAXED),
+                      __atomic_load_n(&sessions_total, __ATOMIC_RELAXED), in, sent,
+                      lock_stats_waits(lock_stats.read_waits), lock_stats_waits(lock_stats.write_waits),
+                      __atomic_load_n(&lock_stats.write_timeouts, __ATOMIC_RELAXED),
+                      __atomic_load_n(&lock_stats.write_denied, __ATOMIC_RELAXED));
+    len += sprintf(out + len, "%-16s %10s %10s %10s %10s %10s %10s\n",
+                   "command", "count", "mean_us", "p50_us", "p99_us", "p99.9_us", "max_us");
+    for (int i = 0; i < METRIC_COMMANDS; i++) {
+        metrics_sum(i, &m);
+        if (m.count == 0) continue;
+        len += sprintf(out + len, "%-16s %10lld %10lld %10lld %10lld %10lld %10lld\n", metric_commands[i], m.count,
+                       m.sum_us / m.count, metrics_percentile(&m, 0.50), metrics_percentile(&m, 0.99),
+                       metrics_percentile(&m, 0.999), m.max_us);
     }
+}
 
-    // 2. Original Logic (Implicit Shared or Local)
-    char first_component[100];
-    char remainder[256] = "";
-    
-    int i = 0;
-    while(input_path[i] != '/' && input_path[i] != '\0' && i < 99) {
-        first_component[i] = input_path[i];
-        i++;
-    }
-    first_component[i] = '\0';
-    if (input_path[i] == '/') strcpy(remainder, input_path + i + 1);
-
-    // Check shared table (legacy implicit support)
-    for (int k = 0; k < shared_count; k++) {
-        if (strcmp(shared_table[k].shared_with, current_user) == 0 &&
-            strcmp(shared_table[k].folder_name, first_component) == 0) {
-            
-            int has_write = (strstr(shared_table[k].permission, "WRITE") != NULL);
-            int is_write_req = (strcmp(required_perm, "WRITE") == 0);
-            if (is_write_req && !has_write) return 0;
+// The same numbers in Prometheus text format (METRICS_REPORT bytes).
+void metrics_prometheus(char *out) {
+    const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    long long in, sent;
+    CommandMetrics m;
+    metrics_totals(&in, &sent);
+    int len = sprintf(out,
+        "# TYPE remotefs_uptime_seconds gauge\nremotefs_uptime_seconds %ld\n"
+        "# TYPE remotefs_sessions_active gauge\nremotefs_sessions_active %ld\n"
+        "# TYPE remotefs_sessions_total counter\nremotefs_sessions_total %ld\n"
+        "# TYPE remotefs_received_bytes_total counter\nremotefs_received_bytes_total %lld\n"
+        "# TYPE remotefs_sent_bytes_total counter\nremotefs_sent_bytes_total %lld\n"
+        "# TYPE remotefs_lock_waits_total counter\n"
+        "remotefs_lock_waits_total{mode=\"read\"} %ld\nremotefs_lock_waits_total{mode=\"write\"} %ld\n"
+        "# TYPE remotefs_lock_denied_total counter\n"
+        "remotefs_lock_denied_total{reason=\"timeout\"} %ld\nremotefs_lock_denied_total{reason=\"busy\"} %ld\n"
+        "# TYPE remotefs_command_duration_seconds summary\n",
+        (long)(time(NULL) - metrics_started),
+        __atomic_load_n(&sessions_active, __ATOMIC_RELAXED),
+        __atomic_load_n(&sessions_total, __ATOMIC_RELAXED), in, sent,
+        lock_stats_waits(lock_stats.read_waits), lock_stats_waits(lock_stats.write_waits),
+        __atomic_load_n(&lock_stats.write_timeouts, __ATOMIC_RELAXED),
+        __atomic_load_n(&lock_stats.write_denied, __ATOMIC_RELAXED));
+    for (int i = 0; i < METRIC_COMMANDS; i++) {
+        metrics_sum(i, &m);
+        if (m.count == 0) continue;
+        const char *name = metric_commands[i];
+        for (int q = 0; q < 4; q++)
+            len += sprintf(out + len, "remotefs_command_duration_seconds{command=\"%s\",quantile=\"%g\"} %.6f\n",
+                           name, quantiles[q], metrics_percentile(&m, quantiles[q]) / 1e6);
+        len += sprintf(out + len, "remotefs_command_duration_seconds_sum{command=\"%s\"} %.6f\n"
+                       "remotefs_command_duration_seconds_count{command=\"%s\"} %lld\n",
+                       name, m.sum_us / 1e6, name, m.count);
+    }
+}
 
-            if (strlen(remainder) > 0)
-                sprintf(final_path, "storage/%s/%s/%s", shared_table[k].owner, first_component, remainder);
-            else
-                sprintf(final_path, "storage/%s/%s", shared_table[k].owner, first_component);
-            return 1;
+// Answers every request on the metrics port with the Prometheus report.
+// Only 127.0.0.1 is bound: the numbers are for the local operator.
+#ifdef _WIN32
+DWORD WINAPI metrics_http_thread(LPVOID arg) {
+#else
+void* metrics_http_thread(void *arg) {
+#endif
+    SOCKET server = (SOCKET)(size_t)arg;
+    char *body = (char*)malloc(METRICS_REPORT);
+    char req[2048];
+    while (body) {
+        SOCKET c = accept(server, NULL, NULL);
+        if (c == INVALID_SOCKET) continue;
+#ifdef _WIN32
+        DWORD timeout = 2000;
+#else
+        struct timeval timeout = { 2, 0 };
+#endif
+        setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+        int len = 0, n;
+        while (len < (int)sizeof(req) - 1 && (n = recv(c, req + len, sizeof(req) - 1 - len, 0)) > 0) {
+            len += n;
+            req[len] = '\0';
+            if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
         }
+        req[len] = '\0';
+        const char *reply = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        if (strncmp(req, "GET /metrics ", 13) == 0 || strncmp(req, "GET / ", 6) == 0) {
+            int at = sprintf(body, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+            metrics_prometheus(body + at);
+            reply = body;
+        }
+        // Not send_all(): scrapes are not client traffic.
+        for (long left = (long)strlen(reply); left > 0 && (n = send(c, reply, (int)left, 0)) > 0; left -= n) reply += n;
+        closesocket(c);
+    }
+    return 0;
+}
+
+void metrics_init() {
+    metrics_started = time(NULL);
+    metric_shards = (MetricShard*)calloc(METRIC_SHARDS, sizeof(MetricShard));
+    if (!metric_shards) {
+        printf("Metrics allocation failed\n");
+        exit(1);
     }
+    if (g_cfg.metrics_port <= 0) return;
 
-    sprintf(final_path, "storage/%s/%s", current_user, input_path);
-    return 1;
+    struct sockaddr_in addr;
+    int yes = 1;
+    SOCKET server = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_cfg.metrics_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+    if (server == INVALID_SOCKET || bind(server, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(server, 16) != 0) {
+        printf("Metrics endpoint: cannot listen on 127.0.0.1:%d\n", g_cfg.metrics_port);
+        if (server != INVALID_SOCKET) closesocket(server);
+        return;
+    }
+#ifdef _WIN32
+    HANDLE h = CreateThread(NULL, 0, metrics_http_thread, (LPVOID)server, 0, NULL);
+    if (h) CloseHandle(h);
+#else
+    pthread_t t;
+    if (pthread_create(&t, NULL, metrics_http_thread, (void*)(size_t)server) == 0) pthread_detach(t);
+#endif
+    printf("Metrics on http://127.0.0.1:%d/metrics\n", g_cfg.metrics_port);
 }
 
-/* ---------- CLIENT SESSION ---------- */
-void handle_client(SOCKET c) {
-    char buf[BUF];
-    char cmd[20], a1[256], a2[256], a3[20];
-    char current_user[50] = "";
-    char path1[512], path2[512];
+/* ---------- METADATA CACHE ---------- */
+/*
+ * Caches stat() results and sorted directory listings by path for STAT,
+ * LS and LSR. On Linux every directory with cached data under it has an
+ * inotify watch, so changes made outside the server invalidate the cache;
+ * the server's own handlers also invalidate synchronously so a client
+ * always sees its own changes. Builds without inotify fall back to a
+ * short expiry. Entries live on an LRU list trimmed to --meta-cache-mb.
+ *
+ * A lookup that misses reads the disk without holding the lock and only
+ * stores the result if nothing that could affect it was invalidated
+ * meanwhile: each key maps to one of META_EPOCH_SLOTS counters, bumped
+ * when that key or a child of it is invalidated, and meta.epoch is bumped
+ * by whole-subtree invalidations.
+ */
+#define META_STAT 0
+#define META_DIR 1
+#define META_BUCKETS 4096       // initial; doubles with the entry count
+#define META_TTL_MS 1000        // only without inotify
+#define META_EPOCH_SLOTS 1024
+
+typedef struct MetaEntry {
+    unsigned long long hash;
+    int kind;
+    int found;                  // META_STAT: stat() succeeded
     struct stat st;
-    
-    // Ensure shares are loaded (simple approach: reload every connection or on start)
-    // Ideally use a mutex, but for this lab valid enough.
-    load_shares(); 
+    WalkEntry *entries;         // META_DIR: sorted listing
+    int count;
+    long bytes;
+    double expires;
+    struct MetaEntry *hnext;    // bucket chain
+    struct MetaEntry *prev, *next;  // LRU, most recent first
+    char path[];
+} MetaEntry;
 
-    while (1) {
-        memset(buf, 0, BUF);
-        int r = recv(c, buf, BUF, 0);
-        if (r <= 0) {
-            release_all_locks_for_client(c);
-            break;
-        }
-        
-        printf("[DEBUG] Raw Received: '%s'\n", buf);
+typedef struct {
+    CRITICAL_SECTION cs;
+    MetaEntry **buckets;
+    int nbuckets, count;
+    MetaEntry lru;              // sentinel
+    long bytes;
+    unsigned long epoch;
+    unsigned long epochs[META_EPOCH_SLOTS];
+    long hits, misses, invalidations, evictions;
+    int inotify_fd;             // -1: no watches, use META_TTL_MS
+    char **watches;             // inotify wd -> directory
+    int watch_cap, watch_count;
+} MetaCache;
 
-        sscanf(buf, "%s", cmd);
+MetaCache meta;
 
-        /* LOGGING */
-        char log_buf[BUF];
-        strcpy(log_buf, buf);
-        log_buf[strcspn(log_buf, "\r\n")] = 0;
-        log_command(current_user, log_buf);
+// Copies 'in' dropping repeated and trailing slashes, so "storage/al/" and
+// "storage//al" share one key.
+void meta_key(const char *in, char *out, int size) {
+    int n = 0;
+    for (; *in && n < size - 1; in++) {
+        if (*in == '/' && (n == 0 ? 0 : out[n - 1] == '/')) continue;
+        out[n++] = *in;
+    }
+    while (n > 1 && out[n - 1] == '/') n--;
+    out[n] = '\0';
+}
 
-        /* LS */
-        if (strcmp(cmd, "LS") == 0) {
-            if (strlen(current_user) == 0) {
-                send(c, "Please login first\n", 19, 0);
-            } else {
-                WIN32_FIND_DATA fd;
-                HANDLE hFind;
-                char search_path[512], file_list[BUF];
-                
-                // 1. List Local Files
-                sprintf(search_path, "storage/%s/*", current_user);
-                memset(file_list, 0, BUF);
-                
-                hFind = FindFirstFile(search_path, &fd);
-                if (hFind != INVALID_HANDLE_VALUE) {
-                    do {
-                        if (strcmp(fd.cFileName, ".") != 0 && strcmp(fd.cFileName, "..") != 0) {
-                            if (strlen(file_list) + strlen(fd.cFileName) + 20 < BUF) {
-                                if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-                                    strcat(file_list, "[DIR] ");
-                                strcat(file_list, fd.cFileName);
-                                strcat(file_list, "\n");
-                            }
-                        }
-                    } while (FindNextFile(hFind, &fd));
-                    FindClose(hFind);
-                }
-                
-                // 2. Append Shared Folders
-                for(int k=0; k<shared_count; k++) {
-                     if(strcmp(shared_table[k].shared_with, current_user) == 0) {
-                         char line[100];
-                         sprintf(line, "[SHARED] %s (from %s)\n", shared_table[k].folder_name, shared_table[k].owner);
-                         if (strlen(file_list) + strlen(line) < BUF)
-                             strcat(file_list, line);
-                     }
-                }
-                
-                if (strlen(file_list) == 0) strcpy(file_list, "Empty directory\n");
-                send(c, file_list, strlen(file_list), 0);
-            }
-        }
+MetaEntry** meta_slot(const char *key, int kind, unsigned long long h) {
+    MetaEntry **pp = &meta.buckets[h & (meta.nbuckets - 1)];
+    while (*pp && ((*pp)->hash != h || (*pp)->kind != kind || strcmp((*pp)->path, key) != 0))
+        pp = &(*pp)->hnext;
+    return pp;
+}
 
-        /* LSR [path] */
-        else if (strcmp(cmd, "LSR") == 0) {
-             if (strlen(current_user) == 0) {
-                 send(c, "Please login first\n", 19, 0);
-             } else {
-                 char extra[256] = "";
-                 sscanf(buf, "%*s %s", extra);
-                 
-                 char base[512];
-                 int allowed = 1;
-                 char *ls_buf = malloc(BUF * 8); // Dynamic buffer
-
-                 if (!ls_buf) {
-                     send(c, "Server memory error\n", 20, 0);
-                     continue;
-                 }
-                 memset(ls_buf, 0, BUF * 8);
-                 int len = 0;
-                 char display_prefix[256] = "";
-
-                 if (strlen(extra) > 0) {
-                     // User specified a path
-                     if (strncmp(extra, "SHARED/", 7) == 0) {
-                         strcpy(display_prefix, extra);
-                     }
-                     
-                     if (!resolve_path(current_user, extra, base, "READ")) {
-                         sprintf(ls_buf, "Error: Access denied or path not found: %s\n", extra);
-                         allowed = 0;
-                     } else {
-                         sprintf(ls_buf, " Listing for %s:\n", extra);
-                         struct stat s;
-                         if(stat(base, &s)==0 && !S_ISDIR(s.st_mode)) {
-                             strcat(ls_buf, " (Is a file)\n");
-                             allowed = 0; 
-                         }
-                     }
-                 } else {
-                     // Default: Local root
-                     sprintf(base, "storage/%s", current_user);
-                     strcat(ls_buf, " Directory tree for user:\n");
-                 }
-                 len = strlen(ls_buf);
-
-                 if (allowed) {
-                     list_recursive(base, "", display_prefix, ls_buf, &len);
-                     
-                     // If Root listing (no extra), append Shared Headers
-                     if (strlen(extra) == 0) {
-                         if (len + 100 < BUF*8) strcat(ls_buf, "\n [Shared Resources]:\n");
-                         
-                         for(int k=0; k<shared_count; k++) {
-                             if(strcmp(shared_table[k].shared_with, current_user) == 0) {
-                                 char shared_disp[200];
-                                 sprintf(shared_disp, "SHARED/%s/%s", shared_table[k].owner, shared_table[k].folder_name);
-                                 
-                                 char phys_path[512];
-                                 sprintf(phys_path, "storage/%s/%s", shared_table[k].owner, shared_table[k].folder_name);
-                                 
-                                 struct stat s;
-                                 if(stat(phys_path, &s)==0) {
-                                     if (S_ISDIR(s.st_mode)) {
-                                         // Print Header using display path
-                                         char line[300];
-                                         sprintf(line, "\n%s/:\n", shared_disp);
-                                         if((len + strlen(line)) < BUF*8) { 
-                                             strcat(ls_buf, line); 
-                                             len += strlen(line);
-                                         }
-                                         
-                                         // Recurse
-                                         list_recursive(phys_path, "", shared_disp, ls_buf, &len);
-                                     } else {
-                                         // File
-                                         char line[300];
-                                         sprintf(line, " |- %s (Shared File)\n", shared_disp);
-                                         if((len + strlen(line)) < BUF*8) { 
-                                             strcat(ls_buf, line); 
-                                             len += strlen(line);
-                                         }
-                                     }
-                                 }
-                             }
-                         }
-                     }
-                     
-                     if (len == strlen(" Directory tree for user:\n") && strlen(extra)==0) 
-                         strcat(ls_buf, " (Empty)\n");
-                 }
-                 
-                 send(c, ls_buf, strlen(ls_buf), 0);
-                 free(ls_buf);
-             }
-        }
+void meta_free(MetaEntry *e) {
+    for (int i = 0; i < e->count; i++) free(e->entries[i].name);
+    free(e->entries);
+    free(e);
+}
 
-        /* REGISTER */
-        else if (strcmp(cmd, "REGISTER") == 0) {
-            sscanf(buf, "%*s %s %s", a1, a2);
-            if (user_exists(a1)) {
-                send(c, "User already exists\n", 21, 0);
-            } else {
-                FILE *fp = fopen("users.txt", "a");
-                fprintf(fp, "%s %s\n", a1, a2);
-                fclose(fp);
+// Unlinks and frees the entry at *pp. Caller holds meta.cs.
+void meta_drop(MetaEntry **pp) {
+    MetaEntry *e = *pp;
+    *pp = e->hnext;
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    meta.bytes -= e->bytes;
+    meta.count--;
+    meta_free(e);
+}
 
-                _mkdir("storage");
-                sprintf(path1, "storage/%s", a1);
-                _mkdir(path1);
+void meta_drop_key(const char *key, int kind) {
+    unsigned long long h = path_hash(key) + kind;
+    MetaEntry **pp = meta_slot(key, kind, h);
+    if (*pp) meta_drop(pp);
+}
 
-                send(c, "Registration successful\n", 24, 0);
-            }
+// Drops 'path' itself, its parent directory, and with 'tree' everything
+// below it. Caller holds meta.cs.
+void meta_invalidate_locked(const char *path, int tree) {
+    char key[1024], parent[1024];
+    meta_key(path, key, sizeof(key));
+    meta.invalidations++;
+    meta.epochs[path_hash(key) & (META_EPOCH_SLOTS - 1)]++;
+    meta_drop_key(key, META_STAT);
+    meta_drop_key(key, META_DIR);
+    strcpy(parent, key);
+    char *slash = strrchr(parent, '/');
+    if (slash) {
+        *slash = '\0';
+        meta.epochs[path_hash(parent) & (META_EPOCH_SLOTS - 1)]++;
+        meta_drop_key(parent, META_STAT);
+        meta_drop_key(parent, META_DIR);
+    }
+    if (!tree) return;
+    meta.epoch++;
+    int len = strlen(key);
+    for (int b = 0; b < meta.nbuckets; b++) {
+        MetaEntry **pp = &meta.buckets[b];
+        while (*pp) {
+            if (strncmp((*pp)->path, key, len) == 0 && (*pp)->path[len] == '/') meta_drop(pp);
+            else pp = &(*pp)->hnext;
         }
+    }
+}
 
-        /* LOGIN */
-        else if (strcmp(cmd, "LOGIN") == 0) {
-            sscanf(buf, "%*s %s %s", a1, a2);
-            if (authenticate(a1, a2)) {
-                strcpy(current_user, a1);
-                send(c, "Login successful\n", 18, 0);
-            } else {
-                send(c, "Invalid credentials\n", 20, 0);
-            }
-        }
-        
-        /* LOGOUT */
-        else if (strcmp(cmd, "LOGOUT") == 0) {
-            current_user[0] = '\0';
-            send(c, "Logged out\n", 11, 0);
-        }
+// For command handlers after they change 'path'; also drops any cached
+// contents. Use meta_invalidate_tree when a whole directory may have moved
+// or vanished.
+void meta_invalidate(const char *path) {
+    content_invalidate(path, 0);
+    if (g_cfg.meta_cache_bytes <= 0) return;
+    EnterCriticalSection(&meta.cs);
+    meta_invalidate_locked(path, 0);
+    LeaveCriticalSection(&meta.cs);
+}
 
-        /* BLOCK IF NOT LOGGED IN (Except Auth) */
-        else if (strlen(current_user) == 0) {
-            send(c, "Please login first\n", 19, 0);
-        }
+void meta_invalidate_tree(const char *path) {
+    content_invalidate(path, 1);
+    if (g_cfg.meta_cache_bytes <= 0) return;
+    EnterCriticalSection(&meta.cs);
+    meta_invalidate_locked(path, 1);
+    LeaveCriticalSection(&meta.cs);
+}
 
-        /* SHARE <folder> WITH <user> <perm> */
-        else if (strcmp(cmd, "SHARE") == 0) {
-            // Buf: SHARE docs WITH user2 READ
-            // sscanf format slightly tricky with "WITH"
-            char target[50], perm[20];
-            sscanf(buf, "%*s %s %*s %s %s", a1, target, perm); // a1=folder
-            
-            // Verify file/folder exists locally
-            sprintf(path1, "storage/%s/%s", current_user, a1);
-            struct stat st;
-            if (stat(path1, &st) != 0) {
-                send(c, "Error: File/Folder not found\n", 29, 0);
-            } else if (!user_exists(target)) {
-                send(c, "Error: Target user not found\n", 29, 0);
-            } else {
-                save_share(current_user, a1, target, perm);
-                send(c, "Shared successfully\n", 20, 0);
-            }
-        }
+void meta_flush_locked() {
+    for (int b = 0; b < meta.nbuckets; b++)
+        while (meta.buckets[b]) meta_drop(&meta.buckets[b]);
+    meta.epoch++;
+}
 
-        /* SHARED_WITH_ME */
-        else if (strcmp(cmd, "SHARED_WITH_ME") == 0) {
-            char list[BUF] = "Folders/Files shared with you:\n";
-            int found = 0;
-            for(int k=0; k<shared_count; k++) {
-                if(strcmp(shared_table[k].shared_with, current_user) == 0) {
-                    char line[200];
-                    sprintf(line, "- %s (Use Path: SHARED/%s/%s) [%s]\n", 
-                        shared_table[k].folder_name, shared_table[k].owner, shared_table[k].folder_name, shared_table[k].permission);
-                    if (strlen(list) + strlen(line) < BUF)
-                        strcat(list, line);
-                    found = 1;
-                }
-            }
-            if (!found) strcat(list, "(None)\n");
-            send(c, list, strlen(list), 0);
-        }
-        
-        /* MKDIR */
-        else if (strcmp(cmd, "MKDIR") == 0) {
-            sscanf(buf, "%*s %s", a1);
-            if (resolve_path(current_user, a1, path1, "WRITE")) {
-                _mkdir(path1);
-                send(c, "Directory created\n", 18, 0);
-            } else {
-                 send(c, "Access Denied (Write)\n", 22, 0);
-            }
-        }
+// Finds a live entry and marks it most recently used. Caller holds meta.cs.
+MetaEntry* meta_lookup(const char *key, int kind) {
+    MetaEntry **pp = meta_slot(key, kind, path_hash(key) + kind);
+    MetaEntry *e = *pp;
+    if (!e) return NULL;
+    if (meta.inotify_fd < 0 && now_ms() > e->expires) {
+        meta_drop(pp);
+        return NULL;
+    }
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->next = meta.lru.next;
+    e->prev = &meta.lru;
+    meta.lru.next->prev = e;
+    meta.lru.next = e;
+    return e;
+}
 
-        /* RMDIR */
-        else if (strcmp(cmd, "RMDIR") == 0) {
-            sscanf(buf, "%*s %s", a1);
-            if (resolve_path(current_user, a1, path1, "WRITE")) {
-                if (_rmdir(path1) == 0)
-                    send(c, "Directory removed\n", 18, 0);
-                else
-                    send(c, "Directory not empty or in use\n", 30, 0);
-            } else {
-                send(c, "Access Denied (Write)\n", 22, 0);
-            }
-        }
+// Both counters only grow, so the sum changes if either does. Never 0.
+unsigned long meta_token_locked(const char *key) {
+    return meta.epoch + meta.epochs[path_hash(key) & (META_EPOCH_SLOTS - 1)];
+}
 
-        /* TOUCH */
-        else if (strcmp(cmd, "TOUCH") == 0) {
-            sscanf(buf, "%*s %s", a1);
-            if (resolve_path(current_user, a1, path1, "WRITE")) {
-                FILE *fp = fopen(path1, "w");
-                if (!fp) send(c, "File creation failed\n", 21, 0);
-                else {
-                    fclose(fp);
-                    send(c, "Empty file created\n", 19, 0);
+// Inserts 'e' unless it may have gone stale since meta_begin() gave 'token'.
+void meta_store(MetaEntry *e, unsigned long token) {
+    EnterCriticalSection(&meta.cs);
+    if (meta_token_locked(e->path) != token || e->bytes > g_cfg.meta_cache_bytes / 4) {
+        LeaveCriticalSection(&meta.cs);
+        meta_free(e);
+        return;
+    }
+    MetaEntry **pp = meta_slot(e->path, e->kind, e->hash);
+    if (*pp) meta_drop(pp);
+
+    if (meta.count >= meta.nbuckets) {
+        int n = meta.nbuckets * 2;
+        MetaEntry **grown = (MetaEntry**)calloc(n, sizeof(MetaEntry*));
+        if (grown) {
+            for (int b = 0; b < meta.nbuckets; b++) {
+                while (meta.buckets[b]) {
+                    MetaEntry *m = meta.buckets[b];
+                    meta.buckets[b] = m->hnext;
+                    m->hnext = grown[m->hash & (n - 1)];
+                    grown[m->hash & (n - 1)] = m;
                 }
-            } else {
-                send(c, "Access Denied (Write)\n", 22, 0);
             }
+            free(meta.buckets);
+            meta.buckets = grown;
+            meta.nbuckets = n;
         }
+    }
+    pp = &meta.buckets[e->hash & (meta.nbuckets - 1)];
+    e->hnext = *pp;
+    *pp = e;
+    e->next = meta.lru.next;
+    e->prev = &meta.lru;
+    meta.lru.next->prev = e;
+    meta.lru.next = e;
+    meta.bytes += e->bytes;
+    meta.count++;
 
-        /* LOCK_FILE */
-        else if (strcmp(cmd, "LOCK_FILE") == 0) {
-            sscanf(buf, "%*s %s", a1);
-            if (resolve_path(current_user, a1, path1, "WRITE")) {
-                 FileLock *l = get_file_lock(path1);
-                 if (try_acquire_write_lock(l, c)) {
-                     send(c, "WRITE_LOCK_GRANTED\n", 19, 0);
-                 } else {
-                     send(c, "WRITE_LOCK_DENIED: File is currently locked by another user\n", 54, 0);
-                 }
-            } else {
-                 send(c, "Error: Access Denied or File Not Found\n", 37, 0);
-            }
-        }
+    while (meta.bytes > g_cfg.meta_cache_bytes && meta.lru.prev != &meta.lru) {
+        MetaEntry *old = meta.lru.prev;
+        meta_drop(meta_slot(old->path, old->kind, old->hash));
+        meta.evictions++;
+    }
+    LeaveCriticalSection(&meta.cs);
+}
 
-        /* UNLOCK_FILE */
-        else if (strcmp(cmd, "UNLOCK_FILE") == 0) {
-            sscanf(buf, "%*s %s", a1);
-            if (resolve_path(current_user, a1, path1, "WRITE")) {
-                 FileLock *l = get_file_lock(path1);
-                 release_write_lock(l, c);
-                 send(c, "FILE_UNLOCKED\n", 14, 0);
-            } else {
-                 send(c, "Error: Access Denied\n", 21, 0);
-            }
-        }
+MetaEntry* meta_new(const char *key, int kind) {
+    int len = strlen(key);
+    MetaEntry *e = (MetaEntry*)calloc(1, sizeof(MetaEntry) + len + 1);
+    if (!e) return NULL;
+    memcpy(e->path, key, len + 1);
+    e->kind = kind;
+    e->hash = path_hash(key) + kind;
+    e->bytes = sizeof(MetaEntry) + len + 1;
+    e->expires = now_ms() + META_TTL_MS;
+    return e;
+}
 
-        /* WRITE */
-        else if (strcmp(cmd, "WRITE") == 0) {
-            char data[512];
-            sscanf(buf, "%*s %s %[^\n]", a1, data);
-            
-            if (resolve_path(current_user, a1, path1, "WRITE")) {
-                FileLock *l = get_file_lock(path1);
-                
-                // Try acquire lock (if user doesn't already have it)
-                // In strict mode, user should have called LOCK_FILE first, 
-                // but we allow atomic write if free.
-                if (try_acquire_write_lock(l, c)) {
-                    FILE *fp = fopen(path1, "a");
-                    if (!fp)
-                        send(c, "File not found\n", 15, 0);
-                    else {
-                        fprintf(fp, "%s", data);
-                        fclose(fp);
-                        send(c, "WRITE_COMPLETED\n", 16, 0); // Prompt Requirement
-                    }
-                    // Prompt says: "The server must release the file lock immediately"
-                    release_write_lock(l, c);
-                } else {
-                     send(c, "ACCESS DENIED: File is currently locked by another user\n", 54, 0);
-                }
-            } else {
-                send(c, "Access Denied (Write)\n", 22, 0);
+// Makes sure changes inside 'dir' will invalidate the cache.
+int meta_watch(const char *dir) {
+#ifdef __linux__
+    if (meta.inotify_fd >= 0) {
+        int wd = inotify_add_watch(meta.inotify_fd, dir[0] ? dir : ".",
+            IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO |
+            IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        if (wd < 0) return 0;
+        EnterCriticalSection(&meta.cs);
+        if (wd >= meta.watch_cap) {
+            int cap = meta.watch_cap ? meta.watch_cap : 256;
+            while (cap <= wd) cap *= 2;
+            char **grown = (char**)realloc(meta.watches, cap * sizeof(char*));
+            if (!grown) {
+                LeaveCriticalSection(&meta.cs);
+                return 0;
             }
+            memset(grown + meta.watch_cap, 0, (cap - meta.watch_cap) * sizeof(char*));
+            meta.watches = grown;
+            meta.watch_cap = cap;
         }
-
-        /* READ */
-        else if (strcmp(cmd, "READ") == 0) {
-            sscanf(buf, "%*s %s", a1);
-            
-            if (resolve_path(current_user, a1, path1, "READ")) {
-                FileLock *l = get_file_lock(path1);
-                acquire_read_lock(l, c);
-                
-                FILE *fp = fopen(path1, "r");
-                if (!fp)
-                    send(c, "File not found\n", 15, 0);
+        if (!meta.watches[wd]) {
+            meta.watches[wd] = strdup(dir);
+            meta.watch_count++;
+        }
+        LeaveCriticalSection(&meta.cs);
+    }
+#endif
+    (void)dir;
+    return 1;
+}
+
+// Call before reading 'key' (inside 'dir') from disk. Returns the token
+// for meta_store(), or 0 if the result must not be cached.
+unsigned long meta_begin(const char *dir, const char *key) {
+    char k[1024];
+    if (g_cfg.meta_cache_bytes <= 0 || !meta_watch(dir)) return 0;
+    meta_key(key, k, sizeof(k));
+    EnterCriticalSection(&meta.cs);
+    unsigned long token = meta_token_locked(k);
+    LeaveCriticalSection(&meta.cs);
+    return token;
+}
+
+int meta_enabled() {
+    return g_cfg.meta_cache_bytes > 0;
+}
+
+int meta_stat(const char *path, struct stat *st) {
+    char key[1024], dir[1024];
+    if (!meta_enabled()) return fs_stat(path, st);
+    meta_key(path, key, sizeof(key));
+
+    EnterCriticalSection(&meta.cs);
+    MetaEntry *e = meta_lookup(key, META_STAT);
+    if (e) {
+        int found = e->found;
+        if (found) *st = e->st;
+        meta.hits++;
+        LeaveCriticalSection(&meta.cs);
+        return found ? 0 : -1;
+    }
+    meta.misses++;
+    LeaveCriticalSection(&meta.cs);
+
+    strcpy(dir, key);
+    char *slash = strrchr(dir, '/');
+    if (slash) *slash = '\0';
+    else strcpy(dir, ".");
+    unsigned long token = meta_begin(dir, key);
+
+    int rc = fs_stat(path, st);
+    if (token && rc == 0 && S_ISDIR(st->st_mode)) {
+        // A directory's own stat changes with its contents, which are
+        // reported on its own watch rather than its parent's.
+        if (!meta_watch(key)) token = 0;
+        else rc = fs_stat(path, st);
+    }
+    if (token && (e = meta_new(key, META_STAT))) {
+        e->found = rc == 0;
+        if (rc == 0) e->st = *st;
+        meta_store(e, token);
+    }
+    return rc;
+}
+
+// Copies a cached listing of 'dir' into *out; -1 on a miss.
+int meta_get_dir(const char *dir, WalkEntry **out) {
+    char key[1024];
+    if (!meta_enabled()) return -1;
+    meta_key(dir, key, sizeof(key));
+    EnterCriticalSection(&meta.cs);
+    MetaEntry *e = meta_lookup(key, META_DIR);
+    if (!e) {
+        meta.misses++;
+        LeaveCriticalSection(&meta.cs);
+        return -1;
+    }
+    WalkEntry *list = (WalkEntry*)malloc((e->count + 1) * sizeof(WalkEntry));
+    int n = 0;
+    for (int i = 0; list && i < e->count; i++) {
+        list[n].name = strdup(e->entries[i].name);
+        list[n].is_dir = e->entries[i].is_dir;
+        if (list[n].name) n++;
+    }
+    meta.hits++;
+    LeaveCriticalSection(&meta.cs);
+    if (!list) return -1;
+    *out = list;
+    return n;
+}
+
+// Caches a copy of a listing read after meta_begin(dir, dir) gave 'token'.
+void meta_put_dir(const char *dir, const WalkEntry *list, int n, unsigned long token) {
+    char key[1024];
+    if (!meta_enabled() || !token) return;
+    meta_key(dir, key, sizeof(key));
+    MetaEntry *e = meta_new(key, META_DIR);
+    if (!e) return;
+    e->entries = (WalkEntry*)malloc((n + 1) * sizeof(WalkEntry));
+    for (int i = 0; e->entries && i < n; i++) {
+        e->entries[e->count].name = strdup(list[i].name);
+        e->entries[e->count].is_dir = list[i].is_dir;
+        if (!e->entries[e->count].name) break;
+        e->bytes += sizeof(WalkEntry) + strlen(list[i].name) + 1;
+        e->count++;
+    }
+    if (!e->entries || e->count != n) {
+        meta_free(e);
+        return;
+    }
+    meta_store(e, token);
+}
+
+// Sorted listing of 'dir' through the cache; -1 if it can't be opened.
+int meta_list(const char *dir, WalkEntry **out) {
+    int n = meta_get_dir(dir, out);
+    if (n >= 0) return n;
+    unsigned long token = meta_begin(dir, dir);
+    DIR *dp = opendir(dir);
+    if (!dp) return -1;
+    n = dir_read_sorted(dp, dir, out);
+    closedir(dp);
+    if (!*out) return -1;
+    meta_put_dir(dir, *out, n, token);
+    return n;
+}
+
+// The tree walker reads listings through this cache.
+const WalkCache meta_walk_cache = { meta_get_dir, meta_begin, meta_put_dir };
+
+#ifdef __linux__
+void* meta_inotify_thread(void *arg) {
+    (void)arg;
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[1024];
+    while (1) {
+        long len = read(meta.inotify_fd, buf, sizeof(buf));
+        if (len <= 0) {
+            if (len < 0 && errno == EINTR) continue;
+            break;
+        }
+        EnterCriticalSection(&meta.cs);
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                meta_flush_locked();
+                continue;
+            }
+            if (ev->wd < 0 || ev->wd >= meta.watch_cap || !meta.watches[ev->wd]) continue;
+            char *dir = meta.watches[ev->wd];
+            if (ev->mask & IN_IGNORED) {
+                meta_invalidate_locked(dir, 1);
+                free(dir);
+                meta.watches[ev->wd] = NULL;
+                meta.watch_count--;
+                continue;
+            }
+            if (ev->len > 0 && ev->name[0]) {
+                snprintf(path, sizeof(path), "%s/%s", dir, ev->name);
+                meta_invalidate_locked(path, (ev->mask & IN_ISDIR) != 0);
+            } else {
+                meta_invalidate_locked(dir, (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) != 0);
+            }
+        }
+        LeaveCriticalSection(&meta.cs);
+    }
+    // The watch fd failed: stop trusting the cache.
+    EnterCriticalSection(&meta.cs);
+    meta_flush_locked();
+    g_cfg.meta_cache_bytes = 0;
+    LeaveCriticalSection(&meta.cs);
+    return NULL;
+}
+#endif
+
+void meta_init() {
+    InitializeCriticalSection(&meta.cs);
+    meta.lru.next = meta.lru.prev = &meta.lru;
+    meta.nbuckets = META_BUCKETS;
+    meta.buckets = (MetaEntry**)calloc(meta.nbuckets, sizeof(MetaEntry*));
+    meta.epoch = 1; // tokens are never 0, which means "don't cache"
+    meta.inotify_fd = -1;
+    if (!meta.buckets) g_cfg.meta_cache_bytes = 0;
+    if (!meta_enabled()) return;
+#ifdef __linux__
+    meta.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (meta.inotify_fd >= 0) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, meta_inotify_thread, NULL) == 0) {
+            pthread_detach(t);
+        } else {
+            close(meta.inotify_fd);
+            meta.inotify_fd = -1;
+        }
+    }
+#endif
+    if (meta.inotify_fd < 0)
+        printf("Metadata cache: no inotify, entries expire after %d ms\n", META_TTL_MS);
+}
+
+void meta_stats_format(char *out) {
+    EnterCriticalSection(&meta.cs);
+    long lookups = meta.hits + meta.misses;
+    sprintf(out, "Metadata cache: %s\n"
+                 "  Entries: %d (%ld KB of %ld KB)\n"
+                 "  Hits: %ld  Misses: %ld  Hit rate: %.1f%%\n"
+                 "  Invalidations: %ld  Evictions: %ld  Watches: %d\n",
+            meta_enabled() ? (meta.inotify_fd >= 0 ? "on (inotify)" : "on (expiry)") : "off",
+            meta.count, meta.bytes / 1024, g_cfg.meta_cache_bytes / 1024,
+            meta.hits, meta.misses, lookups ? 100.0 * meta.hits / lookups : 0.0,
+            meta.invalidations, meta.evictions, meta.watch_count);
+    LeaveCriticalSection(&meta.cs);
+}
+
+/* RECURSIVE LISTING (LSR) */
+/*
+ * LSR [path] [LIMIT n] [AFTER cursor]
+ *
+ * The tree is walked in sorted order and streamed out in LSR_CHUNK pieces,
+ * so server memory is bounded by the largest single directory, not by the
+ * tree. Every line (directory header, file, share root) has a cursor:
+ * "L/<rel>" inside the listed tree, "S/" for the shared-resources heading
+ * and "S/<owner>/<folder>[/<rel>]" inside a share. With LIMIT the reply
+ * ends in "NEXT <cursor>" (send it back with AFTER) or "END".
+ */
+#define LSR_CHUNK (16 * 1024)
+#define LSR_MAX_LIMIT 100000
+#define LSR_FRAME_PAGE 5000  // binary replies are one frame, so always page
+
+typedef struct {
+    Session *s;
+    char *buf;
+    long len, cap;
+    long limit;          // entries left on this page, -1 = no limit
+    long entries;
+    int full;            // another entry was pending when the page filled
+    char cursor[1024];   // cursor of the last emitted entry
+} LsrOut;
+
+void lsr_flush(LsrOut *o) {
+    if (o->len > 0) session_send(o->s, o->buf, o->len);
+    o->len = 0;
+}
+
+void lsr_append(LsrOut *o, const char *text) {
+    long n = strlen(text);
+    if (o->len + n > o->cap) {
+        long cap = o->cap ? o->cap : LSR_CHUNK;
+        while (cap < o->len + n) cap *= 2;
+        char *grown = realloc(o->buf, cap);
+        if (!grown) return;
+        o->buf = grown;
+        o->cap = cap;
+    }
+    memcpy(o->buf + o->len, text, n);
+    o->len += n;
+    if (o->len >= LSR_CHUNK) lsr_flush(o);
+}
+
+// Emits one listing entry; returns 0 once the page is full.
+int lsr_emit(LsrOut *o, const char *line, const char *cursor_a, const char *cursor_b) {
+    if (o->full) return 0;
+    if (o->limit == 0) {
+        o->full = 1;
+        return 0;
+    }
+    lsr_append(o, line);
+    snprintf(o->cursor, sizeof(o->cursor), "%s%s", cursor_a, cursor_b);
+    if (o->limit > 0) o->limit--;
+    o->entries++;
+    return 1;
+}
+
+/*
+ * Lists one walked directory. 'prefix' is the display prefix for directory
+ * headers and 'section' is prepended to paths for cursors. 'resume' is the
+ * part of the cursor below this directory (NULL = list everything).
+ */
+void lsr_walk_node(LsrOut *o, WalkNode *n, const char *prefix, const char *section, const char *resume) {
+    char child[1024], line[1200], path[1600];
+    tree_walk_wait(n);
+
+    char first[256] = "";
+    const char *rest = NULL;
+    if (resume) {
+        const char *slash = strchr(resume, '/');
+        int len = slash ? (int)(slash - resume) : (int)strlen(resume);
+        if (len >= (int)sizeof(first)) len = sizeof(first) - 1;
+        memcpy(first, resume, len);
+        first[len] = '\0';
+        rest = slash ? slash + 1 : NULL;
+    }
+
+    for (int i = 0; i < n->count && !o->full; i++) {
+        WalkEntry *e = &n->entries[i];
+        WalkNode *sub = n->children ? n->children[i] : NULL;
+        if (n->rel[0]) snprintf(child, sizeof(child), "%s/%s", n->rel, e->name);
+        else snprintf(child, sizeof(child), "%s", e->name);
+
+        int at_cursor = 0;
+        if (resume) {
+            int cmp = strcmp(e->name, first);
+            if (cmp < 0) continue;
+            resume = NULL;
+            at_cursor = cmp == 0;
+        }
+
+        if (at_cursor) {
+            // The cursor is this entry (already sent) or lies below it.
+            if (sub) lsr_walk_node(o, sub, prefix, section, rest);
+        } else if (e->is_dir) {
+            if (prefix[0]) snprintf(line, sizeof(line), "\n%s/%s/:\n", prefix, child);
+            else snprintf(line, sizeof(line), "\n%s/:\n", child);
+            if (lsr_emit(o, line, section, child) && sub)
+                lsr_walk_node(o, sub, prefix, section, NULL);
+        } else {
+            snprintf(path, sizeof(path), "%s/%s", n->walk->base, child);
+            snprintf(line, sizeof(line), "  |-- %s%s\n", e->name,
+                     file_is_write_locked(path) ? " (LOCKED)" : "");
+            lsr_emit(o, line, section, child);
+        }
+        // Done with this subtree: free it so memory follows the walk.
+        if (sub && !o->full) {
+            n->children[i] = NULL;
+            tree_walk_release(sub);
+        }
+    }
+}
+
+void lsr_walk(LsrOut *o, const char *base, const char *prefix, const char *section, const char *resume) {
+    WalkNode *root;
+    TreeWalk *w = tree_walk_start(base, resume, &root);
+    if (!w) return;
+    lsr_walk_node(o, root, prefix, section, resume);
+    tree_walk_end(w, root);
+}
+
+// "[Shared Resources]" part of a root LSR; 'resume' is the cursor after "S/".
+void lsr_shares(LsrOut *o, const char *user, const char *resume) {
+    char key[110], section[120], disp[120], phys[512], line[300];
+    struct stat st;
+    if (!resume && !lsr_emit(o, "\n [Shared Resources]:\n", "S/", "")) return;
+
+    ShareSnapshot *sn = share_pin();
+    for (int k = share_first_for(sn, user); k >= 0 && !o->full; k = sn->next_for_grantee[k]) {
+        SharedFolder *f = &sn->items[k];
+        snprintf(key, sizeof(key), "%s/%s", f->owner, f->folder_name);
+        snprintf(section, sizeof(section), "S/%s/", key);
+        snprintf(disp, sizeof(disp), "SHARED/%s", key);
+        snprintf(phys, sizeof(phys), "storage/%s", key);
+        const char *below = NULL;
+
+        if (resume && resume[0]) {
+            int n = strlen(key);
+            if (strncmp(resume, key, n) != 0 || (resume[n] != '\0' && resume[n] != '/'))
+                continue; // sent on an earlier page
+            below = resume[n] == '/' ? resume + n + 1 : NULL;
+            resume = NULL;
+        } else {
+            if (stat(phys, &st) != 0) continue;
+            if (S_ISDIR(st.st_mode)) snprintf(line, sizeof(line), "\n%s/:\n", disp);
+            else snprintf(line, sizeof(line), " |- %s (Shared File)\n", disp);
+            if (!lsr_emit(o, line, "S/", key)) break;
+        }
+        lsr_walk(o, phys, disp, section, below);
+    }
+    share_unpin();
+}
+
+// 'limit' is the page size to use when the client gives none (-1 = all).
+void lsr_command(Session *s, const char *user, long limit, char *buf) {
+    char extra[256] = "", base[512], display_prefix[256] = "", line[1100];
+    const char *cursor = NULL;
+    struct stat st;
+
+    // Arguments: [path] [LIMIT n] [AFTER cursor...]
+    char *p = buf + strcspn(buf, " \t\r\n");
+    char *end = p + strlen(p);
+    while (end > p && (end[-1] == '\r' || end[-1] == '\n')) *--end = '\0';
+    while (*p) {
+        char word[256];
+        p += strspn(p, " \t");
+        if (!*p) break;
+        int n = 0;
+        while (p[n] && p[n] != ' ' && p[n] != '\t') n++;
+        snprintf(word, sizeof(word), "%.*s", n, p);
+        p += n;
+        if (strcmp(word, "LIMIT") == 0) {
+            limit = strtol(p, &p, 10);
+            if (limit < 1) limit = 1;
+            if (limit > LSR_MAX_LIMIT) limit = LSR_MAX_LIMIT;
+        } else if (strcmp(word, "AFTER") == 0) {
+            cursor = p + strspn(p, " \t");
+            if (limit < 0) limit = LSR_MAX_LIMIT;
+            break;
+        } else if (!extra[0]) {
+            snprintf(extra, sizeof(extra), "%s", word);
+        }
+    }
+
+    LsrOut o;
+    memset(&o, 0, sizeof(o));
+    o.s = s;
+    o.limit = limit;
+
+    if (strlen(extra) > 0) {
+        // User specified a path
+        if (strncmp(extra, "SHARED/", 7) == 0) strcpy(display_prefix, extra);
+        if (!resolve_path(user, extra, base, "READ")) {
+            snprintf(line, sizeof(line), "Error: Access denied or path not found: %s\n", extra);
+            session_send(s, line, strlen(line));
+            return;
+        }
+        if (stat(base, &st) == 0 && !S_ISDIR(st.st_mode)) {
+            snprintf(line, sizeof(line), " Listing for %s:\n (Is a file)\n", extra);
+            session_send(s, line, strlen(line));
+            return;
+        }
+        if (!cursor) {
+            snprintf(line, sizeof(line), " Listing for %s:\n", extra);
+            lsr_append(&o, line);
+        }
+        if (!cursor || strncmp(cursor, "L/", 2) == 0)
+            lsr_walk(&o, base, display_prefix, "L/", cursor ? cursor + 2 : NULL);
+    } else {
+        // Default: Local root, then everything shared with the user
+        sprintf(base, "storage/%s", user);
+        if (!cursor) lsr_append(&o, " Directory tree for user:\n");
+        if (!cursor || strncmp(cursor, "L/", 2) == 0) {
+            lsr_walk(&o, base, "", "L/", cursor ? cursor + 2 : NULL);
+            if (!cursor && o.entries == 0) lsr_append(&o, " (Empty)\n");
+        }
+        if (!cursor || strncmp(cursor, "L/", 2) == 0) lsr_shares(&o, user, NULL);
+        else if (strncmp(cursor, "S/", 2) == 0) lsr_shares(&o, user, cursor + 2);
+    }
+
+    if (limit >= 0) {
+        if (o.full) snprintf(line, sizeof(line), "NEXT %s\n", o.cursor);
+        else strcpy(line, "END\n");
+        lsr_append(&o, line);
+    }
+    lsr_flush(&o);
+    free(o.buf);
+}
+
+/* ---------- FILE I/O BACKEND ---------- */
+/*
+ * The fs_* calls below are what the command handlers use for file and
+ * metadata operations. By default they are the ordinary blocking syscalls.
+ * With --io uring (Linux) they are turned into io_uring requests: callers
+ * queue requests, one I/O thread submits everything queued in a single
+ * io_uring_enter() and reaps completions in batches, so the requests of
+ * many sessions are in flight at once. Opcodes the running kernel does not
+ * support (probed at startup) quietly use the blocking call instead.
+ * No liburing: the ring is set up with the raw syscalls.
+ */
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/sysmacros.h>
+
+#define URING_ENTRIES 256
+#define URING_WAKE_TAG 0   // user_data of the eventfd read that wakes the I/O thread
+
+typedef struct IoReq {
+    struct io_uring_sqe sqe;    // prepared by the caller
+    int res;                    // cqe->res once done
+    int done;
+    struct IoReq *next;
+} IoReq;
+
+typedef struct {
+    int fd;
+    int wake_fd;                // eventfd: "new requests queued"
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned entries;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned char supported[IORING_OP_LAST];
+    IoReq *queue_head, *queue_tail;     // waiting to be submitted
+    int inflight;
+    CRITICAL_SECTION cs;
+    pthread_cond_t done_cond;
+} Uring;
+
+Uring ring;
+int uring_active = 0;
+
+int uring_setup_rings(Uring *u) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->fd < 0) return 0;
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_sz > sq_sz) sq_sz = cq_sz;
+        cq_sz = sq_sz;
+    }
+    char *sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) return 0;
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) return 0;
+    }
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) return 0;
+
+    u->sq_head = (unsigned*)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + p.sq_off.array);
+    u->cq_head = (unsigned*)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    u->entries = p.sq_entries;
+
+    // Ask the kernel which opcodes it actually implements.
+    size_t probe_sz = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_sz);
+    if (probe && syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        for (int i = 0; i < probe->ops_len && i < IORING_OP_LAST; i++)
+            if (probe->ops[i].flags & IO_URING_OP_SUPPORTED) u->supported[probe->ops[i].op] = 1;
+    }
+    free(probe);
+    return u->supported[IORING_OP_READ] && u->supported[IORING_OP_WRITE];
+}
+
+// Copies one request into the next SQ slot. Caller is the I/O thread.
+void uring_push_sqe(Uring *u, const struct io_uring_sqe *src, __u64 user_data) {
+    unsigned tail = *u->sq_tail;
+    unsigned idx = tail & *u->sq_mask;
+    u->sqes[idx] = *src;
+    u->sqes[idx].user_data = user_data;
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void* uring_thread(void *arg) {
+    Uring *u = (Uring*)arg;
+    unsigned long long wake_val;
+    struct io_uring_sqe wake;
+    int wake_armed = 0;
+
+    memset(&wake, 0, sizeof(wake));
+    wake.opcode = IORING_OP_READ;
+    wake.fd = u->wake_fd;
+    wake.addr = (__u64)(unsigned long)&wake_val;
+    wake.len = sizeof(wake_val);
+
+    while (1) {
+        unsigned to_submit = 0;
+        if (!wake_armed) {
+            uring_push_sqe(u, &wake, URING_WAKE_TAG);
+            wake_armed = 1;
+            to_submit++;
+        }
+
+        // Batch: everything queued since the last pass goes in one enter().
+        EnterCriticalSection(&u->cs);
+        while (u->queue_head && u->inflight < (int)u->entries - 1) {
+            IoReq *r = u->queue_head;
+            u->queue_head = r->next;
+            if (!u->queue_head) u->queue_tail = NULL;
+            uring_push_sqe(u, &r->sqe, (__u64)(unsigned long)r);
+            u->inflight++;
+            to_submit++;
+        }
+        LeaveCriticalSection(&u->cs);
+
+        int ret = (int)syscall(__NR_io_uring_enter, u->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            printf("io_uring_enter failed. Error: %d\n", errno);
+            Sleep(10);
+        }
+
+        // Reap every completion that is ready, then wake the waiters once.
+        int reaped = 0;
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        EnterCriticalSection(&u->cs);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            if (cqe->user_data == URING_WAKE_TAG) {
+                wake_armed = 0;
+            } else {
+                IoReq *r = (IoReq*)(unsigned long)cqe->user_data;
+                r->res = cqe->res;
+                r->done = 1;
+                u->inflight--;
+                reaped++;
+            }
+            head++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        if (reaped) pthread_cond_broadcast(&u->done_cond);
+        LeaveCriticalSection(&u->cs);
+    }
+    return NULL;
+}
+
+// Queues n prepared requests together and waits until all have completed.
+void uring_run(IoReq **reqs, int n) {
+    unsigned long long one = 1;
+    EnterCriticalSection(&ring.cs);
+    for (int i = 0; i < n; i++) {
+        reqs[i]->done = 0;
+        reqs[i]->next = NULL;
+        if (ring.queue_tail) ring.queue_tail->next = reqs[i];
+        else ring.queue_head = reqs[i];
+        ring.queue_tail = reqs[i];
+    }
+    LeaveCriticalSection(&ring.cs);
+    if (write(ring.wake_fd, &one, sizeof(one)) < 0) { /* counter saturated: already pending */ }
+
+    EnterCriticalSection(&ring.cs);
+    for (int i = 0; i < n; i++) {
+        while (!reqs[i]->done)
+            pthread_cond_wait(&ring.done_cond, &ring.cs);
+    }
+    LeaveCriticalSection(&ring.cs);
+}
+
+// Single request: run it and turn the result into the usual -1/errno form.
+// The caller sleeps until the I/O thread reaps it, so this costs two thread
+// hand-offs per call on top of the syscall; only batches via uring_run()
+// keep more than one operation of a session in flight.
+long uring_run_one(IoReq *r) {
+    IoReq *list[1] = { r };
+    uring_run(list, 1);
+    if (r->res < 0) {
+        errno = -r->res;
+        return -1;
+    }
+    return r->res;
+}
+
+void uring_prep(IoReq *r, int op, int fd, const void *addr, unsigned len, __u64 off) {
+    memset(r, 0, sizeof(*r));
+    r->sqe.opcode = op;
+    r->sqe.fd = fd;
+    r->sqe.addr = (__u64)(unsigned long)addr;
+    r->sqe.len = len;
+    r->sqe.off = off;
+}
+
+#define URING_CAN(op) (uring_active && ring.supported[op])
+
+int uring_init() {
+    memset(&ring, 0, sizeof(ring));
+    if (!uring_setup_rings(&ring)) return 0;
+    ring.wake_fd = eventfd(0, 0);
+    if (ring.wake_fd < 0) return 0;
+    InitializeCriticalSection(&ring.cs);
+    pthread_cond_init(&ring.done_cond, NULL);
+
+    pthread_t t;
+    if (pthread_create(&t, NULL, uring_thread, &ring) != 0) return 0;
+    pthread_detach(t);
+    uring_active = 1;
+    return 1;
+}
+#endif
+
+// Picks the backend requested with --io. Falls back to blocking I/O.
+void io_backend_init() {
+    if (!g_cfg.use_uring) return;
+#ifdef __linux__
+    if (uring_init()) {
+        printf("I/O backend: io_uring (%u entries)\n", ring.entries);
+        return;
+    }
+    printf("io_uring not available (error %d), using blocking I/O\n", errno);
+#else
+    printf("io_uring is only available on Linux, using blocking I/O\n");
+#endif
+    g_cfg.use_uring = 0;
+}
+
+int fs_open(const char *path, int flags, int mode) {
+#ifdef _WIN32
+    return _open(path, flags | O_BINARY, mode);
+#else
+#ifdef __linux__
+    if (URING_CAN(IORING_OP_OPENAT)) {
+        IoReq r;
+        uring_prep(&r, IORING_OP_OPENAT, AT_FDCWD, path, mode, 0);
+        r.sqe.open_flags = flags;
+        return (int)uring_run_one(&r);
+    }
+#endif
+    return open(path, flags, mode);
+#endif
+}
+
+int fs_close(int fd) {
+#ifdef _WIN32
+    return _close(fd);
+#else
+#ifdef __linux__
+    if (URING_CAN(IORING_OP_CLOSE)) {
+        IoReq r;
+        uring_prep(&r, IORING_OP_CLOSE, fd, NULL, 0, 0);
+        return (int)uring_run_one(&r);
+    }
+#endif
+    return close(fd);
+#endif
+}
+
+long fs_pread(int fd, void *data, long len, long offset) {
+#ifdef _WIN32
+    if (_lseeki64(fd, offset, SEEK_SET) < 0) return -1;
+    return _read(fd, data, (unsigned)len);
+#else
+#ifdef __linux__
+    if (URING_CAN(IORING_OP_READ)) {
+        IoReq r;
+        uring_prep(&r, IORING_OP_READ, fd, data, (unsigned)len, offset);
+        return uring_run_one(&r);
+    }
+#endif
+    return pread(fd, data, len, offset);
+#endif
+}
+
+// offset < 0 writes at the current position (what O_APPEND files want).
+long fs_pwrite(int fd, const void *data, long len, long offset) {
+#ifdef _WIN32
+    if (offset >= 0 && _lseeki64(fd, offset, SEEK_SET) < 0) return -1;
+    return _write(fd, data, (unsigned)len);
+#else
+#ifdef __linux__
+    if (URING_CAN(IORING_OP_WRITE)) {
+        IoReq r;
+        uring_prep(&r, IORING_OP_WRITE, fd, data, (unsigned)len, (__u64)(long long)offset);
+        return uring_run_one(&r);
+    }
+#endif
+    if (offset < 0) return write(fd, data, len);
+    return pwrite(fd, data, len, offset);
+#endif
+}
+
+int fs_stat(const char *path, struct stat *st) {
+#ifdef __linux__
+    if (URING_CAN(IORING_OP_STATX)) {
+        IoReq r;
+        struct statx sx;
+        uring_prep(&r, IORING_OP_STATX, AT_FDCWD, path, STATX_BASIC_STATS, (__u64)(unsigned long)&sx);
+        if (uring_run_one(&r) < 0) return -1;
+        memset(st, 0, sizeof(*st));
+        // Everything stat() fills, nanoseconds included: the content
+        // cache compares these against fstat() of the open file.
+        st->st_dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+        st->st_ino = sx.stx_ino;
+        st->st_mode = sx.stx_mode;
+        st->st_size = sx.stx_size;
+        st->st_nlink = sx.stx_nlink;
+        st->st_uid = sx.stx_uid;
+        st->st_gid = sx.stx_gid;
+        st->st_blocks = sx.stx_blocks;
+        st->st_blksize = sx.stx_blksize;
+        st->st_mtim.tv_sec = sx.stx_mtime.tv_sec;
+        st->st_mtim.tv_nsec = sx.stx_mtime.tv_nsec;
+        st->st_atim.tv_sec = sx.stx_atime.tv_sec;
+        st->st_atim.tv_nsec = sx.stx_atime.tv_nsec;
+        st->st_ctim.tv_sec = sx.stx_ctime.tv_sec;
+        st->st_ctim.tv_nsec = sx.stx_ctime.tv_nsec;
+        return 0;
+    }
+#endif
+    return stat(path, st);
+}
+
+int fs_rename(const char *from, const char *to) {
+#ifdef __linux__
+    if (URING_CAN(IORING_OP_RENAMEAT)) {
+        IoReq r;
+        uring_prep(&r, IORING_OP_RENAMEAT, AT_FDCWD, from, AT_FDCWD, (__u64)(unsigned long)to);
+        return (int)uring_run_one(&r);
+    }
+#endif
+    return rename(from, to);
+}
+
+int fs_unlink(const char *path) {
+#ifdef __linux__
+    if (URING_CAN(IORING_OP_UNLINKAT)) {
+        IoReq r;
+        uring_prep(&r, IORING_OP_UNLINKAT, AT_FDCWD, path, 0, 0);
+        return (int)uring_run_one(&r);
+    }
+#endif
+    return remove(path);
+}
+
+int fs_rmdir(const char *path) {
+#ifdef __linux__
+    if (URING_CAN(IORING_OP_UNLINKAT)) {
+        IoReq r;
+        uring_prep(&r, IORING_OP_UNLINKAT, AT_FDCWD, path, 0, 0);
+        r.sqe.unlink_flags = AT_REMOVEDIR;
+        return (int)uring_run_one(&r);
+    }
+#endif
+    return _rmdir(path);
+}
+
+int fs_mkdir(const char *path) {
+#ifdef __linux__
+    if (URING_CAN(IORING_OP_MKDIRAT)) {
+        IoReq r;
+        uring_prep(&r, IORING_OP_MKDIRAT, AT_FDCWD, path, 0755, 0);
+        return (int)uring_run_one(&r);
+    }
+#endif
+    return _mkdir(path);
+}
+
+// Copies src_fd to dst_fd through a userspace buffer. With io_uring,
+// several chunk reads are submitted as one batch, then the matching writes
+// as the next batch.
+#define COPY_CHUNK (128 * 1024)
+#define COPY_DEPTH 8
+
+int fs_copy_buffered(int src_fd, int dst_fd) {
+    char *bufs = malloc((size_t)COPY_CHUNK * COPY_DEPTH);
+    long offset = 0;
+    if (!bufs) return 0;
+#ifdef __linux__
+    if (URING_CAN(IORING_OP_READ)) {
+        IoReq reqs[COPY_DEPTH];
+        IoReq *list[COPY_DEPTH];
+        while (1) {
+            for (int i = 0; i < COPY_DEPTH; i++) {
+                uring_prep(&reqs[i], IORING_OP_READ, src_fd, bufs + (size_t)i * COPY_CHUNK, COPY_CHUNK,
+                           offset + (long)i * COPY_CHUNK);
+                list[i] = &reqs[i];
+            }
+            uring_run(list, COPY_DEPTH);
+
+            int n = 0, eof = 0;
+            long lens[COPY_DEPTH];
+            for (int i = 0; i < COPY_DEPTH && !eof; i++) {
+                if (reqs[i].res < 0) { free(bufs); return 0; }
+                lens[i] = reqs[i].res;
+                if (reqs[i].res < COPY_CHUNK) eof = 1;   // short read: end of file
+                if (lens[i] > 0) n = i + 1;
+            }
+            for (int i = 0; i < n; i++) {
+                uring_prep(&reqs[i], IORING_OP_WRITE, dst_fd, bufs + (size_t)i * COPY_CHUNK, (unsigned)lens[i],
+                           offset + (long)i * COPY_CHUNK);
+                list[i] = &reqs[i];
+            }
+            if (n > 0) uring_run(list, n);
+            for (int i = 0; i < n; i++) {
+                if (reqs[i].res != lens[i]) { free(bufs); return 0; }
+                offset += lens[i];
+            }
+            if (eof || n == 0) break;
+        }
+        free(bufs);
+        return 1;
+    }
+#endif
+    while (1) {
+        long n = fs_pread(src_fd, bufs, COPY_CHUNK, offset);
+        if (n < 0) { free(bufs); return 0; }
+        if (n == 0) break;
+        if (fs_pwrite(dst_fd, bufs, n, offset) != n) { free(bufs); return 0; }
+        offset += n;
+    }
+    free(bufs);
+    return 1;
+}
+
+// How fs_copy_fd() managed it; 0 is failure.
+#define COPY_FAILED 0
+#define COPY_REFLINK 1
+#define COPY_RANGE 2
+#define COPY_BUFFERED 3
+
+const char *copy_method_names[] = { "failed", "reflink", "copy_file_range", "buffered" };
+
+// Copies all of src_fd into the empty dst_fd the cheapest way available:
+// a reflink that shares the source's blocks (FICLONE, e.g. Btrfs/XFS),
+// then copy_file_range() so the data never passes through userspace, then
+// the buffered loop.
+int fs_copy_fd(int src_fd, int dst_fd) {
+#ifdef __linux__
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0) return COPY_REFLINK;
+    loff_t in = 0, out = 0;
+    while (1) {
+        ssize_t n = copy_file_range(src_fd, &in, dst_fd, &out, 1L << 30, 0);
+        if (n > 0) continue;
+        if (n == 0) return COPY_RANGE;
+        if (errno == EINTR) continue;
+        if (in == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                        errno == EOPNOTSUPP || errno == EBADF))
+            break;  // not possible between these files
+        return COPY_FAILED;
+    }
+#endif
+    return fs_copy_buffered(src_fd, dst_fd) ? COPY_BUFFERED : COPY_FAILED;
+}
+
+/* ---------- CONTENT CACHE ---------- */
+/*
+ * Keeps the bytes of small and medium files that READ, DOWNLOAD and GET
+ * frames serve, so a file everyone reads is loaded once instead of once
+ * per request. Buffers are reference counted: a session pins one, sends
+ * straight out of it and unpins it, and eviction only frees a buffer once
+ * the last sender lets go.
+ *
+ * Eviction is 2Q-style: a file enters on the probation list and moves to
+ * the protected list when it is read again, so a burst of one-off
+ * downloads only churns probation and cannot push out the files that are
+ * read all the time. Protected is held to 3/4 of --file-cache-mb.
+ *
+ * Handlers invalidate through meta_invalidate()/meta_invalidate_tree().
+ * Every hit is also checked against the file's current size, mtime and
+ * inode (via meta_stat, so it usually costs no syscall) which catches
+ * files changed outside the server. A miss reads the file without holding
+ * the lock and is stored only if no invalidation for that path happened
+ * meanwhile, using the same slot-epoch scheme as the metadata cache.
+ */
+#define CONTENT_BUCKETS 1024        // initial; doubles with the entry count
+#define CONTENT_EPOCH_SLOTS 1024
+#define CONTENT_PROBATION 0
+#define CONTENT_PROTECTED 1
+
+typedef struct ContentFile {
+    long refs;                  // the cache's own reference plus one per sender
+    unsigned long long hash;
+    int list;                   // CONTENT_PROBATION / CONTENT_PROTECTED, -1 once dropped
+    long long mtime_ns;
+    long long ino;
+    struct ContentFile *hnext;
+    struct ContentFile *prev, *next;
+    long size;
+    long bytes;                 // size plus bookkeeping, what the budget counts
+    char *data;
+    char path[];
+} ContentFile;
+
+typedef struct {
+    CRITICAL_SECTION cs;
+    ContentFile **buckets;
+    int nbuckets, count;
+    ContentFile lists[2];       // sentinels, most recent first
+    long list_bytes[2];
+    unsigned long epoch;
+    unsigned long epochs[CONTENT_EPOCH_SLOTS];
+    long hits, misses, stale, invalidations, evictions;
+    long long bytes_served;
+} ContentCache;
+
+ContentCache content;
+
+int content_enabled() {
+    return g_cfg.file_cache_bytes > 0;
+}
+
+// Largest file worth caching: one file must not wipe out the rest.
+long content_max_file() {
+    return g_cfg.file_cache_bytes / 16;
+}
+
+long long content_mtime_ns(const struct stat *st) {
+#ifdef __linux__
+    return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#else
+    return (long long)st->st_mtime * 1000000000LL;
+#endif
+}
+
+int content_matches(const ContentFile *f, const struct stat *st) {
+    return f->size == (long)st->st_size && f->mtime_ns == content_mtime_ns(st) &&
+           f->ino == (long long)st->st_ino;
+}
+
+void content_release(ContentFile *f) {
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(f->data);
+        free(f);
+    }
+}
+
+void content_unlink(ContentFile *f) {
+    f->prev->next = f->next;
+    f->next->prev = f->prev;
+    content.list_bytes[f->list] -= f->bytes;
+}
+
+void content_push(ContentFile *f, int list) {
+    f->list = list;
+    f->next = content.lists[list].next;
+    f->prev = &content.lists[list];
+    content.lists[list].next->prev = f;
+    content.lists[list].next = f;
+    content.list_bytes[list] += f->bytes;
+}
+
+ContentFile** content_slot(const char *key, unsigned long long h) {
+    ContentFile **pp = &content.buckets[h & (content.nbuckets - 1)];
+    while (*pp && ((*pp)->hash != h || strcmp((*pp)->path, key) != 0))
+        pp = &(*pp)->hnext;
+    return pp;
+}
+
+// Removes the entry at *pp and drops the cache's reference. Caller holds content.cs.
+void content_drop(ContentFile **pp) {
+    ContentFile *f = *pp;
+    *pp = f->hnext;
+    content_unlink(f);
+    f->list = -1;
+    content.count--;
+    content_release(f);
+}
+
+void content_drop_key(const char *key) {
+    ContentFile **pp = content_slot(key, path_hash(key));
+    if (*pp) content_drop(pp);
+}
+
+// Called by meta_invalidate()/meta_invalidate_tree() for every path a
+// handler changes.
+void content_invalidate(const char *path, int tree) {
+    char key[1024];
+    if (!content_enabled()) return;
+    meta_key(path, key, sizeof(key));
+    EnterCriticalSection(&content.cs);
+    content.invalidations++;
+    content.epochs[path_hash(key) & (CONTENT_EPOCH_SLOTS - 1)]++;
+    content_drop_key(key);
+    if (tree) {
+        content.epoch++;
+        int len = strlen(key);
+        for (int b = 0; b < content.nbuckets; b++) {
+            ContentFile **pp = &content.buckets[b];
+            while (*pp) {
+                if (strncmp((*pp)->path, key, len) == 0 && (*pp)->path[len] == '/') content_drop(pp);
+                else pp = &(*pp)->hnext;
+            }
+        }
+    }
+    LeaveCriticalSection(&content.cs);
+}
+
+unsigned long content_token_locked(const char *key) {
+    return content.epoch + content.epochs[path_hash(key) & (CONTENT_EPOCH_SLOTS - 1)];
+}
+
+void content_grow() {
+    int n = content.nbuckets * 2;
+    ContentFile **grown = (ContentFile**)calloc(n, sizeof(ContentFile*));
+    if (!grown) return;
+    for (int b = 0; b < content.nbuckets; b++) {
+        while (content.buckets[b]) {
+            ContentFile *f = content.buckets[b];
+            content.buckets[b] = f->hnext;
+            f->hnext = grown[f->hash & (n - 1)];
+            grown[f->hash & (n - 1)] = f;
+        }
+    }
+    free(content.buckets);
+    content.buckets = grown;
+    content.nbuckets = n;
+}
+
+// Inserts a freshly read file unless 'token' shows it may be stale.
+// Caller holds content.cs.
+void content_insert(ContentFile *f, unsigned long token) {
+    if (content_token_locked(f->path) != token) return;
+    ContentFile **pp = content_slot(f->path, f->hash);
+    if (*pp) content_drop(pp);
+    if (content.count >= content.nbuckets) content_grow();
+
+    pp = &content.buckets[f->hash & (content.nbuckets - 1)];
+    f->hnext = *pp;
+    *pp = f;
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+    content_push(f, CONTENT_PROBATION);
+    content.count++;
+
+    long budget = g_cfg.file_cache_bytes;
+    while (content.list_bytes[CONTENT_PROTECTED] > budget / 4 * 3) {
+        ContentFile *old = content.lists[CONTENT_PROTECTED].prev;
+        content_unlink(old);
+        content_push(old, CONTENT_PROBATION);
+    }
+    while (content.list_bytes[0] + content.list_bytes[1] > budget) {
+        int from = (content.lists[CONTENT_PROBATION].prev != &content.lists[CONTENT_PROBATION])
+                   ? CONTENT_PROBATION : CONTENT_PROTECTED;
+        ContentFile *old = content.lists[from].prev;
+        content_drop(content_slot(old->path, old->hash));
+        content.evictions++;
+    }
+}
+
+// Reads the whole file into a new, unshared ContentFile, or NULL if it
+// changed while being read or could not be read.
+ContentFile* content_load(const char *path, const char *key, const struct stat *st) {
+    int len = strlen(key);
+    ContentFile *f = (ContentFile*)calloc(1, sizeof(ContentFile) + len + 1);
+    if (!f) return NULL;
+    f->data = malloc(st->st_size > 0 ? (size_t)st->st_size : 1);
+    int fd = f->data ? fs_open(path, O_RDONLY, 0) : -1;
+    if (fd < 0) {
+        free(f->data);
+        free(f);
+        return NULL;
+    }
+    long got = 0;
+    while (got < (long)st->st_size) {
+        long n = fs_pread(fd, f->data + got, (long)st->st_size - got, got);
+        if (n <= 0) break;
+        got += n;
+    }
+    struct stat after;
+    int same = got == (long)st->st_size && fstat(fd, &after) == 0 &&
+               after.st_size == st->st_size && content_mtime_ns(&after) == content_mtime_ns(st);
+    fs_close(fd);
+    if (!same) {
+        free(f->data);
+        free(f);
+        return NULL;
+    }
+    memcpy(f->path, key, len + 1);
+    f->refs = 1;
+    f->hash = path_hash(key);
+    f->list = -1;
+    f->size = got;
+    f->mtime_ns = content_mtime_ns(st);
+    f->ino = (long long)st->st_ino;
+    f->bytes = got + sizeof(ContentFile) + len + 1;
+    return f;
+}
+
+// Returns the contents of the regular file 'path' pinned for sending, or
+// NULL if the cache is off, the file is too big or missing, or it could
+// not be read consistently; callers then fall back to reading it
+// themselves. Release the result with content_release().
+ContentFile* content_get(const char *path) {
+    char key[1024];
+    struct stat st;
+    if (!content_enabled()) return NULL;
+    if (meta_stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > content_max_file())
+        return NULL;
+    meta_key(path, key, sizeof(key));
+
+    EnterCriticalSection(&content.cs);
+    ContentFile **pp = content_slot(key, path_hash(key));
+    ContentFile *f = *pp;
+    if (f && !content_matches(f, &st)) {
+        content_drop(pp);
+        content.stale++;
+        f = NULL;
+    }
+    if (f) {
+        // A second hit promotes a file out of probation.
+        content_unlink(f);
+        content_push(f, CONTENT_PROTECTED);
+        __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+        content.hits++;
+        content.bytes_served += f->size;
+        LeaveCriticalSection(&content.cs);
+        return f;
+    }
+    content.misses++;
+    unsigned long token = content_token_locked(key);
+    LeaveCriticalSection(&content.cs);
+
+    f = content_load(path, key, &st);
+    if (!f) return NULL;
+    EnterCriticalSection(&content.cs);
+    content_insert(f, token);
+    LeaveCriticalSection(&content.cs);
+    return f;
+}
+
+void content_init() {
+    InitializeCriticalSection(&content.cs);
+    for (int i = 0; i < 2; i++) content.lists[i].next = content.lists[i].prev = &content.lists[i];
+    content.nbuckets = CONTENT_BUCKETS;
+    content.buckets = (ContentFile**)calloc(content.nbuckets, sizeof(ContentFile*));
+    if (!content.buckets) g_cfg.file_cache_bytes = 0;
+}
+
+void content_stats_format(char *out) {
+    EnterCriticalSection(&content.cs);
+    long lookups = content.hits + content.misses;
+    sprintf(out, "File cache: %s\n"
+                 "  Files: %d (%ld KB of %ld KB, %ld KB protected)\n"
+                 "  Hits: %ld  Misses: %ld  Hit rate: %.1f%%  Stale: %ld\n"
+                 "  Invalidations: %ld  Evictions: %ld  Served from cache: %lld KB\n",
+            content_enabled() ? "on" : "off",
+            content.count, (content.list_bytes[0] + content.list_bytes[1]) / 1024,
+            g_cfg.file_cache_bytes / 1024, content.list_bytes[CONTENT_PROTECTED] / 1024,
+            content.hits, content.misses, lookups ? 100.0 * content.hits / lookups : 0.0, content.stale,
+            content.invalidations, content.evictions, content.bytes_served / 1024);
+    LeaveCriticalSection(&content.cs);
+}
+
+/* ---------- FILE TRANSFER HELPERS ---------- */
+#define XFER_BUF (256 * 1024)   // fallback copy buffer for transfers
+
+// Milliseconds from a monotonic clock, for transfer timing.
+double now_ms() {
+#ifdef _WIN32
+    return (double)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+// send() until everything is out. Returns 0 if the connection failed.
+int send_all(SOCKET c, const char *data, long len) {
+    while (len > 0) {
+        int chunk = (len > XFER_BUF) ? XFER_BUF : (int)len;
+        int n = send(c, data, chunk, 0);
+        if (n <= 0) {
+            worker_note_timeout(n);
+            return 0;
+        }
+        metrics_bytes(0, n);
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Streams len bytes of fp starting at offset to the socket.
+// On Linux this is sendfile() straight from the page cache; elsewhere (or
+// if sendfile is refused) it falls back to a large-buffer read/send loop.
+// Returns the number of bytes actually sent.
+long send_file_data(SOCKET c, FILE *fp, long offset, long len) {
+    long sent = 0;
+#ifdef __linux__
+    int fd = fileno(fp);
+    off_t off = offset;
+    while (sent < len) {
+        ssize_t n = sendfile(c, fd, &off, (size_t)(len - sent));
+        if (n > 0) {
+            sent += n;
+            metrics_bytes(0, n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            break; // not supported for this file, use the copy loop
+        } else {
+            worker_note_timeout(n);
+            return sent;
+        }
+    }
+    if (sent == len) return sent;
+#endif
+    char *fbuf = malloc(XFER_BUF);
+    if (!fbuf) return sent;
+    fseek(fp, offset + sent, SEEK_SET);
+    while (sent < len) {
+        long want = (len - sent < XFER_BUF) ? (len - sent) : XFER_BUF;
+        size_t n = fread(fbuf, 1, want, fp);
+        if (n == 0) break;
+        if (!send_all(c, fbuf, (long)n)) break;
+        sent += n;
+    }
+    free(fbuf);
+    return sent;
+}
+
+// Per-transfer throughput goes to server_log.txt through the log rings,
+// so a finished transfer never waits on stdout.
+void log_transfer(const char *what, const char *path, long bytes, double ms) {
+    char line[LOG_ENTRY_MAX];
+    double mbps = (ms > 0) ? (bytes / (1024.0 * 1024.0)) / (ms / 1000.0) : 0;
+    snprintf(line, sizeof(line), "[XFER] %s %s: %ld bytes in %.1f ms (%.1f MB/s)", what, path, bytes, ms, mbps);
+    log_command("Server", line);
+}
+
+/* ---------- CLIENT SESSION ---------- */
+/*
+ * Per-connection state. The legacy protocol is "one recv() is one command",
+ * so bytes are buffered here and split on newlines; whatever is left when the
+ * socket has nothing more to give is treated as a single command (the Python
+ * GUI sends commands without a trailing newline).
+ */
+typedef struct Reactor Reactor;
+
+struct Session {
+    SOCKET sock;
+    char current_user[50];
+    char *inbuf;            // received but not yet consumed
+    int in_len, in_cap;     // in_cap is BUF until binary frames need more
+    int framed;             // negotiated binary framing (PROTO BINARY 1)
+    int capture;            // replies go to 'out' instead of the socket
+    char *out;              // pending reply frames, flushed once per batch
+    long out_len, out_cap;
+    Reactor *owner;         // NULL in thread-per-client mode
+    struct Session *prev, *next;   // owner's session table
+    struct Session *next_job;
+};
+
+Session* session_open(SOCKET c) {
+    Session *s = (Session*)calloc(1, sizeof(Session));
+    if (!s) return NULL;
+    s->inbuf = malloc(BUF);
+    if (!s->inbuf) {
+        free(s);
+        return NULL;
+    }
+    s->in_cap = BUF;
+    s->sock = c;
+    metrics_session(1);
+    return s;
+}
+
+void session_close(Session *s) {
+    release_all_locks_for_client(s->sock);
+    transfer_session_closed(s->sock);
+    closesocket(s->sock);
+    free(s->inbuf);
+    free(s->out);
+    free(s);
+    metrics_session(0);
+}
+
+// Every reply from a command handler goes through here. Normally that is a
+// plain send(); while a binary frame is being answered the bytes are
+// collected so they can be wrapped in a response frame.
+void session_send(Session *s, const char *data, long len) {
+    if (!s->capture) {
+        send_all(s->sock, data, len);
+        return;
+    }
+    if (s->out_len + len > s->out_cap) {
+        long cap = s->out_cap ? s->out_cap : BUF * 4;
+        while (cap < s->out_len + len) cap *= 2;
+        char *grown = realloc(s->out, cap);
+        if (!grown) return;
+        s->out = grown;
+        s->out_cap = cap;
+    }
+    memcpy(s->out + s->out_len, data, len);
+    s->out_len += len;
+}
+
+void session_flush(Session *s) {
+    if (s->out_len > 0) send_all(s->sock, s->out, s->out_len);
+    s->out_len = 0;
+}
+
+// recv() for command handlers that read a payload (UPLOAD data, DOWNLOAD ack).
+// Bytes already buffered after the command are handed out first.
+int session_recv(Session *s, char *out, int len) {
+    if (s->in_len > 0) {
+        int n = (s->in_len < len) ? s->in_len : len;
+        memcpy(out, s->inbuf, n);
+        memmove(s->inbuf, s->inbuf + n, s->in_len - n);
+        s->in_len -= n;
+        return n;
+    }
+    // The client sets the pace here, so an --epoll worker lends the pool a spare.
+    worker_block_begin();
+    int n = recv_counted(s->sock, out, len);
+    worker_block_end();
+    worker_note_timeout(n);
+    return n;
+}
+
+// session_recv() until len bytes have arrived. Returns 0 if the connection failed.
+int session_recv_all(Session *s, char *out, long len) {
+    while (len > 0) {
+        int n = session_recv(s, out, (len > (1 << 20)) ? (1 << 20) : (int)len);
+        if (n <= 0) return 0;
+        out += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Takes the next complete command out of inbuf into out (BUF bytes).
+// 'drained' means no more bytes are pending on the socket right now.
+// Returns the command length, or 0 if nothing is ready yet.
+int session_take_command(Session *s, char *out, int drained) {
+    int n = 0;
+    char *nl = memchr(s->inbuf, '\n', s->in_len);
+    if (nl) n = (int)(nl - s->inbuf) + 1;
+    else if (drained || s->in_len == s->in_cap) n = s->in_len;
+    if (n == 0) return 0;
+    if (n > BUF - 1) n = BUF - 1;
+
+    memcpy(out, s->inbuf, n);
+    out[n] = '\0';
+    memmove(s->inbuf, s->inbuf + n, s->in_len - n);
+    s->in_len -= n;
+    return n;
+}
+
+// Writes len bytes at a fixed file offset (pwrite on POSIX).
+int write_at(FILE *fp, long offset, const char *data, long len) {
+#ifdef _WIN32
+    if (fseek(fp, offset, SEEK_SET) != 0) return 0;
+    return fwrite(data, 1, len, fp) == (size_t)len;
+#else
+    int fd = fileno(fp);
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        data += n;
+        offset += n;
+        len -= n;
+    }
+    return 1;
+#endif
+}
+
+// Receives len bytes from the session into fp at offset. Bytes that came in
+// together with the command are written first; the rest is moved
+// socket -> pipe -> file with splice() on Linux, or through a large buffer
+// with recv()/pwrite() otherwise. Returns the number of bytes stored.
+long recv_file_data(Session *s, FILE *fp, long offset, long len) {
+    long got = 0;
+
+    if (s->in_len > 0) {
+        long n = (s->in_len < len) ? s->in_len : len;
+        if (!write_at(fp, offset, s->inbuf, n)) return 0;
+        memmove(s->inbuf, s->inbuf + n, s->in_len - n);
+        s->in_len -= n;
+        got = n;
+    }
+
+#ifdef __linux__
+    int pipefd[2];
+    if (got < len && pipe(pipefd) == 0) {
+        int fd = fileno(fp);
+        int use_fallback = 0;
+        loff_t off = offset + got;
+        fcntl(pipefd[1], F_SETPIPE_SZ, XFER_BUF); // best effort, bigger moves per call
+        while (got < len) {
+            long want = (len - got < XFER_BUF) ? (len - got) : XFER_BUF;
+            ssize_t in = splice(s->sock, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (in < 0 && errno == EINTR) continue;
+            if (in < 0 && (errno == EINVAL || errno == ENOSYS) && off == offset + got) {
+                use_fallback = 1; // this socket/filesystem pair can't splice
+                break;
+            }
+            if (in <= 0) {
+                worker_note_timeout(in);
+                break;
+            }
+            metrics_bytes(in, 0);
+            while (in > 0) {
+                ssize_t out = splice(pipefd[0], NULL, fd, &off, in, SPLICE_F_MOVE);
+                if (out < 0 && errno == EINTR) continue;
+                if (out <= 0) {
+                    // Data already pulled off the socket can't be recovered
+                    close(pipefd[0]);
+                    close(pipefd[1]);
+                    return got;
+                }
+                in -= out;
+                got += out;
+            }
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (!use_fallback) return got;
+    }
+#endif
+
+    char *rbuf = malloc(XFER_BUF);
+    if (!rbuf) return got;
+    while (got < len) {
+        long want = (len - got < XFER_BUF) ? (len - got) : XFER_BUF;
+        int r = recv_counted(s->sock, rbuf, (int)want);
+        if (r <= 0) {
+            worker_note_timeout(r);
+            break;
+        }
+        if (!write_at(fp, offset + got, rbuf, r)) break;
+        got += r;
+    }
+    free(rbuf);
+    return got;
+}
+
+// Reserves disk space up front so a large upload doesn't fragment or run
+// out of space halfway through. Best effort. The file size is left alone,
+// so it keeps showing how much has really been written.
+int preallocate_file(FILE *fp, long size) {
+#ifdef __linux__
+    // Filesystems without fallocate just skip the reservation.
+    if (fallocate(fileno(fp), FALLOC_FL_KEEP_SIZE, 0, size) != 0 && (errno == ENOSPC || errno == EDQUOT))
+        return 0;
+#else
+    (void)fp; (void)size;
+#endif
+    return 1;
+}
+
+// Atomically puts a finished temp file in place of dst.
+int replace_file(const char *tmp, const char *dst) {
+#ifdef _WIN32
+    return MoveFileExA(tmp, dst, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return fs_rename(tmp, dst);
+#endif
+}
+
+// READ sends large files in slices so its memory use does not grow with
+// the file. Slices are counted against --read-inflight-mb across all
+// sessions; a READ that would go over waits for others to finish a slice.
+#define READ_SLICE (4L << 20)
+#define READ_MMAP_MIN (64 * 1024)   // smaller slices are cheaper to pread
+
+typedef struct {
+    CRITICAL_SECTION cs;
+    CONDITION_VARIABLE cv;
+    long inflight;
+    long peak, waits;
+} ReadBudget;
+
+ReadBudget read_budget;
+
+void read_budget_init() {
+    InitializeCriticalSection(&read_budget.cs);
+    InitializeConditionVariable(&read_budget.cv);
+}
+
+// Slice length: READ_SLICE, or less if the whole budget is smaller. Kept a
+// multiple of 64 KB so every slice offset is page aligned for mmap.
+long read_slice_bytes() {
+    long n = g_cfg.read_inflight_bytes < READ_SLICE ? g_cfg.read_inflight_bytes : READ_SLICE;
+    n &= ~(64L * 1024 - 1);
+    return n > 0 ? n : 64 * 1024;
+}
+
+void read_budget_acquire(long len) {
+    EnterCriticalSection(&read_budget.cs);
+    if (read_budget.inflight > 0 && read_budget.inflight + len > g_cfg.read_inflight_bytes) {
+        read_budget.waits++;
+        worker_block_begin();
+        while (read_budget.inflight > 0 && read_budget.inflight + len > g_cfg.read_inflight_bytes)
+            SleepConditionVariableCS(&read_budget.cv, &read_budget.cs, INFINITE);
+        worker_block_end();
+    }
+    read_budget.inflight += len;
+    if (read_budget.inflight > read_budget.peak) read_budget.peak = read_budget.inflight;
+    LeaveCriticalSection(&read_budget.cs);
+}
+
+void read_budget_format(char *out) {
+    EnterCriticalSection(&read_budget.cs);
+    sprintf(out, "READ memory: %ld KB in flight (peak %ld KB of %ld KB), %ld waits\n",
+            read_budget.inflight / 1024, read_budget.peak / 1024,
+            g_cfg.read_inflight_bytes / 1024, read_budget.waits);
+    LeaveCriticalSection(&read_budget.cs);
+}
+
+void read_budget_release(long len) {
+    EnterCriticalSection(&read_budget.cs);
+    read_budget.inflight -= len;
+    WakeAllConditionVariable(&read_budget.cv);
+    LeaveCriticalSection(&read_budget.cs);
+}
+
+// Sends the first 'size' bytes of fd as a READ reply, one slice at a time.
+// On POSIX each large slice is mapped read-only and handed to send(), so
+// the kernel copies straight from the page cache; a file truncated under
+// us makes send() fail with EFAULT instead of faulting the server. Other
+// slices (small ones, Windows, binary frames that copy the reply anyway)
+// go through one slice-sized buffer. Returns the bytes sent.
+long read_send_file(Session *s, int fd, long size) {
+    long slice = read_slice_bytes(), sent = 0;
+    while (sent < size) {
+        long len = (size - sent < slice) ? (size - sent) : slice;
+        int ok = 0;
+        read_budget_acquire(len);
+#ifndef _WIN32
+        if (!s->capture && len >= READ_MMAP_MIN) {
+            void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, sent);
+            if (map != MAP_FAILED) {
+                madvise(map, len, MADV_SEQUENTIAL);
+                worker_block_begin();
+                ok = send_all(s->sock, map, len) ? 1 : -1;
+                worker_block_end();
+                munmap(map, len);
+            }
+        }
+#endif
+        if (ok == 0) {
+            char *data = malloc(len);
+            long got = 0;
+            while (data && got < len) {
+                long n = fs_pread(fd, data + got, len - got, sent + got);
+                if (n <= 0) break;
+                got += n;
+            }
+            if (got > 0) session_send(s, data, got);
+            free(data);
+            ok = (got == len) ? 1 : -1;
+            if (got > 0 && ok < 0) sent += got;
+        }
+        read_budget_release(len);
+        if (ok < 0) break;
+        sent += len;
+    }
+    return sent;
+}
+
+/* ---------- PARTIAL UPLOADS ---------- */
+/*
+ * An UPLOAD is received into "<target>.part" and renamed over the target
+ * when the last byte arrives. If the connection drops first, the partial
+ * file is kept: a client that reconnects asks UPLOAD_STATUS how many bytes
+ * made it to disk and continues with "UPLOAD <name> <size> <offset>". This
+ * table remembers each unfinished upload's total size and whether a
+ * session is currently receiving it, so two sessions never write the same
+ * partial file. Partial files left from before a restart can still be
+ * resumed; their total size is then simply unknown (0).
+ */
+typedef struct {
+    char path[512];     // target path
+    long expected;      // total size announced by the client
+    int active;         // a session is receiving it right now
+    SOCKET owner;       // that session
+    // Chunked uploads (UPLOAD_BEGIN) only:
+    long chunk_size;    // 0 for a plain UPLOAD
+    int nchunks, chunks_done;
+    unsigned char *chunk_done;
+    unsigned int gen;   // bumped by every UPLOAD_BEGIN, so late chunks of an abandoned attempt don't count
+} PartialUpload;
+
+struct {
+    CRITICAL_SECTION cs;
+    PartialUpload *items;
+    int count, cap;
+} partials;
+
+void partials_init() {
+    InitializeCriticalSection(&partials.cs);
+}
+
+void partial_path(const char *path, char *out) {
+    sprintf(out, "%s.part", path);
+}
+
+// Caller holds partials.cs.
+PartialUpload* partial_find(const char *path) {
+    for (int i = 0; i < partials.count; i++)
+        if (strcmp(partials.items[i].path, path) == 0) return &partials.items[i];
+    return NULL;
+}
+
+// Marks the upload of 'path' as being received by session 'owner'.
+// Returns 0 if another session is receiving it, -1 if a resume does not
+// match what was started (different total size), 1 on success.
+int partial_claim(const char *path, long expected, long offset, SOCKET owner) {
+    EnterCriticalSection(&partials.cs);
+    PartialUpload *p = partial_find(path);
+    if (p && p->active) {
+        LeaveCriticalSection(&partials.cs);
+        return 0;
+    }
+    if (offset > 0 && p && p->expected != expected) {
+        LeaveCriticalSection(&partials.cs);
+        return -1;
+    }
+    if (!p) {
+        if (partials.count == partials.cap) {
+            int cap = partials.cap ? partials.cap * 2 : 16;
+            PartialUpload *grown = realloc(partials.items, cap * sizeof(PartialUpload));
+            if (!grown) {
+                LeaveCriticalSection(&partials.cs);
+                return -1;
+            }
+            partials.items = grown;
+            partials.cap = cap;
+        }
+        p = &partials.items[partials.count++];
+        memset(p, 0, sizeof(*p));
+        strcpy(p->path, path);
+    }
+    p->expected = expected;
+    p->active = 1;
+    p->owner = owner;
+    p->chunk_size = 0;
+    p->nchunks = p->chunks_done = 0;
+    free(p->chunk_done);
+    p->chunk_done = NULL;
+    p->gen++;
+    LeaveCriticalSection(&partials.cs);
+    return 1;
+}
+
+// Ends the caller's claim. 'finished' forgets the upload entirely;
+// otherwise it stays resumable.
+void partial_release(const char *path, int finished) {
+    EnterCriticalSection(&partials.cs);
+    PartialUpload *p = partial_find(path);
+    if (p) {
+        if (finished) {
+            free(p->chunk_done);
+            *p = partials.items[--partials.count];
+        } else {
+            p->active = 0;
+        }
+    }
+    LeaveCriticalSection(&partials.cs);
+}
+
+// Bytes of 'path' already on disk, with the total size (0 if unknown) and
+// whether a session is still receiving it.
+long partial_status(const char *path, long *expected, int *active) {
+    char part[600];
+    struct stat st;
+    EnterCriticalSection(&partials.cs);
+    PartialUpload *p = partial_find(path);
+    *expected = p ? p->expected : 0;
+    *active = p ? p->active : 0;
+    LeaveCriticalSection(&partials.cs);
+    partial_path(path, part);
+    return fs_stat(part, &st) == 0 ? (long)st.st_size : 0;
+}
+
+// Cuts an open partial file back to the resume offset.
+int truncate_file(FILE *fp, long size) {
+#ifdef _WIN32
+    return _chsize_s(_fileno(fp), size) == 0;
+#else
+    return ftruncate(fileno(fp), size) == 0;
+#endif
+}
+
+/* ---------- PARALLEL TRANSFERS ---------- */
+/*
+ * A large file can be moved over several connections at once:
+ *
+ *   control:  SESSION_TOKEN                 -> TOKEN <hex>
+ *   others:   ATTACH <hex>                  -> logged in as the same user
+ *   control:  UPLOAD_BEGIN <name> <size> <chunk_size>  -> XFER <chunks>
+ *   any:      UPLOAD_CHUNK <name> <index> <crc32>      -> READY, bytes, CHUNK_OK <index>
+ *   control:  UPLOAD_END <name>             -> Upload Complete
+ *
+ * Chunks are written in place into <name>.part with pwrite, in any order
+ * and from any attached connection. Each chunk is checked against the
+ * CRC-32 the client sent and only counted when it matches; UPLOAD_END
+ * renames the file over the target once every chunk is in. Downloads need
+ * nothing new: each attached connection fetches its own ranges with
+ * "DOWNLOAD <name> <offset> <length>".
+ */
+#define CHUNK_MIN (64L * 1024)
+#define CHUNK_MAX (256L << 20)
+
+typedef struct {
+    char token[33];
+    char user[50];
+    SOCKET owner;       // the token dies with this connection
+} SessionToken;
+
+struct {
+    CRITICAL_SECTION cs;
+    SessionToken *items;
+    int count, cap;
+} tokens;
+
+void transfers_init() {
+    InitializeCriticalSection(&tokens.cs);
+    crc32_init();
+}
+
+// Fills out[0..2n] with n random bytes in hex.
+int random_hex(char *out, int n) {
+    unsigned char bytes[32];
+    if (n > (int)sizeof(bytes)) return 0;
+#ifdef _WIN32
+    for (int i = 0; i < n; i += 4) {
+        unsigned int r;
+        if (rand_s(&r) != 0) return 0;
+        memcpy(bytes + i, &r, (n - i < 4) ? n - i : 4);
+    }
+#else
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0) return 0;
+    int got = read(fd, bytes, n);
+    close(fd);
+    if (got != n) return 0;
+#endif
+    for (int i = 0; i < n; i++) sprintf(out + 2 * i, "%02x", bytes[i]);
+    return 1;
+}
+
+// Returns the connection's token for 'user', creating it on first use.
+int session_token_issue(SOCKET c, const char *user, char *out) {
+    int ok = 1;
+    EnterCriticalSection(&tokens.cs);
+    for (int i = 0; i < tokens.count; i++) {
+        if (tokens.items[i].owner == c && strcmp(tokens.items[i].user, user) == 0) {
+            strcpy(out, tokens.items[i].token);
+            LeaveCriticalSection(&tokens.cs);
+            return 1;
+        }
+    }
+    if (tokens.count == tokens.cap) {
+        int cap = tokens.cap ? tokens.cap * 2 : 16;
+        SessionToken *grown = realloc(tokens.items, cap * sizeof(SessionToken));
+        if (grown) {
+            tokens.items = grown;
+            tokens.cap = cap;
+        }
+    }
+    if (tokens.count < tokens.cap && random_hex(out, 16)) {
+        SessionToken *t = &tokens.items[tokens.count++];
+        strcpy(t->token, out);
+        strcpy(t->user, user);
+        t->owner = c;
+    } else {
+        ok = 0;
+    }
+    LeaveCriticalSection(&tokens.cs);
+    return ok;
+}
+
+// Copies the user a token was issued to into 'user'. 0 if unknown.
+int session_token_user(const char *token, char *user) {
+    int found = 0;
+    EnterCriticalSection(&tokens.cs);
+    for (int i = 0; i < tokens.count && !found; i++) {
+        if (strcmp(tokens.items[i].token, token) == 0) {
+            strcpy(user, tokens.items[i].user);
+            found = 1;
+        }
+    }
+    LeaveCriticalSection(&tokens.cs);
+    return found;
+}
+
+void session_token_revoke(SOCKET c) {
+    EnterCriticalSection(&tokens.cs);
+    for (int i = 0; i < tokens.count; ) {
+        if (tokens.items[i].owner == c) tokens.items[i] = tokens.items[--tokens.count];
+        else i++;
+    }
+    LeaveCriticalSection(&tokens.cs);
+}
+
+// Called as a connection closes: its tokens stop working and chunked
+// uploads it started are no longer in progress.
+void transfer_session_closed(SOCKET c) {
+    session_token_revoke(c);
+    EnterCriticalSection(&partials.cs);
+    for (int i = 0; i < partials.count; i++)
+        if (partials.items[i].owner == c) partials.items[i].active = 0;
+    LeaveCriticalSection(&partials.cs);
+}
+
+// Switches the upload 'path' just claimed by 'owner' to chunked mode.
+// Returns the number of chunks, or 0 on failure.
+int partial_begin_chunks(const char *path, long chunk_size, SOCKET owner) {
+    int n = 0;
+    EnterCriticalSection(&partials.cs);
+    PartialUpload *p = partial_find(path);
+    if (p && p->active && p->owner == owner) {
+        long chunks = (p->expected + chunk_size - 1) / chunk_size;
+        p->chunk_done = (unsigned char*)calloc(chunks, 1);
+        if (p->chunk_done) {
+            p->chunk_size = chunk_size;
+            p->nchunks = n = (int)chunks;
+        }
+    }
+    LeaveCriticalSection(&partials.cs);
+    return n;
+}
+
+// Looks up chunk 'index' of a chunked upload in progress. Returns 1 and
+// its offset/length/generation if it still needs to be sent, 2 if it was
+// already received, 0 if there is no such chunk.
+int partial_chunk_info(const char *path, int index, long *offset, long *len, unsigned int *gen) {
+    int r = 0;
+    EnterCriticalSection(&partials.cs);
+    PartialUpload *p = partial_find(path);
+    if (p && p->active && p->chunk_size > 0 && index >= 0 && index < p->nchunks) {
+        *offset = (long)index * p->chunk_size;
+        *len = (p->expected - *offset < p->chunk_size) ? p->expected - *offset : p->chunk_size;
+        *gen = p->gen;
+        r = p->chunk_done[index] ? 2 : 1;
+    }
+    LeaveCriticalSection(&partials.cs);
+    return r;
+}
+
+void partial_chunk_done(const char *path, int index, unsigned int gen) {
+    EnterCriticalSection(&partials.cs);
+    PartialUpload *p = partial_find(path);
+    if (p && p->gen == gen && p->chunk_size > 0 && index < p->nchunks && !p->chunk_done[index]) {
+        p->chunk_done[index] = 1;
+        p->chunks_done++;
+    }
+    LeaveCriticalSection(&partials.cs);
+}
+
+// Chunks of 'path' still missing, or -1 if 'owner' has no chunked upload of it.
+int partial_chunks_missing(const char *path, SOCKET owner) {
+    int missing = -1;
+    EnterCriticalSection(&partials.cs);
+    PartialUpload *p = partial_find(path);
+    if (p && p->active && p->owner == owner && p->chunk_size > 0) missing = p->nchunks - p->chunks_done;
+    LeaveCriticalSection(&partials.cs);
+    return missing;
+}
+
+// Receives one chunk into fd at 'offset'. Returns 1 if all 'len' bytes
+// arrived and match 'crc', 0 if they did not match, -1 if the
+// connection failed.
+int recv_chunk(Session *s, int fd, long offset, long len, unsigned int crc) {
+    char *rbuf = malloc(XFER_BUF);
+    unsigned int got_crc = 0;
+    long got = 0;
+    int ok = 1;
+    if (!rbuf) return -1;
+    while (got < len) {
+        int want = (len - got < XFER_BUF) ? (int)(len - got) : XFER_BUF;
+        int n = session_recv(s, rbuf, want);
+        if (n <= 0) {
+            free(rbuf);
+            return -1;
+        }
+        got_crc = crc32_update(got_crc, rbuf, n);
+        if (ok && fs_pwrite(fd, rbuf, n, offset + got) != n) ok = 0;
+        got += n;
+    }
+    free(rbuf);
+    return ok && got_crc == crc;
+}
+
+/* ---------- SERVER-SIDE COPY ---------- */
+/*
+ * COPY of a file holds a read lock on the source and a write lock on the
+ * destination while fs_copy_fd() runs (reflink, copy_file_range or a
+ * buffered loop). Both waits are bounded by --writer-wait, so neither two
+ * crossing COPYs nor a writer that never lets go can pin a copy thread;
+ * a source write-locked by the copying session itself is read under that
+ * lock instead of queueing behind it. COPY of a folder walks the source with the tree walker,
+ * creates the directories in order and then copies the files with
+ * --copy-threads threads, each file under the same locks.
+ */
+#define COPY_MAX_THREADS 64
+
+// Returns a COPY_* method, or -1 if the source or destination is locked.
+int copy_file(const char *src, const char *dst, SOCKET c, long *bytes) {
+    if (strcmp(src, dst) == 0) return COPY_FAILED;
+    FileLock *rl = get_file_lock(src);
+    FileLock *wl = rl ? get_file_lock(dst) : NULL;
+    int method = COPY_FAILED;
+    if (!wl) {
+        if (rl) put_file_lock(rl);
+        return COPY_FAILED;
+    }
+    int reading = acquire_copy_read_lock(rl, c, g_cfg.writer_wait_ms);
+    if (!reading || !acquire_write_lock(wl, c, g_cfg.writer_wait_ms)) {
+        method = -1;
+    } else {
+        struct stat st;
+        int sfd = fs_open(src, O_RDONLY, 0);
+        int dfd = (sfd >= 0) ? fs_open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+        if (dfd >= 0) {
+            method = fs_copy_fd(sfd, dfd);
+            if (method != COPY_FAILED && fstat(sfd, &st) == 0) *bytes += (long)st.st_size;
+            fs_close(dfd);
+        }
+        if (sfd >= 0) fs_close(sfd);
+        meta_invalidate(dst);
+        release_write_lock(wl, c);
+    }
+    if (reading == 1) release_read_lock(rl, c);
+    put_file_lock(wl);
+    put_file_lock(rl);
+    return method;
+}
+
+typedef struct {
+    char src[512], dst[512];
+    SOCKET c;
+    char **files;           // relative paths, in walk order
+    int count, cap;
+    int next;               // next file nobody has taken
+    long bytes;
+    int failed, locked;
+} CopyJob;
+
+void copy_job_add(CopyJob *j, const char *rel) {
+    if (j->count == j->cap) {
+        int cap = j->cap ? j->cap * 2 : 256;
+        char **grown = realloc(j->files, cap * sizeof(char*));
+        if (!grown) {
+            j->failed++;
+            return;
+        }
+        j->files = grown;
+        j->cap = cap;
+    }
+    j->files[j->count] = strdup(rel);
+    if (j->files[j->count]) j->count++;
+    else j->failed++;
+}
+
+// Creates the directories of walk node n under j->dst (parents before
+// children) and queues its files.
+void copy_collect(CopyJob *j, WalkNode *n) {
+    char rel[1024], path[1600];
+    tree_walk_wait(n);
+    for (int i = 0; i < n->count; i++) {
+        WalkEntry *e = &n->entries[i];
+        WalkNode *sub = n->children ? n->children[i] : NULL;
+        if (n->rel[0]) snprintf(rel, sizeof(rel), "%s/%s", n->rel, e->name);
+        else snprintf(rel, sizeof(rel), "%s", e->name);
+        if (!e->is_dir) {
+            copy_job_add(j, rel);
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", j->dst, rel);
+        struct stat st;
+        if (fs_mkdir(path) != 0 && (fs_stat(path, &st) != 0 || !S_ISDIR(st.st_mode))) j->failed++;
+        else if (sub) copy_collect(j, sub);
+        if (sub) {
+            n->children[i] = NULL;
+            tree_walk_release(sub);
+        }
+    }
+}
+
+void copy_job_run(CopyJob *j) {
+    char src[1600], dst[1600];
+    long bytes = 0;
+    int i;
+    while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->count) {
+        snprintf(src, sizeof(src), "%s/%s", j->src, j->files[i]);
+        snprintf(dst, sizeof(dst), "%s/%s", j->dst, j->files[i]);
+        int r = copy_file(src, dst, j->c, &bytes);
+        if (r < 0) __atomic_add_fetch(&j->locked, 1, __ATOMIC_RELAXED);
+        else if (r == COPY_FAILED) __atomic_add_fetch(&j->failed, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&j->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+#ifdef _WIN32
+DWORD WINAPI copy_thread(LPVOID arg) {
+    copy_job_run((CopyJob*)arg);
+    log_thread_release();
+    return 0;
+}
+#else
+void* copy_thread(void *arg) {
+    copy_job_run((CopyJob*)arg);
+    log_thread_release();
+    return NULL;
+}
+#endif
+
+// Copies folder src to dst (created, or merged into if it exists).
+// Returns the number of files copied, or -1 if nothing could be started.
+int copy_tree(CopyJob *j) {
+    struct stat st;
+    WalkNode *root;
+    if (fs_mkdir(j->dst) != 0 && (fs_stat(j->dst, &st) != 0 || !S_ISDIR(st.st_mode))) return -1;
+    TreeWalk *w = tree_walk_start(j->src, NULL, &root);
+    if (!w) return -1;
+    copy_collect(j, root);
+    tree_walk_end(w, root);
+
+    int nthreads = (j->count < g_cfg.copy_threads) ? j->count : g_cfg.copy_threads;
+#ifdef _WIN32
+    HANDLE threads[COPY_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < nthreads; i++) {
+        threads[started] = CreateThread(NULL, 0, copy_thread, j, 0, NULL);
+        if (threads[started]) started++;
+    }
+    worker_block_begin();
+    copy_job_run(j);    // the caller copies too, so the job finishes even with no threads
+    for (int i = 0; i < started; i++) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+    worker_block_end();
+#else
+    pthread_t threads[COPY_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < nthreads; i++)
+        if (pthread_create(&threads[started], NULL, copy_thread, j) == 0) started++;
+    worker_block_begin();
+    copy_job_run(j);    // the caller copies too, so the job finishes even with no threads
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    worker_block_end();
+#endif
+    meta_invalidate_tree(j->dst);
+    for (int i = 0; i < j->count; i++) free(j->files[i]);
+    free(j->files);
+    return j->count - j->failed - j->locked;
+}
+
+/* ---------- DELTA UPLOADS ---------- */
+/*
+ * rsync-style upload of a file the server already has an older copy of.
+ * DELTA_SIG sends the signature of the server's copy: for every block a
+ * rolling (weak) checksum and an MD5. The client looks for those blocks at
+ * any offset of its new version, then sends DELTA_UPLOAD followed by a
+ * stream of instructions (integers are 4-byte big-endian):
+ *   'L' <len> <len bytes>     literal data
+ *   'B' <index> <count>       'count' blocks of the old copy from 'index'
+ *   'E' <16-byte MD5>         end, with the MD5 of the whole new file
+ * The new file is built in <name>.part and renamed over the old copy only
+ * if its size and MD5 match, so a copy that changed in between is never
+ * half-patched.
+ */
+#define DELTA_BLOCK_MIN 1024
+#define DELTA_BLOCK_MAX (1 << 20)
+#define DELTA_LITERAL_MAX (1 << 20)
+#define DELTA_SIG_ENTRY 20          // weak checksum + MD5
+
+// About sqrt(size), as rsync does: fewer, larger blocks for big files.
+long delta_block_size(long size) {
+    long b = DELTA_BLOCK_MIN;
+    while (b < DELTA_BLOCK_MAX && b * b < size) b *= 2;
+    return b;
+}
+
+// Sends "SIG <size> <block> <count>\n" and the block signatures of fd.
+// block = 0 picks delta_block_size().
+int delta_send_signature(Session *s, int fd, long block) {
+    struct stat st;
+    char header[100];
+    if (fstat(fd, &st) != 0) return 0;
+    long size = (long)st.st_size;
+    if (block == 0) block = delta_block_size(size);
+    long count = (size + block - 1) / block;
+    unsigned char *data = malloc(block);
+    unsigned char *out = malloc(DELTA_SIG_ENTRY * 4096);
+    if (!data || !out) {
+        free(data);
+        free(out);
+        return 0;
+    }
+    sprintf(header, "SIG %ld %ld %ld\n", size, block, count);
+    session_send(s, header, strlen(header));
+
+    int used = 0;
+    for (long i = 0; i < count; i++) {
+        long len = (size - i * block < block) ? size - i * block : block;
+        long got = fs_pread(fd, data, len, i * block);
+        if (got < len) memset(data + (got > 0 ? got : 0), 0, len - (got > 0 ? got : 0)); // shrank meanwhile; the final MD5 check catches it
+        Md5 m;
+        md5_init(&m);
+        md5_update(&m, data, len);
+        put_be32(out + used, delta_weak(data, len));
+        md5_final(&m, out + used + 4);
+        used += DELTA_SIG_ENTRY;
+        if (used == DELTA_SIG_ENTRY * 4096 || i == count - 1) {
+            session_send(s, (char*)out, used);
+            used = 0;
+        }
+    }
+    free(data);
+    free(out);
+    return 1;
+}
+
+// Rebuilds the new file into 'out' from 'basis' and the client's
+// instructions. Returns 1 if it came out as the client's file, 0 if it did
+// not (size or MD5 differ), -1 if the connection or the stream broke.
+int delta_apply(Session *s, int basis, long basis_size, long block, int out,
+                long new_size, long *literal, long *matched) {
+    unsigned char op[9], want[16], got[16];
+    char *data = malloc(DELTA_LITERAL_MAX);
+    long pos = 0;
+    int ok = 1, result = -1;
+    Md5 m;
+    md5_init(&m);
+    while (data && session_recv_all(s, (char*)op, 1)) {
+        if (op[0] == 'E') {
+            if (!session_recv_all(s, (char*)want, 16)) break;
+            md5_final(&m, got);
+            result = ok && pos == new_size && memcmp(want, got, 16) == 0;
+            break;
+        } else if (op[0] == 'L') {
+            if (!session_recv_all(s, (char*)op + 1, 4)) break;
+            long len = get_be32(op + 1);
+            if (len > DELTA_LITERAL_MAX || !session_recv_all(s, data, len)) break;
+            if (pos + len > new_size || fs_pwrite(out, data, len, pos) != len) ok = 0;
+            md5_update(&m, data, len);
+            pos += len;
+            *literal += len;
+        } else if (op[0] == 'B') {
+            if (!session_recv_all(s, (char*)op + 1, 8)) break;
+            long offset = (long)get_be32(op + 1) * block;
+            long len = (long)get_be32(op + 5) * block;
+            if (offset >= basis_size || len <= 0) {
+                ok = 0;
+                continue;
+            }
+            if (offset + len > basis_size) len = basis_size - offset;
+            *matched += len;
+            while (ok && len > 0) {
+                long n = (len < DELTA_LITERAL_MAX) ? len : DELTA_LITERAL_MAX;
+                if (pos + n > new_size || fs_pread(basis, data, n, offset) != n ||
+                    fs_pwrite(out, data, n, pos) != n) {
+                    ok = 0;
+                    break;
+                }
+                md5_update(&m, data, n);
+                offset += n;
+                pos += n;
+                len -= n;
+            }
+        } else {
+            break;
+        }
+    }
+    free(data);
+    return result;
+}
+
+/* ---------- BINARY FRAMING ---------- */
+/*
+ * A client that sends "PROTO BINARY 1" (and gets "PROTO BINARY 1 OK") then
+ * talks in length-prefixed frames instead of text lines:
+ *
+ *   u32 length   payload bytes (big-endian, at most FRAME_MAX)
+ *   u16 opcode   FRAME_CMD / FRAME_PUT / FRAME_GET
+ *   u16 flags    FRAME_RESPONSE, plus FRAME_ERROR on failed PUT/GET
+ *   u32 req_id   picked by the client, echoed in the reply
+ *   payload
+ *
+ * Frames can be pipelined: the client sends as many as it likes without
+ * waiting, and replies for one read burst go back in a single send().
+ * Replies currently come back in request order, but clients should match
+ * them by req_id. Legacy text clients never send PROTO and are unaffected.
+ */
+#define FRAME_VERSION 1
+#define FRAME_HDR 12
+#define FRAME_MAX (16 * 1024 * 1024)
+#define FRAME_CMD 1         // payload: one text command, reply: its text reply
+#define FRAME_PUT 2         // payload: "<name>\n" + file bytes
+#define FRAME_GET 3         // payload: "<name>", reply: file bytes
+#define FRAME_RESPONSE 0x1
+#define FRAME_ERROR 0x2
+#define FRAME_FLUSH_AT (256 * 1024)
+
+void process_command(Session *s, char *buf);
+void batch_command(Session *s, const char *header, const char *body);
+
+typedef struct {
+    unsigned int length;
+    unsigned short opcode;
+    unsigned short flags;
+    unsigned int req_id;
+} FrameHeader;
+
+void frame_decode(const char *p, FrameHeader *h) {
+    unsigned int l, id;
+    unsigned short op, fl;
+    memcpy(&l, p, 4);
+    memcpy(&op, p + 4, 2);
+    memcpy(&fl, p + 6, 2);
+    memcpy(&id, p + 8, 4);
+    h->length = ntohl(l);
+    h->opcode = ntohs(op);
+    h->flags = ntohs(fl);
+    h->req_id = ntohl(id);
+}
+
+void frame_encode(char *p, const FrameHeader *h) {
+    unsigned int l = htonl(h->length), id = htonl(h->req_id);
+    unsigned short op = htons(h->opcode), fl = htons(h->flags);
+    memcpy(p, &l, 4);
+    memcpy(p + 4, &op, 2);
+    memcpy(p + 6, &fl, 2);
+    memcpy(p + 8, &id, 4);
+}
+
+// Returns 1 (and the header) once a whole frame is buffered.
+int session_frame_ready(Session *s, FrameHeader *h) {
+    if (s->in_len < FRAME_HDR) return 0;
+    frame_decode(s->inbuf, h);
+    return s->in_len >= FRAME_HDR + (long)h->length;
+}
+
+// Makes room in inbuf for the frame being received.
+// Returns 0 if the peer announced a frame larger than FRAME_MAX.
+int session_reserve_input(Session *s) {
+    FrameHeader h;
+    if (!s->framed || s->in_len < FRAME_HDR) return 1;
+    frame_decode(s->inbuf, &h);
+    if (h.length > FRAME_MAX) return 0;
+    int need = FRAME_HDR + (int)h.length;
+    if (need > s->in_cap) {
+        char *grown = realloc(s->inbuf, need);
+        if (!grown) return 0;
+        s->inbuf = grown;
+        s->in_cap = need;
+    }
+    return 1;
+}
+
+// Starts a reply frame: from here on handler output is collected in s->out.
+long frame_begin(Session *s) {
+    char hdr[FRAME_HDR];
+    memset(hdr, 0, sizeof(hdr));
+    s->capture = 1;
+    long at = s->out_len;
+    session_send(s, hdr, FRAME_HDR);
+    return at;
+}
+
+void frame_end(Session *s, long at, const FrameHeader *req, unsigned short flags) {
+    FrameHeader h;
+    s->capture = 0;
+    if (s->out_len < at + FRAME_HDR) return; // out of memory while replying
+    h.length = (unsigned int)(s->out_len - at - FRAME_HDR);
+    h.opcode = req->opcode;
+    h.flags = FRAME_RESPONSE | flags;
+    h.req_id = req->req_id;
+    frame_encode(s->out + at, &h);
+}
+
+// FRAME_PUT: whole small file in one frame, stored via temp file + rename.
+int frame_put(Session *s, const char *payload, unsigned int len) {
+    char name[256], path[512], tmp_path[600], log_buf[300];
+    const char *nl = memchr(payload, '\n', len);
+    if (!nl || nl == payload || nl - payload >= (long)sizeof(name)) {
+        session_send(s, "Bad PUT frame\n", 14);
+        return 0;
+    }
+    memcpy(name, payload, nl - payload);
+    name[nl - payload] = '\0';
+    sprintf(log_buf, "PUT %s", name);
+    log_command(s->current_user, log_buf);
+
+    if (strlen(s->current_user) == 0) {
+        session_send(s, "Please login first\n", 19);
+        return 0;
+    }
+    if (!resolve_path(s->current_user, name, path, "WRITE")) {
+        session_send(s, "Access Denied (Write)\n", 22);
+        return 0;
+    }
+
+    const char *data = nl + 1;
+    long dlen = len - (long)(data - payload);
+    sprintf(tmp_path, "%s.%d.part", path, (int)s->sock);
+    int fd = fs_open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        session_send(s, "Server Error\n", 13);
+        return 0;
+    }
+    long done = 0;
+    while (done < dlen) {
+        long n = fs_pwrite(fd, data + done, dlen - done, done);
+        if (n <= 0) break;
+        done += n;
+    }
+    fs_close(fd);
+    if (done != dlen || replace_file(tmp_path, path) != 0) {
+        fs_unlink(tmp_path);
+        session_send(s, "Upload Failed\n", 14);
+        return 0;
+    }
+    meta_invalidate(path);
+    session_send(s, "Upload Complete\n", 16);
+    return 1;
+}
+
+// FRAME_GET: reply payload is the file itself.
+int frame_get(Session *s, const char *payload, unsigned int len) {
+    char name[256], path[512], log_buf[300];
+    struct stat st;
+    if (len == 0 || len >= sizeof(name)) {
+        session_send(s, "Bad GET frame\n", 14);
+        return 0;
+    }
+    memcpy(name, payload, len);
+    name[len] = '\0';
+    sprintf(log_buf, "GET %s", name);
+    log_command(s->current_user, log_buf);
+
+    if (strlen(s->current_user) == 0) {
+        session_send(s, "Please login first\n", 19);
+        return 0;
+    }
+    if (!resolve_path(s->current_user, name, path, "READ")) {
+        session_send(s, "Access Denied (Read)\n", 21);
+        return 0;
+    }
+    if (fs_stat(path, &st) != 0 || S_ISDIR(st.st_mode)) {
+        session_send(s, "File not found\n", 15);
+        return 0;
+    }
+    if (st.st_size > FRAME_MAX) {
+        session_send(s, "File too large for a frame, use DOWNLOAD\n", 41);
+        return 0;
+    }
+    ContentFile *cf = content_get(path);
+    if (cf) {
+        session_send(s, cf->data, cf->size);
+        content_release(cf);
+        return 1;
+    }
+    int fd = fs_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        session_send(s, "File not found\n", 15);
+        return 0;
+    }
+    long size = (long)st.st_size, got = 0;
+    char *data = malloc(size > 0 ? size : 1);
+    while (data && got < size) {
+        long n = fs_pread(fd, data + got, size - got, got);
+        if (n <= 0) break;
+        got += n;
+    }
+    fs_close(fd);
+    if (!data || got != size) {
+        free(data);
+        session_send(s, "Read failed\n", 12);
+        return 0;
+    }
+    session_send(s, data, size);
+    free(data);
+    return 1;
+}
+
+void process_frame(Session *s, const FrameHeader *h, const char *payload) {
+    unsigned short flags = 0;
+    long at = frame_begin(s);
+
+    if (h->opcode == FRAME_CMD) {
+        char buf[BUF], cmd[20] = "";
+        if (h->length > 6 && memcmp(payload, "BATCH ", 6) == 0) {
+            // A whole batch is one frame: its header line, then the commands.
+            char *text = (char*)malloc(h->length + 1);
+            if (text) {
+                memcpy(text, payload, h->length);
+                text[h->length] = '\0';
+                char *nl = strchr(text, '\n');
+                if (nl) *nl = '\0';
+                if (strlen(text) < BUF) strcpy(buf, text);
+                else buf[0] = '\0';
+                log_command(s->current_user, buf);
+                batch_command(s, buf, nl ? nl + 1 : "");
+                free(text);
+            } else {
+                session_send(s, "Server memory error\n", 20);
+                flags = FRAME_ERROR;
+            }
+        } else if (h->length >= BUF) {
+            session_send(s, "Command too long\n", 17);
+            flags = FRAME_ERROR;
+        } else {
+            memcpy(buf, payload, h->length);
+            buf[h->length] = '\0';
+            sscanf(buf, "%19s", cmd);
+            // These need their own handshake on the raw socket
+            if (strcmp(cmd, "UPLOAD") == 0 || strcmp(cmd, "DOWNLOAD") == 0 || strcmp(cmd, "PROTO") == 0 ||
+                strcmp(cmd, "DELTA_SIG") == 0 || strcmp(cmd, "DELTA_UPLOAD") == 0) {
+                session_send(s, "Not available in binary mode, use PUT/GET frames\n", 49);
+                flags = FRAME_ERROR;
+            } else {
+                process_command(s, buf);
+            }
+        }
+    } else if (h->opcode == FRAME_PUT) {
+        double start = now_us();
+        if (!frame_put(s, payload, h->length)) flags = FRAME_ERROR;
+        metrics_command("PUT", start);
+    } else if (h->opcode == FRAME_GET) {
+        double start = now_us();
+        if (!frame_get(s, payload, h->length)) flags = FRAME_ERROR;
+        metrics_command("GET", start);
+    } else {
+        session_send(s, "Unknown opcode\n", 15);
+        flags = FRAME_ERROR;
+    }
+    frame_end(s, at, h, flags);
+}
+
+// Something the worker/thread can act on: a complete frame, or (text mode)
+// any bytes at all, since one burst is one command there.
+int session_has_request(Session *s) {
+    FrameHeader h;
+    if (s->framed) return session_frame_ready(s, &h);
+    return s->in_len > 0;
+}
+
+// Runs every complete request in inbuf. Returns how many were handled.
+int session_process_input(Session *s) {
+    char buf[BUF];
+    int handled = 0;
+    while (1) {
+        if (s->framed) {
+            FrameHeader h;
+            if (!session_frame_ready(s, &h)) break;
+            process_frame(s, &h, s->inbuf + FRAME_HDR);
+            int used = FRAME_HDR + (int)h.length;
+            memmove(s->inbuf, s->inbuf + used, s->in_len - used);
+            s->in_len -= used;
+            if (s->out_len >= FRAME_FLUSH_AT) session_flush(s);
+        } else {
+            if (session_take_command(s, buf, 1) == 0) break;
+            process_command(s, buf);
+        }
+        handled++;
+    }
+    session_flush(s);
+
+    // Give back big frame buffers so idle sessions stay small.
+    if (s->in_cap > BUF && s->in_len <= BUF) {
+        char *shrunk = realloc(s->inbuf, BUF);
+        if (shrunk) {
+            s->inbuf = shrunk;
+            s->in_cap = BUF;
+        }
+    }
+    if (s->out_cap > FRAME_FLUSH_AT) {
+        free(s->out);
+        s->out = NULL;
+        s->out_cap = 0;
+    }
+    return handled;
+}
+
+/* ---------- BATCH ---------- */
+/*
+ * BATCH <count> [ATOMIC], followed by <count> command lines, runs them in
+ * order in one round trip. Each result comes back as
+ *   <index> OK|ERR <length>\n<the command's normal reply>
+ * and a final line "END <ok> <failed>" (plus " ROLLED_BACK" when undone).
+ * ATOMIC stops at the first failure and undoes what the batch did so far:
+ * paths it created are removed and moves are moved back. An ATOMIC batch
+ * that holds a command which cannot be undone (a delete, an append to an
+ * existing file, a share, ...) is refused before any of it runs.
+ * In text mode the lines follow on the connection; in binary mode they
+ * are the rest of the BATCH frame.
+ */
+#define BATCH_MAX 10000
+
+#define BATCH_CREATED 1     // undo: remove 'to'
+#define BATCH_MOVED 2       // undo: move 'to' back to 'from'
+
+typedef struct {
+    int kind;
+    char from[512], to[768];    // 'to' may be a folder plus a file name
+} BatchUndo;
+
+// Commands whose reply, when they work, starts with a fixed text.
+const char *batch_success[][2] = {
+    { "MKDIR", "Directory created" },       { "RMDIR", "Directory removed" },
+    { "TOUCH", "Empty file created" },      { "WRITE", "WRITE_COMPLETED" },
+    { "DELETE", "File deleted" },           { "MOVE", "Moved successfully" },
+    { "PUTFILE", "File moved successfully" }, { "COPY", "Copy successful" },
+    { "STAT", "Size:" },                    { "SHARE", "Shared successfully" },
+    { "CHPASS", "Password changed" },       { "LOCK_FILE", "WRITE_LOCK_GRANTED" },
+    { "UNLOCK_FILE", "FILE_UNLOCKED" },     { "LOGIN", "Login successful" },
+    { "REGISTER", "Registration successful" }, { "LOGOUT", "Logged out" },
+    { "UPLOAD_BEGIN", "XFER" },             { "UPLOAD_END", "Upload Complete" },
+    { "SESSION_TOKEN", "TOKEN" },
+};
+// Replies that mean failure for every other command.
+const char *batch_errors[] = {
+    "Access Denied", "ACCESS DENIED", "Error", "Please login", "Invalid",
+    "File not found", "Server memory error", "Server Error", "Not available",
+};
+
+int batch_reply_ok(const char *cmd, const char *reply) {
+    for (int i = 0; i < (int)(sizeof(batch_success) / sizeof(batch_success[0])); i++)
+        if (strcmp(cmd, batch_success[i][0]) == 0)
+            return strncmp(reply, batch_success[i][1], strlen(batch_success[i][1])) == 0;
+    for (int i = 0; i < (int)(sizeof(batch_errors) / sizeof(batch_errors[0])); i++)
+        if (strncmp(reply, batch_errors[i], strlen(batch_errors[i])) == 0) return 0;
+    return 1;
+}
+
+// These need their own handshake, or would nest.
+int batch_allowed(const char *cmd) {
+    return strcmp(cmd, "UPLOAD") != 0 && strcmp(cmd, "DOWNLOAD") != 0 && strcmp(cmd, "PROTO") != 0 &&
+           strcmp(cmd, "DELTA_SIG") != 0 && strcmp(cmd, "DELTA_UPLOAD") != 0 &&
+           strcmp(cmd, "UPLOAD_CHUNK") != 0 && strcmp(cmd, "BATCH") != 0;
+}
+
+// Removes a file, or a folder and everything in it.
+void remove_tree(const char *path) {
+    struct stat st;
+    if (fs_stat(path, &st) != 0) return;
+    if (S_ISDIR(st.st_mode)) {
+        WalkEntry *entries = NULL;
+        DIR *dp = opendir(path);
+        int n = dp ? dir_read_sorted(dp, path, &entries) : 0;
+        if (dp) closedir(dp);
+        for (int i = 0; i < n && entries; i++) {
+            char child[1100];
+            snprintf(child, sizeof(child), "%s/%s", path, entries[i].name);
+            remove_tree(child);
+        }
+        if (entries) dir_list_free(entries, n);
+        fs_rmdir(path);
+    } else {
+        fs_unlink(path);
+    }
+}
+
+// Commands that change nothing an ATOMIC batch would have to undo.
+const char *batch_readonly[] = {
+    "LS", "LSR", "READ", "STAT", "SHARED_WITH_ME", "UPLOAD_STATUS",
+    "CACHESTATS", "LOCKSTATS", "STATS",
+};
+
+// Works out what 'line' would change so it can be undone. Returns 1 if it
+// fills in 'u', 0 if there is nothing to undo (a read, or a command that
+// will be refused), and -1 if the command's effect cannot be undone.
+int batch_undo_prepare(Session *s, const char *line, BatchUndo *u) {
+    char cmd[20] = "", a1[256] = "", a2[256] = "", dir[512];
+    struct stat st;
+    sscanf(line, "%19s %255s %255s", cmd, a1, a2);
+    memset(u, 0, sizeof(*u));
+    for (int i = 0; i < (int)(sizeof(batch_readonly) / sizeof(batch_readonly[0])); i++)
+        if (strcmp(cmd, batch_readonly[i]) == 0) return 0;
+    if (strcmp(cmd, "MKDIR") == 0 || strcmp(cmd, "TOUCH") == 0 || strcmp(cmd, "WRITE") == 0 ||
+        strcmp(cmd, "COPY") == 0) {
+        const char *target = strcmp(cmd, "COPY") == 0 ? a2 : a1;
+        if (!resolve_path(s->current_user, target, u->to, "WRITE")) return 0;
+        u->kind = BATCH_CREATED;
+        return fs_stat(u->to, &st) == 0 ? -1 : 1;   // would truncate, append to or overwrite it
+    }
+    if (strcmp(cmd, "MOVE") == 0 || strcmp(cmd, "PUTFILE") == 0) {
+        if (!resolve_path(s->current_user, a1, u->from, "WRITE")) return 0;
+        if (strcmp(cmd, "MOVE") == 0) {
+            if (!resolve_path(s->current_user, a2, u->to, "WRITE")) return 0;
+        } else {
+            const char *fname = strrchr(a1, '/');
+            fname = fname ? fname + 1 : a1;
+            if (!resolve_path(s->current_user, a2, dir, "WRITE")) return 0;
+            if (snprintf(u->to, sizeof(u->to), "%s/%s", dir, fname) >= (int)sizeof(u->to)) return 0;
+        }
+        u->kind = BATCH_MOVED;
+        return fs_stat(u->to, &st) == 0 ? -1 : 1;   // moving back would not restore what it replaced
+    }
+    return -1;
+}
+
+// True if 'path' is, or is inside, something this batch created.
+int batch_created(const BatchUndo *log, int n, const char *path) {
+    for (int i = 0; i < n; i++) {
+        int len = strlen(log[i].to);
+        if (log[i].kind == BATCH_CREATED && strncmp(path, log[i].to, len) == 0 &&
+            (path[len] == '\0' || path[len] == '/'))
+            return 1;
+    }
+    return 0;
+}
+
+void batch_undo(BatchUndo *log, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        if (log[i].kind == BATCH_MOVED) {
+            fs_rename(log[i].to, log[i].from);
+            meta_invalidate_tree(log[i].from);
+        } else {
+            remove_tree(log[i].to);
+        }
+        meta_invalidate_tree(log[i].to);
+    }
+}
+
+// Next command line of the batch, without its newline. 'body' is the rest
+// of a BATCH frame, or NULL to read from the connection.
+int batch_next_line(Session *s, const char **body, char *out) {
+    if (*body) {
+        const char *nl = strchr(*body, '\n');
+        int n = nl ? (int)(nl - *body) : (int)strlen(*body);
+        if (n == 0 && !nl) return 0;
+        if (n > BUF - 1) n = BUF - 1;
+        memcpy(out, *body, n);
+        out[n] = '\0';
+        *body = nl ? nl + 1 : *body + strlen(*body);
+    } else {
+        while (!memchr(s->inbuf, '\n', s->in_len) && s->in_len < s->in_cap) {
+            worker_block_begin();
+            int r = recv_counted(s->sock, s->inbuf + s->in_len, s->in_cap - s->in_len);
+            worker_block_end();
+            worker_note_timeout(r);
+            if (r <= 0) return 0;
+            s->in_len += r;
+        }
+        session_take_command(s, out, 0);
+    }
+    out[strcspn(out, "\r\n")] = '\0';
+    return 1;
+}
+
+void batch_command(Session *s, const char *header, const char *body) {
+    int count = 0, atomic = 0;
+    char mode[20] = "", end[80];
+    sscanf(header, "%*s %d %19s", &count, mode);
+    atomic = strcmp(mode, "ATOMIC") == 0;
+    if (count <= 0 || count > BATCH_MAX) {
+        session_send(s, "Invalid batch size\n", 19);
+        return;
+    }
+
+    // Read every line first, so nothing is left to run as a normal command
+    // if an ATOMIC batch stops early.
+    char **lines = (char**)calloc(count, sizeof(char*));
+    BatchUndo *undo = atomic ? (BatchUndo*)malloc(count * sizeof(BatchUndo)) : NULL;
+    char line[BUF];
+    int got = 0;
+    while (lines && got < count && batch_next_line(s, &body, line)) {
+        if (!(lines[got] = strdup(line))) break;
+        got++;
+    }
+    if (!lines || got < count || (atomic && !undo)) {
+        for (int i = 0; lines && i < got; i++) free(lines[i]);
+        free(lines);
+        free(undo);
+        session_send(s, got < count ? "Batch incomplete\n" : "Server memory error\n", got < count ? 17 : 20);
+        return;
+    }
+
+    // Replies are collected the way a binary frame collects them, then
+    // re-sent with their index and status in front.
+    int was_capturing = s->capture;
+    int ok = 0, failed = 0, undone = 0, refused = -1;
+    s->capture = 1;
+
+    // An ATOMIC batch only starts if every command in it can be undone.
+    // Paths an earlier line creates do not exist yet, so they pass here.
+    for (int i = 0; atomic && i < count && refused < 0; i++) {
+        BatchUndo u;
+        if (batch_undo_prepare(s, lines[i], &u) < 0) refused = i;
+    }
+    if (refused >= 0) {
+        sprintf(end, "%d ERR 36\nCannot be undone in an ATOMIC batch\n", refused);
+        session_send(s, end, strlen(end));
+        failed = 1;
+    }
+    for (int i = 0; refused < 0 && i < count; i++) {
+        char cmd[20] = "", head[64];
+        BatchUndo u;
+        sscanf(lines[i], "%19s", cmd);
+        int track = atomic ? batch_undo_prepare(s, lines[i], &u) : 0;
+        // Writing into what the batch itself created is undone with it;
+        // anything else that appeared since the check is left alone.
+        int blocked = track < 0 && !(u.kind == BATCH_CREATED && batch_created(undo, undone, u.to));
+        long start = s->out_len;
+        if (blocked) session_send(s, "Cannot be undone in an ATOMIC batch\n", 36);
+        else if (batch_allowed(cmd)) process_command(s, lines[i]);
+        else session_send(s, "Not available in BATCH\n", 23);
+
+        long len = s->out_len - start;
+        char *reply = (char*)malloc(len + 1);
+        if (reply) {
+            memcpy(reply, s->out + start, len);
+            reply[len] = '\0';
+        }
+        s->out_len = start;
+        int success = reply && !blocked && batch_reply_ok(cmd, reply);
+        if (success) ok++;
+        else failed++;
+        if (success && track > 0) {
+            struct stat st;
+            if (u.kind == BATCH_MOVED || fs_stat(u.to, &st) == 0) undo[undone++] = u;
+        }
+        sprintf(head, "%d %s %ld\n", i, success ? "OK" : "ERR", reply ? len : 0);
+        session_send(s, head, strlen(head));
+        if (reply) session_send(s, reply, len);
+        free(reply);
+        if (!success && atomic) break;
+    }
+    if (atomic && failed) batch_undo(undo, undone);
+    sprintf(end, "END %d %d%s\n", ok, failed, (atomic && failed && refused < 0) ? " ROLLED_BACK" : "");
+    session_send(s, end, strlen(end));
+    s->capture = was_capturing;
+    if (!was_capturing) session_flush(s);
+
+    for (int i = 0; i < count; i++) free(lines[i]);
+    free(lines);
+    free(undo);
+}
+
+void run_command(Session *s, char *buf) {
+    SOCKET c = s->sock;
+    char *current_user = s->current_user;
+    char cmd[20] = "", a1[256], a2[256];
+    char path1[512], path2[512];
+
+    sscanf(buf, "%19s", cmd);
+
+    /* LOGGING */
+    char log_buf[BUF];
+    strcpy(log_buf, buf);
+    log_buf[strcspn(log_buf, "\r\n")] = 0;
+    log_command(current_user, log_buf);
+
+    /* LS */
+    if (strcmp(cmd, "LS") == 0) {
+        if (strlen(current_user) == 0) {
+            session_send(s, "Please login first\n", 19);
+        } else {
+            WalkEntry *entries;
+            char search_path[512], file_list[BUF];
+            
+            // 1. List Local Files
+            sprintf(search_path, "storage/%s", current_user);
+            memset(file_list, 0, BUF);
+            
+            int n = meta_list(search_path, &entries);
+            for (int i = 0; i < n; i++) {
+                if (strlen(file_list) + strlen(entries[i].name) + 20 < BUF) {
+                    if (entries[i].is_dir) strcat(file_list, "[DIR] ");
+                    strcat(file_list, entries[i].name);
+                    strcat(file_list, "\n");
+                }
+            }
+            if (n >= 0) dir_list_free(entries, n);
+            
+            // 2. Append Shared Folders
+            ShareSnapshot *sn = share_pin();
+            for (int k = share_first_for(sn, current_user); k >= 0; k = sn->next_for_grantee[k]) {
+                 char line[120];
+                 sprintf(line, "[SHARED] %s (from %s)\n", sn->items[k].folder_name, sn->items[k].owner);
+                 if (strlen(file_list) + strlen(line) < BUF)
+                     strcat(file_list, line);
+            }
+            share_unpin();
+            
+            if (strlen(file_list) == 0) strcpy(file_list, "Empty directory\n");
+            session_send(s, file_list, strlen(file_list));
+        }
+    }
+
+    /* LSR [path] [LIMIT n] [AFTER cursor] */
+    else if (strcmp(cmd, "LSR") == 0) {
+         if (strlen(current_user) == 0) {
+             session_send(s, "Please login first\n", 19);
+         } else {
+             lsr_command(s, current_user, s->framed ? LSR_FRAME_PAGE : -1, buf);
+         }
+    }
+
+    /* REGISTER */
+    else if (strcmp(cmd, "REGISTER") == 0) {
+        sscanf(buf, "%*s %s %s", a1, a2);
+        if (!register_user(a1, a2)) {
+            session_send(s, "User already exists\n", 21);
+        } else {
+            _mkdir("storage");
+            sprintf(path1, "storage/%s", a1);
+            _mkdir(path1);
+
+            session_send(s, "Registration successful\n", 24);
+        }
+    }
+
+    /* LOGIN */
+    else if (strcmp(cmd, "LOGIN") == 0) {
+        sscanf(buf, "%*s %s %s", a1, a2);
+        if (authenticate(a1, a2)) {
+            strcpy(current_user, a1);
+            session_send(s, "Login successful\n", 18);
+        } else {
+            session_send(s, "Invalid credentials\n", 20);
+        }
+    }
+    
+    /* LOGOUT */
+    else if (strcmp(cmd, "LOGOUT") == 0) {
+        current_user[0] = '\0';
+        session_token_revoke(c);
+        session_send(s, "Logged out\n", 11);
+    }
+
+    /* PROTO BINARY <version> : switch this connection to binary frames */
+    else if (strcmp(cmd, "PROTO") == 0) {
+        int version = 0;
+        a1[0] = '\0';
+        sscanf(buf, "%*s %255s %d", a1, &version);
+        if (strcmp(a1, "BINARY") == 0 && version == FRAME_VERSION && !s->framed) {
+            session_send(s, "PROTO BINARY 1 OK\n", 18);
+            s->framed = 1;
+        } else {
+            session_send(s, "PROTO ERROR unsupported\n", 24);
+        }
+    }
+
+    /* ATTACH <token> : log in as the connection that issued the token */
+    else if (strcmp(cmd, "ATTACH") == 0) {
+        sscanf(buf, "%*s %255s", a1);
+        if (session_token_user(a1, current_user)) session_send(s, "Attached\n", 9);
+        else session_send(s, "Invalid token\n", 14);
+    }
+
+    /* BATCH <count> [ATOMIC] : <count> commands in one round trip (each checks the login) */
+    else if (strcmp(cmd, "BATCH") == 0) {
+        batch_command(s, buf, NULL);
+    }
+
+    /* BLOCK IF NOT LOGGED IN (Except Auth) */
+    else if (strlen(current_user) == 0) {
+        session_send(s, "Please login first\n", 19);
+    }
+
+    /* SHARE <folder> WITH <user> <perm> */
+    else if (strcmp(cmd, "SHARE") == 0) {
+        // Buf: SHARE docs WITH user2 READ
+        // sscanf format slightly tricky with "WITH"
+        char target[50], perm[20];
+        sscanf(buf, "%*s %s %*s %s %s", a1, target, perm); // a1=folder
+        
+        // Verify file/folder exists locally
+        sprintf(path1, "storage/%s/%s", current_user, a1);
+        struct stat st;
+        if (stat(path1, &st) != 0) {
+            session_send(s, "Error: File/Folder not found\n", 29);
+        } else if (!user_exists(target)) {
+            session_send(s, "Error: Target user not found\n", 29);
+        } else {
+            if (save_share(current_user, a1, target, perm))
+                session_send(s, "Shared successfully\n", 20);
+            else
+                session_send(s, "Server memory error\n", 20);
+        }
+    }
+
+    /* SHARED_WITH_ME */
+    else if (strcmp(cmd, "SHARED_WITH_ME") == 0) {
+        char list[BUF] = "Folders/Files shared with you:\n";
+        int found = 0;
+        ShareSnapshot *sn = share_pin();
+        for (int k = share_first_for(sn, current_user); k >= 0; k = sn->next_for_grantee[k]) {
+            SharedFolder *f = &sn->items[k];
+            char line[250];
+            sprintf(line, "- %s (Use Path: SHARED/%s/%s) [%s]\n",
+                f->folder_name, f->owner, f->folder_name, f->permission);
+            if (strlen(list) + strlen(line) < BUF)
+                strcat(list, line);
+            found = 1;
+        }
+        share_unpin();
+        if (!found) strcat(list, "(None)\n");
+        session_send(s, list, strlen(list));
+    }
+    
+    /* MKDIR */
+    else if (strcmp(cmd, "MKDIR") == 0) {
+        sscanf(buf, "%*s %s", a1);
+        if (resolve_path(current_user, a1, path1, "WRITE")) {
+            struct stat st;
+            if (fs_mkdir(path1) != 0 && (fs_stat(path1, &st) != 0 || !S_ISDIR(st.st_mode))) {
+                session_send(s, "Directory creation failed\n", 26);
+            } else {
+                meta_invalidate(path1);
+                session_send(s, "Directory created\n", 18);
+            }
+        } else {
+             session_send(s, "Access Denied (Write)\n", 22);
+        }
+    }
+
+    /* RMDIR */
+    else if (strcmp(cmd, "RMDIR") == 0) {
+        sscanf(buf, "%*s %s", a1);
+        if (resolve_path(current_user, a1, path1, "WRITE")) {
+            if (fs_rmdir(path1) == 0) {
+                meta_invalidate_tree(path1);
+                session_send(s, "Directory removed\n", 18);
+            } else
+                session_send(s, "Directory not empty or in use\n", 30);
+        } else {
+            session_send(s, "Access Denied (Write)\n", 22);
+        }
+    }
+
+    /* TOUCH */
+    else if (strcmp(cmd, "TOUCH") == 0) {
+        sscanf(buf, "%*s %s", a1);
+        if (resolve_path(current_user, a1, path1, "WRITE")) {
+            int fd = fs_open(path1, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) session_send(s, "File creation failed\n", 21);
+            else {
+                fs_close(fd);
+                meta_invalidate(path1);
+                session_send(s, "Empty file created\n", 19);
+            }
+        } else {
+            session_send(s, "Access Denied (Write)\n", 22);
+        }
+    }
+
+    /* LOCK_FILE <file> [wait_ms] */
+    else if (strcmp(cmd, "LOCK_FILE") == 0) {
+        int wait_ms = g_cfg.writer_wait_ms;
+        sscanf(buf, "%*s %s %d", a1, &wait_ms);
+        if (resolve_path(current_user, a1, path1, "WRITE")) {
+             FileLock *l = get_file_lock(path1);
+             if (!l) {
+                 session_send(s, "Server memory error\n", 20);
+             } else if (acquire_write_lock(l, c, wait_ms)) {
+                 session_send(s, "WRITE_LOCK_GRANTED\n", 19);
+                 put_file_lock(l); // entry stays alive while the lock is held
+             } else {
+                 session_send(s, "WRITE_LOCK_DENIED: File is currently locked by another user\n", 54);
+                 put_file_lock(l);
+             }
+        } else {
+             session_send(s, "Error: Access Denied or File Not Found\n", 37);
+        }
+    }
+
+    /* LOCKSTATS : lock contention report */
+    else if (strcmp(cmd, "LOCKSTATS") == 0) {
+        char report[BUF * 2];
+        lock_stats_format(report);
+        session_send(s, report, strlen(report));
+    }
+
+    /* STATS : per-command latency, traffic, sessions and lock contention (logged in only, like all below) */
+    else if (strcmp(cmd, "STATS") == 0) {
+        char *report = (char*)malloc(METRICS_REPORT);
+        if (report) {
+            metrics_format(report);
+            session_send(s, report, strlen(report));
+            free(report);
+        } else {
+            session_send(s, "Server memory error\n", 20);
+        }
+    }
+
+    /* CACHESTATS : cache hit rates and memory use */
+    else if (strcmp(cmd, "CACHESTATS") == 0) {
+        char report[BUF * 2];
+        meta_stats_format(report);
+        content_stats_format(report + strlen(report));
+        read_budget_format(report + strlen(report));
+        session_send(s, report, strlen(report));
+    }
+
+    /* UNLOCK_FILE */
+    else if (strcmp(cmd, "UNLOCK_FILE") == 0) {
+        sscanf(buf, "%*s %s", a1);
+        if (resolve_path(current_user, a1, path1, "WRITE")) {
+             FileLock *l = get_file_lock(path1);
+             if (l) {
+                 release_write_lock(l, c);
+                 put_file_lock(l);
+             }
+             session_send(s, "FILE_UNLOCKED\n", 14);
+        } else {
+             session_send(s, "Error: Access Denied\n", 21);
+        }
+    }
+
+    /* WRITE */
+    else if (strcmp(cmd, "WRITE") == 0) {
+        char data[512];
+        sscanf(buf, "%*s %s %[^\n]", a1, data);
+        
+        if (resolve_path(current_user, a1, path1, "WRITE")) {
+            FileLock *l = get_file_lock(path1);
+            
+            // Try acquire lock (if user doesn't already have it)
+            // In strict mode, user should have called LOCK_FILE first, 
+            // but we allow atomic write if free.
+            if (!l) {
+                session_send(s, "Server memory error\n", 20);
+            } else if (acquire_write_lock(l, c, g_cfg.writer_wait_ms)) {
+                int fd = fs_open(path1, O_WRONLY | O_APPEND | O_CREAT, 0644);
+                if (fd < 0)
+                    session_send(s, "File not found\n", 15);
                 else {
-                    fseek(fp, 0, SEEK_END);
-                    long fsize = ftell(fp);
-                    fseek(fp, 0, SEEK_SET);
-                    
-                    if (fsize >= BUF) {
-                        char *file_buf = malloc(fsize + 1);
-                        if (file_buf) {
-                            fread(file_buf, 1, fsize, fp);
-                            file_buf[fsize] = 0;
-                            send(c, file_buf, fsize, 0);
-                            free(file_buf);
-                        } else {
-                            send(c, "File too large\n", 15, 0);
-                        }
-                    } else {
-                        char *file_buf = malloc(fsize + 1);
-                        fread(file_buf, 1, fsize, fp);
-                        file_buf[fsize] = 0;
-                        send(c, file_buf, fsize, 0);
-                        free(file_buf);
-                    }
-                    fclose(fp);
+                    fs_pwrite(fd, data, (long)strlen(data), -1);
+                    fs_close(fd);
+                    meta_invalidate(path1);
+                    session_send(s, "WRITE_COMPLETED\n", 16); // Prompt Requirement
                 }
-                release_read_lock(l, c);
+                // Prompt says: "The server must release the file lock immediately"
+                release_write_lock(l, c);
+                put_file_lock(l);
+            } else {
+                 session_send(s, "ACCESS DENIED: File is currently locked by another user\n", 54);
+                 put_file_lock(l);
+            }
+        } else {
+            session_send(s, "Access Denied (Write)\n", 22);
+        }
+    }
+
+    /* READ */
+    else if (strcmp(cmd, "READ") == 0) {
+        sscanf(buf, "%*s %s", a1);
+        
+        if (resolve_path(current_user, a1, path1, "READ")) {
+            FileLock *l = get_file_lock(path1);
+            if (!l) {
+                session_send(s, "Server memory error\n", 20);
+                return;
+            }
+            acquire_read_lock(l, s);
+            
+            struct stat fst;
+            ContentFile *cf = content_get(path1);
+            int fd = cf ? -1 : fs_open(path1, O_RDONLY, 0);
+            // A captured reply (binary frame or BATCH) is buffered whole in
+            // s->out, so it is held to FRAME_MAX like a GET frame.
+            if (cf && s->capture && cf->size > FRAME_MAX) {
+                content_release(cf);
+                session_send(s, "File too large for a frame, use DOWNLOAD\n", 41);
+            } else if (cf) {
+                session_send(s, cf->data, cf->size);
+                content_release(cf);
+            } else if (fd < 0 || fs_stat(path1, &fst) != 0) {
+                if (fd >= 0) fs_close(fd);
+                session_send(s, "File not found\n", 15);
+            } else if (s->capture && fst.st_size > FRAME_MAX) {
+                fs_close(fd);
+                session_send(s, "File too large for a frame, use DOWNLOAD\n", 41);
             } else {
-                send(c, "Access Denied (Read)\n", 21, 0);
+                read_send_file(s, fd, (long)fst.st_size);
+                fs_close(fd);
             }
+            release_read_lock(l, c);
+            put_file_lock(l);
+        } else {
+            session_send(s, "Access Denied (Read)\n", 21);
         }
-        
-        /* UPLOAD */
-        else if (strcmp(cmd, "UPLOAD") == 0) {
-             long filesize = 0;
-             sscanf(buf, "%*s %s %ld", a1, &filesize);
-             
-             if (resolve_path(current_user, a1, path1, "WRITE")) {
-                if (filesize > 0) {
-                    send(c, "READY", 5, 0);
-                    FILE *fp = fopen(path1, "wb");
-                    if (fp) {
-                        char *img_buf = malloc(BUF);
-                        long total_rcvd = 0;
-                        int r;
-                        while (total_rcvd < filesize) {
-                            int to_read = (filesize - total_rcvd < BUF) ? (filesize - total_rcvd) : BUF;
-                            r = recv(c, img_buf, to_read, 0);
-                            if (r <= 0) break;
-                            fwrite(img_buf, 1, r, fp);
-                            total_rcvd += r;
-                        }
-                        free(img_buf);
+    }
+    
+    /* UPLOAD <name> <size> [offset] */
+    else if (strcmp(cmd, "UPLOAD") == 0) {
+         long filesize = 0, offset = 0;
+         sscanf(buf, "%*s %s %ld %ld", a1, &filesize, &offset);
+         
+         if (resolve_path(current_user, a1, path1, "WRITE")) {
+            if (filesize <= 0) session_send(s, "Invalid Size\n", 13);
+            else if (offset < 0 || offset >= filesize) session_send(s, "Invalid Offset\n", 15);
+            else {
+                // Receive into <target>.part and rename it over the target
+                // only once every byte has arrived. An interrupted upload
+                // keeps its partial file so it can be resumed at 'offset'.
+                char tmp_path[600];
+                struct stat pst;
+                partial_path(path1, tmp_path);
+                int claim = partial_claim(path1, filesize, offset, c);
+                FILE *fp = NULL;
+                if (claim == 1 && offset > 0 && (fs_stat(tmp_path, &pst) != 0 || pst.st_size < offset))
+                    claim = -1;
+                if (claim == 1) {
+                    fp = fopen(tmp_path, offset > 0 ? "r+b" : "wb");
+                    if (fp && offset > 0 && !truncate_file(fp, offset)) {
                         fclose(fp);
-                        send(c, "Upload Complete\n", 16, 0);
+                        fp = NULL;
+                    }
+                }
+                if (claim == 0) {
+                    session_send(s, "Upload in progress\n", 19);
+                } else if (claim < 0) {
+                    partial_release(path1, 0);
+                    session_send(s, "Invalid Offset\n", 15);
+                } else if (fp && !preallocate_file(fp, filesize)) {
+                    // Refuse before READY rather than fail halfway through.
+                    fclose(fp);
+                    if (offset == 0) remove(tmp_path);
+                    partial_release(path1, offset == 0);
+                    session_send(s, "Upload Failed: No space\n", 24);
+                } else if (fp) {
+                    session_send(s, "READY", 5);
+                    double t0 = now_ms();
+                    worker_block_begin();
+                    long total_rcvd = recv_file_data(s, fp, offset, filesize - offset);
+                    worker_block_end();
+                    fclose(fp);
+                    log_transfer("UPLOAD", path1, total_rcvd, now_ms() - t0);
+
+                    if (offset + total_rcvd == filesize && replace_file(tmp_path, path1) == 0) {
+                        partial_release(path1, 1);
+                        meta_invalidate(path1);
+                        session_send(s, "Upload Complete\n", 16);
+                    } else if (offset + total_rcvd == filesize) {
+                        remove(tmp_path);
+                        partial_release(path1, 1);
+                        session_send(s, "Upload Failed\n", 14);
                     } else {
-                        send(c, "Server Error\n", 13, 0);
+                        partial_release(path1, 0);
+                        meta_invalidate(tmp_path);
+                        session_send(s, "Upload Failed\n", 14);
                     }
-                } else send(c, "Invalid Size\n", 13, 0);
-             } else {
-                 send(c, "Access Denied (Write)\n", 22, 0);
-             }
+                } else {
+                    partial_release(path1, 0);
+                    session_send(s, "Server Error\n", 13);
+                }
+            }
+         } else {
+             session_send(s, "Access Denied (Write)\n", 22);
+         }
+    }
+
+    /* DELTA_SIG <name> [block] : block signatures of the server's copy */
+    else if (strcmp(cmd, "DELTA_SIG") == 0) {
+        long block = 0;
+        sscanf(buf, "%*s %s %ld", a1, &block);
+        if (!resolve_path(current_user, a1, path1, "WRITE")) {
+            session_send(s, "Access Denied (Write)\n", 22);
+        } else if (block != 0 && (block < DELTA_BLOCK_MIN || block > DELTA_BLOCK_MAX)) {
+            session_send(s, "Invalid Block Size\n", 19);
+        } else {
+            int fd = fs_open(path1, O_RDONLY, 0);
+            if (fd < 0) {
+                session_send(s, "No Such File\n", 13);
+            } else {
+                if (!delta_send_signature(s, fd, block)) session_send(s, "Server Error\n", 13);
+                fs_close(fd);
+            }
+        }
+    }
+
+    /* DELTA_UPLOAD <name> <size> <block> : rebuild <name> from its old copy and a delta */
+    else if (strcmp(cmd, "DELTA_UPLOAD") == 0) {
+        long filesize = 0, block = 0;
+        sscanf(buf, "%*s %s %ld %ld", a1, &filesize, &block);
+        if (!resolve_path(current_user, a1, path1, "WRITE")) {
+            session_send(s, "Access Denied (Write)\n", 22);
+        } else if (filesize <= 0) {
+            session_send(s, "Invalid Size\n", 13);
+        } else if (block < DELTA_BLOCK_MIN || block > DELTA_BLOCK_MAX) {
+            session_send(s, "Invalid Block Size\n", 19);
+        } else if (partial_claim(path1, filesize, 0, c) != 1) {
+            session_send(s, "Upload in progress\n", 19);
+        } else {
+            char tmp_path[600], reply[120];
+            struct stat st;
+            partial_path(path1, tmp_path);
+            int basis = fs_open(path1, O_RDONLY, 0);
+            int out = (basis >= 0) ? fs_open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+            if (basis < 0) {
+                partial_release(path1, 1);
+                session_send(s, "No Such File\n", 13);
+            } else if (out < 0 || fstat(basis, &st) != 0) {
+                if (out >= 0) fs_close(out);
+                fs_close(basis);
+                partial_release(path1, 1);
+                session_send(s, "Server Error\n", 13);
+            } else {
+                long literal = 0, matched = 0;
+                session_send(s, "READY", 5);
+                double t0 = now_ms();
+                int r = delta_apply(s, basis, (long)st.st_size, block, out, filesize, &literal, &matched);
+                fs_close(out);
+                fs_close(basis);
+                log_transfer("UPLOAD (delta)", path1, literal, now_ms() - t0);
+                if (r == 1 && replace_file(tmp_path, path1) == 0) {
+                    partial_release(path1, 1);
+                    meta_invalidate(path1);
+                    sprintf(reply, "Upload Complete (delta: %ld bytes sent, %ld reused)\n", literal, matched);
+                    session_send(s, reply, strlen(reply));
+                } else {
+                    remove(tmp_path);
+                    partial_release(path1, 1);
+                    if (r == 0) session_send(s, "Delta Mismatch\n", 15);
+                    else session_send(s, "Upload Failed\n", 14);
+                }
+            }
+        }
+    }
+
+    /* UPLOAD_STATUS <name> : how much of an interrupted upload is on disk */
+    else if (strcmp(cmd, "UPLOAD_STATUS") == 0) {
+        sscanf(buf, "%*s %s", a1);
+        if (resolve_path(current_user, a1, path1, "WRITE")) {
+            long expected;
+            int active;
+            long received = partial_status(path1, &expected, &active);
+            char reply[100];
+            sprintf(reply, "PARTIAL %ld %ld%s\n", received, expected, active ? " ACTIVE" : "");
+            session_send(s, reply, strlen(reply));
+        } else {
+            session_send(s, "Access Denied (Write)\n", 22);
+        }
+    }
+
+    /* SESSION_TOKEN : lets more connections act for this login (ATTACH) */
+    else if (strcmp(cmd, "SESSION_TOKEN") == 0) {
+        char token[33], reply[64];
+        if (strlen(current_user) == 0) {
+            session_send(s, "Please login first\n", 19);
+        } else if (session_token_issue(c, current_user, token)) {
+            sprintf(reply, "TOKEN %s\n", token);
+            session_send(s, reply, strlen(reply));
+        } else {
+            session_send(s, "Server Error\n", 13);
+        }
+    }
+
+    /* UPLOAD_BEGIN <name> <size> <chunk_size> : start a chunked upload */
+    else if (strcmp(cmd, "UPLOAD_BEGIN") == 0) {
+        long filesize = 0, chunk = 0;
+        sscanf(buf, "%*s %s %ld %ld", a1, &filesize, &chunk);
+        if (!resolve_path(current_user, a1, path1, "WRITE")) {
+            session_send(s, "Access Denied (Write)\n", 22);
+        } else if (filesize <= 0) {
+            session_send(s, "Invalid Size\n", 13);
+        } else if (chunk < CHUNK_MIN || chunk > CHUNK_MAX) {
+            session_send(s, "Invalid Chunk Size\n", 19);
+        } else if (partial_claim(path1, filesize, 0, c) != 1) {
+            session_send(s, "Upload in progress\n", 19);
+        } else {
+            char tmp_path[600], reply[64];
+            partial_path(path1, tmp_path);
+            FILE *fp = fopen(tmp_path, "wb");
+            int room = fp && preallocate_file(fp, filesize);
+            if (fp) fclose(fp);
+            int chunks = room ? partial_begin_chunks(path1, chunk, c) : 0;
+            if (chunks > 0) {
+                sprintf(reply, "XFER %d\n", chunks);
+                session_send(s, reply, strlen(reply));
+            } else if (fp && !room) {
+                remove(tmp_path);
+                partial_release(path1, 1);
+                session_send(s, "Upload Failed: No space\n", 24);
+            } else {
+                partial_release(path1, 1);
+                session_send(s, "Server Error\n", 13);
+            }
+        }
+    }
+
+    /* UPLOAD_CHUNK <name> <index> <crc32> : one chunk, from any attached connection */
+    else if (strcmp(cmd, "UPLOAD_CHUNK") == 0) {
+        int index = -1;
+        unsigned int crc = 0;
+        long offset, len;
+        unsigned int gen;
+        char reply[64];
+        sscanf(buf, "%*s %s %d %x", a1, &index, &crc);
+        if (!resolve_path(current_user, a1, path1, "WRITE")) {
+            session_send(s, "Access Denied (Write)\n", 22);
+        } else {
+            int state = partial_chunk_info(path1, index, &offset, &len, &gen);
+            char tmp_path[600];
+            partial_path(path1, tmp_path);
+            int fd = (state == 1) ? fs_open(tmp_path, O_WRONLY, 0) : -1;
+            if (state == 0) {
+                session_send(s, "No such chunk\n", 14);
+            } else if (state == 2) {
+                sprintf(reply, "CHUNK_DONE %d\n", index);
+                session_send(s, reply, strlen(reply));
+            } else if (fd < 0) {
+                session_send(s, "Server Error\n", 13);
+            } else {
+                session_send(s, "READY", 5);
+                int r = recv_chunk(s, fd, offset, len, crc);
+                fs_close(fd);
+                if (r == 1) {
+                    partial_chunk_done(path1, index, gen);
+                    sprintf(reply, "CHUNK_OK %d\n", index);
+                    session_send(s, reply, strlen(reply));
+                } else if (r == 0) {
+                    sprintf(reply, "CHUNK_BAD %d\n", index);
+                    session_send(s, reply, strlen(reply));
+                }
+            }
         }
+    }
 
-        /* DELETE */
-        else if (strcmp(cmd, "DELETE") == 0) {
-            sscanf(buf, "%*s %s", a1);
-            if (resolve_path(current_user, a1, path1, "WRITE")) {
-                if (remove(path1) == 0)
-                    send(c, "File deleted\n", 13, 0);
-                else
-                    send(c, "Delete failed\n", 14, 0);
+    /* UPLOAD_END <name> : put a chunked upload in place once it is complete */
+    else if (strcmp(cmd, "UPLOAD_END") == 0) {
+        sscanf(buf, "%*s %s", a1);
+        if (!resolve_path(current_user, a1, path1, "WRITE")) {
+            session_send(s, "Access Denied (Write)\n", 22);
+        } else {
+            int missing = partial_chunks_missing(path1, c);
+            char tmp_path[600], reply[64];
+            partial_path(path1, tmp_path);
+            if (missing < 0) {
+                session_send(s, "No chunked upload\n", 18);
+            } else if (missing > 0) {
+                sprintf(reply, "Upload Incomplete: %d chunks missing\n", missing);
+                session_send(s, reply, strlen(reply));
+            } else if (replace_file(tmp_path, path1) == 0) {
+                partial_release(path1, 1);
+                meta_invalidate(path1);
+                session_send(s, "Upload Complete\n", 16);
             } else {
-                send(c, "Access Denied (Write)\n", 22, 0);
+                remove(tmp_path);
+                partial_release(path1, 1);
+                session_send(s, "Upload Failed\n", 14);
             }
         }
+    }
+
+    /* DELETE */
+    else if (strcmp(cmd, "DELETE") == 0) {
+        sscanf(buf, "%*s %s", a1);
+        if (resolve_path(current_user, a1, path1, "WRITE")) {
+            if (fs_unlink(path1) == 0) {
+                meta_invalidate(path1);
+                session_send(s, "File deleted\n", 13);
+            } else
+                session_send(s, "Delete failed\n", 14);
+        } else {
+            session_send(s, "Access Denied (Write)\n", 22);
+        }
+    }
 
-        /* DOWNLOAD */
-        else if (strcmp(cmd, "DOWNLOAD") == 0) {
-            sscanf(buf, "%*s %s", a1);
-            if (resolve_path(current_user, a1, path1, "READ")) { // Using new resolve_path
-                FILE *fp = fopen(path1, "rb");
+    /* DOWNLOAD <name> [offset [length]] */
+    else if (strcmp(cmd, "DOWNLOAD") == 0) {
+        long offset = 0, length = -1;
+        int ranged = sscanf(buf, "%*s %s %ld %ld", a1, &offset, &length) >= 2;
+        if (resolve_path(current_user, a1, path1, "READ")) { // Using new resolve_path
+            // Cached files are sent from the shared buffer, others from disk.
+            ContentFile *cf = content_get(path1);
+            FILE *fp = cf ? NULL : fopen(path1, "rb");
+            if (cf || fp) {
+                long fsize = cf ? cf->size : 0;
                 if (fp) {
                     fseek(fp, 0, SEEK_END);
-                    long fsize = ftell(fp);
+                    fsize = ftell(fp);
                     fseek(fp, 0, SEEK_SET);
+                }
 
-                    char size_msg[50];
-                    sprintf(size_msg, "SIZE %ld", fsize);
-                    send(c, size_msg, strlen(size_msg), 0);
+                // A ranged request is answered "SIZE <length> <total>".
+                char size_msg[50];
+                if (length < 0 || length > fsize - offset) length = fsize - offset;
+                if (ranged) sprintf(size_msg, "SIZE %ld %ld", length, fsize);
+                else sprintf(size_msg, "SIZE %ld", fsize);
+
+                if (offset < 0 || offset > fsize) {
+                    session_send(s, "Invalid Range\n", 14);
+                } else {
+                    session_send(s, size_msg, strlen(size_msg));
 
                     // Wait for client to be ready
                     char ack[20];
                     memset(ack, 0, 20);
-                    recv(c, ack, 20, 0); 
+                    session_recv(s, ack, sizeof(ack) - 1);
                     if (strstr(ack, "READY")) {
-                        char *fbuf = malloc(BUF);
-                        size_t n;
-                        while ((n = fread(fbuf, 1, BUF, fp)) > 0) {
-                            send(c, fbuf, n, 0);
-                        }
-                        free(fbuf);
+                        double t0 = now_ms();
+                        long sent;
+                        worker_block_begin();
+                        if (cf) sent = send_all(c, cf->data + offset, length) ? length : 0;
+                        else sent = send_file_data(c, fp, offset, length);
+                        worker_block_end();
+                        log_transfer("DOWNLOAD", path1, sent, now_ms() - t0);
                     }
-                    fclose(fp);
-                } else {
-                    send(c, "File not found\n", 15, 0);
                 }
+                if (cf) content_release(cf);
+                else fclose(fp);
             } else {
-                send(c, "Access Denied (Read)\n", 21, 0);
+                session_send(s, "File not found\n", 15);
             }
+        } else {
+            session_send(s, "Access Denied (Read)\n", 21);
         }
-        
-    /* STAT */ 
+    }
+    
+    /* STAT */
     else if (strcmp(cmd, "STAT") == 0) {
-            sscanf(buf, "%*s %s", a1);
-            if (resolve_path(current_user, a1, path1, "READ")) {
-                struct stat fileStat;
-                if (stat(path1, &fileStat) == 0) {
-                    char detailBuf[BUF];
-                    sprintf(detailBuf, "Size: %ld bytes\nMode: %o\n", fileStat.st_size, fileStat.st_mode);
-                    send(c, detailBuf, strlen(detailBuf), 0);
-                } else {
-                    send(c, "File not found\n", 15, 0);
-                }
+        sscanf(buf, "%*s %s", a1);
+        if (resolve_path(current_user, a1, path1, "READ")) {
+            struct stat fileStat;
+            if (meta_stat(path1, &fileStat) == 0) {
+                char detailBuf[BUF];
+                sprintf(detailBuf, "Size: %ld bytes\nMode: %o\n", fileStat.st_size, fileStat.st_mode);
+                session_send(s, detailBuf, strlen(detailBuf));
             } else {
-                send(c, "Access Denied (Read)\n", 21, 0);
+                session_send(s, "File not found\n", 15);
             }
+        } else {
+            session_send(s, "Access Denied (Read)\n", 21);
         }
+    }
+    
+    /* PUTFILE <file> <dir> */
+    else if (strcmp(cmd, "PUTFILE") == 0) {
+        sscanf(buf, "%*s %s %s", a1, a2);
+        char src_path[512], dest_dir_path[512], final_path[512];
         
-        /* PUTFILE <file> <dir> */
-        else if (strcmp(cmd, "PUTFILE") == 0) {
-            sscanf(buf, "%*s %s %s", a1, a2);
-            char src_path[512], dest_dir_path[512], final_path[512];
-            
-            int src_ok = resolve_path(current_user, a1, src_path, "WRITE");
-            int dest_ok = resolve_path(current_user, a2, dest_dir_path, "WRITE");
-            
-            if (src_ok && dest_ok) {
-                struct stat st_check;
-                // Check source exists
-                if (stat(src_path, &st_check) != 0) {
-                     send(c, "Source file not found\n", 23, 0); 
-                }
-                // Check dest is dir
-                else if (stat(dest_dir_path, &st_check) != 0 || !(st_check.st_mode & S_IFDIR)) {
-                     send(c, "Destination not a folder\n", 26, 0); 
-                }
-                else {
-                    // Extract filename
-                    char *fname = strrchr(a1, '/');
-                    if (!fname) fname = strrchr(a1, '\\');
-                    if (!fname) fname = a1; else fname++;
-                    
-                    sprintf(final_path, "%s/%s", dest_dir_path, fname);
-                    
-                    if (rename(src_path, final_path) == 0)
-                        send(c, "File moved successfully\n", 24, 0);
-                    else
-                        send(c, "Move failed\n", 12, 0);
-                }
-            } else {
-                send(c, "Access Denied\n", 14, 0);
+        int src_ok = resolve_path(current_user, a1, src_path, "WRITE");
+        int dest_ok = resolve_path(current_user, a2, dest_dir_path, "WRITE");
+        
+        if (src_ok && dest_ok) {
+            struct stat st_check;
+            // Check source exists
+            if (fs_stat(src_path, &st_check) != 0) {
+                 session_send(s, "Source file not found\n", 23); 
+            }
+            // Check dest is dir
+            else if (fs_stat(dest_dir_path, &st_check) != 0 || !(st_check.st_mode & S_IFDIR)) {
+                 session_send(s, "Destination not a folder\n", 26); 
+            }
+            else {
+                // Extract filename
+                char *fname = strrchr(a1, '/');
+                if (!fname) fname = strrchr(a1, '\\');
+                if (!fname) fname = a1; else fname++;
+                
+                sprintf(final_path, "%s/%s", dest_dir_path, fname);
+                
+                if (fs_rename(src_path, final_path) == 0) {
+                    meta_invalidate_tree(src_path);
+                    meta_invalidate(final_path);
+                    session_send(s, "File moved successfully\n", 24);
+                } else
+                    session_send(s, "Move failed\n", 12);
             }
+        } else {
+            session_send(s, "Access Denied\n", 14);
         }
+    }
 
-        /* MOVE <src> <dest> */
-        else if (strcmp(cmd, "MOVE") == 0) {
-             sscanf(buf, "%*s %s %s", a1, a2);
-             if (resolve_path(current_user, a1, path1, "WRITE") && 
-                 resolve_path(current_user, a2, path2, "WRITE")) {
-                 if (rename(path1, path2) == 0)
-                     send(c, "Moved successfully\n", 19, 0);
-                 else
-                     send(c, "Move failed\n", 12, 0);
-             } else {
-                 send(c, "Access Denied\n", 14, 0);
-             }
-        }
+    /* MOVE <src> <dest> */
+    else if (strcmp(cmd, "MOVE") == 0) {
+         sscanf(buf, "%*s %s %s", a1, a2);
+         if (resolve_path(current_user, a1, path1, "WRITE") && 
+             resolve_path(current_user, a2, path2, "WRITE")) {
+             if (fs_rename(path1, path2) == 0) {
+                 meta_invalidate_tree(path1);
+                 meta_invalidate_tree(path2);
+                 session_send(s, "Moved successfully\n", 19);
+             } else
+                 session_send(s, "Move failed\n", 12);
+         } else {
+             session_send(s, "Access Denied\n", 14);
+         }
+    }
 
-        /* COPY <src> <dest> */
-        else if (strcmp(cmd, "COPY") == 0) {
-             sscanf(buf, "%*s %s %s", a1, a2);
-             if (resolve_path(current_user, a1, path1, "READ") && 
-                 resolve_path(current_user, a2, path2, "WRITE")) {
-                 
-                 FILE *src = fopen(path1, "rb");
-                 FILE *dst = fopen(path2, "wb");
-                 if (src && dst) {
-                     char buf[1024];
-                     size_t n;
-                     while ((n = fread(buf, 1, sizeof(buf), src)) > 0) {
-                         fwrite(buf, 1, n, dst);
-                     }
-                     fclose(src);
-                     fclose(dst);
-                     send(c, "Copy successful\n", 16, 0);
+    /* COPY <src> <dest> : a file, or a whole folder */
+    else if (strcmp(cmd, "COPY") == 0) {
+         sscanf(buf, "%*s %s %s", a1, a2);
+         if (resolve_path(current_user, a1, path1, "READ") && 
+             resolve_path(current_user, a2, path2, "WRITE")) {
+             struct stat st;
+             int len = strlen(path1);
+             double t0 = now_ms();
+             long bytes = 0;
+             if (fs_stat(path1, &st) != 0) {
+                 session_send(s, "Copy failed\n", 12);
+             } else if (strcmp(path1, path2) == 0) {
+                 session_send(s, "Cannot copy a file onto itself\n", 31);
+             } else if (S_ISDIR(st.st_mode)) {
+                 if (strncmp(path2, path1, len) == 0 && (path2[len] == '/' || path2[len] == '\0')) {
+                     session_send(s, "Cannot copy a folder into itself\n", 33);
                  } else {
-                     if(src) fclose(src);
-                     if(dst) fclose(dst);
-                     send(c, "Copy failed\n", 12, 0);
+                     CopyJob *j = (CopyJob*)calloc(1, sizeof(CopyJob));
+                     int copied = j ? (strcpy(j->src, path1), strcpy(j->dst, path2), j->c = c, copy_tree(j)) : -1;
+                     char reply[160];
+                     if (copied < 0) {
+                         session_send(s, "Copy failed\n", 12);
+                     } else {
+                         if (j->failed || j->locked)
+                             sprintf(reply, "Copied %d files; %d failed, %d locked by another user\n",
+                                     copied, j->failed, j->locked);
+                         else
+                             sprintf(reply, "Copy successful (%d files)\n", copied);
+                         session_send(s, reply, strlen(reply));
+                         log_transfer("COPY", path2, j->bytes, now_ms() - t0);
+                     }
+                     free(j);
                  }
              } else {
-                 send(c, "Access Denied\n", 14, 0);
+                 int method = copy_file(path1, path2, c, &bytes);
+                 if (method < 0) {
+                     session_send(s, "ACCESS DENIED: File is locked by another user\n", 46);
+                 } else if (method == COPY_FAILED) {
+                     session_send(s, "Copy failed\n", 12);
+                 } else {
+                     char what[32];
+                     sprintf(what, "COPY (%s)", copy_method_names[method]);
+                     log_transfer(what, path2, bytes, now_ms() - t0);
+                     session_send(s, "Copy successful\n", 16);
+                 }
              }
-        }
+         } else {
+             session_send(s, "Access Denied\n", 14);
+         }
+    }
 
-        else if (strcmp(cmd, "CHPASS") == 0) {
-             // Existing logic ok (only affects users.txt)
-             sscanf(buf, "%*s %s %s", a1, a2);
-             if (change_password_file(current_user, a1, a2)) send(c, "Password changed\n", 17, 0);
-             else send(c, "Change failed\n", 14, 0);
-        }
-        else {
-            send(c, "Invalid command\n", 16, 0);
-        }
+    else if (strcmp(cmd, "CHPASS") == 0) {
+         sscanf(buf, "%*s %s %s", a1, a2);
+         if (change_password_file(current_user, a1, a2)) session_send(s, "Password changed\n", 17);
+         else session_send(s, "Change failed\n", 14);
+    }
+    else {
+        session_send(s, "Invalid command\n", 16);
+    }
+}
+
+// Runs one text command and records how long it took for STATS.
+void process_command(Session *s, char *buf) {
+    char cmd[20] = "";
+    double start = now_us();
+    sscanf(buf, "%19s", cmd);
+    run_command(s, buf);
+    metrics_command(cmd, start);
+}
+
+/* ---------- THREAD-PER-CLIENT MODE ---------- */
+void handle_client(SOCKET c) {
+    Session *s = session_open(c);
+    if (!s) {
+        closesocket(c);
+        return;
+    }
+
+    while (1) {
+        if (!session_reserve_input(s)) break;
+        int r = recv_counted(c, s->inbuf + s->in_len, s->in_cap - s->in_len);
+        if (r <= 0) break;
+        s->in_len += r;
+
+        session_process_input(s);
     }
+    session_close(s);
 }
 
 /* ---------- THREAD WRAPPER ---------- */
+#ifdef _WIN32
 DWORD WINAPI ClientThread(LPVOID lpParam) {
     SOCKET client = (SOCKET)lpParam;
     handle_client(client);
-    closesocket(client);
+    log_thread_release();
+    share_thread_release();
     return 0;
 }
+#else
+void* ClientThread(void *arg) {
+    SOCKET client = (SOCKET)(long)arg;
+    handle_client(client);
+    log_thread_release();
+    share_thread_release();
+    return NULL;
+}
+#endif
 
-/* ---------- MAIN ---------- */
-int main() {
-    setbuf(stdout, NULL);
-    WSADATA wsa;
-    SOCKET server, client;
-    struct sockaddr_in addr;
-    int size = sizeof(addr);
+/* ---------- COMMAND LINE ---------- */
+void print_usage(const char *prog) {
+    printf("Usage: %s [--epoll] [--workers N] [--reactors N] [--backlog N] [--io blocking|uring]\n"
+           "          [--lock-policy fifo|writer] [--writer-wait MS] [--log-flush MS] [--log-max-mb N]\n"
+           "          [--walk-threads N] [--meta-cache-mb N] [--file-cache-mb N]\n"
+           "          [--read-inflight-mb N] [--copy-threads N] [--metrics-port N]\n", prog);
+    printf("  --epoll       Event-driven server (epoll) instead of one thread per client\n");
+    printf("  --workers N   Worker threads that run commands in --epoll mode (default 4)\n");
+    printf("  --reactors N  Listening sockets with SO_REUSEPORT, one pinned reactor each;\n");
+    printf("                0 = one per CPU core. Implies --epoll (default 1)\n");
+    printf("  --backlog N   listen() backlog (default %d)\n", SOMAXCONN);
+    printf("  --io MODE     File I/O backend: blocking (default) or uring (Linux io_uring)\n");
+    printf("  --lock-policy P  Order for queued lock requests: fifo (default) or writer\n");
+    printf("  --writer-wait MS How long WRITE/LOCK_FILE wait for a busy file before DENIED (default 0)\n");
+    printf("  --log-flush MS   How often queued command-log entries are written (default 200)\n");
+    printf("  --log-max-mb N   Rotate server_log.txt past N MB, keeping %d old files; 0 = never (default 10)\n", LOG_KEEP);
+    printf("  --walk-threads N Threads reading directories for LSR, up to %d; 0 = none (default 4)\n", WALK_MAX_THREADS);
+    printf("  --meta-cache-mb N Memory for cached STAT/LS/LSR metadata; 0 = no cache (default 64)\n");
+    printf("  --file-cache-mb N Memory for cached READ/DOWNLOAD file contents; files up to 1/16\n");
+    printf("                   of it are cached; 0 = no cache (default 64)\n");
+    printf("  --read-inflight-mb N Memory all READs together may use for file data (default 256)\n");
+    printf("  --copy-threads N Files copied in parallel by a folder COPY, up to %d; 0 = one by one (default 4)\n", COPY_MAX_THREADS);
+    printf("  --metrics-port N Serve STATS numbers as Prometheus text on http://127.0.0.1:N/metrics (default off)\n");
+}
 
-    WSAStartup(MAKEWORD(2,2), &wsa);
-    InitializeCriticalSection(&file_locks_cs);
+int parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--epoll") == 0) {
+            g_cfg.use_epoll = 1;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            g_cfg.workers = atoi(argv[++i]);
+            if (g_cfg.workers < 1) g_cfg.workers = 1;
+        } else if (strcmp(argv[i], "--reactors") == 0 && i + 1 < argc) {
+            g_cfg.reactors = atoi(argv[++i]);
+            if (g_cfg.reactors < 0) g_cfg.reactors = 0;
+            g_cfg.use_epoll = 1;
+        } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            g_cfg.backlog = atoi(argv[++i]);
+            if (g_cfg.backlog < 1) g_cfg.backlog = 1;
+        } else if (strcmp(argv[i], "--lock-policy") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "fifo") == 0) g_cfg.lock_policy = LOCK_POLICY_FIFO;
+            else if (strcmp(argv[i], "writer") == 0) g_cfg.lock_policy = LOCK_POLICY_WRITER;
+            else {
+                print_usage(argv[0]);
+                return 0;
+            }
+        } else if (strcmp(argv[i], "--writer-wait") == 0 && i + 1 < argc) {
+            g_cfg.writer_wait_ms = atoi(argv[++i]);
+            if (g_cfg.writer_wait_ms < 0) g_cfg.writer_wait_ms = 0;
+        } else if (strcmp(argv[i], "--log-flush") == 0 && i + 1 < argc) {
+            g_cfg.log_flush_ms = atoi(argv[++i]);
+            if (g_cfg.log_flush_ms < 1) g_cfg.log_flush_ms = 1;
+        } else if (strcmp(argv[i], "--meta-cache-mb") == 0 && i + 1 < argc) {
+            g_cfg.meta_cache_bytes = atol(argv[++i]) << 20;
+            if (g_cfg.meta_cache_bytes < 0) g_cfg.meta_cache_bytes = 0;
+        } else if (strcmp(argv[i], "--file-cache-mb") == 0 && i + 1 < argc) {
+            g_cfg.file_cache_bytes = atol(argv[++i]) << 20;
+            if (g_cfg.file_cache_bytes < 0) g_cfg.file_cache_bytes = 0;
+        } else if (strcmp(argv[i], "--read-inflight-mb") == 0 && i + 1 < argc) {
+            g_cfg.read_inflight_bytes = atol(argv[++i]) << 20;
+            if (g_cfg.read_inflight_bytes < (1L << 20)) g_cfg.read_inflight_bytes = 1L << 20;
+        } else if (strcmp(argv[i], "--copy-threads") == 0 && i + 1 < argc) {
+            g_cfg.copy_threads = atoi(argv[++i]);
+            if (g_cfg.copy_threads < 0) g_cfg.copy_threads = 0;
+            if (g_cfg.copy_threads > COPY_MAX_THREADS) g_cfg.copy_threads = COPY_MAX_THREADS;
+        } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            g_cfg.metrics_port = atoi(argv[++i]);
+            if (g_cfg.metrics_port < 0 || g_cfg.metrics_port > 65535) g_cfg.metrics_port = 0;
+        } else if (strcmp(argv[i], "--walk-threads") == 0 && i + 1 < argc) {
+            g_cfg.walk_threads = atoi(argv[++i]);
+            if (g_cfg.walk_threads < 0) g_cfg.walk_threads = 0;
+        } else if (strcmp(argv[i], "--log-max-mb") == 0 && i + 1 < argc) {
+            g_cfg.log_max_bytes = atol(argv[++i]) << 20;
+            if (g_cfg.log_max_bytes < 0) g_cfg.log_max_bytes = 0;
+        } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "uring") == 0) g_cfg.use_uring = 1;
+            else if (strcmp(argv[i], "blocking") == 0) g_cfg.use_uring = 0;
+            else {
+                print_usage(argv[0]);
+                return 0;
+            }
+        } else {
+            print_usage(argv[0]);
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    server = socket(AF_INET, SOCK_STREAM, 0);
+// Creates the bound, listening server socket. 'reuseport' lets several
+// reactors each own a socket on the same port (the kernel spreads accepts).
+SOCKET open_listener(int reuseport) {
+    struct sockaddr_in addr;
+    SOCKET server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server == INVALID_SOCKET) {
+        printf("Socket creation failed. Error: %d\n", WSAGetLastError());
+        return INVALID_SOCKET;
+    }
     addr.sin_family = AF_INET;
     addr.sin_port = htons(PORT);
     addr.sin_addr.s_addr = INADDR_ANY;
 
+#ifndef _WIN32
+    int yes = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+#ifdef SO_REUSEPORT
+    if (reuseport && setsockopt(server, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) != 0) {
+        printf("SO_REUSEPORT failed. Error: %d\n", errno);
+        closesocket(server);
+        return INVALID_SOCKET;
+    }
+#endif
+#else
+    (void)reuseport;
+#endif
+
     int bind_res = bind(server, (struct sockaddr*)&addr, sizeof(addr));
     if (bind_res == SOCKET_ERROR) {
         printf("Bind failed. Error: %d\n", WSAGetLastError());
-        return 1;
+        closesocket(server);
+        return INVALID_SOCKET;
     }
     
-    listen(server, 5);
+    listen(server, g_cfg.backlog);
+    return server;
+}
+
+#ifdef __linux__
+/* ---------- EPOLL REACTOR (LINUX) ---------- */
+/*
+ * One thread owns the epoll set and does all socket reads. Sockets are
+ * non-blocking, edge-triggered and EPOLLONESHOT: once a command is buffered
+ * the session is handed to a worker and gets no further events until the
+ * worker re-arms it. The worker runs the normal command handlers with the
+ * socket temporarily blocking, so UPLOAD/DOWNLOAD keep their handshake.
+ * An idle session costs one Session struct and no thread.
+ *
+ * Waits that the client paces (transfer bodies, the DOWNLOAD READY, batch
+ * lines) lend the pool a spare worker, and every socket has send/receive
+ * timeouts, so clients that stall mid-transfer cannot park the pool. A
+ * session whose transfer timed out is disconnected: the rest of its body
+ * must not be read as commands.
+ *
+ * With --reactors N there are N such threads, each with its own
+ * SO_REUSEPORT listener, epoll set and session table, pinned to a core.
+ * The kernel load-balances new connections across the listeners, so
+ * accepts no longer funnel through a single socket. Each reactor also has
+ * its own job queue and --workers worker threads pinned to its core, so
+ * commands from different cores never meet on a shared queue lock.
+ */
+#include <sys/resource.h>
+
+#define MAX_EVENTS 256
+#define WORKER_IO_TIMEOUT 30    // seconds a worker waits on a silent client
+
+struct Reactor {
+    int id;
+    int epfd;
+    int cpu;                // core the reactor and its workers run on, -1: any
+    SOCKET listener;
+    pthread_t thread;
+    Session *sessions;      // this reactor's session table (reactor thread only)
+    long accepted;          // counters, read by the stats printer
+    long active;
+    long closed;
+    long commands;
+
+    // Sessions with a buffered command, waiting for one of this reactor's workers.
+    CRITICAL_SECTION job_cs;
+    pthread_cond_t job_cond;
+    Session *job_head, *job_tail;
+    int workers_total, workers_blocked;
+};
+
+Reactor *reactors = NULL;
+int reactor_count = 0;
+
+// A worker parked in a lock wait can only be woken by another client's
+// UNLOCK, which itself needs a worker. Lock waits therefore lend the pool a
+// spare thread, and surplus threads retire once the waits finish.
+#define MAX_WORKERS 256     // per reactor
+THREAD_LOCAL Reactor *worker_reactor = NULL;    // set in worker threads only
+
+void* worker_thread(void *arg);
+void pin_to_cpu(pthread_t t, int cpu);
+
+THREAD_LOCAL int worker_timed_out = 0;
+
+// Called with the result of a blocking socket call. In a worker, EAGAIN
+// can only mean the socket timeout expired.
+void worker_note_timeout(long n) {
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) worker_timed_out = 1;
+}
+
+void set_nonblocking(SOCKET fd, int on) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (on) flags |= O_NONBLOCK;
+    else flags &= ~O_NONBLOCK;
+    fcntl(fd, F_SETFL, flags);
+}
+
+void reactor_arm(Session *s, int op) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    ev.data.ptr = s;
+    epoll_ctl(s->owner->epfd, op, s->sock, &ev);
+}
+
+// Queues the session on the reactor that owns it.
+void job_push(Session *s) {
+    Reactor *r = s->owner;
+    EnterCriticalSection(&r->job_cs);
+    s->next_job = NULL;
+    if (r->job_tail) r->job_tail->next_job = s;
+    else r->job_head = s;
+    r->job_tail = s;
+    pthread_cond_signal(&r->job_cond);
+    LeaveCriticalSection(&r->job_cs);
+}
+
+// Caller holds r->job_cs.
+int spawn_worker(Reactor *r) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, worker_thread, r) != 0) return 0;
+    pthread_detach(t);
+    if (r->cpu >= 0) pin_to_cpu(t, r->cpu);
+    r->workers_total++;
+    return 1;
+}
+
+// The spare comes from, and later retires into, the blocked worker's own
+// reactor. Other threads (copy, walk) are not pool workers and lend nothing.
+void worker_block_begin() {
+    Reactor *r = worker_reactor;
+    if (!r) return;
+    EnterCriticalSection(&r->job_cs);
+    r->workers_blocked++;
+    if (r->workers_total - r->workers_blocked < g_cfg.workers && r->workers_total < MAX_WORKERS)
+        spawn_worker(r);
+    LeaveCriticalSection(&r->job_cs);
+}
+
+void worker_block_end() {
+    Reactor *r = worker_reactor;
+    if (!r) return;
+    EnterCriticalSection(&r->job_cs);
+    r->workers_blocked--;
+    LeaveCriticalSection(&r->job_cs);
+}
+
+// Returns NULL when the calling worker is surplus and should exit.
+Session* job_pop(Reactor *r) {
+    EnterCriticalSection(&r->job_cs);
+    while (!r->job_head) {
+        if (r->workers_total - r->workers_blocked > g_cfg.workers) {
+            r->workers_total--;
+            LeaveCriticalSection(&r->job_cs);
+            return NULL;
+        }
+        pthread_cond_wait(&r->job_cond, &r->job_cs);
+    }
+    Session *s = r->job_head;
+    r->job_head = s->next_job;
+    if (!r->job_head) r->job_tail = NULL;
+    LeaveCriticalSection(&r->job_cs);
+    return s;
+}
+
+void* worker_thread(void *arg) {
+    worker_reactor = (Reactor*)arg;
+    while (1) {
+        Session *s = job_pop(worker_reactor);
+        if (!s) {
+            log_thread_release();
+            share_thread_release();
+            break;
+        }
+        worker_timed_out = 0;
+        set_nonblocking(s->sock, 0);
+        int handled = session_process_input(s);
+        __atomic_add_fetch(&s->owner->commands, handled, __ATOMIC_RELAXED);
+        set_nonblocking(s->sock, 1);
+        if (worker_timed_out) shutdown(s->sock, SHUT_RDWR);
+        // Re-arming re-checks readiness, so bytes (or a hangup) that arrived
+        // while we were busy produce a fresh event.
+        reactor_arm(s, EPOLL_CTL_MOD);
+    }
+    return NULL;
+}
+
+void reactor_accept(Reactor *r) {
+    while (1) {
+        SOCKET client = accept(r->listener, NULL, NULL);
+        if (client == INVALID_SOCKET) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                printf("Accept failed. Error: %d\n", errno);
+            if (errno == EINTR) continue;
+            return;
+        }
+        set_nonblocking(client, 1);
+        // Only felt while a worker holds the socket in blocking mode.
+        struct timeval timeout = { WORKER_IO_TIMEOUT, 0 };
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        Session *s = session_open(client);
+        if (!s) {
+            closesocket(client);
+            continue;
+        }
+        s->owner = r;
+        s->next = r->sessions;
+        if (r->sessions) r->sessions->prev = s;
+        r->sessions = s;
+        __atomic_add_fetch(&r->accepted, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&r->active, 1, __ATOMIC_RELAXED);
+
+        printf("New client connected: %d (reactor %d)\n", (int)client, r->id);
+        reactor_arm(s, EPOLL_CTL_ADD);
+    }
+}
+
+void reactor_close(Reactor *r, Session *s) {
+    if (s->prev) s->prev->next = s->next;
+    else r->sessions = s->next;
+    if (s->next) s->next->prev = s->prev;
+    __atomic_sub_fetch(&r->active, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&r->closed, 1, __ATOMIC_RELAXED);
+    session_close(s);
+}
+
+// Drains the socket into inbuf. Returns 0 if the peer is gone.
+int reactor_read(Session *s) {
+    while (1) {
+        if (!session_reserve_input(s)) return 0;
+        if (s->in_len == s->in_cap) return 1; // buffer full, process what we have first
+        int n = recv_counted(s->sock, s->inbuf + s->in_len, s->in_cap - s->in_len);
+        if (n > 0) {
+            s->in_len += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        } else {
+            return 0;
+        }
+    }
+}
+
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+void pin_to_cpu(pthread_t t, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(t, sizeof(set), &set) != 0)
+        printf("Could not pin thread to CPU %d\n", cpu);
+}
+
+void* reactor_loop(void *arg) {
+    Reactor *r = (Reactor*)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            printf("epoll_wait failed on reactor %d. Error: %d\n", r->id, errno);
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            Session *s = (Session*)events[i].data.ptr;
+            if (!s) {
+                reactor_accept(r);
+                continue;
+            }
+            int alive = reactor_read(s);
+            if (session_has_request(s)) {
+                // Hand off even if the peer already hung up: the command
+                // still runs, and the re-arm afterwards reports the EOF.
+                job_push(s);
+            } else if (!alive || (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                reactor_close(r, s);
+            } else {
+                reactor_arm(s, EPOLL_CTL_MOD);
+            }
+        }
+    }
+}
+
+int reactor_init(Reactor *r, int id, int cpu) {
+    struct epoll_event ev;
+    memset(r, 0, sizeof(*r));
+    r->id = id;
+    r->cpu = cpu;
+    InitializeCriticalSection(&r->job_cs);
+    pthread_cond_init(&r->job_cond, NULL);
+    r->listener = open_listener(reactor_count > 1);
+    if (r->listener == INVALID_SOCKET) return 0;
+    r->epfd = epoll_create1(0);
+    if (r->epfd < 0) {
+        printf("epoll_create1 failed. Error: %d\n", errno);
+        return 0;
+    }
+    set_nonblocking(r->listener, 1);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL; // NULL marks the listening socket
+    epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listener, &ev);
+    return 1;
+}
+
+void print_reactor_stats() {
+    for (int i = 0; i < reactor_count; i++) {
+        Reactor *r = &reactors[i];
+        printf("[STATS] reactor %d: active=%ld accepted=%ld closed=%ld commands=%ld\n", r->id,
+               __atomic_load_n(&r->active, __ATOMIC_RELAXED),
+               __atomic_load_n(&r->accepted, __ATOMIC_RELAXED),
+               __atomic_load_n(&r->closed, __ATOMIC_RELAXED),
+               __atomic_load_n(&r->commands, __ATOMIC_RELAXED));
+    }
+}
+
+int run_reactors() {
+    int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+    reactor_count = g_cfg.reactors > 0 ? g_cfg.reactors : ncpu;
+
+    raise_fd_limit();
+    reactors = (Reactor*)calloc(reactor_count, sizeof(Reactor));
+    if (!reactors) return 1;
+    for (int i = 0; i < reactor_count; i++) {
+        // A single reactor is left to the scheduler, as before.
+        if (!reactor_init(&reactors[i], i, reactor_count > 1 ? i % ncpu : -1)) return 1;
+    }
+    for (int i = 0; i < reactor_count; i++) {
+        Reactor *r = &reactors[i];
+        for (int w = 0; w < g_cfg.workers; w++) {
+            EnterCriticalSection(&r->job_cs);
+            int ok = spawn_worker(r);
+            LeaveCriticalSection(&r->job_cs);
+            if (!ok) {
+                printf("Worker creation failed\n");
+                return 1;
+            }
+        }
+    }
+
+    printf("Server running on port %d...\n", PORT);
+    printf("Event loop started (%d reactors, %d workers each, backlog %d)\n",
+           reactor_count, g_cfg.workers, g_cfg.backlog);
+
+    for (int i = 0; i < reactor_count; i++) {
+        Reactor *r = &reactors[i];
+        if (pthread_create(&r->thread, NULL, reactor_loop, r) != 0) {
+            printf("Reactor creation failed\n");
+            return 1;
+        }
+        if (r->cpu >= 0) pin_to_cpu(r->thread, r->cpu);
+    }
+
+    // Main thread just reports per-reactor connection counters when they move.
+    long last = -1;
+    while (1) {
+        Sleep(30000);
+        long total = 0;
+        for (int i = 0; i < reactor_count; i++)
+            total += __atomic_load_n(&reactors[i].accepted, __ATOMIC_RELAXED) +
+                     __atomic_load_n(&reactors[i].commands, __ATOMIC_RELAXED);
+        if (total != last) {
+            print_reactor_stats();
+            last = total;
+        }
+    }
+}
+#else
+// Thread-per-client mode: every waiter has its own thread, nothing to lend.
+void worker_block_begin() {}
+void worker_block_end() {}
+void worker_note_timeout(long n) { (void)n; }
+#endif
+
+/* ---------- MAIN ---------- */
+int main(int argc, char **argv) {
+    setbuf(stdout, NULL);
+    SOCKET server, client;
+    struct sockaddr_in addr;
+    socklen_t size = sizeof(addr);
+
+    if (!parse_args(argc, argv)) return 1;
+
+#ifdef _WIN32
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2,2), &wsa);
+#else
+    signal(SIGPIPE, SIG_IGN); // a client vanishing mid-send must not kill the server
+#endif
+    log_init();
+    metrics_init();
+    user_db_init();
+    share_init();
+    meta_init();
+    content_init();
+    read_budget_init();
+    partials_init();
+    transfers_init();
+    tree_walk_init(g_cfg.walk_threads, &meta_walk_cache);
+    lock_registry_init();
+    lock_stats_init();
+    io_backend_init();
+
+    if (g_cfg.use_epoll) {
+#ifdef __linux__
+        return run_reactors();
+#else
+        printf("--epoll/--reactors are only available on Linux, using one thread per client\n");
+#endif
+    }
+
+    server = open_listener(0);
+    if (server == INVALID_SOCKET) return 1;
 
     printf("Server running on port %d...\n", PORT);
 
@@ -1022,6 +5190,7 @@ int main() {
         printf("New client connected: %d\n", (int)client);
         
         /* Create thread for the new client */
+#ifdef _WIN32
         HANDLE hThread = CreateThread(NULL, 0, ClientThread, (LPVOID)client, 0, NULL);
         if (hThread == NULL) {
             printf("Thread creation failed\n");
@@ -1029,5 +5198,15 @@ int main() {
         } else {
             CloseHandle(hThread); // Detach thread (we don't need to join)
         }
+#else
+        pthread_t t;
+        if (pthread_create(&t, NULL, ClientThread, (void*)(long)client) != 0) {
+            printf("Thread creation failed\n");
+            closesocket(client);
+        } else {
+            pthread_detach(t); // we don't need to join
+        }
+#endif
     }
+    return 0;
 }
@@ -6,12 +6,17 @@ import os
 import signal
 import time
 import platform
+import urllib.request
+from collections import deque
 
 # --- Configuration ---
 SERVER_EXE = "server.exe"  # Assumes in same directory
 USERS_FILE = "users.txt"
 LOG_FILE = "server_log.txt"
 STORAGE_DIR = "storage"
+METRICS_PORT = 9100  # server --metrics-port, charted in the Metrics tab
+METRICS_HISTORY = 120  # samples (seconds) kept per chart
+CHART_COLORS = ["#2ECC71", "#3498DB", "#F39C12", "#E74C3C", "#9B59B6"]
 
 ctk.set_appearance_mode("Dark")
 ctk.set_default_color_theme("blue")
@@ -52,6 +57,7 @@ class ServerManagerApp(ctk.CTk):
         self.tab_logs = self.tab_view.add("Command Logs")
         self.tab_users = self.tab_view.add("Registered Users")
         self.tab_storage_tree = self.tab_view.add("Storage Tree")
+        self.tab_metrics = self.tab_view.add("Metrics")
 
         # 1. Console Tab
         self.console_text = ctk.CTkTextbox(self.tab_console, font=("Consolas", 12), text_color="#2ECC71", fg_color="#1E1E1E")
@@ -72,6 +78,18 @@ class ServerManagerApp(ctk.CTk):
         self.storage_text = ctk.CTkTextbox(self.tab_storage_tree, font=("Consolas", 12))
         self.storage_text.pack(fill="both", expand=True, pady=(0, 10))
         ctk.CTkButton(self.tab_storage_tree, text="Refresh Tree", command=self.refresh_storage_tree, height=30).pack(fill="x")
+
+        # 5. Metrics Tab (polls http://127.0.0.1:METRICS_PORT/metrics)
+        self.metrics_summary = ctk.CTkLabel(self.tab_metrics, text="Waiting for server...", font=("Consolas", 12), anchor="w")
+        self.metrics_summary.pack(fill="x", pady=(0, 5))
+        self.charts = {}
+        for key, title in (("ops", "Requests/s"), ("p99", "p99 latency (ms), busiest commands"),
+                           ("mbps", "Traffic (MB/s)"), ("locks", "Lock waits/s")):
+            canvas = ctk.CTkCanvas(self.tab_metrics, height=110, bg="#1E1E1E", highlightthickness=0)
+            canvas.pack(fill="both", expand=True, pady=2)
+            self.charts[key] = (canvas, title)
+        self.metrics_prev = None
+        self.metrics_history = {key: {} for key in self.charts}
         
         # Initial Refresh
         self.refresh_users_list()
@@ -80,6 +98,7 @@ class ServerManagerApp(ctk.CTk):
         
         # Periodic Status Check
         self.check_process_status()
+        self.poll_metrics()
 
     # --- Server Process Management ---
     def start_server(self):
@@ -94,7 +113,7 @@ class ServerManagerApp(ctk.CTk):
             startupinfo.dwFlags |= subprocess.STARTF_USESHOWWINDOW
             
             self.process = subprocess.Popen(
-                [SERVER_EXE], 
+                [SERVER_EXE, "--metrics-port", str(METRICS_PORT)], 
                 stdout=subprocess.PIPE, 
                 stderr=subprocess.PIPE,
                 stdin=subprocess.PIPE,
@@ -195,10 +214,94 @@ class ServerManagerApp(ctk.CTk):
             os.makedirs(path)
         os.startfile(path)
 
+    # --- Metrics ---
+    def poll_metrics(self):
+        if self.process:
+            threading.Thread(target=self.fetch_metrics, daemon=True).start()
+        self.after(1000, self.poll_metrics)
+
+    def fetch_metrics(self):
+        try:
+            url = f"http://127.0.0.1:{METRICS_PORT}/metrics"
+            with urllib.request.urlopen(url, timeout=0.8) as r:
+                text = r.read().decode("utf-8", errors="ignore")
+        except Exception:
+            return
+        self.after(0, lambda: self.update_metrics(parse_metrics(text), time.time()))
+
+    def update_metrics(self, m, now):
+        prev, self.metrics_prev = self.metrics_prev, (m, now)
+        if not prev or now <= prev[1]:
+            return
+        old, dt = prev[0], now - prev[1]
+        rate = lambda key: max(0.0, (m.get(key, 0) - old.get(key, 0)) / dt)
+
+        counts = {k[len("remotefs_command_duration_seconds_count{command=\""):-2]: v
+                  for k, v in m.items() if k.startswith("remotefs_command_duration_seconds_count{")}
+        ops = sum(rate(f'remotefs_command_duration_seconds_count{{command="{c}"}}') for c in counts)
+        busiest = sorted(counts, key=lambda c: -rate(f'remotefs_command_duration_seconds_count{{command="{c}"}}'))[:len(CHART_COLORS)]
+
+        self.add_sample("ops", "all", ops)
+        p99 = self.metrics_history["p99"]
+        for c in [c for c in p99 if c not in busiest]:
+            del p99[c]
+        for c in busiest:
+            self.add_sample("p99", c, m.get(f'remotefs_command_duration_seconds{{command="{c}",quantile="0.99"}}', 0) * 1000)
+        self.add_sample("mbps", "in", rate("remotefs_received_bytes_total") / (1024 * 1024))
+        self.add_sample("mbps", "out", rate("remotefs_sent_bytes_total") / (1024 * 1024))
+        self.add_sample("locks", "read", rate('remotefs_lock_waits_total{mode="read"}'))
+        self.add_sample("locks", "write", rate('remotefs_lock_waits_total{mode="write"}'))
+        self.add_sample("locks", "denied", rate('remotefs_lock_denied_total{reason="timeout"}') +
+                        rate('remotefs_lock_denied_total{reason="busy"}'))
+
+        self.metrics_summary.configure(text=(
+            f"Sessions: {int(m.get('remotefs_sessions_active', 0))} active, "
+            f"{int(m.get('remotefs_sessions_total', 0))} total   |   {ops:.0f} req/s   |   "
+            f"Uptime: {int(m.get('remotefs_uptime_seconds', 0))} s"))
+        for key in self.charts:
+            self.draw_chart(key)
+
+    def add_sample(self, chart, name, value):
+        self.metrics_history[chart].setdefault(name, deque(maxlen=METRICS_HISTORY)).append(value)
+
+    def draw_chart(self, key):
+        canvas, title = self.charts[key]
+        series = self.metrics_history[key]
+        canvas.delete("all")
+        w, h = max(canvas.winfo_width(), 100), max(canvas.winfo_height(), 60)
+        top = max([max(v) for v in series.values() if v] + [1e-9])
+        canvas.create_text(8, 8, anchor="nw", fill="white", font=("Roboto", 10, "bold"), text=f"{title}   max {top:.2f}")
+        x0, y0, y1 = 8, 26, h - 6
+        step = (w - 16) / (METRICS_HISTORY - 1)
+        legend_x = w - 8
+        for i, (name, values) in enumerate(list(series.items())[-len(CHART_COLORS):]):
+            color = CHART_COLORS[i % len(CHART_COLORS)]
+            pts = []
+            offset = METRICS_HISTORY - len(values)
+            for j, v in enumerate(values):
+                pts += [x0 + (offset + j) * step, y1 - (y1 - y0) * v / top]
+            if len(pts) >= 4:
+                canvas.create_line(*pts, fill=color, width=2)
+            label = canvas.create_text(legend_x, 8, anchor="ne", fill=color, font=("Roboto", 10), text=name)
+            legend_x = canvas.bbox(label)[0] - 10
+
     def on_close(self):
         self.stop_server()
         self.destroy()
 
+def parse_metrics(text):
+    """Prometheus text -> {'name{labels}': value}."""
+    values = {}
+    for line in text.splitlines():
+        if not line or line.startswith("#"):
+            continue
+        name, _, value = line.rpartition(" ")
+        try:
+            values[name] = float(value)
+        except ValueError:
+            pass
+    return values
+
 if __name__ == "__main__":
     app = ServerManagerApp()
     app.protocol("WM_DELETE_WINDOW", app.on_close)
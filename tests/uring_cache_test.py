@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+"""
+Checks that a READ is served from the file cache when the server runs with
+--io uring, for a file whose modification time has a nanosecond part.
+
+Usage: python3 tests/uring_cache_test.py [path/to/server]
+Build the server first: gcc -O2 server.c fscore.c checksum.c -o server -lpthread
+The server is started in a temporary folder on port 8080.
+"""
+import os
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+PORT = 8080
+
+
+def connect():
+    for _ in range(50):
+        try:
+            return socket.create_connection(("127.0.0.1", PORT))
+        except OSError:
+            time.sleep(0.1)
+    raise SystemExit("server did not start")
+
+
+def command(sock, text, wait=0.3):
+    sock.sendall(text.encode())
+    time.sleep(wait)
+    sock.settimeout(2)
+    data = b""
+    try:
+        while True:
+            chunk = sock.recv(65536)
+            data += chunk
+            if len(chunk) < 65536:
+                break
+    except socket.timeout:
+        pass
+    return data.decode(errors="replace")
+
+
+def main():
+    server = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "server")
+    work = tempfile.mkdtemp()
+    proc = subprocess.Popen([server, "--io", "uring"], cwd=work,
+                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    try:
+        sock = connect()
+        command(sock, "REGISTER cacheuser pw")
+        command(sock, "LOGIN cacheuser pw")
+        command(sock, "WRITE notes.txt hello-from-the-cache-test")
+
+        # A whole-second mtime would hide a lost tv_nsec.
+        path = os.path.join(work, "storage", "cacheuser", "notes.txt")
+        os.utime(path, ns=(1700000000123456789, 1700000000123456789))
+
+        first = command(sock, "READ notes.txt")
+        second = command(sock, "READ notes.txt")
+        stats = command(sock, "CACHESTATS")
+        sock.close()
+    finally:
+        proc.terminate()
+        out = proc.communicate()[0].decode(errors="replace")
+        shutil.rmtree(work, ignore_errors=True)
+
+    if "io_uring (" not in out:
+        print("SKIP: io_uring is not available here")
+        return 0
+    hits = re.search(r"File cache: on\n.*\n  Hits: (\d+)", stats)
+    if "hello-from-the-cache-test" not in first + second or not hits or int(hits.group(1)) < 1:
+        print("FAIL: second READ was not a cache hit\n" + stats)
+        return 1
+    print("PASS: %s cache hit(s) with --io uring" % hits.group(1))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())